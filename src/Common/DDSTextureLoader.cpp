@@ -991,6 +991,391 @@ static HRESULT FillInitData12(_In_ size_t width,
 	return (index > 0) ? S_OK : E_FAIL;
 }
 
+//--------------------------------------------------------------------------------------
+// Fills DDSTextureInfo from the magic number and headers (DDS_PROBE_SIZE bytes at most).
+// Per-mip sizes come from GetSurfaceInfo, the same math FillInitData12 uses to walk the data.
+//--------------------------------------------------------------------------------------
+static HRESULT ParseDDSHeader(_In_reads_bytes_(size) const uint8_t* data,
+	_In_ size_t size,
+	_Out_ DDSTextureInfo& info
+	)
+{
+	info = DDSTextureInfo();
+
+	if (size < sizeof(uint32_t) + sizeof(DDS_HEADER) || *(const uint32_t*)data != DDS_MAGIC)
+	{
+		return E_FAIL;
+	}
+
+	auto hdr = reinterpret_cast<const DDS_HEADER*>(data + sizeof(uint32_t));
+	if (hdr->size != sizeof(DDS_HEADER) ||
+		hdr->ddspf.size != sizeof(DDS_PIXELFORMAT))
+	{
+		return E_FAIL;
+	}
+
+	info.Width = hdr->width;
+	info.Height = hdr->height;
+	info.Depth = 1;
+	info.MipCount = hdr->mipMapCount ? hdr->mipMapCount : 1;
+	info.ArraySize = 1;
+	info.HeaderSize = sizeof(uint32_t) + sizeof(DDS_HEADER);
+
+	if ((hdr->ddspf.flags & DDS_FOURCC) && (MAKEFOURCC('D', 'X', '1', '0') == hdr->ddspf.fourCC))
+	{
+		if (size < sizeof(uint32_t) + sizeof(DDS_HEADER) + sizeof(DDS_HEADER_DXT10))
+		{
+			return E_FAIL;
+		}
+
+		auto d3d10ext = reinterpret_cast<const DDS_HEADER_DXT10*>(data + sizeof(uint32_t) + sizeof(DDS_HEADER));
+		info.HeaderSize += sizeof(DDS_HEADER_DXT10);
+		info.Format = d3d10ext->dxgiFormat;
+		info.ArraySize = d3d10ext->arraySize;
+
+		switch (d3d10ext->resourceDimension)
+		{
+		case D3D11_RESOURCE_DIMENSION_TEXTURE1D:
+			info.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE1D;
+			info.Height = 1;
+			break;
+
+		case D3D11_RESOURCE_DIMENSION_TEXTURE2D:
+			info.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+			if (d3d10ext->miscFlag & D3D11_RESOURCE_MISC_TEXTURECUBE)
+			{
+				info.ArraySize *= 6;
+				info.IsCubeMap = true;
+			}
+			break;
+
+		case D3D11_RESOURCE_DIMENSION_TEXTURE3D:
+			info.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE3D;
+			info.Depth = hdr->depth;
+			break;
+
+		default:
+			return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+		}
+	}
+	else
+	{
+		info.Format = GetDXGIFormat(hdr->ddspf);
+
+		if (hdr->flags & DDS_HEADER_FLAGS_VOLUME)
+		{
+			info.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE3D;
+			info.Depth = hdr->depth;
+		}
+		else
+		{
+			info.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+			if (hdr->caps2 & DDS_CUBEMAP)
+			{
+				if ((hdr->caps2 & DDS_CUBEMAP_ALLFACES) != DDS_CUBEMAP_ALLFACES)
+					return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+				info.ArraySize = 6;
+				info.IsCubeMap = true;
+			}
+		}
+	}
+
+	if (info.Format == DXGI_FORMAT_UNKNOWN || BitsPerPixel(info.Format) == 0 ||
+		info.ArraySize == 0 || info.Depth == 0 || info.MipCount > D3D12_REQ_MIP_LEVELS)
+	{
+		return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+	}
+
+	size_t w = info.Width;
+	size_t h = info.Height;
+	size_t d = info.Depth;
+	for (size_t i = 0; i < info.MipCount; i++)
+	{
+		size_t NumBytes = 0;
+		GetSurfaceInfo(w, h, info.Format, &NumBytes, nullptr, nullptr);
+		info.MipBytes[i] = NumBytes * d;
+		info.SliceBytes += info.MipBytes[i];
+
+		w = std::max<size_t>(w >> 1, 1);
+		h = std::max<size_t>(h >> 1, 1);
+		d = std::max<size_t>(d >> 1, 1);
+	}
+	info.TotalBytes = info.SliceBytes * info.ArraySize;
+
+	return S_OK;
+}
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+HRESULT DirectX::GetDDSTextureInfoFromFile(const wchar_t* fileName, DDSTextureInfo& info)
+{
+	info = DDSTextureInfo();
+
+	if (!fileName)
+	{
+		return E_INVALIDARG;
+	}
+
+#if (_WIN32_WINNT >= _WIN32_WINNT_WIN8)
+	ScopedHandle hFile(safe_handle(CreateFile2(fileName,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		OPEN_EXISTING,
+		nullptr)));
+#else
+	ScopedHandle hFile(safe_handle(CreateFileW(fileName,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr)));
+#endif
+
+	if (!hFile)
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	uint8_t headerData[DDS_PROBE_SIZE];
+	DWORD BytesRead = 0;
+	if (!ReadFile(hFile.get(), headerData, DDS_PROBE_SIZE, &BytesRead, nullptr))
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	HRESULT hr = ParseDDSHeader(headerData, BytesRead, info);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	LARGE_INTEGER FileSize = { 0 };
+	if (!GetFileSizeEx(hFile.get(), &FileSize))
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	if ((uint64_t)FileSize.QuadPart < info.HeaderSize + info.TotalBytes)
+	{
+		return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+	}
+
+	return S_OK;
+}
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+HRESULT DirectX::GetDDSTextureInfoFromMemory(const uint8_t* ddsData, size_t ddsDataSize, DDSTextureInfo& info)
+{
+	info = DDSTextureInfo();
+
+	if (!ddsData)
+	{
+		return E_INVALIDARG;
+	}
+
+	HRESULT hr = ParseDDSHeader(ddsData, std::min<size_t>(ddsDataSize, DDS_PROBE_SIZE), info);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	if (ddsDataSize < info.HeaderSize + info.TotalBytes)
+	{
+		return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+	}
+
+	return S_OK;
+}
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+size_t DirectX::GetDDSSkippedMips(const DDSTextureInfo& info, size_t maxsize)
+{
+	if (!maxsize || info.MipCount <= 1)
+	{
+		return 0;
+	}
+
+	size_t skip = 0;
+	while (skip + 1 < info.MipCount &&
+		(std::max<size_t>(info.Width >> skip, 1) > maxsize ||
+		 std::max<size_t>(info.Height >> skip, 1) > maxsize ||
+		 std::max<size_t>(info.Depth >> skip, 1) > maxsize))
+	{
+		++skip;
+	}
+
+	// block compressed top mips have to stay a multiple of the block size; a format is
+	// block compressed when four rows of texels make a single row of blocks (a top
+	// one texel high has as many block rows as texel rows, so it can't tell)
+	size_t NumRows = 0;
+	GetSurfaceInfo(4, 4, info.Format, nullptr, nullptr, &NumRows);
+	bool blocks = NumRows != 4;
+	while (skip > 0 && blocks)
+	{
+		size_t w = std::max<size_t>(info.Width >> skip, 1);
+		size_t h = std::max<size_t>(info.Height >> skip, 1);
+		if (w % 4 == 0 && h % 4 == 0)
+			break;
+		--skip;
+	}
+
+	return skip;
+}
+
+//--------------------------------------------------------------------------------------
+// Reads only the mips no larger than maxsize from a DDS file. The result is laid out
+// like a complete DDS file whose header describes the shortened chain, so it can be
+// passed to CreateTextureFromDDS12 unchanged. Seeks past the skipped top mips of every
+// array slice using the offsets from ParseDDSHeader.
+//--------------------------------------------------------------------------------------
+static HRESULT LoadTextureMipTailFromFile(_In_z_ const wchar_t* fileName,
+	_In_ size_t maxsize,
+	std::unique_ptr<uint8_t[]>& ddsData,
+	DDS_HEADER** header,
+	uint8_t** bitData,
+	size_t* bitSize
+	)
+{
+	if (!maxsize)
+	{
+		return LoadTextureDataFromFile(fileName, ddsData, header, bitData, bitSize);
+	}
+
+	// open the file
+#if (_WIN32_WINNT >= _WIN32_WINNT_WIN8)
+	ScopedHandle hFile(safe_handle(CreateFile2(fileName,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		OPEN_EXISTING,
+		nullptr)));
+#else
+	ScopedHandle hFile(safe_handle(CreateFileW(fileName,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr)));
+#endif
+
+	if (!hFile)
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	LARGE_INTEGER FileSize = { 0 };
+	if (!GetFileSizeEx(hFile.get(), &FileSize))
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	// read magic number and headers
+	uint8_t headerData[DDS_PROBE_SIZE];
+	DWORD BytesRead = 0;
+	if (!ReadFile(hFile.get(), headerData, DDS_PROBE_SIZE, &BytesRead, nullptr))
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	// Unusual files go through the regular loader, which also reports their errors.
+	DDSTextureInfo info;
+	size_t skip = 0;
+	if (SUCCEEDED(ParseDDSHeader(headerData, BytesRead, info)))
+	{
+		skip = GetDDSSkippedMips(info, maxsize);
+	}
+
+	if (skip == 0)
+	{
+		hFile.reset();
+		return LoadTextureDataFromFile(fileName, ddsData, header, bitData, bitSize);
+	}
+
+	if (FileSize.HighPart > 0 || info.HeaderSize + info.TotalBytes > FileSize.LowPart)
+	{
+		return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+	}
+
+	size_t skipBytes = 0;
+	for (size_t i = 0; i < skip; i++)
+	{
+		skipBytes += (size_t)info.MipBytes[i];
+	}
+	size_t sliceBytes = (size_t)info.SliceBytes;
+	size_t tailBytes = sliceBytes - skipBytes;
+	size_t headerSize = info.HeaderSize;
+
+	ddsData.reset(new (std::nothrow) uint8_t[headerSize + tailBytes * info.ArraySize]);
+	if (!ddsData)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memcpy(ddsData.get(), headerData, headerSize);
+
+	// every array slice (or cube face) stores its own full chain
+	for (size_t j = 0; j < info.ArraySize; j++)
+	{
+		LARGE_INTEGER offset;
+		offset.QuadPart = (LONGLONG)(headerSize + j * sliceBytes + skipBytes);
+		if (!SetFilePointerEx(hFile.get(), offset, nullptr, FILE_BEGIN))
+		{
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+
+		if (!ReadFile(hFile.get(), ddsData.get() + headerSize + j * tailBytes, (DWORD)tailBytes, &BytesRead, nullptr))
+		{
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+
+		if (BytesRead < tailBytes)
+		{
+			return E_FAIL;
+		}
+	}
+
+	auto tailHdr = reinterpret_cast<DDS_HEADER*>(ddsData.get() + sizeof(uint32_t));
+	tailHdr->width = std::max<uint32_t>(info.Width >> skip, 1);
+	tailHdr->height = std::max<uint32_t>(info.Height >> skip, 1);
+	if (tailHdr->flags & DDS_HEADER_FLAGS_VOLUME)
+	{
+		tailHdr->depth = std::max<uint32_t>(info.Depth >> skip, 1);
+	}
+	tailHdr->mipMapCount = (uint32_t)(info.MipCount - skip);
+
+	*header = tailHdr;
+	*bitData = ddsData.get() + headerSize;
+	*bitSize = tailBytes * info.ArraySize;
+
+	return S_OK;
+}
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+HRESULT DirectX::LoadDDSTextureDataFromFile(const wchar_t* szFileName, size_t maxsize, std::unique_ptr<uint8_t[]>& ddsData, size_t& ddsDataSize)
+{
+	ddsDataSize = 0;
+
+	if (!szFileName)
+	{
+		return E_INVALIDARG;
+	}
+
+	DDS_HEADER* header = nullptr;
+	uint8_t* bitData = nullptr;
+	size_t bitSize = 0;
+	HRESULT hr = LoadTextureMipTailFromFile(szFileName, maxsize, ddsData, &header, &bitData, &bitSize);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	ddsDataSize = (size_t)(bitData - ddsData.get()) + bitSize;
+	return S_OK;
+}
+
 //--------------------------------------------------------------------------------------
 static HRESULT CreateD3DResources( _In_ ID3D11Device* d3dDevice,
                                    _In_ uint32_t resDim,
@@ -2165,14 +2550,17 @@ HRESULT DirectX::CreateDDSTextureFromFile12(_In_ ID3D12Device* device,
 	size_t bitSize = 0;
 
 	std::unique_ptr<uint8_t[]> ddsData;
-	HRESULT hr = LoadTextureDataFromFile(szFileName, ddsData, &header, &bitData, &bitSize);
+	HRESULT hr = LoadTextureMipTailFromFile(szFileName, maxsize, ddsData, &header, &bitData, &bitSize);
 	if (FAILED(hr))
 	{
 		return hr;
 	}
 
+	// The tail is all that is left to upload. Passed on, maxsize would make
+	// FillInitData12 drop a block compressed top mip GetDDSSkippedMips kept larger for
+	// its alignment, leaving the resource a mip short and its top misaligned.
 	hr = CreateTextureFromDDS12(device, cmdList, header,
-		bitData, bitSize, maxsize, false, texture, textureUploadHeap);
+		bitData, bitSize, 0, false, texture, textureUploadHeap);
 
 	if (SUCCEEDED(hr))
 	{
@@ -32,6 +32,8 @@
 
 #pragma warning(pop)
 
+#include <memory>
+
 #if defined(_MSC_VER) && (_MSC_VER<1610) && !defined(_In_reads_)
 #define _In_reads_(exp)
 #define _Out_writes_(exp)
@@ -55,6 +57,50 @@ namespace DirectX
         DDS_ALPHA_MODE_CUSTOM        = 4,
     };
 
+    // Magic number, DDS_HEADER and DDS_HEADER_DXT10: all a probe has to read.
+    const size_t DDS_PROBE_SIZE = 148;
+
+    // What the DDS headers say about a texture, without reading its pixel data.
+    struct DDSTextureInfo
+    {
+        DXGI_FORMAT Format = DXGI_FORMAT_UNKNOWN;
+        D3D12_RESOURCE_DIMENSION Dimension = D3D12_RESOURCE_DIMENSION_UNKNOWN;
+        uint32_t Width = 0;
+        uint32_t Height = 0;
+        uint32_t Depth = 0;
+        uint32_t MipCount = 0;
+        uint32_t ArraySize = 0;     // six per cube for cube maps
+        bool IsCubeMap = false;
+        uint32_t HeaderSize = 0;    // file offset of the first mip
+        uint64_t MipBytes[D3D12_REQ_MIP_LEVELS] = {};   // per mip of one array slice
+        uint64_t SliceBytes = 0;
+        uint64_t TotalBytes = 0;
+    };
+
+    // Reads only the first DDS_PROBE_SIZE bytes of the file.
+    HRESULT GetDDSTextureInfoFromFile(_In_z_ const wchar_t* szFileName,
+                                      _Out_ DDSTextureInfo& info
+                                      );
+
+    // Same for a DDS file already in memory.
+    HRESULT GetDDSTextureInfoFromMemory(_In_reads_bytes_(ddsDataSize) const uint8_t* ddsData,
+                                        _In_ size_t ddsDataSize,
+                                        _Out_ DDSTextureInfo& info
+                                        );
+
+    // Number of top mips a load with this maxsize leaves out.
+    size_t GetDDSSkippedMips(_In_ const DDSTextureInfo& info,
+                             _In_ size_t maxsize
+                             );
+
+    // Reads the file as CreateDDSTextureFromFile12 does: with a non-zero maxsize only
+    // the mips GetDDSSkippedMips keeps, behind a header rewritten for the shorter chain.
+    HRESULT LoadDDSTextureDataFromFile(_In_z_ const wchar_t* szFileName,
+                                       _In_ size_t maxsize,
+                                       _Out_ std::unique_ptr<uint8_t[]>& ddsData,
+                                       _Out_ size_t& ddsDataSize
+                                       );
+
     // Standard version
     HRESULT CreateDDSTextureFromMemory( _In_ ID3D11Device* d3dDevice,
                                         _In_reads_bytes_(ddsDataSize) const uint8_t* ddsData,
@@ -83,6 +129,9 @@ namespace DirectX
                                       _Out_opt_ DDS_ALPHA_MODE* alphaMode = nullptr
                                     );
 
+	// A non-zero maxsize reads and uploads only the tail of the mip chain that fits into
+	// maxsize, GetDDSSkippedMips mips shorter; the skipped top mips are never read from
+	// the file.
 	HRESULT CreateDDSTextureFromFile12(_In_ ID3D12Device* device,
 		                               _In_ ID3D12GraphicsCommandList* cmdList,
 		                               _In_z_ const wchar_t* szFileName,
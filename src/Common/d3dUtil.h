@@ -251,7 +251,8 @@ struct Material
 enum TextureType
 {
 	TEXTURE2D,
-	CUBEMAP
+	CUBEMAP,
+	TEXTURE2DARRAY
 };
 
 struct Texture
@@ -263,6 +264,14 @@ struct Texture
 	std::wstring Filename;
 	UINT SrvHeapIndex = 0;
 
+	// Entry in the app's texture cache; textures with the same entry share Resource and SRV.
+	int CacheEntry = -1;
+
+	// Header of the file, probed before the pixel data is read, and the first mip
+	// of the file that is loaded into Resource.
+	DirectX::DDSTextureInfo Info;
+	UINT TopMip = 0;
+
 	Microsoft::WRL::ComPtr<ID3D12Resource> Resource = nullptr;
 	Microsoft::WRL::ComPtr<ID3D12Resource> UploadHeap = nullptr;
 };
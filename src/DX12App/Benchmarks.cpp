@@ -0,0 +1,3893 @@
+#define NOMINMAX
+
+#include "Benchmarks.h"
+#include "BoundsTree.h"
+#include "BoxCuller.h"
+#include "CameraPath.h"
+#include "LightClusters.h"
+#include "LodSelector.h"
+#include "OcclusionBuffer.h"
+#include "ShadowCasters.h"
+#include "TerrainCut.h"
+#include "TerrainDetail.h"
+#include "TerrainHeightField.h"
+#include "TerrainHeightData.h"
+#include "TerrainHorizon.h"
+#include "TerrainInstances.h"
+#include "TerrainLod.h"
+#include "TerrainNodeFile.h"
+#include "TerrainPager.h"
+#include "TerrainPyramidBuilder.h"
+#include "TerrainQuadTree.h"
+#include "TextureCache.h"
+#include "TextureResidency.h"
+#include "TextureTranscoder.h"
+#include "ThreadPool.h"
+#include "VegetationScatter.h"
+#include "../Common/DDSTextureLoader.h"
+
+#include <windows.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+	std::vector<std::wstring> ListFiles(const std::wstring& dir, const std::wstring& pattern)
+	{
+		std::vector<std::wstring> files;
+		WIN32_FIND_DATAW data;
+		HANDLE find = FindFirstFileW((dir + pattern).c_str(), &data);
+		if (find == INVALID_HANDLE_VALUE)
+			return files;
+
+		do
+		{
+			if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				files.push_back(dir + data.cFileName);
+		} while (FindNextFileW(find, &data));
+
+		FindClose(find);
+		return files;
+	}
+
+	// Decode, mip generation and block compression of every bundled PNG/JPG/BMP,
+	// at 1, 2, 4, ... threads. The cache is ignored so every run does the full work.
+	void BenchmarkTranscode()
+	{
+		std::vector<std::wstring> sources;
+		const wchar_t* dirs[] = { L"../Textures/", L"../Models/glTF/" };
+		const wchar_t* patterns[] = { L"*.png", L"*.jpg", L"*.bmp" };
+		for (auto dir : dirs)
+			for (auto pattern : patterns)
+			{
+				auto files = ListFiles(dir, pattern);
+				sources.insert(sources.end(), files.begin(), files.end());
+			}
+
+		BenchmarkLog("transcode: " + std::to_string(sources.size()) + " source images");
+		if (sources.empty())
+			return;
+
+		TextureTranscoder transcoder(L"../Textures/Cache/");
+		TranscodeOptions options;
+
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		double singleThreadMs = 0.0;
+		for (unsigned threads = 1; ; threads *= 2)
+		{
+			if (threads > maxThreads)
+				threads = maxThreads;
+
+			ThreadPool pool(threads - 1);
+			TranscodeStats stats;
+			transcoder.Transcode(sources, options, pool, &stats, true);
+			if (threads == 1)
+				singleThreadMs = stats.WallMs;
+
+			char line[256];
+			sprintf_s(line, "transcode: %2u threads %9.1f ms (x%.2f)  decode %.1f  mips %.1f  bc %.1f  write %.1f  failed %zu",
+				threads, stats.WallMs, singleThreadMs / stats.WallMs,
+				stats.DecodeMs, stats.MipMs, stats.CompressMs, stats.WriteMs, stats.Failed);
+			BenchmarkLog(line);
+
+			if (threads == maxThreads)
+				break;
+		}
+	}
+
+	// Block compressed DDS file with a full mip chain whose bytes tell the mip and the
+	// offset within it apart.
+	bool WriteBlockCompressedDds(const std::wstring& filename, uint32_t width, uint32_t height, uint32_t fourCC, uint32_t blockBytes,
+		std::vector<uint8_t>& mipData)
+	{
+		uint32_t mipCount = 1;
+		while ((width >> mipCount) || (height >> mipCount))
+			mipCount++;
+
+		mipData.clear();
+		for (uint32_t mip = 0; mip < mipCount; mip++)
+		{
+			uint32_t w = std::max(width >> mip, 1u), h = std::max(height >> mip, 1u);
+			size_t bytes = (size_t)((w + 3) / 4) * ((h + 3) / 4) * blockBytes;
+			for (size_t i = 0; i < bytes; i++)
+				mipData.push_back((uint8_t)(mip * 37 + i * 13 + (i >> 8)));
+		}
+
+		// Magic number and DDS_HEADER, the pixel format at [19].
+		uint32_t header[32] = {};
+		header[0] = 0x20534444;
+		header[1] = 124;
+		header[2] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;
+		header[3] = height;
+		header[4] = width;
+		header[5] = ((width + 3) / 4) * ((height + 3) / 4) * blockBytes;
+		header[7] = mipCount;
+		header[19] = 32;
+		header[20] = 0x4;
+		header[21] = fourCC;
+		header[27] = 0x1000 | 0x8 | 0x400000;
+
+		std::ofstream file(filename, std::ios::binary);
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(mipData.data()), mipData.size());
+		return (bool)file;
+	}
+
+	// Mip tails read from non-square BC1 and BC3 files at every budget, the way texture
+	// residency loads them. The tail must be the chain GetDDSSkippedMips promises,
+	// Info.MipCount - TopMip mips starting at a whole number of blocks, byte for byte
+	// the file's mips. Budgets where the creation used to drop another mip because
+	// the top was kept larger than maxsize for its alignment are counted.
+	void BenchmarkDdsMipTail()
+	{
+		struct Case
+		{
+			uint32_t Width, Height;
+			const char* Name;
+			uint32_t FourCC;
+			uint32_t BlockBytes;
+		};
+		const Case cases[] =
+		{
+			{ 64, 20, "BC1", 0x31545844, 8 },
+			{ 20, 64, "BC1", 0x31545844, 8 },
+			{ 256, 36, "BC3", 0x35545844, 16 },
+			{ 1000, 12, "BC1", 0x31545844, 8 },
+			{ 512, 512, "BC3", 0x35545844, 16 },
+		};
+		const std::wstring filename = L"ddsmiptail.dds";
+
+		for (auto& c : cases)
+		{
+			std::vector<uint8_t> mipData;
+			DirectX::DDSTextureInfo info;
+			if (!WriteBlockCompressedDds(filename, c.Width, c.Height, c.FourCC, c.BlockBytes, mipData) ||
+				FAILED(DirectX::GetDDSTextureInfoFromFile(filename.c_str(), info)))
+			{
+				BenchmarkLog("ddsmiptail: couldn't write a test file");
+				DeleteFileW(filename.c_str());
+				return;
+			}
+
+			size_t budgets = 0, failed = 0, mismatches = 0, keptLarger = 0;
+			for (size_t maxsize = 1; maxsize <= 1024; maxsize *= 2)
+			{
+				budgets++;
+				size_t skip = DirectX::GetDDSSkippedMips(info, maxsize);
+				std::unique_ptr<uint8_t[]> ddsData;
+				size_t ddsDataSize = 0;
+				DirectX::DDSTextureInfo tail;
+				if (FAILED(DirectX::LoadDDSTextureDataFromFile(filename.c_str(), maxsize, ddsData, ddsDataSize)) ||
+					FAILED(DirectX::GetDDSTextureInfoFromMemory(ddsData.get(), ddsDataSize, tail)))
+				{
+					failed++;
+					continue;
+				}
+
+				uint64_t skipBytes = 0;
+				for (size_t mip = 0; mip < skip; mip++)
+					skipBytes += info.MipBytes[mip];
+				bool aligned = skip == 0 || (tail.Width % 4 == 0 && tail.Height % 4 == 0);
+				if (tail.MipCount != info.MipCount - skip || tail.Format != info.Format || !aligned ||
+					tail.Width != std::max<uint32_t>(info.Width >> skip, 1) || tail.Height != std::max<uint32_t>(info.Height >> skip, 1) ||
+					tail.TotalBytes != info.TotalBytes - skipBytes ||
+					memcmp(ddsData.get() + tail.HeaderSize, mipData.data() + skipBytes, (size_t)tail.TotalBytes) != 0)
+				{
+					mismatches++;
+				}
+				if (tail.MipCount > 1 && (tail.Width > maxsize || tail.Height > maxsize))
+					keptLarger++;
+			}
+
+			char line[256];
+			sprintf_s(line, "ddsmiptail: %4ux%-4u %s %2u mips: %zu budgets, %zu failed, %zu mismatches, %zu tops kept larger than the budget for alignment",
+				c.Width, c.Height, c.Name, info.MipCount, budgets, failed, mismatches, keptLarger);
+			BenchmarkLog(line);
+		}
+		DeleteFileW(filename.c_str());
+	}
+
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double MsSince(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	// TextureCache on files written here: identical files and the same bytes in memory
+	// share an entry, different files don't, even a large one that only differs
+	// between the fingerprint's samples. References go through Release and the saved
+	// bytes follow them. Also times acquiring a large file without and with a candidate.
+	void BenchmarkTextureCache()
+	{
+		size_t checks = 0, failed = 0;
+		auto check = [&](bool ok, const char* what)
+		{
+			checks++;
+			if (!ok)
+			{
+				failed++;
+				BenchmarkLog(std::string("texturecache: failed: ") + what);
+			}
+		};
+		auto write = [](const std::wstring& filename, const std::vector<uint8_t>& bytes)
+		{
+			std::ofstream file(filename, std::ios::binary);
+			file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+			return (bool)file;
+		};
+
+		std::vector<uint8_t> small(64 * 1024), large((size_t)TextureCache::FullHashLimit * 2 + 12345);
+		for (size_t i = 0; i < small.size(); i++)
+			small[i] = (uint8_t)(i * 31 + (i >> 9));
+		for (size_t i = 0; i < large.size(); i++)
+			large[i] = (uint8_t)(i * 7 + (i >> 12));
+		std::vector<uint8_t> otherSmall = small, otherLarge = large;
+		otherSmall[small.size() / 2] ^= 1;
+		// Halfway between the first two samples.
+		uint64_t stride = (large.size() - TextureCache::HeaderBytes - TextureCache::SampleBytes) / (TextureCache::SampleCount - 1);
+		otherLarge[(size_t)(TextureCache::HeaderBytes + stride / 2)] ^= 1;
+
+		const std::wstring files[] = { L"texturecache_a.dds", L"texturecache_a_copy.dds", L"texturecache_b.dds",
+			L"texturecache_large.dds", L"texturecache_large_copy.dds", L"texturecache_large_other.dds" };
+		if (!write(files[0], small) || !write(files[1], small) || !write(files[2], otherSmall) ||
+			!write(files[3], large) || !write(files[4], large) || !write(files[5], otherLarge))
+		{
+			BenchmarkLog("texturecache: couldn't write the test files");
+			for (auto& file : files)
+				DeleteFileW(file.c_str());
+			return;
+		}
+
+		TextureFingerprint sampledLarge, sampledOther;
+		check(TextureCache::FingerprintFile(files[3], sampledLarge) && TextureCache::FingerprintFile(files[5], sampledOther) &&
+			sampledLarge == sampledOther, "the large files don't differ only between samples");
+
+		TextureCache cache;
+		bool isNew = false;
+		int a = cache.AcquireFile(files[0], 0, isNew);
+		check(a >= 0 && isNew, "first file is new");
+		int aCopy = cache.AcquireFile(files[1], 0, isNew);
+		check(aCopy == a && !isNew, "identical file shares the entry");
+		int aBudget = cache.AcquireFile(files[0], 256, isNew);
+		check(aBudget != a && isNew, "same file at another budget is new");
+		int b = cache.AcquireFile(files[2], 0, isNew);
+		check(b != a && isNew, "different file is new");
+		int aMemory = cache.AcquireMemory(small.data(), small.size(), 0, isNew);
+		check(aMemory == a && !isNew, "same bytes in memory share the file's entry");
+
+		auto start = Clock::now();
+		int l = cache.AcquireFile(files[3], 0, isNew);
+		double sampledMs = MsSince(start);
+		check(l >= 0 && isNew, "large file is new");
+		start = Clock::now();
+		int lCopy = cache.AcquireFile(files[4], 0, isNew);
+		double confirmedMs = MsSince(start);
+		check(lCopy == l && !isNew, "identical large file shares the entry");
+		int lOther = cache.AcquireFile(files[5], 0, isNew);
+		check(lOther != l && isNew, "large file matching only the samples is new");
+		int lMemory = cache.AcquireMemory(otherLarge.data(), otherLarge.size(), 0, isNew);
+		check(lMemory == lOther && !isNew, "large bytes in memory share their file's entry");
+		check(cache.AcquireFile(L"texturecache_missing.dds", 0, isNew) == -1 && isNew, "missing file is uncached");
+
+		cache.SetByteSize(a, 1000);
+		cache.SetByteSize(aBudget, 300);
+		cache.SetByteSize(b, 1000);
+		cache.SetByteSize(l, 50000);
+		cache.SetByteSize(lOther, 50000);
+		check(cache.RefCount(a) == 3 && cache.RefCount(l) == 2 && cache.RefCount(lOther) == 2, "reference counts");
+		check(cache.UniqueCount() == 5 && cache.RequestCount() == 9, "unique and requested counts");
+		check(cache.BytesLoaded() == 102300 && cache.BytesSaved() == 2 * 1000 + 50000 + 50000, "bytes loaded and saved");
+
+		check(!cache.Release(a) && !cache.Release(a) && cache.RefCount(a) == 1, "releasing shared references");
+		check(cache.BytesSaved() == 100000, "saved bytes after release");
+		check(cache.Release(a) && cache.RefCount(a) == 0 && !cache.Release(a), "releasing the last reference");
+		int c = cache.AcquireFile(files[1], 0, isNew);
+		check(c == a && isNew, "released entry is reused for a new load");
+		for (int entry : { c, aBudget, b, l, lCopy, lOther, lMemory })
+			cache.Release(entry);
+		check(cache.UniqueCount() == 0 && cache.RequestCount() == 0 && cache.BytesSaved() == 0, "everything released");
+
+		for (auto& file : files)
+			DeleteFileW(file.c_str());
+
+		char line[256];
+		sprintf_s(line, "texturecache: %zu checks, %zu failed; %.1f MB file acquired in %.2f ms sampled, %.2f ms confirming a match",
+			checks, failed, large.size() / (1024.0 * 1024.0), sampledMs, confirmedMs);
+		BenchmarkLog(line);
+	}
+
+	// TextureResidency on synthetic mip chains: a promotion applies at once and a
+	// demotion after DemoteDelay updates, trimming keeps the resident bytes within the
+	// budget, and equal costs go to the texture seen longest ago, then the lowest id.
+	// A random scene with some loads failing then runs twice and must give the same
+	// changes both times.
+	void BenchmarkTextureResidency()
+	{
+		size_t checks = 0, failed = 0;
+		auto check = [&](bool ok, const char* what)
+		{
+			checks++;
+			if (!ok)
+			{
+				failed++;
+				BenchmarkLog(std::string("textureresidency: failed: ") + what);
+			}
+		};
+		// BC1-like chain, mips up to 32 x 32 in the tail.
+		auto chain = [](uint32_t width, std::vector<uint64_t>& mipBytes)
+		{
+			uint32_t tail = 0;
+			mipBytes.clear();
+			for (uint32_t w = width; ; w /= 2)
+			{
+				mipBytes.push_back(std::max<uint64_t>(w / 4, 1) * std::max<uint64_t>(w / 4, 1) * 8);
+				if (w <= 32)
+					tail++;
+				if (w == 1)
+					break;
+			}
+			return tail;
+		};
+		std::vector<uint64_t> mipBytes;
+		uint32_t tail = chain(1024, mipBytes);
+
+		{
+			TextureResidency residency;
+			int id = residency.Register(1024, mipBytes, tail, 31);
+			check(residency.TopMip(id) == residency.TailMip(id) && residency.TailMip(id) == 5, "registered at the tail");
+			residency.Request(id, 1.0f, 1024.0f);
+			auto& changes = residency.Update();
+			check(changes.size() == 1 && changes[0].Id == id && changes[0].OldTopMip == 5 && changes[0].NewTopMip == 0,
+				"promoted at once");
+			bool early = false;
+			for (uint32_t u = 1; u < TextureResidency::DemoteDelay; u++)
+				early |= !residency.Update().empty();
+			check(!early, "kept until the demotion delay");
+			auto& late = residency.Update();
+			check(late.size() == 1 && late[0].Id == id && late[0].NewTopMip == 5, "demoted after the delay");
+
+			residency.Request(id, 1.0f, 1024.0f);
+			residency.Update();
+			residency.SetTopMip(id, 3);
+			check(residency.TopMip(id) == 3, "set to the mip actually resident");
+			residency.Request(id, 1.0f, 1024.0f);
+			auto& retry = residency.Update();
+			check(retry.size() == 1 && retry[0].OldTopMip == 3 && retry[0].NewTopMip == 0, "failed promotion asked again");
+		}
+
+		{
+			// Same chains and demand: the lower id loses the mip.
+			TextureResidency residency;
+			int a = residency.Register(1024, mipBytes, tail);
+			int b = residency.Register(1024, mipBytes, tail);
+			residency.SetBudget(residency.BytesFrom(a, 1) + residency.BytesFrom(b, 0));
+			residency.Request(a, 1.0f, 1024.0f);
+			residency.Request(b, 1.0f, 1024.0f);
+			residency.Update();
+			check(residency.TopMip(a) == 1 && residency.TopMip(b) == 0 && residency.LastPressureTrims() == 1,
+				"equal cost trims the lowest id");
+		}
+
+		{
+			// Neither is wanted any more: the one seen longest ago loses the mip.
+			TextureResidency residency;
+			int a = residency.Register(1024, mipBytes, tail);
+			int b = residency.Register(1024, mipBytes, tail);
+			residency.Request(a, 1.0f, 1024.0f);
+			residency.Request(b, 1.0f, 1024.0f);
+			residency.Update();
+			residency.Request(a, 1.0f, 1024.0f);
+			residency.Update();
+			residency.SetBudget(residency.ResidentBytes() - mipBytes[0]);
+			residency.Update();
+			check(residency.TopMip(a) == 0 && residency.TopMip(b) == 1, "equal cost trims the oldest");
+		}
+
+		const int textureCount = 64, updates = 300;
+		auto scene = [&](uint64_t& changeCount, double& updateMs)
+		{
+			std::mt19937 rng(29);
+			std::uniform_int_distribution<int> widthShift(7, 12);
+			std::uniform_real_distribution<float> pixels(1.0f, 2048.0f);
+			TextureResidency residency;
+			uint64_t tails = 0, full = 0;
+			for (int i = 0; i < textureCount; i++)
+			{
+				uint32_t width = 1u << widthShift(rng);
+				std::vector<uint64_t> bytes;
+				int id = residency.Register(width, bytes, chain(width, bytes), 31);
+				tails += residency.BytesFrom(id, residency.TailMip(id));
+				full += residency.BytesFrom(id, 0);
+			}
+			residency.SetBudget(tails + (full - tails) / 4);
+
+			uint64_t hash = 1469598103934665603ull;
+			auto mix = [&](uint64_t value)
+			{
+				hash = (hash ^ value) * 1099511628211ull;
+			};
+			bool withinBudget = true, consistent = true;
+			changeCount = 0;
+			updateMs = 0.0;
+			for (int u = 0; u < updates; u++)
+			{
+				// A drifting window of the textures is on screen.
+				for (int i = 0; i < textureCount; i++)
+					if ((i + u / 10) % 4 != 0 && rng() % 3 != 0)
+						residency.Request(i, 1.0f + (rng() % 4), pixels(rng));
+
+				std::vector<uint32_t> before(textureCount);
+				for (int i = 0; i < textureCount; i++)
+					before[i] = residency.TopMip(i);
+				auto start = Clock::now();
+				auto& changes = residency.Update();
+				updateMs += MsSince(start);
+				withinBudget &= residency.ResidentBytes() <= residency.Budget();
+				changeCount += changes.size();
+				for (auto& change : changes)
+				{
+					consistent &= change.OldTopMip == before[change.Id] && change.NewTopMip == residency.TopMip(change.Id);
+					mix((uint64_t)change.Id << 40 | (uint64_t)change.OldTopMip << 20 | change.NewTopMip);
+					// One promotion in eight fails to load.
+					if (change.NewTopMip < change.OldTopMip && rng() % 8 == 0)
+						residency.SetTopMip(change.Id, change.OldTopMip);
+				}
+				mix(residency.ResidentBytes());
+			}
+			check(withinBudget, "resident bytes within the budget after every update");
+			check(consistent, "changes start from the resident mip");
+			return hash;
+		};
+		uint64_t changeCount = 0, repeatCount = 0;
+		double updateMs = 0.0, repeatMs = 0.0;
+		uint64_t hash = scene(changeCount, updateMs);
+		check(scene(repeatCount, repeatMs) == hash && repeatCount == changeCount, "same changes across runs");
+
+		char line[256];
+		sprintf_s(line, "textureresidency: %zu checks, %zu failed; %d textures, %d updates, %llu changes, %.4f ms per update",
+			checks, failed, textureCount, updates, (unsigned long long)changeCount, std::min(updateMs, repeatMs) / updates);
+		BenchmarkLog(line);
+	}
+
+	// Synthetic height fields in [0, 1], x and z in tiles of the finest level.
+	float RollingHills(float x, float z)
+	{
+		return 0.5f + 0.3f * std::sin(x * 0.11f) * std::cos(z * 0.07f) + 0.2f * std::sin((x + z) * 0.031f);
+	}
+
+	float Ridges(float x, float z)
+	{
+		float r = 1.0f - std::fabs(std::sin(x * 0.23f + std::sin(z * 0.05f) * 3.0f));
+		return 0.2f + 0.6f * r * r + 0.2f * std::cos(z * 0.013f);
+	}
+
+	// Recursive tree with a heap allocated node per tile, the way the terrain used to be stored.
+	struct PointerNode
+	{
+		DirectX::BoundingBox Bounds;
+		PointerNode* Children[4] = {};
+		uint32_t Level = 0;
+	};
+
+	PointerNode* BuildPointerTree(const TerrainQuadTree& tree, uint32_t node, uint32_t level)
+	{
+		PointerNode* p = new PointerNode();
+		p->Bounds = tree.Bounds(node);
+		p->Level = level;
+		if (level + 1 < tree.Depth())
+		{
+			uint32_t child = TerrainQuadTree::FirstChild(node, level);
+			for (int i = 0; i < 4; i++)
+				p->Children[i] = BuildPointerTree(tree, child + i, level + 1);
+		}
+		return p;
+	}
+
+	void FreePointerTree(PointerNode* p)
+	{
+		for (auto c : p->Children)
+			if (c)
+				FreePointerTree(c);
+		delete p;
+	}
+
+	void SelectPointerTree(const PointerNode* p, const DirectX::BoundingFrustum& frustum, DirectX::FXMVECTOR eye, const float* thresholds, std::vector<const PointerNode*>& selected)
+	{
+		using namespace DirectX;
+		if (!frustum.Intersects(p->Bounds))
+			return;
+
+		float distance = XMVectorGetX(XMVector3Length(XMVectorSubtract(eye, XMLoadFloat3(&p->Bounds.Center))));
+		if (!p->Children[0] || distance > thresholds[p->Level])
+		{
+			selected.push_back(p);
+			return;
+		}
+
+		for (auto c : p->Children)
+			SelectPointerTree(c, frustum, eye, thresholds, selected);
+	}
+
+	// Per frame selection over quadtrees of 4 to 12 levels with 128 unit leaf tiles,
+	// for a camera flying low over two synthetic height fields. The recursive pointer
+	// tree is timed alongside up to 10 levels, past that it no longer fits comfortably.
+	void BenchmarkQuadtree()
+	{
+		using namespace DirectX;
+
+		const float leafSize = 128.0f;
+		const float heightScale = 250.0f;
+		const int frames = 240;
+
+		struct Terrain
+		{
+			const char* Name;
+			float(*Height)(float x, float z);
+		};
+		const Terrain terrains[] = { { "hills", RollingHills }, { "ridges", Ridges } };
+
+		BoundingFrustum viewFrustum;
+		BoundingFrustum::CreateFromMatrix(viewFrustum, XMMatrixPerspectiveFovLH(0.25f * XM_PI, 16.0f / 9.0f, 1.0f, 20000.0f));
+
+		for (auto& terrain : terrains)
+		{
+			for (uint32_t depth = 4; depth <= 12; depth++)
+			{
+				float rootSize = leafSize * (1 << (depth - 1));
+				auto buildStart = Clock::now();
+
+				TerrainQuadTree tree;
+				tree.Build(depth, rootSize, 0.0f, 0.0f, 0.0f, heightScale);
+				uint32_t nodeCount = TerrainQuadTree::LevelOffset(depth);
+				for (uint32_t level = 0; level < depth; level++)
+					for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+						tree.CreateNode(n, level);
+
+				// Leaf ranges from a 3x3 sample of the height field, parents take the union.
+				std::vector<float> minY(nodeCount), maxY(nodeCount);
+				uint32_t leafLevel = depth - 1;
+				for (uint32_t n = TerrainQuadTree::LevelOffset(leafLevel); n < nodeCount; n++)
+				{
+					uint32_t x, y;
+					TerrainQuadTree::TileCoords(n, leafLevel, x, y);
+					float lo = 1.0f, hi = 0.0f;
+					for (int sy = 0; sy < 3; sy++)
+						for (int sx = 0; sx < 3; sx++)
+						{
+							float h = terrain.Height(x + 0.5f * sx, y + 0.5f * sy);
+							lo = std::min(lo, h);
+							hi = std::max(hi, h);
+						}
+					minY[n] = lo * heightScale;
+					maxY[n] = hi * heightScale;
+				}
+				for (int level = (int)leafLevel - 1; level >= 0; level--)
+				{
+					for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+					{
+						uint32_t c = TerrainQuadTree::FirstChild(n, level);
+						minY[n] = std::min(std::min(minY[c], minY[c + 1]), std::min(minY[c + 2], minY[c + 3]));
+						maxY[n] = std::max(std::max(maxY[c], maxY[c + 1]), std::max(maxY[c + 2], maxY[c + 3]));
+					}
+				}
+				for (uint32_t n = 0; n < nodeCount; n++)
+					tree.SetHeightRange(n, minY[n], maxY[n]);
+				double buildMs = MsSince(buildStart);
+
+				// Same rule as the terrain: refine while closer than twice the tile size.
+				std::vector<float> thresholds(depth);
+				for (uint32_t level = 0; level < depth; level++)
+					thresholds[level] = 2.0f * tree.TileSize(level);
+				auto refine = [&](uint32_t, uint32_t level, float distance) { return distance <= thresholds[level]; };
+
+				// Straight flight across the middle, looking ahead and slightly down.
+				std::vector<BoundingFrustum> frustums(frames);
+				std::vector<XMVECTOR> eyes(frames);
+				for (int f = 0; f < frames; f++)
+				{
+					float t = (float)f / (frames - 1);
+					XMVECTOR eye = XMVectorSet((t - 0.5f) * 0.5f * rootSize, heightScale + 100.0f, (t - 0.5f) * 0.3f * rootSize, 1.0f);
+					XMVECTOR dir = XMVectorSet(std::cos(t * 2.0f), -0.3f, std::sin(t * 2.0f), 0.0f);
+					XMMATRIX view = XMMatrixLookToLH(eye, dir, XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+					viewFrustum.Transform(frustums[f], XMMatrixInverse(nullptr, view));
+					eyes[f] = eye;
+				}
+
+				std::vector<TerrainQuadTree::Selected> selected;
+				size_t selectedTotal = 0;
+				auto start = Clock::now();
+				for (int f = 0; f < frames; f++)
+				{
+					selected.clear();
+					tree.Select(frustums[f], eyes[f], refine, selected);
+					selectedTotal += selected.size();
+				}
+				double linearMs = MsSince(start) / frames;
+
+				char line[256];
+				sprintf_s(line, "quadtree: %-6s depth %2u  %8zu nodes  %6.1f MB  build %8.1f ms  select %8.4f ms  %7.1f tiles",
+					terrain.Name, depth, tree.NodeCount(), tree.MemoryBytes() / (1024.0 * 1024.0),
+					buildMs, linearMs, (double)selectedTotal / frames);
+				std::string report = line;
+
+				if (depth <= 10)
+				{
+					PointerNode* root = BuildPointerTree(tree, 0, 0);
+					std::vector<const PointerNode*> pointerSelected;
+					start = Clock::now();
+					for (int f = 0; f < frames; f++)
+					{
+						pointerSelected.clear();
+						SelectPointerTree(root, frustums[f], eyes[f], thresholds.data(), pointerSelected);
+					}
+					double pointerMs = MsSince(start) / frames;
+					FreePointerTree(root);
+
+					sprintf_s(line, "  pointer tree %8.4f ms (x%.2f)", pointerMs, pointerMs / linearMs);
+					report += line;
+				}
+
+				BenchmarkLog(report);
+			}
+		}
+	}
+
+	// Recorded paths from ../CameraPaths/ (F4 in the app), or a slow low orbit over
+	// the terrain when there are none.
+	std::vector<std::pair<std::string, CameraPath>> LoadCameraPaths()
+	{
+		std::vector<std::pair<std::string, CameraPath>> paths;
+		for (auto& file : ListFiles(L"../CameraPaths/", L"*.txt"))
+		{
+			CameraPath path;
+			if (path.Load(file) && !path.Frames().empty())
+				paths.push_back({ std::string(file.begin() + file.find_last_of(L'/') + 1, file.end()), path });
+		}
+
+		if (paths.empty())
+		{
+			CameraPath orbit;
+			for (int f = 0; f < 600; f++)
+			{
+				float a = f * 2.0f * DirectX::XM_PI / 600;
+				CameraPathFrame frame;
+				frame.Position = DirectX::XMFLOAT3(400.0f * std::cos(a), 120.0f, 400.0f * std::sin(a));
+				frame.Look = DirectX::XMFLOAT3(-std::sin(a), -0.2f, std::cos(a));
+				frame.Up = DirectX::XMFLOAT3(0.0f, 1.0f, 0.0f);
+				frame.FovY = 0.25f * DirectX::XM_PI;
+				frame.Aspect = 800.0f / 600.0f;
+				frame.NearZ = 1.0f;
+				frame.FarZ = 1000.0f;
+				frame.ViewportHeight = 600.0f;
+				orbit.Add(frame);
+			}
+			paths.push_back({ "built-in orbit", orbit });
+		}
+
+		return paths;
+	}
+
+	// Tiles selected by the distance thresholds and by screen space error at a few
+	// pixel budgets, on the shipped height tiles along every camera path, with a check
+	// of the edges between levels the morph has to close.
+	void BenchmarkTerrainLod()
+	{
+		// Same terrain setup as DX12App.
+		const uint32_t levels = 4;
+		const float rootSize = 1024.0f;
+		const float baseY = -40.0f;
+		const float heightScale = 250.0f;
+
+		TerrainHeightData heights;
+		auto start = Clock::now();
+		if (!heights.Load(L"../Textures/Terrain", levels))
+		{
+			BenchmarkLog("terrainlod: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+		double loadMs = MsSince(start);
+
+		start = Clock::now();
+		std::vector<float> errors = heights.ComputeGeometricErrors();
+		double errorMs = MsSince(start);
+		std::vector<TerrainHeightRange> heightRanges = heights.ComputeHeightRanges();
+
+		TerrainQuadTree tree;
+		tree.Build(levels, rootSize, 0.0f, 0.0f, baseY, baseY + heightScale);
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+			{
+				tree.CreateNode(n, level, errors[n] * heightScale);
+				tree.SetHeightRange(n, baseY + heightRanges[n].Min * heightScale, baseY + heightRanges[n].Max * heightScale);
+			}
+		}
+
+		char line[256];
+		sprintf_s(line, "terrainlod: loaded %u levels in %.1f ms, geometric errors in %.1f ms", levels, loadMs, errorMs);
+		BenchmarkLog(line);
+		std::vector<float> levelErrors(levels);
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			float lo = FLT_MAX, hi = 0.0f;
+			for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+			{
+				lo = std::min(lo, tree.GeometricError(n));
+				hi = std::max(hi, tree.GeometricError(n));
+			}
+			levelErrors[level] = hi;
+			sprintf_s(line, "terrainlod:   level %u error %.2f .. %.2f", level, lo, hi);
+			BenchmarkLog(line);
+		}
+
+		std::vector<TerrainLodSettings> modes(1);
+		modes[0].Mode = TerrainLodMode::DistanceThresholds;
+		const float pixelErrors[] = { 1.0f, 2.0f, 4.0f, 8.0f };
+		for (float pixels : pixelErrors)
+		{
+			TerrainLodSettings sse;
+			sse.PixelError = pixels;
+			modes.push_back(sse);
+		}
+
+		auto modeName = [](const TerrainLodSettings& mode)
+		{
+			return mode.Mode == TerrainLodMode::DistanceThresholds ? std::string("distance    ") : "sse " + std::to_string((int)mode.PixelError) + " px    ";
+		};
+
+		TerrainLodRanges ranges;
+		for (auto& mode : modes)
+		{
+			ComputeTerrainLodRanges(tree, mode, levelErrors, 0.25f * DirectX::XM_PI, 1080.0f, ranges);
+			std::string text = "terrainlod:   " + modeName(mode) + " ranges at 1080p:";
+			for (uint32_t level = 1; level < levels; level++)
+			{
+				sprintf_s(line, " L%u %.0f (morph from %.0f)", level, ranges.Range[level], ranges.MorphStart[level]);
+				text += line;
+			}
+			BenchmarkLog(text);
+		}
+
+		std::vector<TerrainQuadTree::Selected> selected;
+		for (auto& path : LoadCameraPaths())
+		{
+			const auto& frames = path.second.Frames();
+			BenchmarkLog("terrainlod: path " + path.first + ", " + std::to_string(frames.size()) + " frames");
+
+			for (auto& mode : modes)
+			{
+				size_t total = 0, fewest = SIZE_MAX, most = 0;
+				size_t perLevel[levels] = {};
+				uint32_t coarserEdges = 0, unmorphedEdges = 0, maxLevelDelta = 0;
+				double selectMs = 0.0;
+				for (auto& frame : frames)
+				{
+					DirectX::BoundingFrustum frustum = frame.Frustum();
+					selected.clear();
+					start = Clock::now();
+					ComputeTerrainLodRanges(tree, mode, levelErrors, frame.FovY, frame.ViewportHeight, ranges);
+					SelectTerrainTiles(tree, ranges, frustum, frame.Position, selected);
+					selectMs += MsSince(start);
+
+					total += selected.size();
+					fewest = std::min(fewest, selected.size());
+					most = std::max(most, selected.size());
+					for (auto& s : selected)
+						perLevel[s.Level]++;
+
+					TerrainSeamStats seams = CheckTerrainSeams(tree, ranges, frame.Position, selected);
+					coarserEdges += seams.CoarserEdges;
+					unmorphedEdges += seams.UnmorphedEdges;
+					maxLevelDelta = std::max(maxLevelDelta, seams.MaxLevelDelta);
+				}
+
+				double n = (double)frames.size();
+				sprintf_s(line, "terrainlod:   %s tiles avg %6.1f min %3zu max %3zu  per level %5.1f %5.1f %5.1f %5.1f  select %.4f ms  "
+					"level edges %.1f, max step %u, unmorphed %u",
+					modeName(mode).c_str(), total / n, fewest, most, perLevel[0] / n, perLevel[1] / n, perLevel[2] / n, perLevel[3] / n, selectMs / n,
+					coarserEdges / n, maxLevelDelta, unmorphedEdges);
+				BenchmarkLog(line);
+			}
+		}
+	}
+
+	// The min/max height pyramid of the shipped tiles: checks that every range holds
+	// its children and every vertex its tile's mesh can take, then compares frustum
+	// culling of all nodes with tight bounds against the flat grid bounds the tiles
+	// used to have and against the full height range.
+	void BenchmarkTerrainBounds()
+	{
+		using namespace DirectX;
+
+		const uint32_t levels = 4;
+		const float rootSize = 1024.0f;
+		const float baseY = -40.0f;
+		const float heightScale = 250.0f;
+
+		TerrainHeightData heights;
+		if (!heights.Load(L"../Textures/Terrain", levels))
+		{
+			BenchmarkLog("terrainbounds: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+
+		auto start = Clock::now();
+		std::vector<TerrainHeightRange> ranges = heights.ComputeHeightRanges();
+		double buildMs = MsSince(start);
+
+		// Parents hold their children, and the grid vertices of every tile, sampled at
+		// mip 0 like the terrain vertex shader does, stay inside the tile's range.
+		uint32_t containment = 0, outside = 0;
+		const uint32_t n = TerrainHeightData::GridVertices;
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+			{
+				if (level + 1 < levels)
+				{
+					uint32_t child = TerrainQuadTree::FirstChild(node, level);
+					for (uint32_t i = 0; i < 4; i++)
+						if (ranges[child + i].Min < ranges[node].Min || ranges[child + i].Max > ranges[node].Max)
+							containment++;
+				}
+
+				uint32_t x, y;
+				TerrainQuadTree::TileCoords(node, level, x, y);
+				for (uint32_t i = 0; i < n; i++)
+				{
+					for (uint32_t j = 0; j < n; j++)
+					{
+						float h = heights.SampleTile(level, x, y, (float)j / (n - 1), (float)i / (n - 1));
+						if (h < ranges[node].Min || h > ranges[node].Max)
+							outside++;
+					}
+				}
+			}
+		}
+
+		char line[256];
+		sprintf_s(line, "terrainbounds: pyramid of %u levels in %.2f ms, %u children outside their parent, %u vertices outside their tile",
+			levels, buildMs, containment, outside);
+		BenchmarkLog(line);
+
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			double extent = 0.0;
+			float lo = FLT_MAX, hi = 0.0f;
+			for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+			{
+				float e = (ranges[node].Max - ranges[node].Min) * heightScale;
+				extent += e;
+				lo = std::min(lo, e);
+				hi = std::max(hi, e);
+			}
+			sprintf_s(line, "terrainbounds:   level %u height extent avg %6.1f min %6.1f max %6.1f (full %.0f)",
+				level, extent / TerrainQuadTree::LevelWidth(level) / TerrainQuadTree::LevelWidth(level), lo, hi, heightScale);
+			BenchmarkLog(line);
+		}
+
+		// Flat: the grid at baseY, what the tiles' render items had. Full: the whole
+		// height range, what the quadtree had.
+		std::vector<BoundingBox> tight, flat, full;
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			float size = rootSize / TerrainQuadTree::LevelWidth(level);
+			for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+			{
+				uint32_t x, y;
+				TerrainQuadTree::TileCoords(node, level, x, y);
+				float cx = -0.5f * rootSize + (x + 0.5f) * size;
+				float cz = 0.5f * rootSize - (y + 0.5f) * size;
+				float minY = baseY + ranges[node].Min * heightScale;
+				float maxY = baseY + ranges[node].Max * heightScale;
+				tight.push_back(BoundingBox(XMFLOAT3(cx, 0.5f * (minY + maxY), cz), XMFLOAT3(0.5f * size, 0.5f * (maxY - minY), 0.5f * size)));
+				flat.push_back(BoundingBox(XMFLOAT3(cx, baseY, cz), XMFLOAT3(0.5f * size, 0.0f, 0.5f * size)));
+				full.push_back(BoundingBox(XMFLOAT3(cx, baseY + 0.5f * heightScale, cz), XMFLOAT3(0.5f * size, 0.5f * heightScale, 0.5f * size)));
+			}
+		}
+
+		for (auto& path : LoadCameraPaths())
+		{
+			size_t visible = 0, flatMissed = 0, flatExtra = 0, fullExtra = 0;
+			for (auto& frame : path.second.Frames())
+			{
+				BoundingFrustum frustum = frame.Frustum();
+				for (size_t i = 0; i < tight.size(); i++)
+				{
+					bool inTight = frustum.Intersects(tight[i]);
+					bool inFlat = frustum.Intersects(flat[i]);
+					visible += inTight;
+					flatMissed += inTight && !inFlat;
+					flatExtra += inFlat && !inTight;
+					fullExtra += frustum.Intersects(full[i]) && !inTight;
+				}
+			}
+
+			double frames = (double)path.second.Frames().size();
+			sprintf_s(line, "terrainbounds: path %s, nodes in view per frame %.1f; flat bounds cull %.1f visible and keep %.1f hidden, full range keeps %.1f hidden",
+				path.first.c_str(), visible / frames, flatMissed / frames, flatExtra / frames, fullExtra / frames);
+			BenchmarkLog(line);
+		}
+	}
+
+	// A terrain of 10 to 12 levels that is never loaded as a whole: node records are
+	// paged from a synthetic node file as a camera flies low across it. Compared with
+	// creating the complete tree up front, and paged with groups completed a few
+	// updates after they are requested, as the app does while their tiles load.
+	void BenchmarkTerrainPaging()
+	{
+		using namespace DirectX;
+
+		const float leafSize = 128.0f;
+		const float heightScale = 250.0f;
+		const int frames = 600;
+
+		TerrainLodSettings lod;
+		TerrainPagerSettings settings;
+		settings.MaxNodes = 4096;
+		settings.MaxGroupsPerUpdate = 16;
+		settings.EvictAfter = 60;
+		settings.HeightScale = heightScale;
+
+		for (uint32_t depth = 10; depth <= 12; depth++)
+		{
+			float rootSize = leafSize * (1 << (depth - 1));
+			uint32_t nodeCount = TerrainQuadTree::LevelOffset(depth);
+
+			// Errors roughly halve per level and vary with the ridges, parents bound their children.
+			std::vector<TerrainNodeRecord> records(nodeCount);
+			uint32_t leafLevel = depth - 1;
+			for (int level = (int)leafLevel - 1; level >= 0; level--)
+			{
+				float scale = (float)(1u << (leafLevel - level));
+				for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+				{
+					uint32_t x, y;
+					TerrainQuadTree::TileCoords(n, level, x, y);
+					float error = 0.2f / scale * (0.3f + 0.7f * Ridges((x + 0.5f) * scale, (y + 0.5f) * scale));
+					uint32_t child = TerrainQuadTree::FirstChild(n, level);
+					for (uint32_t i = 0; i < 4; i++)
+						error = std::max(error, records[child + i].Error);
+					records[n].Error = error;
+				}
+			}
+
+			std::wstring filename = L"terrain_nodes_" + std::to_wstring(depth) + L".bin";
+			if (!TerrainNodeFile::Write(filename, depth, records))
+			{
+				BenchmarkLog("terrainpaging: can't write the node file");
+				return;
+			}
+			records.clear();
+			records.shrink_to_fit();
+
+			// Everything up front.
+			auto start = Clock::now();
+			{
+				TerrainNodeFile file;
+				file.Open(filename);
+				std::vector<TerrainNodeRecord> all(nodeCount);
+				file.Read(0, nodeCount, all.data());
+
+				TerrainQuadTree full;
+				full.Build(depth, rootSize, 0.0f, 0.0f, 0.0f, heightScale);
+				for (uint32_t level = 0; level < depth; level++)
+					for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+						full.CreateNode(n, level, all[n].Error * heightScale);
+
+				char line[256];
+				sprintf_s(line, "terrainpaging: depth %2u  complete tree %8zu nodes %7.1f MB  startup %8.1f ms",
+					depth, full.NodeCount(), full.MemoryBytes() / (1024.0 * 1024.0), MsSince(start));
+				BenchmarkLog(line);
+			}
+
+			// On demand, with groups created at once or loadLatency updates after the request.
+			const int loadLatency = 3;
+			for (int deferred = 0; deferred < 2; deferred++)
+			{
+				TerrainNodeFile file;
+				TerrainQuadTree tree;
+				TerrainPagerSettings pagerSettings = settings;
+				pagerSettings.DeferCreation = deferred != 0;
+				TerrainPager pager(tree, file, pagerSettings);
+				start = Clock::now();
+				file.Open(filename);
+				tree.Build(depth, rootSize, 0.0f, 0.0f, 0.0f, heightScale);
+				pager.Reset();
+				double startupMs = MsSince(start);
+				size_t startupBytes = tree.MemoryBytes();
+
+				CameraPathFrame frame;
+				frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+				frame.FovY = 0.25f * XM_PI;
+				frame.Aspect = 16.0f / 9.0f;
+				frame.NearZ = 1.0f;
+				frame.FarZ = 20000.0f;
+				frame.ViewportHeight = 1080.0f;
+
+				std::vector<float> levelErrors = file.LevelErrors();
+				for (float& error : levelErrors)
+					error *= heightScale;
+				TerrainLodRanges ranges;
+				ComputeTerrainLodRanges(tree, lod, levelErrors, frame.FovY, frame.ViewportHeight, ranges);
+
+				std::vector<TerrainQuadTree::Selected> selected, wanted;
+				size_t nodesTotal = 0, nodesMax = 0, memoryMax = 0, tilesTotal = 0, created = 0, destroyed = 0, dropped = 0;
+				std::vector<std::pair<int, TerrainQuadTree::Selected>> requests;
+				double frameMs = 0.0, frameMaxMs = 0.0;
+				for (int f = 0; f < frames; f++)
+				{
+					float t = (float)f / (frames - 1);
+					frame.Position = XMFLOAT3((t - 0.5f) * 8000.0f, heightScale + 100.0f, (t - 0.5f) * 3000.0f);
+					frame.Look = XMFLOAT3(std::cos(t * 2.0f), -0.3f, std::sin(t * 2.0f));
+					BoundingFrustum frustum = frame.Frustum();
+
+					auto frameStart = Clock::now();
+					selected.clear();
+					wanted.clear();
+					SelectTerrainTiles(tree, ranges, frustum, frame.Position, selected, &wanted);
+					pager.Update(selected, wanted);
+					for (auto& r : pager.Requested())
+						requests.push_back({ f + loadLatency, r });
+					size_t done = 0;
+					while (done < requests.size() && requests[done].first <= f)
+					{
+						dropped += !pager.Complete(requests[done].second.Node, requests[done].second.Level);
+						done++;
+					}
+					requests.erase(requests.begin(), requests.begin() + done);
+					double ms = MsSince(frameStart);
+
+					frameMs += ms;
+					frameMaxMs = std::max(frameMaxMs, ms);
+					tilesTotal += selected.size();
+					nodesTotal += tree.NodeCount();
+					if (tree.NodeCount() + 4 * pager.PendingCount() > settings.MaxNodes)
+						BenchmarkLog("terrainpaging: more nodes created and requested than MaxNodes");
+					nodesMax = std::max(nodesMax, tree.NodeCount());
+					memoryMax = std::max(memoryMax, tree.MemoryBytes());
+					created += pager.Created().size();
+					destroyed += pager.Destroyed().size();
+				}
+
+				char line[256];
+				sprintf_s(line, "terrainpaging: depth %2u  %s: startup %.3f ms %.2f MB, nodes avg %.0f max %zu, %.2f MB max, tiles %.1f, frame %.4f ms (max %.3f), %zu created %zu destroyed %zu dropped, %llu KB read",
+					depth, deferred ? "deferred" : "paged", startupMs, startupBytes / (1024.0 * 1024.0), (double)nodesTotal / frames, nodesMax, memoryMax / (1024.0 * 1024.0),
+					(double)tilesTotal / frames, frameMs / frames, frameMaxMs, created, destroyed, dropped, (unsigned long long)(file.BytesRead() >> 10));
+				BenchmarkLog(line);
+
+				file.Close();
+			}
+			DeleteFileW(filename.c_str());
+		}
+	}
+
+	// Horizon culling on the shipped height tiles: the ground of the selected tiles,
+	// as grids of 1, 4 and 8 cells a side, occludes the tiles themselves and a few
+	// thousand boxes standing on the terrain, along the camera paths and a walk
+	// through the valleys at eye height. Every few frames the culled boxes are checked
+	// by marching rays from the eye to their corners over the finest height tiles.
+	void BenchmarkTerrainHorizon()
+	{
+		using namespace DirectX;
+
+		const uint32_t levels = 4;
+		const float rootSize = 1024.0f;
+		const float baseY = -40.0f;
+		const float heightScale = 250.0f;
+
+		TerrainHeightData heights;
+		if (!heights.Load(L"../Textures/Terrain", levels))
+		{
+			BenchmarkLog("terrainhorizon: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+
+		std::vector<float> errors = heights.ComputeGeometricErrors();
+		std::vector<TerrainHeightRange> heightRanges = heights.ComputeHeightRanges();
+		TerrainQuadTree tree;
+		tree.Build(levels, rootSize, 0.0f, 0.0f, baseY, baseY + heightScale);
+		std::vector<float> levelErrors(levels, 0.0f);
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+			{
+				tree.CreateNode(n, level, errors[n] * heightScale);
+				tree.SetHeightRange(n, baseY + heightRanges[n].Min * heightScale, baseY + heightRanges[n].Max * heightScale);
+				levelErrors[level] = std::max(levelErrors[level], errors[n] * heightScale);
+			}
+		}
+
+		const uint32_t gridSizes[] = { 1, 4, 8 };
+		std::vector<std::vector<float>> minHeights[3];
+		for (int g = 0; g < 3; g++)
+		{
+			for (uint32_t level = 0; level < levels; level++)
+			{
+				for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+				{
+					uint32_t x, y;
+					TerrainQuadTree::TileCoords(n, level, x, y);
+					minHeights[g].push_back(TerrainHeightData::ComputeMinHeights(heights.Tile(level, x, y), heights.TileResolution(), gridSizes[g]));
+					for (float& h : minHeights[g].back())
+						h = baseY + h * heightScale;
+				}
+			}
+		}
+
+		const uint32_t finest = levels - 1;
+		auto surface = [&](float x, float z)
+		{
+			float width = (float)TerrainQuadTree::LevelWidth(finest);
+			float u = std::min(std::max((x / rootSize + 0.5f) * width, 0.0f), width - 0.001f);
+			float v = std::min(std::max((0.5f - z / rootSize) * width, 0.0f), width - 0.001f);
+			uint32_t tx = (uint32_t)u, ty = (uint32_t)v;
+			return baseY + heights.SampleTile(finest, tx, ty, u - tx, v - ty) * heightScale;
+		};
+
+		std::mt19937 rng(36);
+		std::uniform_real_distribution<float> across(-0.48f * rootSize, 0.48f * rootSize);
+		std::vector<BoundingBox> objects(4000);
+		for (auto& box : objects)
+		{
+			float x = across(rng), z = across(rng);
+			box = BoundingBox(XMFLOAT3(x, surface(x, z) + 4.0f, z), XMFLOAT3(2.0f, 4.0f, 2.0f));
+		}
+
+		auto paths = LoadCameraPaths();
+		CameraPath valley;
+		for (int f = 0; f < 600; f++)
+		{
+			float t = (float)f / 599;
+			CameraPathFrame frame;
+			frame.Position = XMFLOAT3((t - 0.5f) * 900.0f, 0.0f, (t - 0.5f) * 500.0f + 80.0f * std::sin(t * 9.0f));
+			frame.Position.y = surface(frame.Position.x, frame.Position.z) + 6.0f;
+			float a = 0.5f + 1.5f * std::sin(t * 5.0f);
+			frame.Look = XMFLOAT3(std::cos(a), -0.05f, std::sin(a));
+			frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+			frame.FovY = 0.25f * XM_PI;
+			frame.Aspect = 16.0f / 9.0f;
+			frame.NearZ = 1.0f;
+			frame.FarZ = 1000.0f;
+			frame.ViewportHeight = 1080.0f;
+			valley.Add(frame);
+		}
+		paths.push_back({ "built-in valley walk", valley });
+
+		TerrainLodSettings lod;
+		TerrainLodRanges ranges;
+		TerrainHorizon horizon;
+		std::vector<TerrainQuadTree::Selected> selected;
+		std::vector<BoundingBox> boxes;
+		std::vector<uint8_t> hidden;
+		char line[256];
+		for (auto& path : paths)
+		{
+			for (int g = 0; g < 3; g++)
+			{
+				const auto& frames = path.second.Frames();
+				size_t tiles = 0, tilesCulled = 0, inView = 0, objectsCulled = 0, checked = 0, seen = 0;
+				double cullMs = 0.0;
+				for (size_t f = 0; f < frames.size(); f++)
+				{
+					const CameraPathFrame& frame = frames[f];
+					BoundingFrustum frustum = frame.Frustum();
+					selected.clear();
+					ComputeTerrainLodRanges(tree, lod, levelErrors, frame.FovY, frame.ViewportHeight, ranges);
+					SelectTerrainTiles(tree, ranges, frustum, frame.Position, selected);
+
+					boxes.clear();
+					for (auto& tile : selected)
+						boxes.push_back(tree.Bounds(tile.Node));
+					size_t tileCount = boxes.size();
+					for (auto& box : objects)
+						if (frustum.Intersects(box))
+							boxes.push_back(box);
+
+					auto start = Clock::now();
+					horizon.Begin(frame.Position);
+					for (size_t i = 0; i < tileCount; i++)
+						horizon.AddOccluderGrid(boxes[i], gridSizes[g], minHeights[g][selected[i].Node].data());
+					horizon.Cull(boxes, hidden);
+					cullMs += MsSince(start);
+
+					tiles += tileCount;
+					inView += boxes.size() - tileCount;
+					for (size_t i = 0; i < boxes.size(); i++)
+					{
+						if (!hidden[i])
+							continue;
+						if (i < tileCount)
+						{
+							tilesCulled++;
+							continue;
+						}
+						objectsCulled++;
+						if (f % 8 != 0)
+							continue;
+
+						// A corner in view that a ray reaches without going under the ground
+						// means the box was culled while visible.
+						XMFLOAT3 corners[BoundingBox::CORNER_COUNT];
+						boxes[i].GetCorners(corners);
+						XMVECTOR eye = XMLoadFloat3(&frame.Position);
+						for (auto& corner : corners)
+						{
+							XMVECTOR p = XMLoadFloat3(&corner);
+							if (frustum.Contains(p) == DISJOINT)
+								continue;
+							checked++;
+							XMVECTOR ray = XMVectorSubtract(p, eye);
+							float length = XMVectorGetX(XMVector3Length(ray));
+							bool blocked = false;
+							for (float d = 0.5f; d < length - 0.5f && !blocked; d += 0.5f)
+							{
+								XMFLOAT3 q;
+								XMStoreFloat3(&q, XMVectorAdd(eye, XMVectorScale(ray, d / length)));
+								blocked = q.y < surface(q.x, q.z);
+							}
+							seen += !blocked;
+						}
+					}
+				}
+
+				double n = (double)frames.size();
+				sprintf_s(line, "terrainhorizon: path %s, %ux%u cells: tiles %.1f culled %.1f, objects in view %.1f culled %.1f, cull %.4f ms; %zu culled corners checked, %zu visible",
+					path.first.c_str(), gridSizes[g], gridSizes[g], tiles / n, tilesCulled / n, inView / n, objectsCulled / n, cullMs / n, checked, seen);
+				BenchmarkLog(line);
+			}
+		}
+	}
+
+	// Incremental selection against selecting from the root every frame, on complete
+	// synthetic trees as the camera drifts low over them: time, cut nodes looked at,
+	// splits, merges and the size of the reported differences per frame. Without a
+	// limit both must draw the same tiles every frame; with one, the frames where
+	// they differ show how far the cut lags behind.
+	void BenchmarkTerrainSelect()
+	{
+		using namespace DirectX;
+
+		const float leafSize = 128.0f;
+		const float heightScale = 250.0f;
+		const int frames = 600;
+
+		for (uint32_t depth = 8; depth <= 10; depth += 2)
+		{
+			float rootSize = leafSize * (1 << (depth - 1));
+			TerrainQuadTree tree;
+			tree.Build(depth, rootSize, 0.0f, 0.0f, 0.0f, heightScale);
+
+			// Errors roughly halve per level and vary with the ridges, parents bound their children.
+			std::vector<float> errors(TerrainQuadTree::LevelOffset(depth), 0.0f);
+			std::vector<float> levelErrors(depth, 0.0f);
+			uint32_t leafLevel = depth - 1;
+			for (int level = (int)leafLevel - 1; level >= 0; level--)
+			{
+				float scale = (float)(1u << (leafLevel - level));
+				for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+				{
+					uint32_t x, y;
+					TerrainQuadTree::TileCoords(n, level, x, y);
+					float error = 0.2f / scale * (0.3f + 0.7f * Ridges((x + 0.5f) * scale, (y + 0.5f) * scale));
+					uint32_t child = TerrainQuadTree::FirstChild(n, level);
+					for (uint32_t i = 0; i < 4; i++)
+						error = std::max(error, errors[child + i]);
+					errors[n] = error;
+					levelErrors[level] = std::max(levelErrors[level], error * heightScale);
+				}
+			}
+			for (uint32_t level = 0; level < depth; level++)
+				for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+					tree.CreateNode(n, level, errors[n] * heightScale);
+
+			CameraPathFrame frame;
+			frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+			frame.FovY = 0.25f * XM_PI;
+			frame.Aspect = 16.0f / 9.0f;
+			frame.NearZ = 1.0f;
+			frame.FarZ = 20000.0f;
+			frame.ViewportHeight = 1080.0f;
+
+			TerrainLodSettings lod;
+			TerrainLodRanges ranges;
+			ComputeTerrainLodRanges(tree, lod, levelErrors, frame.FovY, frame.ViewportHeight, ranges);
+
+			std::vector<CameraPathFrame> path(frames, frame);
+			for (int f = 0; f < frames; f++)
+			{
+				float t = (float)f / (frames - 1);
+				path[f].Position = XMFLOAT3((t - 0.5f) * 3000.0f, heightScale + 30.0f, (t - 0.5f) * 1000.0f);
+				path[f].Look = XMFLOAT3(std::cos(t * 2.0f), -0.2f, std::sin(t * 2.0f));
+			}
+
+			std::vector<TerrainQuadTree::Selected> full;
+			size_t fullTiles = 0;
+			auto start = Clock::now();
+			for (auto& p : path)
+			{
+				full.clear();
+				SelectTerrainTiles(tree, ranges, p.Frustum(), p.Position, full);
+				fullTiles += full.size();
+			}
+			double fullMs = MsSince(start) / frames;
+
+			char line[256];
+			sprintf_s(line, "terrainselect: depth %2u  from the root: %.4f ms, %.1f tiles", depth, fullMs, (double)fullTiles / frames);
+			BenchmarkLog(line);
+
+			auto sortedNodes = [](std::vector<TerrainQuadTree::Selected> nodes)
+			{
+				std::vector<uint32_t> sorted;
+				for (auto& n : nodes)
+					sorted.push_back(n.Node);
+				std::sort(sorted.begin(), sorted.end());
+				return sorted;
+			};
+
+			const uint32_t budgets[] = { UINT32_MAX, 64, 16, 4 };
+			for (uint32_t budget : budgets)
+			{
+				TerrainCut cut;
+				size_t evaluated = 0, operations = 0, deferred = 0, diffs = 0, cutSize = 0, differing = 0, worstDiff = 0;
+				double cutMs = 0.0;
+				for (auto& p : path)
+				{
+					BoundingFrustum frustum = p.Frustum();
+					start = Clock::now();
+					cut.Update(tree, ranges, frustum, p.Position, budget);
+					cutMs += MsSince(start);
+
+					const TerrainCut::Stats& stats = cut.GetStats();
+					evaluated += stats.Evaluated;
+					operations += stats.Splits + stats.Merges;
+					deferred += stats.Deferred;
+					diffs += cut.Added().size() + cut.Removed().size();
+					cutSize += cut.Size();
+
+					full.clear();
+					SelectTerrainTiles(tree, ranges, frustum, p.Position, full);
+					std::vector<uint32_t> a = sortedNodes(full), b = sortedNodes(cut.Drawn());
+					if (a != b)
+					{
+						std::vector<uint32_t> delta;
+						std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(delta));
+						differing++;
+						worstDiff = std::max(worstDiff, delta.size());
+					}
+				}
+
+				double n = (double)frames;
+				sprintf_s(line, "terrainselect: depth %2u  incremental, %s: %.4f ms, cut %.1f nodes, %.1f looked at, %.2f splits+merges, %.2f deferred, "
+					"%.2f added+removed; %zu frames differ from the root walk (at most %zu nodes)",
+					depth, budget == UINT32_MAX ? "no limit" : ("limit " + std::to_string(budget)).c_str(), cutMs / n, cutSize / n, evaluated / n,
+					operations / n, deferred / n, diffs / n, differing, worstDiff);
+				BenchmarkLog(line);
+			}
+
+			// A camera that holds still.
+			TerrainCut still;
+			BoundingFrustum frustum = path[0].Frustum();
+			still.Update(tree, ranges, frustum, path[0].Position);
+			start = Clock::now();
+			for (int f = 0; f < frames; f++)
+				still.Update(tree, ranges, frustum, path[0].Position);
+			sprintf_s(line, "terrainselect: depth %2u  incremental, still camera: %.5f ms", depth, MsSince(start) / frames);
+			BenchmarkLog(line);
+		}
+	}
+
+	// Building the per-instance buffer of the visible terrain tiles on complete
+	// synthetic trees as the camera drifts low over them: time per frame, tiles,
+	// batches and bytes, and the command list calls of drawing the tiles as render
+	// items against instanced batches. Every instance is checked against its tile.
+	void BenchmarkTerrainInstances()
+	{
+		using namespace DirectX;
+
+		const float leafSize = 128.0f;
+		const float heightScale = 250.0f;
+		const int frames = 600;
+
+		for (uint32_t depth = 4; depth <= 10; depth += 3)
+		{
+			float rootSize = leafSize * (1 << (depth - 1));
+			TerrainQuadTree tree;
+			tree.Build(depth, rootSize, 0.0f, 0.0f, 0.0f, heightScale);
+
+			std::vector<float> errors(TerrainQuadTree::LevelOffset(depth), 0.0f);
+			std::vector<float> levelErrors(depth, 0.0f);
+			uint32_t leafLevel = depth - 1;
+			for (int level = (int)leafLevel - 1; level >= 0; level--)
+			{
+				float scale = (float)(1u << (leafLevel - level));
+				for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+				{
+					uint32_t x, y;
+					TerrainQuadTree::TileCoords(n, level, x, y);
+					float error = 0.2f / scale * (0.3f + 0.7f * Ridges((x + 0.5f) * scale, (y + 0.5f) * scale));
+					uint32_t child = TerrainQuadTree::FirstChild(n, level);
+					for (uint32_t i = 0; i < 4; i++)
+						error = std::max(error, errors[child + i]);
+					errors[n] = error;
+					levelErrors[level] = std::max(levelErrors[level], error * heightScale);
+				}
+			}
+			for (uint32_t level = 0; level < depth; level++)
+				for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+					tree.CreateNode(n, level, errors[n] * heightScale);
+
+			CameraPathFrame frame;
+			frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+			frame.FovY = 0.25f * XM_PI;
+			frame.Aspect = 16.0f / 9.0f;
+			frame.NearZ = 1.0f;
+			frame.FarZ = 20000.0f;
+			frame.ViewportHeight = 1080.0f;
+
+			TerrainLodSettings lod;
+			TerrainLodRanges ranges;
+			ComputeTerrainLodRanges(tree, lod, levelErrors, frame.FovY, frame.ViewportHeight, ranges);
+
+			std::vector<TerrainQuadTree::Selected> tiles;
+			std::vector<uint32_t> slots;
+			std::vector<TerrainInstance> instances;
+			std::vector<TerrainDrawBatch> batches;
+			size_t tileCount = 0, batchCount = 0, wrong = 0, itemCalls = 0, instancedCalls = 0;
+			double buildMs = 0.0;
+			for (int f = 0; f < frames; f++)
+			{
+				float t = (float)f / (frames - 1);
+				frame.Position = XMFLOAT3((t - 0.5f) * 0.7f * rootSize, heightScale + 30.0f, (t - 0.5f) * 0.25f * rootSize);
+				frame.Look = XMFLOAT3(std::cos(t * 2.0f), -0.2f, std::sin(t * 2.0f));
+
+				tiles.clear();
+				SelectTerrainTiles(tree, ranges, frame.Frustum(), frame.Position, tiles);
+				// Any slot numbering will do; the app's comes from the order tiles were loaded.
+				slots.clear();
+				for (auto& tile : tiles)
+					slots.push_back(tile.Node * 7 % 4096);
+
+				auto start = Clock::now();
+				BuildTerrainInstances(tree, ranges, tiles, slots, instances, batches);
+				buildMs += MsSince(start);
+
+				tileCount += tiles.size();
+				batchCount += batches.size();
+				itemCalls += TerrainCallsPerItem * tiles.size();
+				instancedCalls += TerrainCallsPerFrame + TerrainCallsPerBatch * batches.size();
+
+				// Batches cover the instances in order, one level each, coarsest first,
+				// and hold every tile once with its own placement and slot.
+				uint32_t next = 0, lastLevel = 0;
+				for (auto& batch : batches)
+				{
+					wrong += batch.FirstInstance != next || (next > 0 && batch.Level <= lastLevel);
+					for (uint32_t i = batch.FirstInstance; i < batch.FirstInstance + batch.InstanceCount; i++)
+						wrong += instances[i].Level != batch.Level;
+					next += batch.InstanceCount;
+					lastLevel = batch.Level;
+				}
+				wrong += next != tiles.size();
+				std::vector<std::pair<uint32_t, uint32_t>> expected, built;
+				for (size_t i = 0; i < tiles.size(); i++)
+				{
+					expected.push_back({ slots[i], tiles[i].Level });
+					const TerrainInstance& instance = instances[i];
+					built.push_back({ instance.Slot, instance.Level });
+					uint32_t node = TerrainQuadTree::NodeIndex(instance.Level,
+						(uint32_t)((instance.CenterX + 0.5f * rootSize) / instance.Size), (uint32_t)((0.5f * rootSize - instance.CenterZ) / instance.Size));
+					wrong += instance.Size != tree.TileSize(instance.Level) || instance.Slot != node * 7 % 4096 ||
+						instance.MorphStart != ranges.MorphStart[instance.Level] || instance.MorphScale != ranges.MorphScale[instance.Level];
+				}
+				std::sort(expected.begin(), expected.end());
+				std::sort(built.begin(), built.end());
+				wrong += expected != built;
+			}
+
+			double n = (double)frames;
+			char line[256];
+			sprintf_s(line, "terraininstances: depth %2u: %.1f tiles in %.2f batches, %.0f bytes, build %.4f ms; command list calls %.1f as render items, %.1f instanced; %zu mismatches",
+				depth, tileCount / n, batchCount / n, tileCount / n * sizeof(TerrainInstance), buildMs / n, itemCalls / n, instancedCalls / n, wrong);
+			BenchmarkLog(line);
+		}
+	}
+
+	// Batched height and normal queries against the height tiles, with every level
+	// resident and with only the two coarsest: agreement with sampling the tiles one
+	// point at a time, queries per second by batch size, for scattered and for
+	// coherent points, per thread count, and while tiles come and go.
+	void BenchmarkTerrainHeights()
+	{
+		using namespace DirectX;
+
+		const uint32_t levels = 4;
+		const float rootSize = 1024.0f;
+		const float baseY = -40.0f;
+		const float heightScale = 250.0f;
+
+		TerrainHeightData data;
+		if (!data.Load(L"../Textures/Terrain", levels))
+		{
+			BenchmarkLog("terrainheights: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+
+		TerrainHeightFieldSettings settings;
+		settings.Levels = levels;
+		settings.RootSize = rootSize;
+		settings.BaseY = baseY;
+		settings.HeightScale = heightScale;
+		auto insertLevel = [&](TerrainHeightField& field, uint32_t level)
+		{
+			for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+			{
+				uint32_t x, y;
+				TerrainQuadTree::TileCoords(n, level, x, y);
+				const uint16_t* tile = data.Tile(level, x, y);
+				field.Insert(n, level, std::vector<uint16_t>(tile, tile + data.TileResolution() * data.TileResolution()), data.TileResolution());
+			}
+		};
+		auto fill = [&](TerrainHeightField& field, uint32_t residentLevels)
+		{
+			field.Reset(settings);
+			for (uint32_t level = 0; level < residentLevels; level++)
+				insertLevel(field, level);
+		};
+
+		// One point at a time through TerrainHeightData::SampleTile, the reference.
+		auto reference = [&](uint32_t level, float x, float z)
+		{
+			float width = (float)TerrainQuadTree::LevelWidth(level);
+			float u = std::min(std::max((x / rootSize + 0.5f) * width, 0.0f), width - 0.001f);
+			float v = std::min(std::max((0.5f - z / rootSize) * width, 0.0f), width - 0.001f);
+			uint32_t tx = (uint32_t)u, ty = (uint32_t)v;
+			return baseY + data.SampleTile(level, tx, ty, u - tx, v - ty) * heightScale;
+		};
+
+		const size_t count = 1 << 20;
+		std::mt19937 rng(38);
+		std::uniform_real_distribution<float> across(-0.5f * rootSize, 0.5f * rootSize);
+		std::vector<XMFLOAT2> scattered(count), coherent(count);
+		for (auto& p : scattered)
+			p = XMFLOAT2(across(rng), across(rng));
+		// Rows of a 1024 x 1024 grid, the order placing objects over an area would take.
+		for (size_t i = 0; i < count; i++)
+			coherent[i] = XMFLOAT2(((i & 1023) + 0.5f) - 0.5f * rootSize, 0.5f * rootSize - ((i >> 10) + 0.5f));
+
+		std::vector<float> heights(count), slopes(count);
+		std::vector<uint8_t> answered(count);
+		std::vector<XMFLOAT3> normals(count);
+		char line[256];
+
+		const uint32_t residents[] = { levels, 2 };
+		for (uint32_t resident : residents)
+		{
+			TerrainHeightField field;
+			fill(field, resident);
+
+			field.QueryHeights(scattered.data(), count, heights.data(), answered.data());
+			float worst = 0.0f;
+			size_t wrongLevel = 0;
+			for (size_t i = 0; i < count; i += 16)
+			{
+				worst = std::max(worst, std::fabs(heights[i] - reference(resident - 1, scattered[i].x, scattered[i].y)));
+				wrongLevel += answered[i] != resident - 1;
+			}
+			sprintf_s(line, "terrainheights: L0-L%u resident: largest difference to per-point sampling %.5f, %zu points answered by another level",
+				resident - 1, worst, wrongLevel);
+			BenchmarkLog(line);
+
+			// The reference knows which level answers, the field has to find it.
+			const std::vector<XMFLOAT2>* sets[2] = { &scattered, &coherent };
+			double referenceMs[2];
+			for (int s = 0; s < 2; s++)
+			{
+				auto start = Clock::now();
+				for (size_t i = 0; i < count; i++)
+					heights[i] = reference(resident - 1, (*sets[s])[i].x, (*sets[s])[i].y);
+				referenceMs[s] = MsSince(start);
+			}
+			sprintf_s(line, "terrainheights: L0-L%u resident: per-point SampleTile %.1f M/s scattered, %.1f M/s coherent",
+				resident - 1, count / referenceMs[0] / 1000.0, count / referenceMs[1] / 1000.0);
+			BenchmarkLog(line);
+
+			const size_t batches[] = { 1, 16, 256, 4096 };
+			for (size_t batch : batches)
+			{
+				double ms[2];
+				for (int s = 0; s < 2; s++)
+				{
+					auto start = Clock::now();
+					for (size_t first = 0; first < count; first += batch)
+						field.QueryHeights(sets[s]->data() + first, batch, heights.data() + first);
+					ms[s] = MsSince(start);
+				}
+				auto start = Clock::now();
+				for (size_t first = 0; first < count; first += batch)
+					field.QueryNormals(scattered.data() + first, batch, normals.data() + first, slopes.data() + first);
+				double normalMs = MsSince(start);
+
+				sprintf_s(line, "terrainheights: L0-L%u resident, batches of %4zu: heights %.1f M/s scattered, %.1f M/s coherent; normals+slopes %.1f M/s",
+					resident - 1, batch, count / ms[0] / 1000.0, count / ms[1] / 1000.0, count / normalMs / 1000.0);
+				BenchmarkLog(line);
+			}
+		}
+
+		// Flat ground has an upright normal and no slope; a plane tilted by one in x has
+		// slope 1 everywhere but at the clamped edges.
+		{
+			const uint32_t resolution = 128;
+			std::vector<uint16_t> flat(resolution * resolution, 30000), tilted(resolution * resolution);
+			for (uint32_t y = 0; y < resolution; y++)
+				for (uint32_t x = 0; x < resolution; x++)
+					tilted[y * resolution + x] = (uint16_t)(x * 400);
+			TerrainHeightFieldSettings one;
+			one.RootSize = 128.0f;
+			one.HeightScale = 65535.0f / 400.0f;
+			TerrainHeightField field;
+			field.Reset(one);
+
+			std::vector<XMFLOAT2> inside(4096);
+			std::uniform_real_distribution<float> within(-60.0f, 60.0f);
+			for (auto& p : inside)
+				p = XMFLOAT2(within(rng), within(rng));
+
+			float worstFlat = 0.0f, worstTilted = 0.0f;
+			field.Insert(0, 0, flat, resolution);
+			field.QueryNormals(inside.data(), inside.size(), normals.data(), slopes.data());
+			for (size_t i = 0; i < inside.size(); i++)
+				worstFlat = std::max(worstFlat, std::max(slopes[i], 1.0f - normals[i].y));
+			field.Insert(0, 0, tilted, resolution);
+			field.QueryNormals(inside.data(), inside.size(), normals.data(), slopes.data());
+			for (size_t i = 0; i < inside.size(); i++)
+				worstTilted = std::max(worstTilted, std::max(std::fabs(slopes[i] - 1.0f), std::fabs(normals[i].x + std::sqrt(0.5f))));
+			sprintf_s(line, "terrainheights: normals: flat ground off by %.6f, slope 1 plane off by %.6f", worstFlat, worstTilted);
+			BenchmarkLog(line);
+		}
+
+		// Threads share one field; each takes batches of 4096 scattered points.
+		TerrainHeightField field;
+		fill(field, levels);
+		const size_t batch = 4096;
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned threads = 1; ; threads *= 2)
+		{
+			if (threads > maxThreads)
+				threads = maxThreads;
+
+			ThreadPool pool(threads - 1);
+			auto start = Clock::now();
+			pool.ParallelFor(count / batch, [&](size_t b)
+			{
+				field.QueryHeights(scattered.data() + b * batch, batch, heights.data() + b * batch);
+			});
+			double ms = MsSince(start);
+			sprintf_s(line, "terrainheights: %2u threads: heights %.1f M/s", threads, count / ms / 1000.0);
+			BenchmarkLog(line);
+
+			if (threads == maxThreads)
+				break;
+		}
+
+		// Queries while the finest level is paged out and back in. Every answer has to
+		// come from one of the two finest levels and match it.
+		{
+			ThreadPool pool(std::min(maxThreads, 4u) - 1);
+			std::atomic<bool> done(false);
+			std::atomic<size_t> queries(0), wrong(0);
+			uint32_t finest = levels - 1;
+			auto start = Clock::now();
+			std::thread pager([&]()
+			{
+				for (int round = 0; round < 20; round++)
+				{
+					for (uint32_t n = TerrainQuadTree::LevelOffset(finest); n < TerrainQuadTree::LevelOffset(finest + 1); n++)
+						field.Remove(n);
+					insertLevel(field, finest);
+				}
+				done = true;
+			});
+			pool.ParallelFor(pool.ThreadCount(), [&](size_t t)
+			{
+				std::vector<float> h(batch);
+				std::vector<uint8_t> l(batch);
+				for (size_t b = t; !done; b = (b + pool.ThreadCount()) % (count / batch))
+				{
+					const XMFLOAT2* p = scattered.data() + b * batch;
+					if (!field.QueryHeights(p, batch, h.data(), l.data()))
+						continue;
+					for (size_t i = 0; i < batch; i += 64)
+						if (l[i] < finest - 1 || std::fabs(h[i] - reference(l[i], p[i].x, p[i].y)) > 0.01f)
+							wrong++;
+					queries += batch;
+				}
+			});
+			pager.join();
+			double ms = MsSince(start);
+			sprintf_s(line, "terrainheights: while paging (%u query threads, 20 rounds): %.1f M/s, %zu wrong answers of %zu checked",
+				pool.ThreadCount(), queries / ms / 1000.0, (size_t)wrong, (size_t)queries / 64);
+			BenchmarkLog(line);
+		}
+	}
+
+	// Terrain raycasts on the shipped height tiles, all resident and with parts of
+	// the finer levels missing: pick rays from cameras above the terrain in 2x2 pixel
+	// packets, line of sight between points at eye height, and rays in random
+	// directions. Packets against one ray per call, and every ray against a reference
+	// that steps along it a tenth of a texel at a time and bisects at the first
+	// sample below QueryHeights.
+	void BenchmarkTerrainRaycast()
+	{
+		using namespace DirectX;
+
+		const uint32_t levels = 4;
+		const float rootSize = 1024.0f;
+		const float baseY = -40.0f;
+		const float heightScale = 250.0f;
+
+		TerrainHeightData data;
+		if (!data.Load(L"../Textures/Terrain", levels))
+		{
+			BenchmarkLog("terrainraycast: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+
+		TerrainHeightFieldSettings settings;
+		settings.Levels = levels;
+		settings.RootSize = rootSize;
+		settings.BaseY = baseY;
+		settings.HeightScale = heightScale;
+
+		std::mt19937 rng(41);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		std::uniform_real_distribution<float> across(-0.5f * rootSize, 0.5f * rootSize);
+		char line[256];
+
+		for (int partial = 0; partial < 2; partial++)
+		{
+			// Partial: the two coarse levels and every other tile below them.
+			TerrainHeightField field;
+			field.Reset(settings);
+			for (uint32_t level = 0; level < levels; level++)
+				for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+				{
+					if (partial && level >= 2 && unit(rng) < 0.5f)
+						continue;
+					uint32_t x, y;
+					TerrainQuadTree::TileCoords(n, level, x, y);
+					const uint16_t* tile = data.Tile(level, x, y);
+					field.Insert(n, level, std::vector<uint16_t>(tile, tile + data.TileResolution() * data.TileResolution()), data.TileResolution());
+				}
+			const char* resident = partial ? "partial" : "full";
+
+			auto groundAt = [&](float x, float z)
+			{
+				XMFLOAT2 p(x, z);
+				float h = 0.0f;
+				field.QueryHeights(&p, 1, &h);
+				return h;
+			};
+
+			// Pick rays, 2x2 pixel quads next to each other.
+			const uint32_t cameras = 16, pixels = 256;
+			std::vector<TerrainRay> pick;
+			for (uint32_t c = 0; c < cameras; c++)
+			{
+				XMFLOAT3 eye(across(rng) * 0.8f, 0.0f, across(rng) * 0.8f);
+				eye.y = groundAt(eye.x, eye.z) + 20.0f + 200.0f * unit(rng);
+				float yaw = unit(rng) * XM_2PI, pitch = -0.2f - 0.6f * unit(rng);
+				XMVECTOR look = XMVectorSet(std::cos(pitch) * std::cos(yaw), std::sin(pitch), std::cos(pitch) * std::sin(yaw), 0.0f);
+				XMVECTOR right = XMVector3Normalize(XMVector3Cross(XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), look));
+				XMVECTOR up = XMVector3Cross(look, right);
+				float tanHalf = std::tan(0.125f * XM_PI);
+				for (uint32_t qy = 0; qy < pixels; qy += 2)
+					for (uint32_t qx = 0; qx < pixels; qx += 2)
+						for (uint32_t k = 0; k < 4; k++)
+						{
+							float px = ((qx + (k & 1) + 0.5f) / pixels * 2.0f - 1.0f) * tanHalf;
+							float py = (1.0f - (qy + (k >> 1) + 0.5f) / pixels * 2.0f) * tanHalf;
+							TerrainRay ray;
+							ray.Origin = eye;
+							XMStoreFloat3(&ray.Direction, XMVector3Normalize(look + px * right + py * up));
+							pick.push_back(ray);
+						}
+			}
+
+			// Line of sight between points 1.8 above the ground.
+			std::vector<TerrainRay> sight(1 << 16);
+			for (auto& ray : sight)
+			{
+				float ax = across(rng), az = across(rng), bx = across(rng), bz = across(rng);
+				ray.Origin = XMFLOAT3(ax, groundAt(ax, az) + 1.8f, az);
+				ray.Direction = XMFLOAT3(bx - ax, groundAt(bx, bz) + 1.8f - ray.Origin.y, bz - az);
+				ray.MaxT = 1.0f;
+			}
+
+			// Random origins above the terrain, random downward directions, and rays
+			// straight down.
+			std::vector<TerrainRay> scattered(1 << 16);
+			for (size_t i = 0; i < scattered.size(); i++)
+			{
+				TerrainRay& ray = scattered[i];
+				float x = across(rng), z = across(rng);
+				ray.Origin = XMFLOAT3(x, groundAt(x, z) + 5.0f + 100.0f * unit(rng), z);
+				if (i % 8 == 0)
+					ray.Direction = XMFLOAT3(0.0f, -1.0f, 0.0f);
+				else
+				{
+					float yaw = unit(rng) * XM_2PI, pitch = -0.05f - 1.4f * unit(rng);
+					ray.Direction = XMFLOAT3(std::cos(pitch) * std::cos(yaw), std::sin(pitch), std::cos(pitch) * std::sin(yaw));
+				}
+			}
+
+			struct RaySet
+			{
+				const char* Name;
+				std::vector<TerrainRay>* Rays;
+			};
+			RaySet sets[] = { { "pick", &pick }, { "sight", &sight }, { "scattered", &scattered } };
+			for (auto& set : sets)
+			{
+				std::vector<TerrainRay>& rays = *set.Rays;
+				std::vector<TerrainRayHit> hits(rays.size()), single(rays.size());
+
+				TerrainRaycastStats stats;
+				auto start = Clock::now();
+				field.Raycast(rays.data(), rays.size(), hits.data(), &stats);
+				double packetMs = MsSince(start);
+
+				TerrainRaycastStats singleStats;
+				start = Clock::now();
+				for (size_t i = 0; i < rays.size(); i++)
+					field.Raycast(&rays[i], 1, &single[i], &singleStats);
+				double singleMs = MsSince(start);
+
+				// Neighbouring tiles clamp at their own edges, so the surface has steps
+				// along tile edges, which all lie on the finest level's; rays hit their
+				// sides there.
+				auto onEdge = [&](const TerrainRayHit& hit)
+				{
+					float size = rootSize / TerrainQuadTree::LevelWidth(levels - 1);
+					float fx = std::fmod(hit.Position.x + 0.5f * rootSize, size), fz = std::fmod(hit.Position.z + 0.5f * rootSize, size);
+					return std::min(std::min(fx, size - fx), std::min(fz, size - fz)) < 0.001f;
+				};
+
+				size_t hitCount = 0, differ = 0, edgeHits = 0;
+				float worstHeight = 0.0f;
+				for (size_t i = 0; i < rays.size(); i++)
+				{
+					hitCount += hits[i].Hit;
+					if (hits[i].Hit != single[i].Hit || (hits[i].Hit && hits[i].T != single[i].T))
+						differ++;
+					if (!hits[i].Hit || hits[i].T == 0.0f)
+						continue;
+					float error = std::fabs(hits[i].Position.y - groundAt(hits[i].Position.x, hits[i].Position.z));
+					if (error > 0.01f && onEdge(hits[i]))
+						edgeHits++;
+					else
+						worstHeight = std::max(worstHeight, error);
+				}
+
+				sprintf_s(line, "terrainraycast: %-7s %-9s %6zu rays, %4.1f%% hit: packets %.2f M rays/s (%.1f nodes %.1f cells per ray), single %.2f M rays/s (%.1f nodes), %zu differ, height error %.4f, %zu on tile edge steps",
+					resident, set.Name, rays.size(), 100.0 * hitCount / rays.size(), rays.size() / packetMs / 1000.0,
+					(double)stats.Nodes / rays.size(), (double)stats.Cells / rays.size(), rays.size() / singleMs / 1000.0,
+					(double)singleStats.Nodes / rays.size(), differ, worstHeight, edgeHits);
+				BenchmarkLog(line);
+
+				// Reference on every 16th ray.
+				size_t checked = 0, agree = 0, grazing = 0;
+				float worstDistance = 0.0f;
+				for (size_t i = 0; i < rays.size(); i += 16)
+				{
+					const TerrainRay& ray = rays[i];
+					XMVECTOR origin = XMLoadFloat3(&ray.Origin), dir = XMLoadFloat3(&ray.Direction);
+					float horizontal = std::sqrt(ray.Direction.x * ray.Direction.x + ray.Direction.z * ray.Direction.z);
+					float dt = horizontal > 0.0f ? 0.1f / horizontal : 0.01f / std::fabs(ray.Direction.y);
+					float limit = ray.MaxT;
+					if (limit == FLT_MAX)
+						limit = 4.0f * rootSize / std::max(horizontal, 0.25f);
+
+					auto below = [&](float t)
+					{
+						XMFLOAT3 p;
+						XMStoreFloat3(&p, origin + t * dir);
+						if (std::fabs(p.x) > 0.5f * rootSize || std::fabs(p.z) > 0.5f * rootSize)
+							return false;
+						return p.y <= groundAt(p.x, p.z);
+					};
+
+					bool refHit = false;
+					float refT = 0.0f;
+					for (float t = 0.0f, prev = 0.0f; ; prev = t, t = std::min(t + dt, limit))
+					{
+						if (below(t))
+						{
+							float lo = prev, hi = t;
+							if (t == 0.0f)
+								lo = hi = 0.0f;
+							for (int k = 0; k < 40; k++)
+							{
+								float m = 0.5f * (lo + hi);
+								if (below(m))
+									hi = m;
+								else
+									lo = m;
+							}
+							refHit = true;
+							refT = hi;
+							break;
+						}
+						if (t >= limit)
+							break;
+					}
+
+					// Rays that just graze a crest can pass between two steps.
+					checked++;
+					float length = XMVectorGetX(XMVector3Length(dir));
+					if (refHit == hits[i].Hit && (!refHit || std::fabs(refT - hits[i].T) * length < 0.05f))
+						agree++;
+					else if (hits[i].Hit && (!refHit || hits[i].T < refT) &&
+						std::fabs(hits[i].Position.y - groundAt(hits[i].Position.x, hits[i].Position.z)) < 0.01f)
+						grazing++;
+					else if (refHit && hits[i].Hit)
+						worstDistance = std::max(worstDistance, std::fabs(refT - hits[i].T) * length);
+				}
+				sprintf_s(line, "terrainraycast: %-7s %-9s reference: %zu of %zu agree, %zu grazing hits the steps missed, %zu wrong (worst %.3f)",
+					resident, set.Name, agree, checked, grazing, checked - agree - grazing, worstDistance);
+				BenchmarkLog(line);
+			}
+
+			if (partial)
+				continue;
+
+			// Pick rays over all threads.
+			unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+			ThreadPool pool(maxThreads - 1);
+			std::vector<TerrainRayHit> hits(pick.size());
+			const size_t batch = 1024;
+			auto start = Clock::now();
+			pool.ParallelFor(pick.size() / batch, [&](size_t b)
+			{
+				field.Raycast(pick.data() + b * batch, batch, hits.data() + b * batch);
+			});
+			sprintf_s(line, "terrainraycast: pick rays on %u threads: %.2f M rays/s", pool.ThreadCount(), pick.size() / MsSince(start) / 1000.0);
+			BenchmarkLog(line);
+		}
+	}
+
+	// Heightmap made up on the fly, rows counted so the benchmark sees the builder
+	// read every row once and in order.
+	class SyntheticHeightSource : public TerrainHeightSource
+	{
+	public:
+		SyntheticHeightSource(uint32_t width, uint32_t height) : mWidth(width), mHeight(height) {}
+
+		uint32_t Width() const override { return mWidth; }
+		uint32_t Height() const override { return mHeight; }
+
+		bool ReadRows(uint32_t first, uint32_t count, uint16_t* texels) override
+		{
+			if (first != mRowsRead)
+				mOutOfOrder = true;
+			for (uint32_t y = first; y < first + count; y++)
+				for (uint32_t x = 0; x < mWidth; x++)
+					*texels++ = Texel(x, y);
+			mRowsRead = first + count;
+			return true;
+		}
+
+		uint16_t Texel(uint32_t x, uint32_t y) const
+		{
+			float fx = x * 32.0f / mWidth, fz = y * 32.0f / mHeight;
+			float h = 0.7f * Ridges(fx * 4.0f, fz * 4.0f) + 0.3f * RollingHills(fx * 40.0f, fz * 40.0f);
+			return (uint16_t)(std::min(std::max(h, 0.0f), 1.0f) * 65535.0f);
+		}
+
+		uint32_t RowsRead() const { return mRowsRead; }
+		bool OutOfOrder() const { return mOutOfOrder; }
+
+	private:
+		uint32_t mWidth;
+		uint32_t mHeight;
+		uint32_t mRowsRead = 0;
+		bool mOutOfOrder = false;
+	};
+
+	void RemoveTerrainPyramid(const std::wstring& dir, uint32_t levels)
+	{
+		const wchar_t* kinds[] = { L"height", L"normal", L"diffuse" };
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			std::wstring levelDir = dir + L"/L" + std::to_wstring(level);
+			for (auto kind : kinds)
+			{
+				std::wstring kindDir = levelDir + L"/" + kind;
+				for (uint32_t y = 0; y < (1u << level); y++)
+					for (uint32_t x = 0; x < (1u << level); x++)
+						DeleteFileW((kindDir + L"/tile_" + kind + L"_level" + std::to_wstring(level) + L"_" +
+							std::to_wstring(x) + L"_" + std::to_wstring(y) + L".dds").c_str());
+				RemoveDirectoryW(kindDir.c_str());
+			}
+			RemoveDirectoryW(levelDir.c_str());
+		}
+		DeleteFileW((dir + L"/nodes.bin").c_str());
+		RemoveDirectoryW(dir.c_str());
+	}
+
+	// Offline pyramid build from synthetic heightmaps: throughput at 1, 2, 4, ...
+	// threads, memory held against the size of the source, and the output read back
+	// with TerrainHeightData: finest tiles against the source, height ranges and
+	// errors against what BuildTerrainNodeFile computes from the whole pyramid.
+	void BenchmarkTerrainPyramid()
+	{
+		const std::wstring dir = L"terrain_pyramid_benchmark";
+		char line[256];
+
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned threads = 1; ; threads *= 2)
+		{
+			if (threads > maxThreads)
+				threads = maxThreads;
+
+			SyntheticHeightSource source(2048, 2048);
+			ThreadPool pool(threads - 1);
+			TerrainPyramidStats stats;
+			bool built = BuildTerrainPyramid(source, nullptr, dir, TerrainPyramidSettings(), pool, &stats);
+			sprintf_s(line, "terrainpyramid: 2048^2 %2u threads: %s, %u levels %u tiles in %.0f ms (%.1f Mtexels/s), read %.0f resample %.0f tiles %.0f write %.0f ms, %.1f MB written",
+				threads, built ? "ok" : "FAILED", stats.Levels, stats.Tiles, stats.WallMs, stats.SourceTexels / stats.WallMs / 1000.0,
+				stats.ReadMs, stats.ResampleMs, stats.TileMs, stats.WriteMs, stats.BytesWritten / (1024.0 * 1024.0));
+			BenchmarkLog(line);
+
+			if (threads == maxThreads)
+				break;
+		}
+
+		// Check the last build.
+		{
+			SyntheticHeightSource source(2048, 2048);
+			const uint32_t levels = 5;
+			TerrainHeightData heights;
+			TerrainNodeFile file;
+			if (!heights.Load(dir, levels) || !file.Open(dir + L"/nodes.bin") || file.Levels() != levels)
+			{
+				BenchmarkLog("terrainpyramid: can't read the built pyramid back");
+				RemoveTerrainPyramid(dir, levels);
+				return;
+			}
+
+			size_t wrongTexels = 0;
+			const uint32_t finest = levels - 1, r = heights.TileResolution();
+			for (uint32_t ty = 0; ty < (1u << finest); ty++)
+				for (uint32_t tx = 0; tx < (1u << finest); tx++)
+				{
+					const uint16_t* tile = heights.Tile(finest, tx, ty);
+					for (uint32_t i = 0; i < r; i++)
+						for (uint32_t j = 0; j < r; j++)
+							if (tile[i * r + j] != source.Texel(tx * r + j, ty * r + i))
+								wrongTexels++;
+				}
+
+			std::vector<float> errors = heights.ComputeGeometricErrors();
+			std::vector<TerrainHeightRange> ranges = heights.ComputeHeightRanges();
+			std::vector<TerrainNodeRecord> records(errors.size());
+			file.Read(0, (uint32_t)records.size(), records.data());
+			file.Close();
+
+			float rangeDiff = 0.0f, belowExact = 0.0f, aboveFinestDiff = 0.0f;
+			double ratio = 0.0;
+			size_t ratioCount = 0;
+			for (uint32_t level = 0; level < finest; level++)
+				for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+				{
+					float diff = records[node].Error - errors[node];
+					belowExact = std::max(belowExact, -diff);
+					if (level + 1 == finest)
+						aboveFinestDiff = std::max(aboveFinestDiff, std::fabs(diff));
+					if (errors[node] > 0.0f)
+					{
+						ratio += records[node].Error / errors[node];
+						ratioCount++;
+					}
+				}
+			for (size_t node = 0; node < records.size(); node++)
+				rangeDiff = std::max(rangeDiff, std::max(std::fabs(records[node].MinHeight - ranges[node].Min),
+					std::fabs(records[node].MaxHeight - ranges[node].Max)));
+
+			sprintf_s(line, "terrainpyramid: check: %zu wrong finest texels, ranges max diff %g, errors: below exact by %g, level %u max diff %g, coarser levels %.2fx exact on average",
+				wrongTexels, rangeDiff, belowExact, finest - 1, aboveFinestDiff, ratioCount ? ratio / ratioCount : 1.0);
+			BenchmarkLog(line);
+			RemoveTerrainPyramid(dir, levels);
+		}
+
+		// Memory stays with the width: taller sources of the same width hold as much,
+		// and sizes that aren't tile multiples are resampled.
+		const uint32_t sizes[][2] = { { 4096, 1024 }, { 4096, 4096 }, { 4096, 12000 }, { 3000, 2500 } };
+		ThreadPool pool;
+		for (auto& size : sizes)
+		{
+			SyntheticHeightSource source(size[0], size[1]);
+			TerrainPyramidStats stats;
+			bool built = BuildTerrainPyramid(source, nullptr, dir, TerrainPyramidSettings(), pool, &stats);
+			double sourceMB = (double)stats.SourceTexels * 2.0 / (1024.0 * 1024.0);
+			sprintf_s(line, "terrainpyramid: %ux%u source (%.1f MB): %s, %u levels %u tiles in %.0f ms, %.1f MB peak band memory, %u of %u rows read%s",
+				size[0], size[1], sourceMB, built ? "ok" : "FAILED", stats.Levels, stats.Tiles, stats.WallMs, stats.PeakBandBytes / (1024.0 * 1024.0),
+				source.RowsRead(), size[1], source.OutOfOrder() ? " OUT OF ORDER" : "");
+			BenchmarkLog(line);
+			RemoveTerrainPyramid(dir, stats.Levels);
+		}
+	}
+
+	void BenchmarkTerrainDetail()
+	{
+		const uint32_t storedLevels = 4;
+		TerrainHeightData data;
+		if (!data.Load(L"../Textures/Terrain", storedLevels))
+		{
+			BenchmarkLog("terraindetail: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+
+		const uint32_t r = data.TileResolution();
+		const uint32_t finest = storedLevels - 1;
+		std::vector<std::vector<uint32_t>> albedo(TerrainQuadTree::LevelWidth(finest) * TerrainQuadTree::LevelWidth(finest));
+		for (uint32_t ty = 0; ty < TerrainQuadTree::LevelWidth(finest); ty++)
+			for (uint32_t tx = 0; tx < TerrainQuadTree::LevelWidth(finest); tx++)
+			{
+				uint32_t resolution = 0;
+				std::wstring name = L"tile_diffuse_level" + std::to_wstring(finest) + L"_" + std::to_wstring(tx) + L"_" + std::to_wstring(ty);
+				std::vector<uint32_t>& texels = albedo[ty * TerrainQuadTree::LevelWidth(finest) + tx];
+				if (!TerrainDetail::LoadColorTile(L"../Textures/Terrain/L" + std::to_wstring(finest) + L"/diffuse/" + name + L".dds", texels, resolution) ||
+					resolution != r)
+					texels.clear();
+			}
+
+		TerrainDetailSettings settings;
+		settings.StoredLevels = storedLevels;
+		settings.Levels = 3;
+		settings.TileResolution = r;
+		TerrainDetail detail;
+		detail.Reset(settings);
+
+		// Every node of the first synthesized level, from the stored tiles.
+		const uint32_t level = storedLevels;
+		const uint32_t first = TerrainQuadTree::LevelOffset(level);
+		const uint32_t count = TerrainQuadTree::LevelOffset(level + 1) - first;
+		auto synthesize = [&](const TerrainDetail& d, uint32_t i, TerrainDetailTile& tile)
+		{
+			uint32_t x, y;
+			TerrainQuadTree::TileCoords(first + i, level, x, y);
+			const std::vector<uint32_t>& colors = albedo[(y >> 1) * TerrainQuadTree::LevelWidth(finest) + (x >> 1)];
+			d.Synthesize(first + i, level, data.Tile(finest, x >> 1, y >> 1), colors.empty() ? nullptr : colors.data(), tile);
+		};
+
+		std::vector<TerrainDetailTile> reference(count), tiles(count);
+		for (uint32_t i = 0; i < count; i++)
+			synthesize(detail, i, reference[i]);
+
+		char line[256];
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned threads = 1; ; threads *= 2)
+		{
+			if (threads > maxThreads)
+				threads = maxThreads;
+
+			ThreadPool pool(threads - 1);
+			const int repeats = 4;
+			auto start = Clock::now();
+			for (int rep = 0; rep < repeats; rep++)
+				pool.ParallelFor(count, [&](size_t i) { synthesize(detail, (uint32_t)i, tiles[i]); });
+			double synthMs = MsSince(start) / repeats;
+
+			// The tiles the way the app uploads them, encoded with their mips.
+			std::vector<size_t> bytes(count);
+			start = Clock::now();
+			for (int rep = 0; rep < repeats; rep++)
+				pool.ParallelFor(count, [&](size_t i)
+				{
+					TerrainDetailTile tile;
+					synthesize(detail, (uint32_t)i, tile);
+					bytes[i] = EncodeTerrainTile(tile.Heights, r).size() + EncodeTerrainTile(std::move(tile.Normals), r).size() +
+						EncodeTerrainTile(std::move(tile.Diffuse), r).size();
+				});
+			double encodedMs = MsSince(start) / repeats;
+
+			size_t differ = 0;
+			for (uint32_t i = 0; i < count; i++)
+				if (tiles[i].Heights != reference[i].Heights || tiles[i].Normals != reference[i].Normals || tiles[i].Diffuse != reference[i].Diffuse)
+					differ++;
+
+			sprintf_s(line, "terraindetail: %2u threads: %u tiles of %u^2 in %.2f ms (%.2f tiles/ms), encoded %.2f ms (%.2f tiles/ms, %.1f KB each), %zu differ from 1 thread",
+				threads, count, r, synthMs, count / synthMs, encodedMs, count / encodedMs, bytes[0] / 1024.0, differ);
+			BenchmarkLog(line);
+
+			if (threads == maxThreads)
+				break;
+		}
+
+		// Another seed gives other detail; no amplitude gives the parent upsampled.
+		TerrainDetail reseeded, smooth;
+		settings.Seed = 2;
+		reseeded.Reset(settings);
+		settings.Seed = 1;
+		settings.Amplitude = 0.0f;
+		smooth.Reset(settings);
+		size_t reseededDiffer = 0;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			synthesize(reseeded, i, tiles[i]);
+			if (tiles[i].Heights != reference[i].Heights)
+				reseededDiffer++;
+			synthesize(smooth, i, tiles[i]);
+		}
+
+		// Detail against the upsampled parent: within the amplitude, larger on slopes,
+		// and as continuous across tile edges as inside a tile.
+		const float amplitude = detail.Settings().Amplitude / detail.Settings().HeightScale * 65535.0f;
+		const float slopeScale = detail.Settings().HeightScale / 65535.0f / (2.0f * detail.Settings().RootSize / (float)(r << level));
+		float largest = 0.0f;
+		double flatSum = 0.0, steepSum = 0.0, insideStep = 0.0, edgeStep = 0.0;
+		size_t flatCount = 0, steepCount = 0, insideCount = 0, edgeCount = 0;
+		const uint32_t width = TerrainQuadTree::LevelWidth(level);
+		auto noiseAt = [&](uint32_t gx, uint32_t gy)
+		{
+			uint32_t node = TerrainQuadTree::NodeIndex(level, gx / r, gy / r) - first;
+			size_t at = (size_t)(gy % r) * r + gx % r;
+			return (float)reference[node].Heights[at] - (float)tiles[node].Heights[at];
+		};
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const std::vector<uint16_t>& base = tiles[i].Heights;
+			for (uint32_t ty = 1; ty + 1 < r; ty++)
+				for (uint32_t tx = 1; tx + 1 < r; tx++)
+				{
+					size_t at = (size_t)ty * r + tx;
+					float noise = std::fabs((float)reference[i].Heights[at] - base[at]);
+					largest = std::max(largest, noise);
+					float sx = (base[at + 1] - (float)base[at - 1]) * slopeScale, sy = (base[at + r] - (float)base[at - r]) * slopeScale;
+					float slope = std::sqrt(sx * sx + sy * sy);
+					if (slope < 0.1f)
+					{
+						flatSum += noise;
+						flatCount++;
+					}
+					else if (slope > 0.5f)
+					{
+						steepSum += noise;
+						steepCount++;
+					}
+				}
+		}
+		for (uint32_t gy = 0; gy < width * r; gy += 7)
+			for (uint32_t gx = 0; gx + 1 < width * r; gx++)
+			{
+				double step = std::fabs(noiseAt(gx + 1, gy) - noiseAt(gx, gy));
+				if ((gx + 1) % r == 0)
+				{
+					edgeStep += step;
+					edgeCount++;
+				}
+				else
+				{
+					insideStep += step;
+					insideCount++;
+				}
+			}
+
+		sprintf_s(line, "terraindetail: check: %zu of %u tiles differ with another seed, detail at most %.2f of the amplitude, mean %.1f steps on slopes > 0.5 vs %.1f on slopes < 0.1, step across tile edges %.2f vs %.2f inside",
+			reseededDiffer, count, largest / amplitude, steepCount ? steepSum / steepCount : 0.0, flatCount ? flatSum / flatCount : 0.0,
+			edgeCount ? edgeStep / edgeCount : 0.0, insideCount ? insideStep / insideCount : 0.0);
+		BenchmarkLog(line);
+
+		// Records: the tiles of every synthesized level under the first few stored
+		// tiles stay inside the ranges, and no level moves further from its parent
+		// than the error the parent claims.
+		std::vector<TerrainHeightRange> ranges = data.ComputeHeightRanges();
+		size_t outside = 0, overError = 0, checked = 0;
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			uint32_t x, y;
+			TerrainQuadTree::TileCoords(first + i, level, x, y);
+			uint32_t stored = TerrainQuadTree::Parent(first + i, level);
+			TerrainNodeRecord storedRecord;
+			storedRecord.MinHeight = ranges[stored].Min;
+			storedRecord.MaxHeight = ranges[stored].Max;
+			storedRecord = detail.StoredRecord(storedRecord, finest);
+
+			// Breadth first down to the deepest level, each tile with its parent's record.
+			struct Pending
+			{
+				uint32_t Node;
+				uint32_t Level;
+				TerrainNodeRecord Parent;
+				std::vector<uint16_t> ParentTexels;
+			};
+			std::vector<Pending> pending;
+			const uint16_t* texels = data.Tile(finest, x >> 1, y >> 1);
+			pending.push_back({ first + i, level, storedRecord, std::vector<uint16_t>(texels, texels + r * r) });
+			while (!pending.empty())
+			{
+				Pending p = std::move(pending.back());
+				pending.pop_back();
+
+				TerrainDetailTile tile, upsampled;
+				detail.Synthesize(p.Node, p.Level, p.ParentTexels.data(), nullptr, tile);
+				TerrainDetail none;
+				TerrainDetailSettings noneSettings = detail.Settings();
+				noneSettings.Amplitude = 0.0f;
+				none.Reset(noneSettings);
+				none.Synthesize(p.Node, p.Level, p.ParentTexels.data(), nullptr, upsampled);
+
+				TerrainNodeRecord record = detail.SynthesizedRecord(p.Parent, p.Level);
+				for (size_t t = 0; t < tile.Heights.size(); t++)
+				{
+					float h = tile.Heights[t] / 65535.0f;
+					if (h < record.MinHeight || h > record.MaxHeight)
+						outside++;
+					if (std::fabs(h - upsampled.Heights[t] / 65535.0f) > p.Parent.Error - record.Error)
+						overError++;
+				}
+				checked++;
+
+				if (p.Level + 1 < detail.TotalLevels())
+				{
+					uint32_t child = TerrainQuadTree::FirstChild(p.Node, p.Level);
+					for (uint32_t c = 0; c < 4; c++)
+						pending.push_back({ child + c, p.Level + 1, record, tile.Heights });
+				}
+			}
+		}
+
+		sprintf_s(line, "terraindetail: records: %zu tiles on levels %u-%u checked, %zu texels outside their range, %zu further from the parent than its error allows",
+			checked, level, detail.TotalLevels() - 1, outside, overError);
+		BenchmarkLog(line);
+	}
+
+	// Trees scattered over the real height tiles at rising densities. Scattering is
+	// timed on 1 to all threads. Culling runs on a flight low over the terrain with
+	// the hierarchical cell walk and compact per kind runs, against testing every
+	// instance like a render item each. Without thinning the cell walk has to keep
+	// every instance the per instance test keeps.
+	void BenchmarkVegetation()
+	{
+		using namespace DirectX;
+
+		const uint32_t levels = 4;
+		const float rootSize = 1024.0f;
+		const float baseY = -40.0f;
+		const float heightScale = 250.0f;
+
+		TerrainHeightData data;
+		if (!data.Load(L"../Textures/Terrain", levels))
+		{
+			BenchmarkLog("vegetation: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+
+		TerrainHeightFieldSettings fieldSettings;
+		fieldSettings.Levels = levels;
+		fieldSettings.RootSize = rootSize;
+		fieldSettings.BaseY = baseY;
+		fieldSettings.HeightScale = heightScale;
+		TerrainHeightField field;
+		field.Reset(fieldSettings);
+		for (uint32_t level = 0; level < levels; level++)
+			for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+			{
+				uint32_t x, y;
+				TerrainQuadTree::TileCoords(n, level, x, y);
+				const uint16_t* tile = data.Tile(level, x, y);
+				field.Insert(n, level, std::vector<uint16_t>(tile, tile + data.TileResolution() * data.TileResolution()), data.TileResolution());
+			}
+
+		// Broadleaf trees down low, a mix on the hillsides, conifers up to the ridges.
+		VegetationScatterSettings settings;
+		settings.RootSize = rootSize;
+		VegetationKind low, mid, high;
+		low.Density = 0.12f;
+		low.MaxHeight = 40.0f;
+		low.MaxSlope = 0.5f;
+		mid.Density = 0.1f;
+		mid.MinHeight = 0.0f;
+		mid.MaxHeight = 120.0f;
+		mid.MaxSlope = 0.8f;
+		high.Density = 0.1f;
+		high.MinHeight = 60.0f;
+		high.MaxSlope = 1.2f;
+		high.MinSize = 10.0f;
+		high.MaxSize = 18.0f;
+
+		const int frames = 600;
+		CameraPathFrame frame;
+		frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+		frame.FovY = 0.25f * XM_PI;
+		frame.Aspect = 16.0f / 9.0f;
+		frame.NearZ = 1.0f;
+		frame.FarZ = 2000.0f;
+		frame.ViewportHeight = 1080.0f;
+		std::vector<CameraPathFrame> path(frames, frame);
+		std::vector<XMFLOAT2> ground(frames);
+		for (int f = 0; f < frames; f++)
+		{
+			float t = (float)f / (frames - 1);
+			ground[f] = XMFLOAT2((t - 0.5f) * 900.0f, 350.0f * std::sin(t * 5.0f));
+		}
+		std::vector<float> groundHeights(frames);
+		field.QueryHeights(ground.data(), frames, groundHeights.data());
+		for (int f = 0; f < frames; f++)
+		{
+			float t = (float)f / (frames - 1);
+			path[f].Position = XMFLOAT3(ground[f].x, groundHeights[f] + 25.0f, ground[f].y);
+			path[f].Look = XMFLOAT3(std::cos(t * 9.0f), -0.15f, std::sin(t * 9.0f));
+		}
+
+		VegetationCullSettings cull;
+		VegetationCullSettings exact = cull;
+		exact.ThinStart = exact.MaxDistance;
+
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		char line[256];
+		for (float scale = 1.0f; scale <= 4.0f; scale *= 2.0f)
+		{
+			settings.Kinds.clear();
+			for (VegetationKind kind : { low, mid, high })
+			{
+				kind.Density *= scale;
+				settings.Kinds.push_back(kind);
+			}
+
+			VegetationScatter scatter;
+			double oneThreadMs = 0.0;
+			for (unsigned threads = 1; ; threads *= 2)
+			{
+				if (threads > maxThreads)
+					threads = maxThreads;
+				ThreadPool pool(threads - 1);
+				auto start = Clock::now();
+				scatter.Scatter(field, settings, pool);
+				double ms = MsSince(start);
+				if (threads == 1)
+					oneThreadMs = ms;
+				sprintf_s(line, "vegetation: %zu instances in %u cells scattered in %.1f ms on %u threads (%.2fx)",
+					scatter.Instances().size(), scatter.CellCount(), ms, threads, oneThreadMs / ms);
+				BenchmarkLog(line);
+				if (threads == maxThreads)
+					break;
+			}
+
+			std::vector<VegetationInstance> instances;
+			std::vector<VegetationDrawBatch> batches;
+			VegetationCullStats stats;
+			uint64_t nodes = 0, cells = 0, drawn = 0, batchCount = 0;
+			double worstMs = 0.0;
+			auto start = Clock::now();
+			for (auto& p : path)
+			{
+				auto frameStart = Clock::now();
+				scatter.Cull(p.Frustum(), p.Position, cull, instances, batches, &stats);
+				worstMs = std::max(worstMs, MsSince(frameStart));
+				nodes += stats.Nodes;
+				cells += stats.Cells;
+				drawn += stats.Instances;
+				batchCount += batches.size();
+			}
+			double cellMs = MsSince(start) / frames;
+
+			sprintf_s(line, "vegetation:   cells: %.4f ms a frame (worst %.4f), %.0f nodes tested, %.0f cells, %.0f instances in %.1f draws",
+				cellMs, worstMs, (double)nodes / frames, (double)cells / frames, (double)drawn / frames, (double)batchCount / frames);
+			BenchmarkLog(line);
+
+			// Every instance against the frustum and the distance, gathered into the same
+			// per kind runs.
+			const std::vector<VegetationInstance>& all = scatter.Instances();
+			std::vector<std::vector<uint32_t>> byKind(settings.Kinds.size());
+			std::vector<VegetationInstance> gathered;
+			uint64_t items = 0;
+			start = Clock::now();
+			for (auto& p : path)
+			{
+				BoundingFrustum frustum = p.Frustum();
+				XMVECTOR eye = XMLoadFloat3(&p.Position);
+				for (auto& list : byKind)
+					list.clear();
+				for (uint32_t i = 0; i < (uint32_t)all.size(); i++)
+				{
+					const VegetationInstance& v = all[i];
+					float half = 0.5f * v.Size;
+					BoundingBox box(XMFLOAT3(v.Position.x, v.Position.y + half, v.Position.z), XMFLOAT3(half, half, half));
+					XMVECTOR outside = XMVectorMax(XMVectorSubtract(XMVectorAbs(XMVectorSubtract(eye, XMLoadFloat3(&box.Center))), XMLoadFloat3(&box.Extents)), XMVectorZero());
+					if (XMVectorGetX(XMVector3Length(outside)) > exact.MaxDistance || !frustum.Intersects(box))
+						continue;
+					byKind[v.Kind].push_back(i);
+				}
+				gathered.clear();
+				for (auto& list : byKind)
+					for (uint32_t i : list)
+						gathered.push_back(all[i]);
+				items += gathered.size();
+			}
+			double itemMs = MsSince(start) / frames;
+
+			// Conservative: what the per instance test keeps the cell walk keeps as well.
+			auto key = [](const VegetationInstance& v)
+			{
+				uint32_t x, z;
+				memcpy(&x, &v.Position.x, sizeof(x));
+				memcpy(&z, &v.Position.z, sizeof(z));
+				return (uint64_t)x << 32 | z;
+			};
+			size_t missed = 0;
+			std::vector<uint64_t> kept;
+			for (int f = 0; f < frames; f += 10)
+			{
+				const CameraPathFrame& p = path[f];
+				scatter.Cull(p.Frustum(), p.Position, exact, instances, batches);
+				kept.clear();
+				for (auto& v : instances)
+					kept.push_back(key(v));
+				std::sort(kept.begin(), kept.end());
+
+				BoundingFrustum frustum = p.Frustum();
+				XMVECTOR eye = XMLoadFloat3(&p.Position);
+				for (auto& v : all)
+				{
+					float half = 0.5f * v.Size;
+					BoundingBox box(XMFLOAT3(v.Position.x, v.Position.y + half, v.Position.z), XMFLOAT3(half, half, half));
+					XMVECTOR outside = XMVectorMax(XMVectorSubtract(XMVectorAbs(XMVectorSubtract(eye, XMLoadFloat3(&box.Center))), XMLoadFloat3(&box.Extents)), XMVectorZero());
+					if (XMVectorGetX(XMVector3Length(outside)) > exact.MaxDistance || !frustum.Intersects(box))
+						continue;
+					if (!std::binary_search(kept.begin(), kept.end(), key(v)))
+						missed++;
+				}
+			}
+
+			sprintf_s(line, "vegetation:   per instance: %.4f ms a frame (%.1fx), %.0f render items; %zu instances missed by the cells",
+				itemMs, itemMs / cellMs, (double)items / frames, missed);
+			BenchmarkLog(line);
+		}
+	}
+
+	// Scenes of 1k to 1M random boxes in three layers, culled frame by frame on an
+	// orbit like UpdateObjectCBs does, one heap allocated item at a time through
+	// BoundingFrustum::Intersects, against BoxCuller's SoA arrays. Every box the
+	// per item test keeps has to pass BoxCuller as well; the extra boxes are the ones
+	// near frustum corners that only the full test rejects.
+	void BenchmarkBoxCull()
+	{
+		using namespace DirectX;
+
+		// The fields of a RenderItem that UpdateObjectCBs walks past.
+		struct Item
+		{
+			XMFLOAT4X4 World;
+			XMFLOAT4X4 TexTransform;
+			int NumFramesDirty;
+			UINT ObjCBIndex;
+			void* Mat;
+			void* Geo;
+			UINT IndexCount;
+			BoundingBox Bounds;
+			std::string geoName;
+			int layer;
+			std::vector<std::string> LODGeoNames;
+			int currentLOD;
+		};
+
+		const uint32_t layers = 3;
+		const int frames = 60;
+		const float worldSize = 2000.0f;
+
+		CameraPathFrame frame;
+		frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+		frame.FovY = 0.25f * XM_PI;
+		frame.Aspect = 16.0f / 9.0f;
+		frame.NearZ = 1.0f;
+		frame.FarZ = 1000.0f;
+		frame.ViewportHeight = 1080.0f;
+		std::vector<BoundingFrustum> frustums;
+		for (int f = 0; f < frames; f++)
+		{
+			float a = XM_2PI * f / frames;
+			frame.Position = XMFLOAT3(300.0f * std::cos(a), 60.0f, 300.0f * std::sin(a));
+			frame.Look = XMFLOAT3(-std::sin(a), -0.1f, std::cos(a));
+			frustums.push_back(frame.Frustum());
+		}
+
+		char line[256];
+		for (uint32_t count = 1000; count <= 1000000; count *= 10)
+		{
+			std::mt19937 rng(44);
+			std::uniform_real_distribution<float> across(-0.5f * worldSize, 0.5f * worldSize);
+			std::uniform_real_distribution<float> height(0.0f, 100.0f);
+			std::uniform_real_distribution<float> size(0.5f, 5.0f);
+			std::vector<BoundingBox> boxes(count);
+			std::vector<uint32_t> boxLayers(count);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				boxes[i] = BoundingBox(XMFLOAT3(across(rng), height(rng), across(rng)), XMFLOAT3(size(rng), size(rng), size(rng)));
+				boxLayers[i] = rng() % 8 == 0 ? 1 + rng() % (layers - 1) : 0;
+			}
+
+			// Items are allocated in a random order, the way a scene built over time
+			// scatters them over the heap.
+			std::vector<uint32_t> order(count);
+			for (uint32_t i = 0; i < count; i++)
+				order[i] = i;
+			std::shuffle(order.begin(), order.end(), rng);
+			std::vector<std::unique_ptr<Item>> items(count);
+			for (uint32_t i : order)
+			{
+				items[i] = std::make_unique<Item>();
+				items[i]->Bounds = boxes[i];
+				items[i]->layer = (int)boxLayers[i];
+			}
+
+			BoxCuller culler;
+			culler.Reset(layers);
+			for (uint32_t i = 0; i < count; i++)
+				culler.Add(boxes[i], boxLayers[i]);
+
+			std::vector<Item*> visibleItems[layers];
+			size_t itemsVisible = 0;
+			auto start = Clock::now();
+			for (auto& frustum : frustums)
+			{
+				for (auto& list : visibleItems)
+					list.clear();
+				for (auto& e : items)
+					if (frustum.Intersects(e->Bounds))
+						visibleItems[e->layer].push_back(e.get());
+				for (auto& list : visibleItems)
+					itemsVisible += list.size();
+			}
+			double itemMs = MsSince(start) / frames;
+
+			std::vector<uint32_t> visible[layers];
+			size_t boxesVisible = 0;
+			start = Clock::now();
+			for (auto& frustum : frustums)
+			{
+				culler.Cull(frustum, visible);
+				for (auto& list : visible)
+					boxesVisible += list.size();
+			}
+			double soaMs = MsSince(start) / frames;
+
+			size_t missed = 0, extra = 0;
+			std::vector<uint8_t> passed(count);
+			for (int f = 0; f < frames; f += 10)
+			{
+				culler.Cull(frustums[f], visible);
+				std::fill(passed.begin(), passed.end(), 0);
+				for (uint32_t l = 0; l < layers; l++)
+					for (uint32_t i : visible[l])
+						passed[i] = boxLayers[i] == l ? 1 : 2;
+				for (uint32_t i = 0; i < count; i++)
+				{
+					bool inside = frustums[f].Intersects(boxes[i]);
+					if ((inside && passed[i] != 1) || passed[i] == 2)
+						missed++;
+					else if (!inside && passed[i])
+						extra++;
+				}
+			}
+
+			sprintf_s(line, "boxcull: %7u items  per item: %8.4f ms  SoA: %8.4f ms (%5.1fx)  %.0f visible, %.2f%% extra, %zu missed",
+				count, itemMs, soaMs, itemMs / soaMs, (double)itemsVisible / frames,
+				100.0 * extra / std::max<double>((double)itemsVisible / frames * (frames / 10), 1.0), missed);
+			BenchmarkLog(line);
+		}
+	}
+
+	// Clustered scenes of 10k to 1M boxes. The tree is built with the SAH and,
+	// item by item, with inserts; frustum queries along an orbit and sphere queries
+	// around the eye are timed against testing every box, and have to find the same
+	// items. Then 1% of the items move every frame, kept up by Move (reinserting the
+	// ones that leave their grown box) or by Refit, and the queries are timed again.
+	void BenchmarkBoundsTree()
+	{
+		using namespace DirectX;
+
+		const int frames = 60;
+		const float worldSize = 4000.0f;
+
+		CameraPathFrame frame;
+		frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+		frame.FovY = 0.25f * XM_PI;
+		frame.Aspect = 16.0f / 9.0f;
+		frame.NearZ = 1.0f;
+		frame.FarZ = 1000.0f;
+		frame.ViewportHeight = 1080.0f;
+		std::vector<BoundingFrustum> frustums;
+		std::vector<BoundingSphere> spheres;
+		for (int f = 0; f < frames; f++)
+		{
+			float a = XM_2PI * f / frames;
+			frame.Position = XMFLOAT3(800.0f * std::cos(a), 60.0f, 800.0f * std::sin(a));
+			frame.Look = XMFLOAT3(-std::sin(a), -0.1f, std::cos(a));
+			frustums.push_back(frame.Frustum());
+			spheres.push_back(BoundingSphere(frame.Position, 150.0f));
+		}
+
+		char line[256];
+		for (uint32_t count = 10000; count <= 1000000; count *= 10)
+		{
+			// Items gather around towns, the way objects of a level do.
+			std::mt19937 rng(45);
+			std::uniform_real_distribution<float> across(-0.5f * worldSize, 0.5f * worldSize);
+			std::normal_distribution<float> town(0.0f, 60.0f);
+			std::uniform_real_distribution<float> size(0.5f, 5.0f);
+			std::vector<XMFLOAT3> towns(std::max<uint32_t>(count / 500, 1));
+			for (auto& t : towns)
+				t = XMFLOAT3(across(rng), 0.0f, across(rng));
+			std::vector<BoundingBox> boxes(count);
+			std::vector<uint32_t> items(count);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				const XMFLOAT3& t = towns[rng() % towns.size()];
+				boxes[i] = BoundingBox(XMFLOAT3(t.x + town(rng), std::fabs(town(rng)) * 0.2f, t.z + town(rng)), XMFLOAT3(size(rng), size(rng), size(rng)));
+				items[i] = i;
+			}
+
+			BoundsTree built(0.5f);
+			auto start = Clock::now();
+			built.Build(boxes.data(), items.data(), count);
+			double buildMs = MsSince(start);
+
+			BoundsTree inserted(0.5f);
+			start = Clock::now();
+			for (uint32_t i = 0; i < count; i++)
+				inserted.Insert(boxes[i], i);
+			double insertMs = MsSince(start);
+
+			sprintf_s(line, "boundstree: %7u items  SAH build %7.1f ms, height %d, cost %.1f  inserts %7.1f ms, height %d, cost %.1f",
+				count, buildMs, built.Height(), built.Cost(), insertMs, inserted.Height(), inserted.Cost());
+			BenchmarkLog(line);
+
+			// The per item scan and what it finds, the reference for the queries.
+			std::vector<std::vector<uint32_t>> expected(frames), expectedNear(frames);
+			start = Clock::now();
+			for (int f = 0; f < frames; f++)
+				for (uint32_t i = 0; i < count; i++)
+					if (frustums[f].Intersects(boxes[i]))
+						expected[f].push_back(i);
+			double scanMs = MsSince(start) / frames;
+			start = Clock::now();
+			for (int f = 0; f < frames; f++)
+				for (uint32_t i = 0; i < count; i++)
+					if (spheres[f].Intersects(boxes[i]))
+						expectedNear[f].push_back(i);
+			double scanNearMs = MsSince(start) / frames;
+
+			BoxCuller culler;
+			culler.Reset(1);
+			for (auto& box : boxes)
+				culler.Add(box, 0);
+			std::vector<uint32_t> culled;
+			start = Clock::now();
+			for (auto& frustum : frustums)
+				culler.Cull(frustum, &culled);
+			double soaMs = MsSince(start) / frames;
+
+			auto query = [&](const BoundsTree& tree, const char* name)
+			{
+				std::vector<uint32_t> found;
+				BoundsTreeStats stats, nearStats;
+				size_t visible = 0, wrong = 0;
+				auto start = Clock::now();
+				for (int f = 0; f < frames; f++)
+				{
+					tree.Query(frustums[f], found, &stats);
+					visible += found.size();
+				}
+				double treeMs = MsSince(start) / frames;
+				start = Clock::now();
+				for (int f = 0; f < frames; f++)
+					tree.Query(spheres[f], found, &nearStats);
+				double nearMs = MsSince(start) / frames;
+
+				for (int f = 0; f < frames; f += 10)
+				{
+					tree.Query(frustums[f], found);
+					std::sort(found.begin(), found.end());
+					wrong += found != expected[f];
+					tree.Query(spheres[f], found);
+					std::sort(found.begin(), found.end());
+					wrong += found != expectedNear[f];
+				}
+
+				sprintf_s(line, "boundstree:   %-8s frustum %7.4f ms (scan %7.4f, SoA %7.4f), %.0f visible, %.0f nodes tested, %.0f taken untested",
+					name, treeMs, scanMs, soaMs, (double)visible / frames, (double)stats.Tested / frames, (double)stats.Taken / frames);
+				BenchmarkLog(line);
+				sprintf_s(line, "boundstree:   %-8s sphere  %7.4f ms (scan %7.4f), %.0f nodes tested; %zu queries differ from the scan",
+					name, nearMs, scanNearMs, (double)nearStats.Tested / frames, wrong);
+				BenchmarkLog(line);
+			};
+			query(built, "built");
+			query(inserted, "inserted");
+
+			// 1% of the items take a step every frame, kept up by Move or by Refit.
+			std::vector<BoundingBox> moved = boxes;
+			BoundsTree refitted(0.0f);
+			refitted.Build(boxes.data(), items.data(), count);
+			std::uniform_real_distribution<float> step(-2.0f, 2.0f);
+			size_t reinserted = 0;
+			double moveMs = 0.0, refitMs = 0.0;
+			for (int f = 0; f < frames; f++)
+			{
+				for (uint32_t k = 0; k < count / 100; k++)
+				{
+					uint32_t i = rng() % count;
+					moved[i].Center.x += step(rng);
+					moved[i].Center.z += step(rng);
+				}
+				start = Clock::now();
+				for (uint32_t i = 0; i < count; i++)
+					if (moved[i].Center.x != boxes[i].Center.x || moved[i].Center.z != boxes[i].Center.z)
+						reinserted += built.Move(i, moved[i]);
+				moveMs += MsSince(start);
+				start = Clock::now();
+				for (uint32_t i = 0; i < count; i++)
+					if (moved[i].Center.x != boxes[i].Center.x || moved[i].Center.z != boxes[i].Center.z)
+						refitted.Move(i, moved[i]);
+				refitted.Refit();
+				refitMs += MsSince(start);
+				boxes = moved;
+			}
+
+			sprintf_s(line, "boundstree:   moving: Move %.3f ms a frame, %.1f reinserted, cost %.1f  Refit %.3f ms a frame, cost %.1f",
+				moveMs / frames, (double)reinserted / frames, built.Cost(), refitMs / frames, refitted.Cost());
+			BenchmarkLog(line);
+
+			for (int f = 0; f < frames; f++)
+			{
+				expected[f].clear();
+				expectedNear[f].clear();
+				for (uint32_t i = 0; i < count; i++)
+				{
+					if (frustums[f].Intersects(boxes[i]))
+						expected[f].push_back(i);
+					if (spheres[f].Intersects(boxes[i]))
+						expectedNear[f].push_back(i);
+				}
+			}
+			query(built, "moved");
+			query(refitted, "refitted");
+		}
+	}
+
+	// Occlusion culling on the shipped height tiles with the CPU depth buffer: the
+	// ground of the selected tiles, as 8x8 cell grids, and 150 rocks simplified from
+	// dense meshes occlude the tiles, the rocks and a few thousand boxes standing on the
+	// terrain, along the camera paths and a walk through the valleys. Setup, raster and
+	// test times at 1, 2, 4, ... threads, and the culled fraction next to horizon
+	// culling. Every few frames the culled boxes are checked by marching rays from the
+	// eye to their corners over the finest height tiles and through the dense rocks.
+	void BenchmarkOcclusion()
+	{
+		using namespace DirectX;
+
+		const uint32_t levels = 4;
+		const float rootSize = 1024.0f;
+		const float baseY = -40.0f;
+		const float heightScale = 250.0f;
+		const uint32_t cells = 8;
+
+		TerrainHeightData heights;
+		if (!heights.Load(L"../Textures/Terrain", levels))
+		{
+			BenchmarkLog("occlusion: can't load the height tiles from ../Textures/Terrain");
+			return;
+		}
+
+		std::vector<float> errors = heights.ComputeGeometricErrors();
+		std::vector<TerrainHeightRange> heightRanges = heights.ComputeHeightRanges();
+		TerrainQuadTree tree;
+		tree.Build(levels, rootSize, 0.0f, 0.0f, baseY, baseY + heightScale);
+		std::vector<float> levelErrors(levels, 0.0f);
+		std::vector<std::vector<float>> minHeights;
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+			{
+				tree.CreateNode(n, level, errors[n] * heightScale);
+				tree.SetHeightRange(n, baseY + heightRanges[n].Min * heightScale, baseY + heightRanges[n].Max * heightScale);
+				levelErrors[level] = std::max(levelErrors[level], errors[n] * heightScale);
+
+				uint32_t x, y;
+				TerrainQuadTree::TileCoords(n, level, x, y);
+				minHeights.push_back(TerrainHeightData::ComputeMinHeights(heights.Tile(level, x, y), heights.TileResolution(), cells));
+				for (float& h : minHeights.back())
+					h = baseY + h * heightScale;
+			}
+		}
+
+		const uint32_t finest = levels - 1;
+		auto surface = [&](float x, float z)
+		{
+			float width = (float)TerrainQuadTree::LevelWidth(finest);
+			float u = std::min(std::max((x / rootSize + 0.5f) * width, 0.0f), width - 0.001f);
+			float v = std::min(std::max((0.5f - z / rootSize) * width, 0.0f), width - 0.001f);
+			uint32_t tx = (uint32_t)u, ty = (uint32_t)v;
+			return baseY + heights.SampleTile(finest, tx, ty, u - tx, v - ty) * heightScale;
+		};
+
+		// A lumpy unit sphere as the dense rock, and its occluder.
+		const uint32_t slices = 64, stacks = 32;
+		std::vector<XMFLOAT3> rockVertices;
+		std::vector<uint32_t> rockIndices;
+		for (uint32_t j = 0; j <= stacks; j++)
+		{
+			float phi = XM_PI * j / stacks;
+			for (uint32_t i = 0; i <= slices; i++)
+			{
+				float theta = XM_2PI * i / slices;
+				float r = 0.85f + 0.15f * std::sin(3.0f * theta) * std::sin(2.0f * phi);
+				rockVertices.push_back(XMFLOAT3(r * std::sin(phi) * std::cos(theta), r * std::cos(phi), r * std::sin(phi) * std::sin(theta)));
+			}
+		}
+		for (uint32_t j = 0; j < stacks; j++)
+		{
+			for (uint32_t i = 0; i < slices; i++)
+			{
+				uint32_t a = j * (slices + 1) + i, b = a + slices + 1;
+				uint32_t quad[6] = { a, a + 1, b, a + 1, b + 1, b };
+				rockIndices.insert(rockIndices.end(), quad, quad + 6);
+			}
+		}
+		OccluderMesh rock = SimplifyOccluder(rockVertices.data(), sizeof(XMFLOAT3), rockVertices.size(), rockIndices.data(), rockIndices.size(), 12);
+		BoundingBox rockBounds;
+		BoundingBox::CreateFromPoints(rockBounds, rockVertices.size(), rockVertices.data(), sizeof(XMFLOAT3));
+
+		std::mt19937 rng(46);
+		std::uniform_real_distribution<float> across(-0.48f * rootSize, 0.48f * rootSize);
+		std::uniform_real_distribution<float> rockSize(6.0f, 16.0f);
+		std::vector<XMFLOAT4X4> rocks(150), rockInverses(150);
+		std::vector<BoundingBox> rockBoxes(150);
+		for (size_t r = 0; r < rocks.size(); r++)
+		{
+			float x = across(rng), z = across(rng), size = rockSize(rng);
+			XMMATRIX world = XMMatrixMultiply(XMMatrixScaling(size, 0.7f * size, size), XMMatrixTranslation(x, surface(x, z) + 0.3f * size, z));
+			XMStoreFloat4x4(&rocks[r], world);
+			XMStoreFloat4x4(&rockInverses[r], XMMatrixInverse(nullptr, world));
+			rockBounds.Transform(rockBoxes[r], world);
+		}
+		std::vector<BoundingBox> objects(4000);
+		for (auto& box : objects)
+		{
+			float x = across(rng), z = across(rng);
+			box = BoundingBox(XMFLOAT3(x, surface(x, z) + 4.0f, z), XMFLOAT3(2.0f, 4.0f, 2.0f));
+		}
+
+		char line[256];
+		sprintf_s(line, "occlusion: %zu rocks of %zu triangles, occluding with %zu", rocks.size(), rockIndices.size() / 3, rock.Indices.size() / 3);
+		BenchmarkLog(line);
+
+		// Whether the segment from the eye to p passes through a dense rock.
+		auto throughRock = [&](FXMVECTOR eye, FXMVECTOR p)
+		{
+			for (size_t r = 0; r < rocks.size(); r++)
+			{
+				XMMATRIX inverse = XMLoadFloat4x4(&rockInverses[r]);
+				XMVECTOR o = XMVector3TransformCoord(eye, inverse);
+				XMVECTOR d = XMVectorSubtract(XMVector3TransformCoord(p, inverse), o);
+				float t = std::min(std::max(-XMVectorGetX(XMVector3Dot(o, d)) / XMVectorGetX(XMVector3LengthSq(d)), 0.0f), 1.0f);
+				if (XMVectorGetX(XMVector3LengthSq(XMVectorAdd(o, XMVectorScale(d, t)))) > 1.0f)
+					continue;
+				for (size_t i = 0; i < rockIndices.size(); i += 3)
+				{
+					XMVECTOR v0 = XMLoadFloat3(&rockVertices[rockIndices[i]]);
+					XMVECTOR e1 = XMVectorSubtract(XMLoadFloat3(&rockVertices[rockIndices[i + 1]]), v0);
+					XMVECTOR e2 = XMVectorSubtract(XMLoadFloat3(&rockVertices[rockIndices[i + 2]]), v0);
+					XMVECTOR q = XMVector3Cross(d, e2);
+					float det = XMVectorGetX(XMVector3Dot(e1, q));
+					if (std::fabs(det) < 1e-12f)
+						continue;
+					XMVECTOR s = XMVectorSubtract(o, v0);
+					float u = XMVectorGetX(XMVector3Dot(s, q)) / det;
+					XMVECTOR sc = XMVector3Cross(s, e1);
+					float v = XMVectorGetX(XMVector3Dot(d, sc)) / det;
+					float hit = XMVectorGetX(XMVector3Dot(e2, sc)) / det;
+					if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && hit > 0.0f && hit < 0.999f)
+						return true;
+				}
+			}
+			return false;
+		};
+
+		auto paths = LoadCameraPaths();
+		CameraPath valley;
+		for (int f = 0; f < 600; f++)
+		{
+			float t = (float)f / 599;
+			CameraPathFrame frame;
+			frame.Position = XMFLOAT3((t - 0.5f) * 900.0f, 0.0f, (t - 0.5f) * 500.0f + 80.0f * std::sin(t * 9.0f));
+			frame.Position.y = surface(frame.Position.x, frame.Position.z) + 6.0f;
+			float a = 0.5f + 1.5f * std::sin(t * 5.0f);
+			frame.Look = XMFLOAT3(std::cos(a), -0.05f, std::sin(a));
+			frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+			frame.FovY = 0.25f * XM_PI;
+			frame.Aspect = 16.0f / 9.0f;
+			frame.NearZ = 1.0f;
+			frame.FarZ = 1000.0f;
+			frame.ViewportHeight = 1080.0f;
+			valley.Add(frame);
+		}
+		paths.push_back({ "built-in valley walk", valley });
+
+		TerrainLodSettings lod;
+		TerrainLodRanges ranges;
+		TerrainHorizon horizon;
+		OcclusionBuffer occlusion;
+		std::vector<TerrainQuadTree::Selected> selected;
+		std::vector<BoundingBox> boxes;
+		std::vector<uint32_t> boxRocks;
+		std::vector<uint8_t> hidden, belowHorizon;
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (auto& path : paths)
+		{
+			const auto& frames = path.second.Frames();
+			for (unsigned threads = 1; ; threads *= 2)
+			{
+				if (threads > maxThreads)
+					threads = maxThreads;
+
+				ThreadPool pool(threads - 1);
+				size_t tiles = 0, tilesCulled = 0, inView = 0, objectsCulled = 0, horizonCulled = 0, eitherCulled = 0, checked = 0, seen = 0;
+				double triangles = 0.0, binned = 0.0, setupMs = 0.0, rasterMs = 0.0, testMs = 0.0;
+				for (size_t f = 0; f < frames.size(); f++)
+				{
+					const CameraPathFrame& frame = frames[f];
+					BoundingFrustum frustum = frame.Frustum();
+					selected.clear();
+					ComputeTerrainLodRanges(tree, lod, levelErrors, frame.FovY, frame.ViewportHeight, ranges);
+					SelectTerrainTiles(tree, ranges, frustum, frame.Position, selected);
+
+					boxes.clear();
+					boxRocks.clear();
+					for (auto& tile : selected)
+						boxes.push_back(tree.Bounds(tile.Node));
+					size_t tileCount = boxes.size();
+					for (uint32_t r = 0; r < rocks.size(); r++)
+					{
+						if (frustum.Intersects(rockBoxes[r]))
+						{
+							boxes.push_back(rockBoxes[r]);
+							boxRocks.push_back(r);
+						}
+					}
+					for (auto& box : objects)
+						if (frustum.Intersects(box))
+							boxes.push_back(box);
+
+					auto start = Clock::now();
+					occlusion.Begin(XMMatrixMultiply(frame.View(), frame.Proj()));
+					for (size_t i = 0; i < tileCount; i++)
+						occlusion.AddOccluderGrid(boxes[i], cells, minHeights[selected[i].Node].data());
+					for (uint32_t r : boxRocks)
+						occlusion.AddOccluder(rock, XMLoadFloat4x4(&rocks[r]));
+					setupMs += MsSince(start);
+					start = Clock::now();
+					occlusion.Rasterize(pool);
+					rasterMs += MsSince(start);
+					start = Clock::now();
+					occlusion.Cull(boxes, hidden, pool);
+					testMs += MsSince(start);
+					triangles += occlusion.GetStats().Triangles;
+					binned += occlusion.GetStats().Binned;
+
+					if (threads > 1)
+						continue;
+
+					horizon.Begin(frame.Position);
+					for (size_t i = 0; i < tileCount; i++)
+						horizon.AddOccluderGrid(boxes[i], cells, minHeights[selected[i].Node].data());
+					horizon.Cull(boxes, belowHorizon);
+
+					tiles += tileCount;
+					inView += boxes.size() - tileCount;
+					for (size_t i = 0; i < boxes.size(); i++)
+					{
+						if (i < tileCount)
+						{
+							tilesCulled += hidden[i];
+							continue;
+						}
+						horizonCulled += belowHorizon[i];
+						eitherCulled += hidden[i] || belowHorizon[i];
+						if (!hidden[i])
+							continue;
+						objectsCulled++;
+						if (f % 8 != 0)
+							continue;
+
+						// A corner in view that a ray reaches without going under the ground
+						// or through a rock means the box was culled while visible.
+						XMFLOAT3 corners[BoundingBox::CORNER_COUNT];
+						boxes[i].GetCorners(corners);
+						XMVECTOR eye = XMLoadFloat3(&frame.Position);
+						for (auto& corner : corners)
+						{
+							XMVECTOR p = XMLoadFloat3(&corner);
+							if (frustum.Contains(p) == DISJOINT)
+								continue;
+							checked++;
+							XMVECTOR ray = XMVectorSubtract(p, eye);
+							float length = XMVectorGetX(XMVector3Length(ray));
+							bool blocked = false;
+							for (float d = 0.5f; d < length - 0.5f && !blocked; d += 0.5f)
+							{
+								XMFLOAT3 q;
+								XMStoreFloat3(&q, XMVectorAdd(eye, XMVectorScale(ray, d / length)));
+								blocked = q.y < surface(q.x, q.z);
+							}
+							seen += !blocked && !throughRock(eye, p);
+						}
+					}
+				}
+
+				double n = (double)frames.size();
+				sprintf_s(line, "occlusion: path %s, %2u threads: %.0f triangles (%.0f binned), setup %.4f raster %.4f test %.4f ms, %.1f Mtriangles/s, %.1f Mboxes/s",
+					path.first.c_str(), threads, triangles / n, binned / n, setupMs / n, rasterMs / n, testMs / n,
+					binned / rasterMs / 1000.0, (tiles + inView) / testMs / 1000.0);
+				BenchmarkLog(line);
+				if (threads == 1)
+				{
+					sprintf_s(line, "occlusion: path %s: tiles %.1f culled %.1f, objects in view %.1f culled %.1f (horizon %.1f, either %.1f); %zu culled corners checked, %zu visible",
+						path.first.c_str(), tiles / n, tilesCulled / n, inView / n, objectsCulled / n, horizonCulled / n, eitherCulled / n, checked, seen);
+					BenchmarkLog(line);
+				}
+
+				if (threads == maxThreads)
+					break;
+			}
+		}
+	}
+
+	// The frame update of DX12App::UpdateObjectCBs and UpdateLightCBs on a synthetic
+	// scene of 200k items in four layers, a tenth of them moving each frame, and 2000
+	// point lights with their six shadow views, at 1, 2, 4, ... threads. Jobs take
+	// ranges of items and write their own constant slots; moved bounds go into the
+	// tree and visible items into the layer lists in range order, so every thread
+	// count has to produce the same constants and lists. At the most threads it runs
+	// again with background loads in flight, stood in for by 20 ms sleeps that hold a
+	// thread like a file read, queued on the frame's pool and on a pool of their own.
+	void BenchmarkFrameUpdate()
+	{
+		using namespace DirectX;
+
+		struct Item
+		{
+			XMFLOAT4X4 World;
+			XMFLOAT4X4 TexTransform;
+			BoundingBox LocalBounds;
+			BoundingBox Bounds;
+			uint32_t Layer;
+			int Dirty;
+			uint32_t Lod;
+		};
+		// Same sizes as ObjectConstants and the point light part of LightConstants.
+		struct Constants
+		{
+			XMFLOAT4X4 World;
+			XMFLOAT4X4 TexTransform;
+		};
+		struct LightViews
+		{
+			XMFLOAT4X4 ViewProj[6];
+			XMFLOAT4X4 ShadowTransform[6];
+		};
+		struct Range
+		{
+			std::vector<uint32_t> Moved;
+			std::vector<uint32_t> Visible[4];
+		};
+
+		const size_t itemCount = 200000, lightCount = 2000;
+		const size_t grainSize = 256, lightGrainSize = 8;
+		const int frames = 30;
+		const float worldSize = 3000.0f;
+		LodSettings lod;
+
+		CameraPathFrame frame;
+		frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+		frame.FovY = 0.25f * XM_PI;
+		frame.Aspect = 16.0f / 9.0f;
+		frame.NearZ = 1.0f;
+		frame.FarZ = 1000.0f;
+		frame.ViewportHeight = 1080.0f;
+		const float projectionScale = LodProjectionScale(frame.FovY, frame.ViewportHeight);
+
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		enum Loads { NoLoads, LoadsOnFramePool, LoadsOnOwnPool };
+		std::vector<std::pair<unsigned, Loads>> runs;
+		for (unsigned threads = 1; ; threads = std::min(threads * 2, maxThreads))
+		{
+			runs.push_back({ threads, NoLoads });
+			if (threads == maxThreads)
+				break;
+		}
+		runs.push_back({ maxThreads, LoadsOnFramePool });
+		runs.push_back({ maxThreads, LoadsOnOwnPool });
+
+		uint64_t referenceHash = 0;
+		double singleThreadMs = 0.0;
+		char line[256];
+		for (auto& run : runs)
+		{
+			unsigned threads = run.first;
+
+			// The same scene and moves for every thread count.
+			std::mt19937 rng(47);
+			std::uniform_real_distribution<float> across(-0.5f * worldSize, 0.5f * worldSize);
+			std::uniform_real_distribution<float> angle(0.0f, XM_2PI);
+			std::uniform_real_distribution<float> step(-1.0f, 1.0f);
+			std::vector<Item> items(itemCount);
+			std::vector<BoundingBox> boxes(itemCount);
+			std::vector<uint32_t> ids(itemCount);
+			for (uint32_t i = 0; i < itemCount; i++)
+			{
+				Item& item = items[i];
+				XMStoreFloat4x4(&item.World, XMMatrixMultiply(XMMatrixRotationY(angle(rng)), XMMatrixTranslation(across(rng), 0.0f, across(rng))));
+				XMStoreFloat4x4(&item.TexTransform, XMMatrixScaling(2.0f, 2.0f, 1.0f));
+				item.LocalBounds = BoundingBox(XMFLOAT3(0.0f, 2.0f, 0.0f), XMFLOAT3(1.0f + i % 3, 2.0f, 1.0f));
+				item.LocalBounds.Transform(item.Bounds, XMLoadFloat4x4(&item.World));
+				item.Layer = i % 4;
+				item.Dirty = 0;
+				item.Lod = 0;
+				boxes[i] = item.Bounds;
+				ids[i] = i;
+			}
+			std::vector<XMFLOAT3> lights(lightCount);
+			for (auto& light : lights)
+				light = XMFLOAT3(across(rng), 10.0f, across(rng));
+
+			BoundsTree tree(1.0f);
+			tree.Build(boxes.data(), ids.data(), itemCount);
+			std::vector<Constants> objectCB(itemCount);
+			std::vector<LightViews> lightCB(lightCount);
+			std::vector<Range> ranges;
+			std::vector<uint32_t> visibleIndices, visible[4];
+
+			// As many loads in flight as the frame has threads.
+			std::atomic<unsigned> loadsInFlight{ 0 };
+			ThreadPool pool(threads - 1);
+			ThreadPool loadPool(threads);
+			ThreadPool& loads = run.second == LoadsOnOwnPool ? loadPool : pool;
+			double objectsMs = 0.0, treeMs = 0.0, visibleMs = 0.0, mergeMs = 0.0, lightsMs = 0.0;
+			uint64_t hash = 1469598103934665603ull;
+			auto mix = [&](const void* data, size_t size)
+			{
+				for (size_t b = 0; b < size; b++)
+					hash = (hash ^ ((const uint8_t*)data)[b]) * 1099511628211ull;
+			};
+			for (int f = 0; f < frames; f++)
+			{
+				for (size_t k = 0; k < itemCount / 10; k++)
+				{
+					Item& item = items[rng() % itemCount];
+					item.World._41 += step(rng);
+					item.World._43 += step(rng);
+					item.Dirty = 3;
+				}
+				float a = XM_2PI * f / frames;
+				frame.Position = XMFLOAT3(600.0f * std::cos(a), 40.0f, 600.0f * std::sin(a));
+				frame.Look = XMFLOAT3(-std::sin(a), -0.05f, std::cos(a));
+				BoundingFrustum frustum = frame.Frustum();
+
+				for (unsigned n = loadsInFlight; run.second != NoLoads && n < threads; n++)
+				{
+					loadsInFlight++;
+					loads.Submit([&loadsInFlight]()
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds(20));
+						loadsInFlight--;
+					});
+				}
+
+				auto start = Clock::now();
+				pool.ParallelRanges(itemCount, grainSize, ranges, [&](size_t begin, size_t end, Range& range)
+				{
+					range.Moved.clear();
+					for (size_t i = begin; i < end; i++)
+					{
+						Item& item = items[i];
+						if (item.Dirty <= 0)
+							continue;
+
+						XMMATRIX world = XMLoadFloat4x4(&item.World);
+						item.LocalBounds.Transform(item.Bounds, world);
+						range.Moved.push_back((uint32_t)i);
+
+						Constants constants;
+						XMStoreFloat4x4(&constants.World, XMMatrixTranspose(world));
+						XMStoreFloat4x4(&constants.TexTransform, XMMatrixTranspose(XMLoadFloat4x4(&item.TexTransform)));
+						objectCB[i] = constants;
+						item.Dirty--;
+					}
+				});
+				objectsMs += MsSince(start);
+
+				start = Clock::now();
+				for (auto& range : ranges)
+					for (uint32_t i : range.Moved)
+						tree.Move(i, items[i].Bounds);
+				tree.Query(frustum, visibleIndices);
+				std::sort(visibleIndices.begin(), visibleIndices.end());
+				treeMs += MsSince(start);
+
+				start = Clock::now();
+				pool.ParallelRanges(visibleIndices.size(), grainSize, ranges, [&](size_t begin, size_t end, Range& range)
+				{
+					for (auto& list : range.Visible)
+						list.clear();
+					for (size_t k = begin; k < end; k++)
+					{
+						Item& item = items[visibleIndices[k]];
+						range.Visible[item.Layer].push_back(visibleIndices[k]);
+
+						BoundingSphere sphere;
+						BoundingSphere::CreateFromBoundingBox(sphere, item.Bounds);
+						item.Lod = SelectLod(lod, LodProjectedRadius(sphere, frame.Position, projectionScale), 3, item.Lod);
+					}
+				});
+				visibleMs += MsSince(start);
+
+				start = Clock::now();
+				for (auto& list : visible)
+					list.clear();
+				for (auto& range : ranges)
+					for (int layer = 0; layer < 4; layer++)
+						visible[layer].insert(visible[layer].end(), range.Visible[layer].begin(), range.Visible[layer].end());
+				mergeMs += MsSince(start);
+
+				// Every light moves a little and needs its six views anew.
+				start = Clock::now();
+				pool.ParallelFor(lightCount, lightGrainSize, [&](size_t l)
+				{
+					static const XMVECTOR directions[6] =
+					{
+						XMVectorSet(1.0f, 0.0f, 0.0f, 0.0f), XMVectorSet(-1.0f, 0.0f, 0.0f, 0.0f),
+						XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMVectorSet(0.0f, -1.0f, 0.0f, 0.0f),
+						XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f), XMVectorSet(0.0f, 0.0f, -1.0f, 0.0f)
+					};
+					static const XMVECTOR ups[6] =
+					{
+						XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f),
+						XMVectorSet(0.0f, 0.0f, -1.0f, 0.0f), XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f),
+						XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f)
+					};
+					XMMATRIX T(
+						0.5f, 0.0f, 0.0f, 0.0f,
+						0.0f, -0.5f, 0.0f, 0.0f,
+						0.0f, 0.0f, 1.0f, 0.0f,
+						0.5f, 0.5f, 0.0f, 1.0f);
+					XMVECTOR lightPos = XMVectorAdd(XMLoadFloat3(&lights[l]), XMVectorSet(0.0f, 0.01f * f, 0.0f, 0.0f));
+					XMMATRIX lightProj = XMMatrixPerspectiveFovLH(XM_PIDIV2, 1.0f, 0.1f, 50.0f);
+					for (int i = 0; i < 6; i++)
+					{
+						XMMATRIX S = XMMatrixMultiply(XMMatrixLookAtLH(lightPos, XMVectorAdd(lightPos, directions[i]), ups[i]), lightProj);
+						XMStoreFloat4x4(&lightCB[l].ViewProj[i], XMMatrixTranspose(S));
+						XMStoreFloat4x4(&lightCB[l].ShadowTransform[i], XMMatrixTranspose(XMMatrixMultiply(S, T)));
+					}
+				});
+				lightsMs += MsSince(start);
+
+				for (auto& list : visible)
+					mix(list.data(), list.size() * sizeof(uint32_t));
+			}
+			mix(objectCB.data(), objectCB.size() * sizeof(Constants));
+			mix(lightCB.data(), lightCB.size() * sizeof(LightViews));
+
+			double totalMs = (objectsMs + treeMs + visibleMs + mergeMs + lightsMs) / frames;
+			if (threads == 1)
+			{
+				singleThreadMs = totalMs;
+				referenceHash = hash;
+			}
+			const char* loadNames[] = { "", "  loads on the frame's pool", "  loads on their own pool" };
+			sprintf_s(line, "frameupdate: %2u threads %7.3f ms (x%.2f)  objects %.3f  tree %.3f  visible %.3f  merge %.3f  lights %.3f  %s%s",
+				threads, totalMs, singleThreadMs / totalMs, objectsMs / frames, treeMs / frames, visibleMs / frames, mergeMs / frames, lightsMs / frames,
+				hash == referenceHash ? "same as 1 thread" : "DIFFERS from 1 thread", loadNames[run.second]);
+			BenchmarkLog(line);
+		}
+	}
+
+	// Level selection for 50k items of very different sizes, seen from a camera that
+	// flies forward and from one that hovers in place, both with a small shake like a
+	// hand held camera. Switches per frame by distance (the old rule, level 1 beyond
+	// 150 units) and by projected size without and with hysteresis, with the share of
+	// items at each level for a few biases and the time per item. With hysteresis a
+	// level may lag but never by more than one.
+	void BenchmarkLod()
+	{
+		using namespace DirectX;
+
+		const size_t count = 50000;
+		const uint32_t levels = 4;
+		const int frames = 600;
+
+		std::mt19937 rng(48);
+		std::uniform_real_distribution<float> across(-1000.0f, 1000.0f);
+		std::uniform_real_distribution<float> logRadius(std::log(0.5f), std::log(20.0f));
+		std::vector<BoundingSphere> spheres(count);
+		for (auto& sphere : spheres)
+			sphere = BoundingSphere(XMFLOAT3(across(rng), 0.0f, across(rng)), std::exp(logRadius(rng)));
+
+		const float projectionScale = LodProjectionScale(0.25f * XM_PI, 1080.0f);
+		std::vector<XMFLOAT3> flying(frames), hovering(frames);
+		for (int f = 0; f < frames; f++)
+		{
+			XMFLOAT3 shake(0.3f * std::sin(f * 1.7f), 2.0f + 0.3f * std::sin(f * 2.3f), 0.3f * std::sin(f * 3.1f));
+			flying[f] = XMFLOAT3(shake.x, shake.y, shake.z - 900.0f + 3.0f * f);
+			hovering[f] = shake;
+		}
+		std::pair<const char*, const std::vector<XMFLOAT3>*> paths[] = { { "flying", &flying }, { "hovering", &hovering } };
+
+		char line[256];
+		std::vector<uint32_t> current(count);
+		const float hystereses[] = { 0.0f, 0.15f };
+		const float biases[] = { -1.0f, 0.0f, 1.0f, 2.0f };
+		for (auto& path : paths)
+		{
+			const std::vector<XMFLOAT3>& eyes = *path.second;
+
+			// The old rule.
+			size_t switches = 0;
+			for (int f = 0; f < frames; f++)
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					float dx = spheres[i].Center.x - eyes[f].x, dy = spheres[i].Center.y - eyes[f].y, dz = spheres[i].Center.z - eyes[f].z;
+					uint32_t level = std::sqrt(dx * dx + dy * dy + dz * dz) > 150.0f ? 1 : 0;
+					switches += f > 0 && level != current[i];
+					current[i] = level;
+				}
+			}
+			sprintf_s(line, "lod: %s, distance 150, 2 levels: %.1f switches a frame", path.first, (double)switches / (frames - 1));
+			BenchmarkLog(line);
+
+			for (float hysteresis : hystereses)
+			{
+				for (float bias : biases)
+				{
+					LodSettings settings;
+					settings.Hysteresis = hysteresis;
+					settings.Bias = bias;
+					LodSettings direct = settings;
+					direct.Hysteresis = 0.0f;
+
+					size_t perLevel[levels] = {};
+					size_t lagging = 0, far = 0;
+					switches = 0;
+					double ms = 0.0;
+					std::fill(current.begin(), current.end(), 0);
+					for (int f = 0; f < frames; f++)
+					{
+						auto start = Clock::now();
+						for (size_t i = 0; i < count; i++)
+						{
+							uint32_t level = SelectLod(settings, LodProjectedRadius(spheres[i], eyes[f], projectionScale), levels, current[i]);
+							switches += f > 0 && level != current[i];
+							current[i] = level;
+						}
+						ms += MsSince(start);
+
+						for (size_t i = 0; i < count; i++)
+						{
+							uint32_t level = SelectLod(direct, LodProjectedRadius(spheres[i], eyes[f], projectionScale), levels, 0);
+							perLevel[current[i]]++;
+							lagging += level != current[i];
+							far += level + 1 < current[i] || current[i] + 1 < level;
+						}
+					}
+
+					double total = (double)count * frames;
+					sprintf_s(line, "lod: %s, hysteresis %.2f bias %+.0f: %7.1f switches a frame, levels %4.1f%% %4.1f%% %4.1f%% %4.1f%%, %5.2f%% lagging, %zu by more than a level, %.1f ns an item",
+						path.first, hysteresis, bias, (double)switches / (frames - 1), 100.0 * perLevel[0] / total, 100.0 * perLevel[1] / total, 100.0 * perLevel[2] / total,
+						100.0 * perLevel[3] / total, 100.0 * lagging / total, far, ms * 1e6 / total);
+					BenchmarkLog(line);
+				}
+			}
+		}
+	}
+
+	// Shadow map views the way DX12App::UpdateLightCBs sets them up: four cascades
+	// of a directional light around the eye, the six cube faces of a point light and
+	// a spot light's map.
+	void DirectionalCascades(const DirectX::XMFLOAT3& eye, const DirectX::XMFLOAT3& direction, DirectX::XMFLOAT4X4* viewProj)
+	{
+		using namespace DirectX;
+
+		const float radiuses[4] = { 100, 150, 200, 500 };
+		XMVECTOR target = XMLoadFloat3(&eye);
+		XMVECTOR lightDir = XMLoadFloat3(&direction);
+		for (int i = 0; i < 4; i++)
+		{
+			XMMATRIX view = XMMatrixLookAtLH(target - 2.0f * radiuses[i] * lightDir, target, XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+			XMFLOAT3 center;
+			XMStoreFloat3(&center, XMVector3TransformCoord(target, view));
+			XMMATRIX proj = XMMatrixOrthographicOffCenterLH(center.x - radiuses[i], center.x + radiuses[i],
+				center.y - radiuses[i], center.y + radiuses[i], center.z - radiuses[i], center.z + radiuses[i]);
+			XMStoreFloat4x4(&viewProj[i], view * proj);
+		}
+	}
+
+	void CubeFaces(const DirectX::XMFLOAT3& position, float range, DirectX::XMFLOAT4X4* viewProj)
+	{
+		using namespace DirectX;
+
+		const XMFLOAT3 directions[6] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+		const XMFLOAT3 ups[6] = { { 0, 1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 }, { 0, 1, 0 }, { 0, 1, 0 } };
+		XMMATRIX proj = XMMatrixPerspectiveFovLH(XM_PIDIV2, 1.0f, 0.1f, range);
+		XMVECTOR eye = XMLoadFloat3(&position);
+		for (int i = 0; i < 6; i++)
+			XMStoreFloat4x4(&viewProj[i], XMMatrixLookToLH(eye, XMLoadFloat3(&directions[i]), XMLoadFloat3(&ups[i])) * proj);
+	}
+
+	// Casters of 100k items for a directional light, a point light and a spot light
+	// following the camera around a circle, against drawing every item into every view
+	// as before. Each view's list is checked against testing all boxes on its own; the
+	// cascades' lists include the items between them and the light.
+	void BenchmarkShadowCasters()
+	{
+		using namespace DirectX;
+
+		const int frames = 60;
+		const uint32_t count = 100000;
+		const float worldSize = 4000.0f;
+
+		std::mt19937 rng(49);
+		std::uniform_real_distribution<float> across(-0.5f * worldSize, 0.5f * worldSize);
+		std::normal_distribution<float> town(0.0f, 60.0f);
+		std::uniform_real_distribution<float> size(0.5f, 5.0f);
+		std::vector<XMFLOAT3> towns(count / 500);
+		for (auto& t : towns)
+			t = XMFLOAT3(across(rng), 0.0f, across(rng));
+		std::vector<BoundingBox> boxes(count);
+		std::vector<uint32_t> items(count);
+		// A few items don't cast, like the sky and the terrain in the app.
+		std::vector<uint8_t> casts(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const XMFLOAT3& t = towns[rng() % towns.size()];
+			boxes[i] = BoundingBox(XMFLOAT3(t.x + town(rng), std::fabs(town(rng)) * 0.2f, t.z + town(rng)), XMFLOAT3(size(rng), size(rng), size(rng)));
+			items[i] = i;
+			casts[i] = rng() % 16 != 0;
+		}
+		BoundsTree tree(0.5f);
+		tree.Build(boxes.data(), items.data(), count);
+		size_t casting = 0;
+		for (uint8_t c : casts)
+			casting += c;
+
+		const char* names[3] = { "directional", "point", "spot" };
+		const uint32_t viewCounts[3] = { 4, 6, 1 };
+		const XMFLOAT3 sun(0.57735f, -0.57735f, 0.57735f);
+		ShadowCasters casters[3];
+		std::vector<double> perView[3];
+		for (int l = 0; l < 3; l++)
+			perView[l].assign(viewCounts[l], 0.0);
+		double groups[3] = {}, towardLight = 0.0, cullMs = 0.0;
+		size_t mismatches = 0;
+
+		for (int f = 0; f < frames; f++)
+		{
+			const XMFLOAT3& t = towns[f % towns.size()];
+			XMFLOAT3 eye(t.x, 20.0f, t.z);
+			XMFLOAT4X4 viewProj[3][ShadowCasters::MaxViews];
+			DirectionalCascades(eye, sun, viewProj[0]);
+			CubeFaces(XMFLOAT3(eye.x + 10.0f, 10.0f, eye.z), 50.0f, viewProj[1]);
+			XMMATRIX spotView = XMMatrixLookToLH(XMVectorSet(eye.x, 60.0f, eye.z - 20.0f, 1.0f), XMVectorSet(0.0f, -0.7071f, 0.7071f, 0.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+			XMStoreFloat4x4(&viewProj[2][0], spotView * XMMatrixPerspectiveFovLH(XM_PI / 2.5f, 1.0f, 10.0f, 500.0f));
+
+			ShadowCasterView views[3][ShadowCasters::MaxViews];
+			auto start = Clock::now();
+			for (int l = 0; l < 3; l++)
+			{
+				for (uint32_t v = 0; v < viewCounts[l]; v++)
+					views[l][v] = MakeShadowCasterView(XMLoadFloat4x4(&viewProj[l][v]), l == 0);
+				casters[l].Cull(tree, views[l], viewCounts[l], casts);
+			}
+			cullMs += MsSince(start);
+
+			for (int l = 0; l < 3; l++)
+			{
+				groups[l] += casters[l].Groups().size();
+				for (uint32_t v = 0; v < viewCounts[l]; v++)
+				{
+					const ShadowCasterView& view = views[l][v];
+					std::vector<uint32_t> expected;
+					for (uint32_t i = 0; i < count; i++)
+					{
+						bool outside = !casts[i];
+						for (uint32_t p = 0; p < view.PlaneCount && !outside; p++)
+						{
+							const XMFLOAT4& n = view.Planes[p];
+							const BoundingBox& b = boxes[i];
+							float distance = n.x * b.Center.x + n.y * b.Center.y + n.z * b.Center.z + n.w;
+							float radius = std::fabs(n.x) * b.Extents.x + std::fabs(n.y) * b.Extents.y + std::fabs(n.z) * b.Extents.z;
+							outside = distance - radius > 0.0f;
+						}
+						if (!outside)
+							expected.push_back(i);
+					}
+					if (expected != casters[l].View(v))
+						mismatches++;
+					perView[l][v] += casters[l].View(v).size();
+				}
+			}
+
+			// Casters of the first cascade that its own near plane would have clipped.
+			ShadowCasterView closed = MakeShadowCasterView(XMLoadFloat4x4(&viewProj[0][0]), false);
+			std::vector<uint32_t> inside;
+			tree.Query(closed.Planes, closed.PlaneCount, inside);
+			size_t closedCasters = 0;
+			for (uint32_t i : inside)
+				closedCasters += casts[i];
+			towardLight += casters[0].View(0).size() - closedCasters;
+		}
+
+		char line[256];
+		double drawnBefore = 0.0, drawnAfter = 0.0;
+		for (int l = 0; l < 3; l++)
+		{
+			std::string counts;
+			for (uint32_t v = 0; v < viewCounts[l]; v++)
+			{
+				char number[32];
+				sprintf_s(number, " %7.1f", perView[l][v] / frames);
+				counts += number;
+				drawnAfter += perView[l][v] / frames;
+			}
+			drawnBefore += (double)casting * viewCounts[l];
+			sprintf_s(line, "shadowcasters: %-11s%s  casters a view, %.1f view masks", names[l], counts.c_str(), groups[l] / frames);
+			BenchmarkLog(line);
+		}
+		sprintf_s(line, "shadowcasters: %zu casting items, %.0f item views drawn a frame instead of %.0f, %.1f in cascade 0 toward the light",
+			casting, drawnAfter, drawnBefore, towardLight / frames);
+		BenchmarkLog(line);
+		sprintf_s(line, "shadowcasters: %.3f ms a frame for all lights, %zu views differ from testing every box", cullMs / frames, mismatches);
+		BenchmarkLog(line);
+	}
+
+	// Clustered light assignment of 256 to 16k point lights scattered around a camera
+	// circling a town, binned with 1 to all threads. Sample pixels are checked against
+	// every light: each light whose sphere holds a pixel's point must be in the list of
+	// the pixel's cluster, found the way the resolve pass finds it. The lists' lengths
+	// are compared with the lights that really reach the pixel, and with the light
+	// volumes covering it, each of which read the G-buffer again.
+	void BenchmarkLightClusters()
+	{
+		using namespace DirectX;
+
+		const int frames = 32;
+		const int checkedFrames = 4;
+		const int samples = 4000;
+
+		CameraPathFrame frame;
+		frame.Up = XMFLOAT3(0.0f, 1.0f, 0.0f);
+		frame.FovY = 0.25f * XM_PI;
+		frame.Aspect = 16.0f / 9.0f;
+		frame.NearZ = 1.0f;
+		frame.FarZ = 1000.0f;
+		frame.ViewportHeight = 1080.0f;
+		std::vector<XMFLOAT4X4> views(frames);
+		for (int f = 0; f < frames; f++)
+		{
+			float a = XM_2PI * f / frames;
+			frame.Position = XMFLOAT3(150.0f * std::cos(a), 10.0f, 150.0f * std::sin(a));
+			frame.Look = XMFLOAT3(-std::cos(a), -0.05f, -std::sin(a));
+			XMStoreFloat4x4(&views[f], frame.View());
+		}
+
+		LightClusterSettings settings;
+		settings.Near = frame.NearZ;
+		settings.Far = frame.FarZ;
+		LightClusters clusters;
+		clusters.Reset(settings, frame.FovY, frame.Aspect);
+		const float tanY = std::tan(0.5f * frame.FovY);
+		const float tanX = tanY * frame.Aspect;
+
+		char line[256];
+		unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (uint32_t count = 256; count <= 16384; count *= 4)
+		{
+			// Lamps around the town, a few metres up, reaching 2 to 20 metres.
+			std::mt19937 rng(50);
+			std::uniform_real_distribution<float> across(-250.0f, 250.0f);
+			std::uniform_real_distribution<float> height(0.5f, 8.0f);
+			std::uniform_real_distribution<float> reach(2.0f, 20.0f);
+			std::vector<BoundingSphere> lights(count);
+			for (auto& light : lights)
+				light = BoundingSphere(XMFLOAT3(across(rng), height(rng), across(rng)), reach(rng));
+
+			uint64_t firstHash = 0;
+			bool deterministic = true;
+			for (unsigned threads = 1; ; threads *= 2)
+			{
+				if (threads > maxThreads)
+					threads = maxThreads;
+				ThreadPool pool(threads - 1);
+
+				double binned = 0.0, indices = 0.0, maxPerCluster = 0.0;
+				uint64_t hash = 1469598103934665603ull;
+				auto start = Clock::now();
+				for (int f = 0; f < frames; f++)
+				{
+					clusters.Build(XMLoadFloat4x4(&views[f]), lights.data(), count, pool);
+					const LightClusters::Stats& stats = clusters.GetStats();
+					binned += stats.Binned;
+					indices += stats.Indices;
+					maxPerCluster = std::max(maxPerCluster, (double)stats.MaxPerCluster);
+					for (const LightCluster& c : clusters.Clusters())
+						hash = (hash ^ c.Count) * 1099511628211ull;
+					for (uint32_t i : clusters.Indices())
+						hash = (hash ^ i) * 1099511628211ull;
+				}
+				double ms = MsSince(start) / frames;
+				if (threads == 1)
+					firstHash = hash;
+				deterministic = deterministic && hash == firstHash;
+
+				sprintf_s(line, "lightclusters: %5u lights, %2u threads: %6.3f ms a frame, %6.0f in view, %7.0f indices, up to %4.0f in a cluster",
+					count, threads, ms, binned / frames, indices / frames, maxPerCluster);
+				BenchmarkLog(line);
+				if (threads == maxThreads)
+					break;
+			}
+
+			// Sample pixels at random depths of the checked frames.
+			ThreadPool pool;
+			std::mt19937 sampleRng(51);
+			std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+			size_t missed = 0, reaching = 0, listed = 0, covering = 0;
+			for (int f = 0; f < checkedFrames; f++)
+			{
+				XMMATRIX view = XMLoadFloat4x4(&views[f * frames / checkedFrames]);
+				clusters.Build(view, lights.data(), count, pool);
+				std::vector<XMFLOAT3> viewLights(count);
+				for (uint32_t l = 0; l < count; l++)
+					XMStoreFloat3(&viewLights[l], XMVector3TransformCoord(XMLoadFloat3(&lights[l].Center), view));
+
+				for (int i = 0; i < samples; i++)
+				{
+					float u = unit(sampleRng), v = unit(sampleRng);
+					float z = settings.Near * std::pow(settings.Far / settings.Near, unit(sampleRng));
+					XMFLOAT3 p((2.0f * u - 1.0f) * tanX * z, (1.0f - 2.0f * v) * tanY * z, z);
+					uint32_t x = std::min((uint32_t)(u * settings.TilesX), settings.TilesX - 1);
+					uint32_t y = std::min((uint32_t)(v * settings.TilesY), settings.TilesY - 1);
+					const LightCluster& c = clusters.Clusters()[clusters.ClusterIndex(x, y, clusters.Slice(z))];
+					const uint32_t* list = clusters.Indices().data() + c.Offset;
+					listed += c.Count;
+
+					// The ray through the pixel is (u', v', 1) t.
+					XMFLOAT3 ray(p.x / z, p.y / z, 1.0f);
+					float rayLengthSq = ray.x * ray.x + ray.y * ray.y + 1.0f;
+					for (uint32_t l = 0; l < count; l++)
+					{
+						const XMFLOAT3& center = viewLights[l];
+						float radiusSq = lights[l].Radius * lights[l].Radius;
+						float dx = p.x - center.x, dy = p.y - center.y, dz = p.z - center.z;
+						if (dx * dx + dy * dy + dz * dz <= radiusSq)
+						{
+							reaching++;
+							if (!std::binary_search(list, list + c.Count, l))
+								missed++;
+						}
+						float along = (center.x * ray.x + center.y * ray.y + center.z) / rayLengthSq;
+						float ax = ray.x * along - center.x, ay = ray.y * along - center.y, az = along - center.z;
+						if (along > 0.0f && ax * ax + ay * ay + az * az <= radiusSq)
+							covering++;
+					}
+				}
+			}
+			double pixels = (double)checkedFrames * samples;
+			sprintf_s(line, "lightclusters: %5u lights: %.2f listed and %.2f reaching a pixel, %zu missed, %.2f light volumes over it, %s",
+				count, listed / pixels, reaching / pixels, missed, covering / pixels, deterministic ? "same lists on all threads" : "LISTS DIFFER BY THREADS");
+			BenchmarkLog(line);
+		}
+	}
+
+	struct Benchmark
+	{
+		const char* Name;
+		void(*Run)();
+	};
+
+	const Benchmark gBenchmarks[] =
+	{
+		{ "transcode", BenchmarkTranscode },
+		{ "ddsmiptail", BenchmarkDdsMipTail },
+		{ "texturecache", BenchmarkTextureCache },
+		{ "textureresidency", BenchmarkTextureResidency },
+		{ "quadtree", BenchmarkQuadtree },
+		{ "terrainlod", BenchmarkTerrainLod },
+		{ "terrainbounds", BenchmarkTerrainBounds },
+		{ "terrainpaging", BenchmarkTerrainPaging },
+		{ "terrainhorizon", BenchmarkTerrainHorizon },
+		{ "terrainselect", BenchmarkTerrainSelect },
+		{ "terrainheights", BenchmarkTerrainHeights },
+		{ "terraininstances", BenchmarkTerrainInstances },
+		{ "terrainpyramid", BenchmarkTerrainPyramid },
+		{ "terrainraycast", BenchmarkTerrainRaycast },
+		{ "terraindetail", BenchmarkTerrainDetail },
+		{ "vegetation", BenchmarkVegetation },
+		{ "boxcull", BenchmarkBoxCull },
+		{ "boundstree", BenchmarkBoundsTree },
+		{ "occlusion", BenchmarkOcclusion },
+		{ "frameupdate", BenchmarkFrameUpdate },
+		{ "lod", BenchmarkLod },
+		{ "shadowcasters", BenchmarkShadowCasters },
+		{ "lightclusters", BenchmarkLightClusters },
+	};
+}
+
+void BenchmarkLog(const std::string& line)
+{
+	OutputDebugStringA((line + "\n").c_str());
+
+	std::ofstream log("benchmarks.log", std::ios::app);
+	log << line << "\n";
+}
+
+bool RunBenchmarks(const std::string& commandLine)
+{
+	std::istringstream args(commandLine);
+	std::string arg, name;
+	bool requested = false;
+	while (args >> arg)
+	{
+		if (arg == "-benchmark")
+		{
+			requested = true;
+			if (!(args >> name))
+				name = "all";
+		}
+	}
+
+	if (!requested)
+		return false;
+
+	HRESULT hrCo = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	for (auto& benchmark : gBenchmarks)
+	{
+		if (name == "all" || name == benchmark.Name)
+			benchmark.Run();
+	}
+	if (SUCCEEDED(hrCo))
+		CoUninitialize();
+
+	return true;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+
+// Headless benchmarks that run without creating a window or a D3D device.
+// Started with "-benchmark <name>" ("-benchmark all" runs every one) on the command line.
+// Results go to the debugger output and are appended to benchmarks.log in the working directory.
+
+// Returns false when the command line doesn't ask for a benchmark.
+bool RunBenchmarks(const std::string& commandLine);
+
+void BenchmarkLog(const std::string& line);
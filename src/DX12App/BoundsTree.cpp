@@ -0,0 +1,565 @@
+#include "BoundsTree.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace DirectX;
+
+namespace
+{
+	BoundingBox Merge(const BoundingBox& a, const BoundingBox& b)
+	{
+		XMVECTOR ca = XMLoadFloat3(&a.Center), ea = XMLoadFloat3(&a.Extents);
+		XMVECTOR cb = XMLoadFloat3(&b.Center), eb = XMLoadFloat3(&b.Extents);
+		XMVECTOR lo = XMVectorMin(XMVectorSubtract(ca, ea), XMVectorSubtract(cb, eb));
+		XMVECTOR hi = XMVectorMax(XMVectorAdd(ca, ea), XMVectorAdd(cb, eb));
+		BoundingBox merged;
+		XMStoreFloat3(&merged.Center, XMVectorScale(XMVectorAdd(lo, hi), 0.5f));
+		XMStoreFloat3(&merged.Extents, XMVectorScale(XMVectorSubtract(hi, lo), 0.5f));
+		return merged;
+	}
+
+	// Surface area, up to a constant factor.
+	float Area(const BoundingBox& box)
+	{
+		const XMFLOAT3& e = box.Extents;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	bool Encloses(const BoundingBox& outer, const BoundingBox& inner)
+	{
+		return std::fabs(inner.Center.x - outer.Center.x) + inner.Extents.x <= outer.Extents.x &&
+			std::fabs(inner.Center.y - outer.Center.y) + inner.Extents.y <= outer.Extents.y &&
+			std::fabs(inner.Center.z - outer.Center.z) + inner.Extents.z <= outer.Extents.z;
+	}
+
+	float Axis(const XMFLOAT3& v, int axis)
+	{
+		return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+	}
+
+	// Convex volume of up to six planes; p is outside a plane when N.p + D > 0.
+	struct PlaneVolume
+	{
+		const XMFLOAT4* Planes;
+		uint32_t Count;
+
+		ContainmentType Contains(const BoundingBox& box) const
+		{
+			ContainmentType containment = CONTAINS;
+			for (uint32_t p = 0; p < Count; p++)
+			{
+				const XMFLOAT4& n = Planes[p];
+				float distance = n.x * box.Center.x + n.y * box.Center.y + n.z * box.Center.z + n.w;
+				float radius = std::fabs(n.x) * box.Extents.x + std::fabs(n.y) * box.Extents.y + std::fabs(n.z) * box.Extents.z;
+				if (distance - radius > 0.0f)
+					return DISJOINT;
+				if (distance + radius > 0.0f)
+					containment = INTERSECTS;
+			}
+			return containment;
+		}
+
+		bool Intersects(const BoundingBox& box) const { return Contains(box) != DISJOINT; }
+	};
+
+	// Split candidates per axis of a Build step.
+	const int BuildBins = 12;
+	// Deeper than this Build splits at the median, bounding its recursion.
+	const int MaxSahDepth = 48;
+}
+
+void BoundsTree::Clear()
+{
+	mNodes.clear();
+	mRoot = Null;
+	mFreeList = Null;
+	mLeafCount = 0;
+}
+
+uint32_t BoundsTree::Allocate()
+{
+	uint32_t node = mFreeList;
+	if (node != Null)
+		mFreeList = mNodes[node].Item;
+	else
+	{
+		node = (uint32_t)mNodes.size();
+		mNodes.emplace_back();
+	}
+
+	Node& n = mNodes[node];
+	n.Parent = Null;
+	n.Children[0] = n.Children[1] = Null;
+	n.Item = Null;
+	n.Height = 0;
+	return node;
+}
+
+void BoundsTree::Free(uint32_t node)
+{
+	mNodes[node].Item = mFreeList;
+	mNodes[node].Height = -1;
+	mFreeList = node;
+}
+
+void BoundsTree::Grow(BoundingBox& box) const
+{
+	box.Extents.x += mMargin;
+	box.Extents.y += mMargin;
+	box.Extents.z += mMargin;
+}
+
+void BoundsTree::Build(const BoundingBox* boxes, const uint32_t* items, size_t count)
+{
+	Clear();
+	if (count == 0)
+		return;
+
+	mNodes.reserve(2 * count - 1);
+	mNodes.resize(count);
+	std::vector<uint32_t> order(count);
+	std::vector<XMFLOAT3> centers(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		Node& leaf = mNodes[i];
+		leaf.Tight = boxes[i];
+		leaf.Box = boxes[i];
+		Grow(leaf.Box);
+		leaf.Parent = Null;
+		leaf.Children[0] = leaf.Children[1] = Null;
+		leaf.Item = items[i];
+		leaf.Height = 0;
+		order[i] = (uint32_t)i;
+		centers[i] = boxes[i].Center;
+	}
+	mLeafCount = count;
+
+	// Nodes are made depth first; the stack holds ranges of order still to split and
+	// where their subtree's root goes.
+	struct Range
+	{
+		size_t First;
+		size_t Count;
+		uint32_t Parent;
+		int Side;
+		int Depth;
+	};
+	std::vector<Range> pending;
+	pending.push_back({ 0, count, Null, 0, 0 });
+	while (!pending.empty())
+	{
+		Range r = pending.back();
+		pending.pop_back();
+
+		uint32_t node;
+		if (r.Count == 1)
+		{
+			node = order[r.First];
+		}
+		else
+		{
+			uint32_t* first = &order[r.First];
+			uint32_t* last = first + r.Count;
+
+			XMFLOAT3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			for (uint32_t* i = first; i != last; i++)
+			{
+				const XMFLOAT3& c = centers[*i];
+				lo = XMFLOAT3(std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z));
+				hi = XMFLOAT3(std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z));
+			}
+
+			// Binned SAH over the centers on all three axes: the plane after bin b
+			// costs the areas of both sides times their item counts.
+			int bestAxis = -1, bestBin = 0;
+			float bestCost = FLT_MAX;
+			if (r.Depth < MaxSahDepth)
+			{
+				for (int axis = 0; axis < 3; axis++)
+				{
+					float min = Axis(lo, axis), extent = Axis(hi, axis) - min;
+					if (extent <= 0.0f)
+						continue;
+					float scale = BuildBins / extent;
+
+					BoundingBox bounds[BuildBins];
+					size_t counts[BuildBins] = {};
+					for (uint32_t* i = first; i != last; i++)
+					{
+						int bin = std::min((int)((Axis(centers[*i], axis) - min) * scale), BuildBins - 1);
+						bounds[bin] = counts[bin]++ ? Merge(bounds[bin], boxes[*i]) : boxes[*i];
+					}
+
+					float rightArea[BuildBins];
+					size_t rightCount[BuildBins];
+					BoundingBox right;
+					size_t n = 0;
+					for (int b = BuildBins - 1; b > 0; b--)
+					{
+						if (counts[b])
+							right = n ? Merge(right, bounds[b]) : bounds[b];
+						n += counts[b];
+						rightArea[b] = n ? Area(right) : 0.0f;
+						rightCount[b] = n;
+					}
+
+					BoundingBox left;
+					n = 0;
+					for (int b = 0; b < BuildBins - 1; b++)
+					{
+						if (counts[b])
+							left = n ? Merge(left, bounds[b]) : bounds[b];
+						n += counts[b];
+						if (n == 0 || rightCount[b + 1] == 0)
+							continue;
+						float cost = Area(left) * n + rightArea[b + 1] * rightCount[b + 1];
+						if (cost < bestCost)
+						{
+							bestCost = cost;
+							bestAxis = axis;
+							bestBin = b;
+						}
+					}
+				}
+			}
+
+			uint32_t* middle;
+			if (bestAxis >= 0)
+			{
+				float min = Axis(lo, bestAxis), scale = BuildBins / (Axis(hi, bestAxis) - min);
+				middle = std::partition(first, last, [&](uint32_t i)
+				{
+					return std::min((int)((Axis(centers[i], bestAxis) - min) * scale), BuildBins - 1) <= bestBin;
+				});
+			}
+			else
+			{
+				// Centers all in one spot, or too deep: halves along the widest axis.
+				int axis = hi.x - lo.x >= hi.y - lo.y && hi.x - lo.x >= hi.z - lo.z ? 0 : hi.y - lo.y >= hi.z - lo.z ? 1 : 2;
+				middle = first + r.Count / 2;
+				std::nth_element(first, middle, last, [&](uint32_t a, uint32_t b)
+				{
+					return Axis(centers[a], axis) < Axis(centers[b], axis);
+				});
+			}
+
+			node = Allocate();
+			mNodes[node].Height = 1;
+			size_t leftCount = middle - first;
+			pending.push_back({ r.First + leftCount, r.Count - leftCount, node, 1, r.Depth + 1 });
+			pending.push_back({ r.First, leftCount, node, 0, r.Depth + 1 });
+		}
+
+		mNodes[node].Parent = r.Parent;
+		if (r.Parent == Null)
+			mRoot = node;
+		else
+			mNodes[r.Parent].Children[r.Side] = node;
+	}
+
+	// Inner nodes come after their parents, so boxes and heights are filled in
+	// backwards.
+	for (size_t n = mNodes.size(); n-- > count;)
+	{
+		Node& node = mNodes[n];
+		const Node& a = mNodes[node.Children[0]];
+		const Node& b = mNodes[node.Children[1]];
+		node.Box = Merge(a.Box, b.Box);
+		node.Height = 1 + std::max(a.Height, b.Height);
+	}
+}
+
+uint32_t BoundsTree::Insert(const BoundingBox& box, uint32_t item)
+{
+	uint32_t leaf = Allocate();
+	Node& node = mNodes[leaf];
+	node.Tight = box;
+	node.Box = box;
+	Grow(node.Box);
+	node.Item = item;
+	InsertLeaf(leaf);
+	mLeafCount++;
+	return leaf;
+}
+
+void BoundsTree::Remove(uint32_t leaf)
+{
+	RemoveLeaf(leaf);
+	Free(leaf);
+	mLeafCount--;
+}
+
+bool BoundsTree::Move(uint32_t leaf, const BoundingBox& box)
+{
+	Node& node = mNodes[leaf];
+	node.Tight = box;
+	if (Encloses(node.Box, box))
+		return false;
+
+	RemoveLeaf(leaf);
+	mNodes[leaf].Box = box;
+	Grow(mNodes[leaf].Box);
+	InsertLeaf(leaf);
+	return true;
+}
+
+void BoundsTree::InsertLeaf(uint32_t leaf)
+{
+	if (mRoot == Null)
+	{
+		mRoot = leaf;
+		mNodes[leaf].Parent = Null;
+		return;
+	}
+
+	// Walks down while making a new parent here would cost more than the cheaper
+	// child's share, the area added to every node on the way counted as well.
+	BoundingBox box = mNodes[leaf].Box;
+	uint32_t index = mRoot;
+	while (!mNodes[index].IsLeaf())
+	{
+		const Node& node = mNodes[index];
+		float area = Area(node.Box);
+		float combined = Area(Merge(node.Box, box));
+		float cost = 2.0f * combined;
+		float inherited = 2.0f * (combined - area);
+
+		float childCost[2];
+		for (int c = 0; c < 2; c++)
+		{
+			const Node& child = mNodes[node.Children[c]];
+			childCost[c] = Area(Merge(child.Box, box)) + inherited;
+			if (!child.IsLeaf())
+				childCost[c] -= Area(child.Box);
+		}
+
+		if (cost < childCost[0] && cost < childCost[1])
+			break;
+		index = node.Children[childCost[0] < childCost[1] ? 0 : 1];
+	}
+
+	uint32_t sibling = index;
+	uint32_t parent = Allocate();
+	uint32_t grandParent = mNodes[sibling].Parent;
+	Node& p = mNodes[parent];
+	p.Parent = grandParent;
+	p.Box = Merge(box, mNodes[sibling].Box);
+	p.Height = mNodes[sibling].Height + 1;
+	p.Children[0] = sibling;
+	p.Children[1] = leaf;
+	mNodes[sibling].Parent = parent;
+	mNodes[leaf].Parent = parent;
+
+	if (grandParent == Null)
+		mRoot = parent;
+	else
+		mNodes[grandParent].Children[mNodes[grandParent].Children[0] == sibling ? 0 : 1] = parent;
+
+	FixUpwards(grandParent);
+}
+
+void BoundsTree::RemoveLeaf(uint32_t leaf)
+{
+	if (leaf == mRoot)
+	{
+		mRoot = Null;
+		return;
+	}
+
+	uint32_t parent = mNodes[leaf].Parent;
+	uint32_t grandParent = mNodes[parent].Parent;
+	uint32_t sibling = mNodes[parent].Children[mNodes[parent].Children[0] == leaf ? 1 : 0];
+
+	mNodes[sibling].Parent = grandParent;
+	if (grandParent == Null)
+		mRoot = sibling;
+	else
+		mNodes[grandParent].Children[mNodes[grandParent].Children[0] == parent ? 0 : 1] = sibling;
+	Free(parent);
+	FixUpwards(grandParent);
+}
+
+void BoundsTree::FixUpwards(uint32_t index)
+{
+	while (index != Null)
+	{
+		index = Balance(index);
+		Node& node = mNodes[index];
+		const Node& a = mNodes[node.Children[0]];
+		const Node& b = mNodes[node.Children[1]];
+		node.Height = 1 + std::max(a.Height, b.Height);
+		node.Box = Merge(a.Box, b.Box);
+		index = node.Parent;
+	}
+}
+
+uint32_t BoundsTree::Balance(uint32_t iA)
+{
+	Node& A = mNodes[iA];
+	if (A.IsLeaf() || A.Height < 2)
+		return iA;
+
+	uint32_t iB = A.Children[0];
+	uint32_t iC = A.Children[1];
+	Node& B = mNodes[iB];
+	Node& C = mNodes[iC];
+	int balance = C.Height - B.Height;
+	if (balance >= -1 && balance <= 1)
+		return iA;
+
+	// The taller child takes A's place, A takes the taller child's shorter child and
+	// the taller child keeps the other.
+	uint32_t iUp = balance > 1 ? iC : iB;
+	uint32_t iStay = balance > 1 ? iB : iC;
+	int stay = balance > 1 ? 0 : 1;
+	Node& Up = mNodes[iUp];
+	uint32_t iF = Up.Children[0];
+	uint32_t iG = Up.Children[1];
+	Node& F = mNodes[iF];
+	Node& G = mNodes[iG];
+
+	Up.Children[0] = iA;
+	Up.Parent = A.Parent;
+	A.Parent = iUp;
+	if (Up.Parent == Null)
+		mRoot = iUp;
+	else
+		mNodes[Up.Parent].Children[mNodes[Up.Parent].Children[0] == iA ? 0 : 1] = iUp;
+
+	uint32_t iTall = F.Height > G.Height ? iF : iG;
+	uint32_t iShort = F.Height > G.Height ? iG : iF;
+	Node& Short = mNodes[iShort];
+	Node& Tall = mNodes[iTall];
+	Up.Children[1] = iTall;
+	A.Children[stay] = iStay;
+	A.Children[1 - stay] = iShort;
+	Short.Parent = iA;
+
+	const Node& Stay = mNodes[iStay];
+	A.Box = Merge(Stay.Box, Short.Box);
+	A.Height = 1 + std::max(Stay.Height, Short.Height);
+	Up.Box = Merge(A.Box, Tall.Box);
+	Up.Height = 1 + std::max(A.Height, Tall.Height);
+	return iUp;
+}
+
+void BoundsTree::Refit()
+{
+	if (mRoot == Null)
+		return;
+
+	// Depth first; a node is popped once before and once after its children.
+	std::vector<std::pair<uint32_t, bool>> stack;
+	stack.push_back({ mRoot, false });
+	while (!stack.empty())
+	{
+		auto entry = stack.back();
+		stack.pop_back();
+		Node& node = mNodes[entry.first];
+		if (node.IsLeaf())
+		{
+			node.Box = node.Tight;
+			Grow(node.Box);
+		}
+		else if (!entry.second)
+		{
+			stack.push_back({ entry.first, true });
+			stack.push_back({ node.Children[0], false });
+			stack.push_back({ node.Children[1], false });
+		}
+		else
+		{
+			node.Box = Merge(mNodes[node.Children[0]].Box, mNodes[node.Children[1]].Box);
+		}
+	}
+}
+
+float BoundsTree::Cost() const
+{
+	if (mRoot == Null)
+		return 0.0f;
+
+	double inner = 0.0;
+	for (auto& node : mNodes)
+		if (node.Height > 0)
+			inner += Area(node.Box);
+	return (float)(inner / std::max(Area(mNodes[mRoot].Box), FLT_MIN));
+}
+
+template <typename Volume>
+void BoundsTree::QueryVolume(const Volume& volume, std::vector<uint32_t>& items, BoundsTreeStats* stats) const
+{
+	items.clear();
+	BoundsTreeStats counted;
+	if (mRoot != Null)
+	{
+		std::vector<uint32_t> stack, inside;
+		stack.push_back(mRoot);
+		while (!stack.empty())
+		{
+			const Node& node = mNodes[stack.back()];
+			stack.pop_back();
+			counted.Tested++;
+
+			if (node.IsLeaf())
+			{
+				if (volume.Intersects(node.Tight))
+					items.push_back(node.Item);
+				continue;
+			}
+
+			ContainmentType containment = volume.Contains(node.Box);
+			if (containment == DISJOINT)
+				continue;
+			if (containment == INTERSECTS)
+			{
+				stack.push_back(node.Children[0]);
+				stack.push_back(node.Children[1]);
+				continue;
+			}
+
+			// Everything below is inside.
+			inside.push_back(node.Children[0]);
+			inside.push_back(node.Children[1]);
+			while (!inside.empty())
+			{
+				const Node& below = mNodes[inside.back()];
+				inside.pop_back();
+				if (below.IsLeaf())
+				{
+					items.push_back(below.Item);
+					counted.Taken++;
+				}
+				else
+				{
+					inside.push_back(below.Children[0]);
+					inside.push_back(below.Children[1]);
+				}
+			}
+		}
+	}
+
+	if (stats)
+	{
+		stats->Tested += counted.Tested;
+		stats->Taken += counted.Taken;
+	}
+}
+
+void BoundsTree::Query(const BoundingFrustum& frustum, std::vector<uint32_t>& items, BoundsTreeStats* stats) const
+{
+	QueryVolume(frustum, items, stats);
+}
+
+void BoundsTree::Query(const BoundingSphere& sphere, std::vector<uint32_t>& items, BoundsTreeStats* stats) const
+{
+	QueryVolume(sphere, items, stats);
+}
+
+void BoundsTree::Query(const XMFLOAT4* planes, uint32_t planeCount, std::vector<uint32_t>& items, BoundsTreeStats* stats) const
+{
+	PlaneVolume volume = { planes, planeCount };
+	QueryVolume(volume, items, stats);
+}
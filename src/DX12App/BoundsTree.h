@@ -0,0 +1,100 @@
+#pragma once
+
+#include <DirectXCollision.h>
+
+#include <cstdint>
+#include <vector>
+
+struct BoundsTreeStats
+{
+	// Nodes whose box was tested, and leaves taken without a test because an
+	// ancestor was fully inside.
+	uint64_t Tested = 0;
+	uint64_t Taken = 0;
+};
+
+// Bounding volume hierarchy over the boxes of a scene's items, a binary tree with
+// one item per leaf. Build makes the tree top down with the surface area heuristic;
+// after that items come and go one at a time and move without a rebuild.
+//
+// Leaves keep the item's box grown by Margin, so an item can move inside it without
+// touching the tree. Once it leaves, the leaf is taken out and inserted again where
+// the surface area grows least, and AVL rotations keep the tree balanced on the way
+// up. Refit instead shrinks every box to what is below it, for scenes where
+// everything moves a little. Queries test the leaves' exact boxes.
+class BoundsTree
+{
+public:
+	static const uint32_t Null = UINT32_MAX;
+
+	explicit BoundsTree(float margin = 0.0f) : mMargin(margin) {}
+
+	void Clear();
+
+	// Replaces the tree by one over count boxes, leaf i holding items[i]. Leaves
+	// get ids 0 to count - 1 in that order.
+	void Build(const DirectX::BoundingBox* boxes, const uint32_t* items, size_t count);
+
+	// Adds a leaf for an item and returns its id.
+	uint32_t Insert(const DirectX::BoundingBox& box, uint32_t item);
+	void Remove(uint32_t leaf);
+	// Gives a leaf a new box. True if it left its grown box and was inserted again.
+	bool Move(uint32_t leaf, const DirectX::BoundingBox& box);
+	// Sets the leaf boxes to the items' boxes and every other box to the union of its
+	// children, keeping the tree's shape.
+	void Refit();
+
+	size_t LeafCount() const { return mLeafCount; }
+	uint32_t Item(uint32_t leaf) const { return mNodes[leaf].Item; }
+	// Longest path from the root to a leaf, 0 for a single leaf.
+	int Height() const { return mRoot == Null ? -1 : mNodes[mRoot].Height; }
+	// Surface area of the inner nodes over that of the root, the SAH cost of the tree
+	// when all leaves cost the same.
+	float Cost() const;
+
+	// Items whose box may be in the frustum or the sphere, in no particular order.
+	// Subtrees fully inside are taken without testing their leaves.
+	void Query(const DirectX::BoundingFrustum& frustum, std::vector<uint32_t>& items, BoundsTreeStats* stats = nullptr) const;
+	void Query(const DirectX::BoundingSphere& sphere, std::vector<uint32_t>& items, BoundsTreeStats* stats = nullptr) const;
+	// The same for a convex volume of planes, p being outside a plane when N.p + D > 0.
+	// Unlike a BoundingFrustum it may be open on a side or come from an orthographic
+	// projection.
+	void Query(const DirectX::XMFLOAT4* planes, uint32_t planeCount, std::vector<uint32_t>& items, BoundsTreeStats* stats = nullptr) const;
+
+private:
+	struct Node
+	{
+		// Union of the children, or the leaf's box grown by the margin.
+		DirectX::BoundingBox Box;
+		// The item's own box; leaves only.
+		DirectX::BoundingBox Tight;
+		uint32_t Parent;
+		uint32_t Children[2];
+		// Item of a leaf, Null for inner nodes; the next free node while free.
+		uint32_t Item;
+		// 0 for leaves, -1 while free.
+		int Height;
+
+		bool IsLeaf() const { return Children[0] == Null; }
+	};
+
+	uint32_t Allocate();
+	void Free(uint32_t node);
+	void InsertLeaf(uint32_t leaf);
+	void RemoveLeaf(uint32_t leaf);
+	// Rotates the subtree at a if its children's heights differ by more than one and
+	// returns the subtree's new root.
+	uint32_t Balance(uint32_t a);
+	// Fixes boxes and heights from node up to the root, balancing on the way.
+	void FixUpwards(uint32_t node);
+	void Grow(DirectX::BoundingBox& box) const;
+
+	template <typename Volume>
+	void QueryVolume(const Volume& volume, std::vector<uint32_t>& items, BoundsTreeStats* stats) const;
+
+	float mMargin;
+	std::vector<Node> mNodes;
+	uint32_t mRoot = Null;
+	uint32_t mFreeList = Null;
+	size_t mLeafCount = 0;
+};
@@ -0,0 +1,127 @@
+#include "BoxCuller.h"
+
+#include <cfloat>
+#include <cmath>
+#include <emmintrin.h>
+
+using namespace DirectX;
+
+namespace
+{
+	// A frustum plane with each component in all four lanes. A point p is outside
+	// when N.p + D > 0.
+	struct SplatPlane
+	{
+		__m128 Nx, Ny, Nz, D;
+		__m128 AbsNx, AbsNy, AbsNz;
+	};
+}
+
+void BoxCuller::Reset(uint32_t layerCount)
+{
+	mCenterX.clear();
+	mCenterY.clear();
+	mCenterZ.clear();
+	mExtentX.clear();
+	mExtentY.clear();
+	mExtentZ.clear();
+	mLayers.clear();
+	mLayerSizes.assign(layerCount, 0);
+	mSize = 0;
+}
+
+uint32_t BoxCuller::Add(const BoundingBox& box, uint32_t layer)
+{
+	uint32_t index = mSize++;
+	mLayerSizes[layer]++;
+
+	// Four more padding boxes every fourth box.
+	if (index % 4 == 0)
+	{
+		size_t padded = index + 4;
+		mLayers.resize(padded, 0);
+		mCenterX.resize(padded, 0.0f);
+		mCenterY.resize(padded, 0.0f);
+		mCenterZ.resize(padded, 0.0f);
+		mExtentX.resize(padded, -FLT_MAX);
+		mExtentY.resize(padded, -FLT_MAX);
+		mExtentZ.resize(padded, -FLT_MAX);
+	}
+	mLayers[index] = layer;
+	Set(index, box);
+	return index;
+}
+
+void BoxCuller::Set(uint32_t index, const BoundingBox& box)
+{
+	mCenterX[index] = box.Center.x;
+	mCenterY[index] = box.Center.y;
+	mCenterZ[index] = box.Center.z;
+	mExtentX[index] = box.Extents.x;
+	mExtentY[index] = box.Extents.y;
+	mExtentZ[index] = box.Extents.z;
+}
+
+void BoxCuller::Cull(const BoundingFrustum& frustum, std::vector<uint32_t>* visible) const
+{
+	XMVECTOR planes[6];
+	frustum.GetPlanes(&planes[0], &planes[1], &planes[2], &planes[3], &planes[4], &planes[5]);
+	SplatPlane splat[6];
+	for (int p = 0; p < 6; p++)
+	{
+		XMFLOAT4 plane;
+		XMStoreFloat4(&plane, planes[p]);
+		splat[p].Nx = _mm_set1_ps(plane.x);
+		splat[p].Ny = _mm_set1_ps(plane.y);
+		splat[p].Nz = _mm_set1_ps(plane.z);
+		splat[p].D = _mm_set1_ps(plane.w);
+		splat[p].AbsNx = _mm_set1_ps(std::fabs(plane.x));
+		splat[p].AbsNy = _mm_set1_ps(std::fabs(plane.y));
+		splat[p].AbsNz = _mm_set1_ps(std::fabs(plane.z));
+	}
+
+	// Room for every box of a layer and one more, cut down to what passed at the end.
+	uint32_t layerCount = LayerCount();
+	std::vector<uint32_t*> out(layerCount);
+	std::vector<uint32_t> counts(layerCount, 0);
+	for (uint32_t l = 0; l < layerCount; l++)
+	{
+		visible[l].resize(mLayerSizes[l] + 1);
+		out[l] = visible[l].data();
+	}
+
+	const __m128 zero = _mm_setzero_ps();
+	size_t padded = mCenterX.size();
+	for (size_t i = 0; i < padded; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(&mCenterX[i]);
+		__m128 cy = _mm_loadu_ps(&mCenterY[i]);
+		__m128 cz = _mm_loadu_ps(&mCenterZ[i]);
+		__m128 ex = _mm_loadu_ps(&mExtentX[i]);
+		__m128 ey = _mm_loadu_ps(&mExtentY[i]);
+		__m128 ez = _mm_loadu_ps(&mExtentZ[i]);
+
+		// Outside a plane when even the box corner furthest inside is outside.
+		__m128 outside = zero;
+		for (int p = 0; p < 6; p++)
+		{
+			const SplatPlane& s = splat[p];
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s.Nx, cx), _mm_mul_ps(s.Ny, cy)), _mm_add_ps(_mm_mul_ps(s.Nz, cz), s.D));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s.AbsNx, ex), _mm_mul_ps(s.AbsNy, ey)), _mm_mul_ps(s.AbsNz, ez));
+			outside = _mm_or_ps(outside, _mm_cmpgt_ps(_mm_sub_ps(distance, radius), zero));
+		}
+
+		// Every lane is written to its layer's list without branches, only the
+		// visible ones move the list on. Padding lanes are in layer 0.
+		int mask = ~_mm_movemask_ps(outside);
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			uint32_t layer = mLayers[i + lane];
+			out[layer][counts[layer]] = (uint32_t)i + lane;
+			counts[layer] += (mask >> lane) & 1;
+		}
+	}
+
+	for (uint32_t l = 0; l < layerCount; l++)
+		visible[l].resize(counts[l]);
+}
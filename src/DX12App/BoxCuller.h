@@ -0,0 +1,43 @@
+#pragma once
+
+#include <DirectXCollision.h>
+
+#include <cstdint>
+#include <vector>
+
+// World space boxes of a scene, each in a layer, culled against a view frustum in
+// one pass. Centers and extents are kept in separate arrays per axis, padded to a
+// multiple of four, so four boxes are tested against a frustum plane at once with
+// SSE; padding boxes have negative extents and are outside every plane.
+//
+// A box is culled when it lies entirely outside one of the six planes, the plane
+// test BoundingFrustum::Intersects starts with. Boxes that straddle two planes
+// outside a frustum corner are kept, so a few more boxes pass than with
+// BoundingFrustum, never fewer.
+//
+// The app no longer uses it: BoundsTree replaced it in UpdateObjectCBs, since the
+// tree skips whole subtrees where this scans every box. It stays as the flat
+// baseline the boxcull and boundstree benchmarks measure against.
+class BoxCuller
+{
+public:
+	// Drops every box.
+	void Reset(uint32_t layerCount);
+
+	// Appends a box and returns its index.
+	uint32_t Add(const DirectX::BoundingBox& box, uint32_t layer);
+	void Set(uint32_t index, const DirectX::BoundingBox& box);
+	size_t Size() const { return mSize; }
+	uint32_t LayerCount() const { return (uint32_t)mLayerSizes.size(); }
+
+	// visible[l], for every layer l, receives the indices of the layer's boxes that
+	// may be in the frustum, in index order.
+	void Cull(const DirectX::BoundingFrustum& frustum, std::vector<uint32_t>* visible) const;
+
+private:
+	std::vector<float> mCenterX, mCenterY, mCenterZ;
+	std::vector<float> mExtentX, mExtentY, mExtentZ;
+	std::vector<uint32_t> mLayers;
+	std::vector<uint32_t> mLayerSizes;
+	uint32_t mSize = 0;
+};
@@ -0,0 +1,69 @@
+#include "CameraPath.h"
+
+#include <fstream>
+#include <sstream>
+
+using namespace DirectX;
+
+XMMATRIX CameraPathFrame::View() const
+{
+	return XMMatrixLookToLH(XMLoadFloat3(&Position), XMLoadFloat3(&Look), XMLoadFloat3(&Up));
+}
+
+XMMATRIX CameraPathFrame::Proj() const
+{
+	return XMMatrixPerspectiveFovLH(FovY, Aspect, NearZ, FarZ);
+}
+
+BoundingFrustum CameraPathFrame::Frustum() const
+{
+	BoundingFrustum local, world;
+	BoundingFrustum::CreateFromMatrix(local, Proj());
+	local.Transform(world, XMMatrixInverse(nullptr, View()));
+	return world;
+}
+
+bool CameraPath::Save(const std::wstring& filename) const
+{
+	std::ofstream fout(filename);
+	if (!fout)
+		return false;
+
+	fout.precision(9);
+	for (auto& f : mFrames)
+	{
+		fout << f.Position.x << ' ' << f.Position.y << ' ' << f.Position.z << ' '
+			<< f.Look.x << ' ' << f.Look.y << ' ' << f.Look.z << ' '
+			<< f.Up.x << ' ' << f.Up.y << ' ' << f.Up.z << ' '
+			<< f.FovY << ' ' << f.Aspect << ' ' << f.NearZ << ' ' << f.FarZ << ' ' << f.ViewportHeight << '\n';
+	}
+
+	return (bool)fout;
+}
+
+bool CameraPath::Load(const std::wstring& filename)
+{
+	std::ifstream fin(filename);
+	if (!fin)
+		return false;
+
+	mFrames.clear();
+	std::string line;
+	while (std::getline(fin, line))
+	{
+		if (line.empty())
+			continue;
+
+		std::istringstream fields(line);
+		CameraPathFrame f;
+		fields >> f.Position.x >> f.Position.y >> f.Position.z
+			>> f.Look.x >> f.Look.y >> f.Look.z
+			>> f.Up.x >> f.Up.y >> f.Up.z
+			>> f.FovY >> f.Aspect >> f.NearZ >> f.FarZ >> f.ViewportHeight;
+		if (!fields)
+			return false;
+		mFrames.push_back(f);
+	}
+
+	return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <DirectXCollision.h>
+#include <DirectXMath.h>
+
+#include <string>
+#include <vector>
+
+// Everything needed to rebuild a camera's view frustum without the window.
+struct CameraPathFrame
+{
+	DirectX::XMFLOAT3 Position;
+	DirectX::XMFLOAT3 Look;
+	DirectX::XMFLOAT3 Up;
+	float FovY;
+	float Aspect;
+	float NearZ;
+	float FarZ;
+	float ViewportHeight;
+
+	DirectX::XMMATRIX View() const;
+	DirectX::XMMATRIX Proj() const;
+	// World space view frustum, like Camera::Bounds.
+	DirectX::BoundingFrustum Frustum() const;
+};
+
+// Camera poses recorded frame by frame, replayed by the benchmarks to compare
+// CPU side techniques on the same flight through the scene.
+class CameraPath
+{
+public:
+	void Clear() { mFrames.clear(); }
+	void Add(const CameraPathFrame& frame) { mFrames.push_back(frame); }
+	const std::vector<CameraPathFrame>& Frames() const { return mFrames; }
+
+	// One frame per line, space separated, in CameraPathFrame order.
+	bool Save(const std::wstring& filename) const;
+	bool Load(const std::wstring& filename);
+
+private:
+	std::vector<CameraPathFrame> mFrames;
+};
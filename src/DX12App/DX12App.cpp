@@ -7,6 +7,30 @@
 #include "../Common/Camera.h"
 #include "FrameResource.h"
 #include "ShadowMap.h"
+#include "TextureCache.h"
+#include "TextureTranscoder.h"
+#include "ThreadPool.h"
+#include "TextureResidency.h"
+#include "TextureIndex.h"
+#include "TerrainQuadTree.h"
+#include "TerrainHeightData.h"
+#include "TerrainHeightField.h"
+#include "TerrainLod.h"
+#include "TerrainNodeFile.h"
+#include "TerrainPyramidBuilder.h"
+#include "TerrainPager.h"
+#include "TerrainCut.h"
+#include "TerrainHorizon.h"
+#include "TerrainInstances.h"
+#include "TerrainDetail.h"
+#include "VegetationScatter.h"
+#include "BoundsTree.h"
+#include "LightClusters.h"
+#include "LodSelector.h"
+#include "OcclusionBuffer.h"
+#include "ShadowCasters.h"
+#include "CameraPath.h"
+#include "Benchmarks.h"
 
 using Microsoft::WRL::ComPtr;
 using namespace DirectX;
@@ -20,6 +44,49 @@ using namespace DirectX::PackedVector;
 
 const int gNumFrameResources = 3;
 
+// Texture memory budget and how often (in frames) residency is re-evaluated.
+const UINT64 gTextureBudget = 128ull * 1024 * 1024;
+const int gResidencyUpdateInterval = 30;
+
+// Terrain tiles that can be resident at once, and the most quadtree levels used
+// when the tile data has that many.
+const int gTerrainTileSlots = 256;
+const uint32_t gTerrainMaxLevels = 12;
+// Levels synthesized below the finest stored one, see TerrainDetail.
+const uint32_t gTerrainDetailLevels = 2;
+// Splits and merges of the terrain selection per frame; the rest waits a frame.
+const uint32_t gTerrainSelectionBudget = 32;
+// Each loaded tile occludes as a grid of this many cells a side.
+const uint32_t gTerrainOccluderCells = 8;
+// Render items, materials and visible items per job of the frame update, and lights,
+// which take far longer each.
+const size_t gUpdateGrainSize = 256;
+const size_t gLightUpdateGrainSize = 8;
+// Threads reading and synthesizing textures and tiles in the background, apart
+// from the pool of the frame update so its jobs never queue behind a load.
+const unsigned gLoadThreadCount = 2;
+// Resolution of the CPU depth buffer for occlusion culling.
+const uint32_t gOcclusionWidth = 256;
+const uint32_t gOcclusionHeight = 128;
+// Models that occlude, simplified on a grid of this many cells a side.
+const char* const gOccluderModels[] = { "trex", "Baryonyx" };
+const uint32_t gOccluderCells = 16;
+
+// Most plants drawn a frame, the size of the instance buffers; more are thinned.
+const uint32_t gVegetationMaxInstances = 1 << 16;
+// Stored terrain levels the plants are placed on. Level 3 texels are a world unit
+// apart, closer than the plants.
+const uint32_t gVegetationGroundLevels = 4;
+
+// Lights without shadow maps, shaded by clusters. Lights past the first buffer
+// aren't drawn; indices past the second are dropped, the clusters' lists cut short.
+const uint32_t gMaxClusterLights = 4096;
+const uint32_t gMaxClusterLightIndices = 1 << 18;
+// Depth the cluster slices cover; lights wholly beyond it aren't drawn.
+const float gLightClusterFar = 2000.0f;
+// Lamps over the field of spheres, one a sphere.
+const int gLampRows = 11;
+
 enum class RenderLayer : int
 {
 	Opaque = 0,
@@ -69,14 +136,6 @@ struct RenderItem
 	int currentLOD = 0;
 };
 
-struct Node
-{
-	RenderItem* RItem = nullptr;
-	Node* children[4] = { nullptr };
-	int layer = 0;
-	bool hasChildren = false;
-};
-
 struct LightObject
 {
 	DirectX::XMFLOAT3 Strength = { 0.5f, 0.5f, 0.5f };
@@ -91,6 +150,9 @@ struct LightObject
 	int NumFramesDirty = gNumFrameResources;
 	std::string GeoName;
 	ShadowMap* shadowMap;
+	// View projections of the shadow map's views, for culling its casters.
+	DirectX::XMFLOAT4X4 ShadowViewProj[ShadowCasters::MaxViews];
+	uint32_t ShadowViewCount = 0;
 };
 
 class DX12App : public D3DApp
@@ -115,16 +177,23 @@ private:
 	virtual void OnMouseWheel(WPARAM btnState)override;
 
 	void OnKeyboardInput(const GameTimer& gt);
+	// True once per press.
+	bool KeyPressed(int key);
+	void ToggleCameraPathRecording();
 	void AnimateMaterials(const GameTimer& gt);
 	void UpdateObjectCBs(const GameTimer& gt);
 	void UpdateLightCBs(const GameTimer& gt);
 	void UpdateMaterialCBs(const GameTimer& gt);
 	void UpdateMainPassCB(const GameTimer& gt);
 	void UpdatePostProcessCB(const GameTimer& gt);
+	// Bins the lights without shadow maps into the view's clusters and uploads them.
+	void UpdateLightClusters();
 
-	void LoadTexture(std::string name, std::wstring filename, TextureType type = TextureType::TEXTURE2D);
+	// maxSize > 0 loads only the mips no larger than maxSize.
+	void LoadTexture(std::string name, std::wstring filename, TextureType type = TextureType::TEXTURE2D, size_t maxSize = 0);
+	// A generated 2D texture, from a DDS file in memory.
+	void LoadTextureFromMemory(std::string name, const std::vector<uint8_t>& dds);
 	void LoadTextures();
-	void LoadTerrainTextures();
 	void BuildRootSignature();
 	void BuildDescriptorHeaps();
 	void BuildShadersAndInputLayout();
@@ -143,10 +212,56 @@ private:
 	void DrawShadowMaps();
 
 	// Quad Tree for Terrain
-	Node* BuildNode(int layer, float x, float y, int xi, int yi);
 	void BuildTerrainQuadTree();
 	void UpdateVisibleTerrainTiles();
-	void ChooseVisibleTerrainTile(Node* node);
+	// Drops the visible tiles and opaque items hidden behind nearer terrain.
+	void CullBelowTerrainHorizon();
+	// Drops the visible tiles and opaque items that the drawn tiles and the occluder
+	// models hide in the CPU depth buffer.
+	void CullOccluded();
+	// Removes the tiles and opaque items marked in mCullHidden, tiles first, and
+	// reports the counts when they change.
+	void DropHidden(const char* name, uint32_t& culledTiles, uint32_t& culledItems);
+	// Finds the opaque items each shadow map view of each light has to draw.
+	void CullShadowCasters();
+	// Fills the frame's instance buffer from the visible tiles.
+	void UpdateTerrainInstances();
+	// One instanced draw per level of the visible tiles.
+	void DrawTerrain();
+	// Releases the tiles of destroyed nodes, reads the tiles of the groups the pager
+	// requests on the thread pool and completes the groups whose tiles are ready.
+	void UpdateTerrainPaging();
+	// Puts mGroundedItems on the terrain again when its resident heights changed.
+	void PlaceOnTerrain();
+	// Logs where the ray through a client area pixel meets the terrain.
+	void PickTerrain(int x, int y);
+	// A tile read from disk or synthesized, encoded like the stored tiles.
+	struct TerrainTileData
+	{
+		std::vector<uint16_t> Heights;
+		uint32_t Resolution = 0;
+		// Diffuse, height and normal DDS files, in slot order.
+		std::vector<uint8_t> Dds[3];
+	};
+	// Runs on the thread pool but for the root; synthesized levels need the parent's heights.
+	void ReadTerrainTile(uint32_t node, uint32_t level, const std::vector<uint16_t>& parentHeights, TerrainTileData& tile) const;
+	void LoadTerrainTile(uint32_t node, uint32_t level, TerrainTileData& tile);
+	void ReleaseTerrainTile(uint32_t node, uint32_t level);
+
+	// Plants scattered over the terrain, culled by cell and drawn as billboards.
+	void BuildVegetation();
+	void UpdateVegetationInstances();
+	// One instanced draw per kind of the visible plants.
+	void DrawVegetation();
+
+	// Texture residency under gTextureBudget
+	void BuildTextureResidency();
+	void RequestTextureResidency(const RenderItem* ri);
+	// Starts loading the textures whose residency changed on the thread pool.
+	void UpdateTextureResidency();
+	// Uploads the finished loads on the frame's command list and switches their
+	// textures to the new resources.
+	void UploadTextureResidency();
 
 	std::array<const CD3DX12_STATIC_SAMPLER_DESC, 7> GetStaticSamplers();
 
@@ -166,6 +281,38 @@ private:
 	std::unordered_map<std::string, std::unique_ptr<Material>> mMaterials;
 	std::unordered_map<std::string, std::unique_ptr<Texture>> mTextures;
 	std::unordered_map<std::string, ComPtr<ID3DBlob>> mShaders;
+
+	// Content-hash deduplication of texture files; one resource per cache entry.
+	TextureCache mTextureCache;
+	std::unordered_map<int, ComPtr<ID3D12Resource>> mTextureCacheResources;
+	// PNG/JPG/BMP sources are converted to DDS once and loaded from the cache afterwards.
+	TextureTranscoder mTextureTranscoder{ L"../Textures/Cache/" };
+	ThreadPool mThreadPool;
+	ThreadPool mLoadThreads{ gLoadThreadCount };
+	// Mip residency of 2D textures, keyed by SRV heap index since textures sharing
+	// a resource share the SRV as well.
+	TextureResidency mTextureResidency{ gTextureBudget };
+	std::unordered_map<UINT, int> mResidencyIds;
+	std::vector<UINT> mResidencyHeapIndices;
+	std::vector<UINT> mResidencyTopSizes;
+	int mResidencyFrame = 0;
+	// Every texture descriptor has a second one mResidencySrvBase further on. A
+	// reloaded texture gets the one frames in flight don't read, and the other is
+	// free again once mFence passes the value in mResidencySwapFences.
+	UINT mResidencySrvBase = 0;
+	std::vector<UINT64> mResidencySwapFences;
+	// A file being read by the thread pool; a later change of the same texture
+	// replaces it and the stale result is dropped.
+	struct ResidencyLoad
+	{
+		std::wstring Filename;
+		size_t MaxSize = 0;
+		std::unique_ptr<uint8_t[]> Data;
+		size_t DataSize = 0;
+		HRESULT Result = E_PENDING;
+		std::atomic<bool> Done{ false };
+	};
+	std::vector<std::shared_ptr<ResidencyLoad>> mResidencyLoads;
 	std::unordered_map<std::string, ComPtr<ID3D12PipelineState>> mPSOs;
 
 	std::vector<D3D12_INPUT_ELEMENT_DESC> mInputLayout;
@@ -178,7 +325,31 @@ private:
 	// Render items divided by PSO.
 	std::vector<RenderItem*> mRitemLayer[(int)RenderLayer::Count];
 	std::vector<RenderItem*> mVisibleRitems[(int)RenderLayer::Count];
-	std::vector<RenderItem*> mVisibleTerrain;
+	// World bounds of mAllRitems, leaf i holding item i. Items moving less than a
+	// metre stay in their leaf.
+	BoundsTree mRitemBounds{ 1.0f };
+	std::vector<uint32_t> mVisibleRitemIndices;
+	// What a job of the frame update found in its range of items or tiles, merged in
+	// range order so the result doesn't depend on the threads.
+	struct UpdateRange
+	{
+		std::vector<uint32_t> Moved;
+		std::vector<RenderItem*> Visible[(int)RenderLayer::Count];
+		std::vector<TerrainQuadTree::Selected> Tiles;
+		std::vector<uint32_t> Slots;
+	};
+	std::vector<UpdateRange> mUpdateRanges;
+	// LOD of the items with LODGeoNames by their size on screen.
+	LodSettings mItemLod;
+	// mMaterials in a vector for the jobs to split.
+	std::vector<Material*> mMaterialList;
+	// Visible terrain tiles and their slots, drawn as TerrainInstances batches.
+	std::vector<TerrainQuadTree::Selected> mVisibleTerrain;
+	std::vector<uint32_t> mVisibleTerrainSlots;
+	std::vector<TerrainInstance> mTerrainInstances;
+	std::vector<TerrainDrawBatch> mTerrainBatches;
+	// Command list calls of the last terrain draw, for the stats.
+	uint32_t mTerrainDrawCalls = 0;
 
 	PassConstants mMainPassCB;
 
@@ -188,10 +359,88 @@ private:
 	UINT mShadowMapHeapIndex = 0;
 
 	// Quad tree typa shit
-	Node* root = nullptr;
-	int layers = 4;
+	TerrainQuadTree mTerrainTree;
+	// Node records come from nodes.bin and nodes are only created when the view needs them.
+	TerrainNodeFile mTerrainNodes;
+	std::unique_ptr<TerrainPager> mTerrainPager;
+	// Nodes below the stored levels, their tiles synthesized from their parent's.
+	TerrainDetail mTerrainDetail;
+	// Tiles of a group the pager requested, read on the thread pool. The group is
+	// completed and its tiles put into slots once they are all done.
+	struct TerrainGroupLoad
+	{
+		uint32_t Parent = 0;
+		uint32_t Level = 0;
+		// Copied from mTerrainHeights when the load starts.
+		std::vector<uint16_t> ParentHeights;
+		TerrainTileData Tiles[4];
+		std::atomic<bool> Done{ false };
+	};
+	std::vector<std::shared_ptr<TerrainGroupLoad>> mTerrainLoads;
+	// Every slot has a render item, a material and 3 SRVs (diffuse, height, normal)
+	// from mTerrainSrvBase on; created nodes take a free slot. Released slots wait in
+	// the frame resource until the frames that drew them are done.
+	std::vector<RenderItem*> mTerrainItems;
+	std::vector<int> mFreeTerrainSlots;
+	std::unordered_map<uint32_t, int> mTerrainNodeSlots;
+	UINT mTerrainSrvBase = 0;
+	// Selection carried over from the last frame; tiles come and go as its differences.
+	TerrainCut mTerrainCut;
+	// Largest geometric error per level in world units, and the CDLOD ranges of the frame.
+	std::vector<float> mTerrainLevelErrors;
+	TerrainLodRanges mTerrainRanges;
 	float RootSize = 1024.f;
-	float thresholds[5] = {1500.f, 1000.f, 500.f, 200.f, 100.f};
+	// Tiles are flat grids at TerrainBaseY, Terrain.hlsl lifts them by up to TerrainHeightScale.
+	float TerrainBaseY = -40.f;
+	float TerrainHeightScale = 250.f;
+	TerrainLodSettings mTerrainLod;
+	// Lowest height of every occluder cell of the tile in each slot, in world units.
+	std::vector<std::vector<float>> mTerrainMinHeights;
+	TerrainHorizon mTerrainHorizon;
+	// Heights of the resident tiles for game logic, and the items standing on them.
+	TerrainHeightField mTerrainHeights;
+	std::vector<RenderItem*> mGroundedItems;
+	uint64_t mGroundedVersion = 0;
+	bool mHorizonCulling = true;
+	// Boxes of the visible tiles and opaque items, and which of them are hidden.
+	std::vector<BoundingBox> mCullBoxes;
+	std::vector<uint8_t> mCullHidden;
+	// Tiles and opaque items culled by the horizon in the last frame.
+	uint32_t mHorizonCulledTiles = 0;
+	uint32_t mHorizonCulledItems = 0;
+	OcclusionBuffer mOcclusion{ gOcclusionWidth, gOcclusionHeight };
+	// Simplified meshes of gOccluderModels by geometry name.
+	std::unordered_map<std::string, OccluderMesh> mOccluderMeshes;
+	bool mOcclusionCulling = true;
+	uint32_t mOcclusionCulledTiles = 0;
+	uint32_t mOcclusionCulledItems = 0;
+	// Casters of every light by view, items of mAllRitems that cast set in
+	// mCastsShadow. Without caster culling every view draws every opaque item.
+	std::vector<ShadowCasters> mShadowCasters;
+	std::vector<uint8_t> mCastsShadow;
+	std::vector<RenderItem*> mShadowDrawItems;
+	bool mShadowCasterCulling = true;
+	// Casters per view of the last frame, for the stats.
+	std::vector<size_t> mShadowCasterCounts;
+
+	// Lights without shadow maps and their bounds, drawn in one pass by clusters.
+	std::vector<ClusterLight> mClusterLights;
+	std::vector<BoundingSphere> mClusterLightBounds;
+	LightClusters mLightClusters;
+	LightClusters::Stats mLightClusterStats;
+
+	VegetationScatter mVegetation;
+	VegetationCullSettings mVegetationCull;
+	std::vector<VegetationInstance> mVegetationInstances;
+	std::vector<VegetationDrawBatch> mVegetationBatches;
+	// Plants of the last draw, for the stats.
+	uint32_t mVegetationDrawn = 0;
+
+	bool mKeyDown[256] = {};
+
+	// F4 records the camera every frame for the benchmarks, see CameraPath.
+	bool mRecordingCameraPath = false;
+	CameraPath mCameraPath;
 };
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
@@ -204,6 +453,10 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 
 	try
 	{
+		if (RunBenchmarks(lpCmdLine) || RunTextureIndexTool(lpCmdLine) || RunTerrainNodeTool(lpCmdLine) ||
+			RunTerrainPyramidTool(lpCmdLine))
+			return 0;
+
 		DX12App theApp(hInstance);
 		if (!theApp.Initialize())
 			return 0;
@@ -224,6 +477,11 @@ DX12App::DX12App(HINSTANCE hInstance)
 
 DX12App::~DX12App()
 {
+	// Tile loads still on the thread pool read mTerrainDetail.
+	for (auto& load : mTerrainLoads)
+		while (!load->Done)
+			std::this_thread::yield();
+
 	if (md3dDevice != nullptr)
 		FlushCommandQueue();
 }
@@ -245,14 +503,21 @@ bool DX12App::Initialize()
 	mCamera.RotateY(0.7f);
 
 	LoadTextures();
-	LoadTerrainTextures();
+
+	std::string cacheStats = "TextureCache: " + std::to_string(mTextureCache.RequestCount()) + " textures, " +
+		std::to_string(mTextureCache.UniqueCount()) + " unique, " +
+		std::to_string(mTextureCache.BytesSaved() / 1024) + " KB saved\n";
+	OutputDebugStringA(cacheStats.c_str());
+
 	BuildRootSignature();
 	BuildDescriptorHeaps();
+	BuildTextureResidency();
 	BuildShadersAndInputLayout();
 	BuildShapeGeometry();
 	BuildMaterials();
 	BuildRenderItems();
 	BuildTerrainQuadTree();
+	BuildVegetation();
 	BuildLightObjects();
 	BuildFrameResources();
 	BuildPSOs();
@@ -295,6 +560,10 @@ void DX12App::OnResize()
 
 	// The window resized, so update the aspect ratio and recompute the projection matrix.
 	mCamera.SetLens(0.25f * MathHelper::Pi, AspectRatio(), 1.0f, 100000.0f);
+	LightClusterSettings clusterSettings;
+	clusterSettings.Near = mCamera.GetNearZ();
+	clusterSettings.Far = gLightClusterFar;
+	mLightClusters.Reset(clusterSettings, mCamera.GetFovY(), mCamera.GetAspect());
 	mGBuffer->Resize(mClientWidth, mClientHeight, md3dDevice.Get());
 
 	// copy gbuffer resources into the srv heap
@@ -325,29 +594,47 @@ void DX12App::Update(const GameTimer& gt)
 		WaitForSingleObject(eventHandle, INFINITE);
 		CloseHandle(eventHandle);
 	}
+	mCurrFrameResource->RetiredResources.clear();
+	mFreeTerrainSlots.insert(mFreeTerrainSlots.end(),
+		mCurrFrameResource->RetiredTerrainSlots.begin(), mCurrFrameResource->RetiredTerrainSlots.end());
+	mCurrFrameResource->RetiredTerrainSlots.clear();
+
+	// Reuse the memory associated with command recording.
+	// We can only reset when the associated command lists have finished execution on the GPU.
+	// The list is opened here rather than in Draw so the update can record uploads.
+	ThrowIfFailed(mCurrFrameResource->CmdListAlloc->Reset());
+
+	// A command list can be reset after it has been added to the command queue via ExecuteCommandList.
+	// Reusing the command list reuses memory.
+	ThrowIfFailed(mCommandList->Reset(mCurrFrameResource->CmdListAlloc.Get(), nullptr));
 
 	AnimateMaterials(gt);
-	UpdateObjectCBs(gt);
+	// Before the object constants, it moves tiles and sets their morph ranges.
 	UpdateVisibleTerrainTiles();
+	PlaceOnTerrain();
+	UpdateObjectCBs(gt);
+	CullBelowTerrainHorizon();
+	CullOccluded();
+	UpdateTerrainInstances();
+	UpdateVegetationInstances();
 	UpdateLightCBs(gt);
+	CullShadowCasters();
 	UpdateMaterialCBs(gt);
 	UpdateMainPassCB(gt);
 	UpdatePostProcessCB(gt);
+	UpdateLightClusters();
+
+	UploadTextureResidency();
+	if (++mResidencyFrame % gResidencyUpdateInterval == 0)
+		UpdateTextureResidency();
 }
 
 void DX12App::Draw(const GameTimer& gt)
 {
-	auto cmdListAlloc = mCurrFrameResource->CmdListAlloc;
 	auto passCB = mCurrFrameResource->PassCB->Resource();
 	ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
 
-	// Reuse the memory associated with command recording.
-	// We can only reset when the associated command lists have finished execution on the GPU.
-	ThrowIfFailed(cmdListAlloc->Reset());
-
-	// A command list can be reset after it has been added to the command queue via ExecuteCommandList.
-	// Reusing the command list reuses memory.
-	ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), nullptr));
+	// Update has reset the command list and may have recorded uploads on it.
 	mCommandList->SetGraphicsRootSignature(mRootSignature["default"].Get());
 
 	mCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
@@ -405,6 +692,9 @@ void DX12App::OnMouseDown(WPARAM btnState, int x, int y)
 	mLastMousePos.x = x;
 	mLastMousePos.y = y;
 
+	if ((btnState & MK_RBUTTON) != 0)
+		PickTerrain(x, y);
+
 	SetCapture(mhMainWnd);
 }
 
@@ -457,7 +747,89 @@ void DX12App::OnKeyboardInput(const GameTimer& gt)
 	if (GetAsyncKeyState('D') & 0x8000)
 		mCamera.Strafe(mCamera.speed * dt);
 
+	// F3 switches the terrain between screen space error and distance LOD.
+	if (KeyPressed(VK_F3))
+	{
+		mTerrainLod.Mode = mTerrainLod.Mode == TerrainLodMode::ScreenSpaceError ? TerrainLodMode::DistanceThresholds : TerrainLodMode::ScreenSpaceError;
+		OutputDebugStringA(mTerrainLod.Mode == TerrainLodMode::ScreenSpaceError ? "Terrain LOD: screen space error\n" : "Terrain LOD: distance thresholds\n");
+	}
+
+	if (KeyPressed(VK_F4))
+		ToggleCameraPathRecording();
+
+	// F5 switches horizon culling, to compare the frame with and without it.
+	if (KeyPressed(VK_F5))
+	{
+		mHorizonCulling = !mHorizonCulling;
+		OutputDebugStringA(mHorizonCulling ? "Horizon culling: on\n" : "Horizon culling: off\n");
+	}
+
+	// F6 switches occlusion culling.
+	if (KeyPressed(VK_F6))
+	{
+		mOcclusionCulling = !mOcclusionCulling;
+		OutputDebugStringA(mOcclusionCulling ? "Occlusion culling: on\n" : "Occlusion culling: off\n");
+	}
+
+	// F9 switches shadow caster culling.
+	if (KeyPressed(VK_F9))
+	{
+		mShadowCasterCulling = !mShadowCasterCulling;
+		OutputDebugStringA(mShadowCasterCulling ? "Shadow caster culling: on\n" : "Shadow caster culling: off\n");
+	}
+
+	// F7 and F8 move every item a level coarser or finer.
+	bool coarser = KeyPressed(VK_F7);
+	bool finer = KeyPressed(VK_F8);
+	if (coarser || finer)
+	{
+		mItemLod.Bias += coarser ? 1.0f : -1.0f;
+		std::string bias = "LOD bias: " + std::to_string((int)mItemLod.Bias) + "\n";
+		OutputDebugStringA(bias.c_str());
+	}
+
 	mCamera.UpdateViewMatrix();
+
+	if (mRecordingCameraPath)
+	{
+		CameraPathFrame frame;
+		frame.Position = mCamera.GetPosition3f();
+		frame.Look = mCamera.GetLook3f();
+		frame.Up = mCamera.GetUp3f();
+		frame.FovY = mCamera.GetFovY();
+		frame.Aspect = mCamera.GetAspect();
+		frame.NearZ = mCamera.GetNearZ();
+		frame.FarZ = mCamera.GetFarZ();
+		frame.ViewportHeight = (float)mClientHeight;
+		mCameraPath.Add(frame);
+	}
+}
+
+bool DX12App::KeyPressed(int key)
+{
+	bool down = (GetAsyncKeyState(key) & 0x8000) != 0;
+	bool pressed = down && !mKeyDown[key];
+	mKeyDown[key] = down;
+	return pressed;
+}
+
+void DX12App::ToggleCameraPathRecording()
+{
+	mRecordingCameraPath = !mRecordingCameraPath;
+	if (mRecordingCameraPath)
+	{
+		mCameraPath.Clear();
+		OutputDebugStringA("Camera path: recording\n");
+		return;
+	}
+
+	CreateDirectoryW(L"../CameraPaths", nullptr);
+	std::string filename = "../CameraPaths/path_" + std::to_string(GetTickCount64()) + ".txt";
+	bool saved = mCameraPath.Save(AnsiToWString(filename));
+
+	std::string report = "Camera path: " + std::to_string(mCameraPath.Frames().size()) + " frames " +
+		(saved ? "saved to " : "failed to save to ") + filename + "\n";
+	OutputDebugStringA(report.c_str());
 }
 
 void DX12App::AnimateMaterials(const GameTimer& gt)
@@ -467,15 +839,37 @@ void DX12App::AnimateMaterials(const GameTimer& gt)
 
 void DX12App::UpdateObjectCBs(const GameTimer& gt)
 {
+	// Items are only added while the scene is built; then the bounds are taken anew.
+	if (mRitemBounds.LeafCount() != mAllRitems.size())
+	{
+		std::vector<BoundingBox> boxes(mAllRitems.size());
+		std::vector<uint32_t> items(mAllRitems.size());
+		for (size_t i = 0; i < mAllRitems.size(); i++)
+		{
+			boxes[i] = mAllRitems[i]->Bounds;
+			items[i] = (uint32_t)i;
+		}
+		mRitemBounds.Build(boxes.data(), items.data(), boxes.size());
+	}
+
+	// Dirty items in parallel, each writing its own constants; the tree takes the
+	// moved bounds afterwards, in item order.
 	auto currObjectCB = mCurrFrameResource->ObjectCB.get();
-	for (auto& e : mAllRitems)
+	mThreadPool.ParallelRanges(mAllRitems.size(), gUpdateGrainSize, mUpdateRanges, [&](size_t begin, size_t end, UpdateRange& range)
 	{
-		XMMATRIX world = XMLoadFloat4x4(&e->World);
-		
-		if (e->NumFramesDirty > 0)
+		range.Moved.clear();
+		for (size_t i = begin; i < end; i++)
 		{
+			auto& e = mAllRitems[i];
+			if (e->NumFramesDirty <= 0)
+				continue;
+
+			XMMATRIX world = XMLoadFloat4x4(&e->World);
 			XMMATRIX texTransform = XMLoadFloat4x4(&e->TexTransform);
-			e->Geo->DrawArgs[e->geoName].Bounds.Transform(e->Bounds, XMLoadFloat4x4(&e->World));
+			// Terrain tiles are displaced in the shader, their bounds come from the quadtree.
+			if (e->layer != (int)RenderLayer::Terrain)
+				e->Geo->DrawArgs.at(e->geoName).Bounds.Transform(e->Bounds, world);
+			range.Moved.push_back((uint32_t)i);
 
 			ObjectConstants objConstants;
 			XMStoreFloat4x4(&objConstants.World, XMMatrixTranspose(world));
@@ -486,28 +880,58 @@ void DX12App::UpdateObjectCBs(const GameTimer& gt)
 			// Next FrameResource need to be updated too.
 			e->NumFramesDirty--;
 		}
-
-		if (mCamera.Bounds.Intersects(e->Bounds))
+	});
+	for (auto& range : mUpdateRanges)
+		for (uint32_t i : range.Moved)
+			mRitemBounds.Move(i, mAllRitems[i]->Bounds);
+
+	// Sorted so items are drawn in the order they were added, as before.
+	mRitemBounds.Query(mCamera.Bounds, mVisibleRitemIndices);
+	std::sort(mVisibleRitemIndices.begin(), mVisibleRitemIndices.end());
+
+	// LODs of the visible items in parallel; the layer lists and the texture requests
+	// are filled from the ranges in order.
+	XMFLOAT3 eye = mCamera.GetPosition3f();
+	float projectionScale = LodProjectionScale(mCamera.GetFovY(), (float)mClientHeight);
+	mThreadPool.ParallelRanges(mVisibleRitemIndices.size(), gUpdateGrainSize, mUpdateRanges, [&](size_t begin, size_t end, UpdateRange& range)
+	{
+		for (auto& visible : range.Visible)
+			visible.clear();
+		for (size_t k = begin; k < end; k++)
 		{
-			mVisibleRitems[e->layer].push_back(e.get());
+			RenderItem* e = mAllRitems[mVisibleRitemIndices[k]].get();
+			range.Visible[e->layer].push_back(e);
 
-			XMVECTOR worldPos, temp;
-			XMMatrixDecompose(&temp, &temp, &worldPos, world);
-			float camToObjDistance;
-			XMStoreFloat(&camToObjDistance, XMVector3Length(XMVectorSubtract(mCamera.GetPosition(), worldPos)));
-
-			if (camToObjDistance > 150.f)
-				e->currentLOD = 1;
-			else e->currentLOD = 0;
+			if (!e->LODGeoNames.empty())
+			{
+				BoundingSphere sphere;
+				BoundingSphere::CreateFromBoundingBox(sphere, e->Bounds);
+				float pixels = LodProjectedRadius(sphere, eye, projectionScale);
+				e->currentLOD = (int)SelectLod(mItemLod, pixels, (uint32_t)e->LODGeoNames.size(), (uint32_t)e->currentLOD);
+			}
+		}
+	});
+	for (auto& range : mUpdateRanges)
+	{
+		for (int layer = 0; layer < (int)RenderLayer::Count; layer++)
+		{
+			for (RenderItem* e : range.Visible[layer])
+			{
+				mVisibleRitems[layer].push_back(e);
+				if (layer != (int)RenderLayer::Terrain)
+					RequestTextureResidency(e);
+			}
 		}
 	}
 }
 
 void DX12App::UpdateLightCBs(const GameTimer& gt)
 {
+	// Lights in parallel, each writing its own constants.
 	auto currLightCB = mCurrFrameResource->LightCB.get();
-	for (auto& e : mAllLights)
+	mThreadPool.ParallelFor(mAllLights.size(), gLightUpdateGrainSize, [&](size_t index)
 	{
+		auto& e = mAllLights[index];
 		// Only update the cbuffer data if the constants have changed.  
 		// This needs to be tracked per frame resource.
 		if (e->NumFramesDirty > 0)
@@ -565,7 +989,9 @@ void DX12App::UpdateLightCBs(const GameTimer& gt)
 					XMMATRIX S1 = S * T;
 					XMStoreFloat4x4(&lightConstants.ViewProj[i], XMMatrixTranspose(S));
 					XMStoreFloat4x4(&lightConstants.ShadowTransform[i], XMMatrixTranspose(S1));
+					XMStoreFloat4x4(&e->ShadowViewProj[i], S);
 				}
+				e->ShadowViewCount = 4;
 				break;
 			}
 			case LightType::Spotlight:
@@ -597,6 +1023,8 @@ void DX12App::UpdateLightCBs(const GameTimer& gt)
 
 				XMStoreFloat4x4(&lightConstants.ViewProj[0], XMMatrixTranspose(S));
 				XMStoreFloat4x4(&lightConstants.ShadowTransform[0], XMMatrixTranspose(S1));
+				XMStoreFloat4x4(&e->ShadowViewProj[0], S);
+				e->ShadowViewCount = 1;
 				break;
 			}
 			case LightType::Pointlight:
@@ -638,7 +1066,9 @@ void DX12App::UpdateLightCBs(const GameTimer& gt)
 					XMMATRIX S1 = S * T;
 					XMStoreFloat4x4(&lightConstants.ViewProj[i], XMMatrixTranspose(S));
 					XMStoreFloat4x4(&lightConstants.ShadowTransform[i], XMMatrixTranspose(S1));
+					XMStoreFloat4x4(&e->ShadowViewProj[i], S);
 				}
+				e->ShadowViewCount = 6;
 				break;
 			}
 			}
@@ -648,17 +1078,25 @@ void DX12App::UpdateLightCBs(const GameTimer& gt)
 			// Next FrameResource need to be updated too.
 			e->NumFramesDirty--;
 		}
-	}
+	});
 }
 
 void DX12App::UpdateMaterialCBs(const GameTimer& gt)
 {
+	// Materials are only added while the scene is built.
+	if (mMaterialList.size() != mMaterials.size())
+	{
+		mMaterialList.clear();
+		for (auto& e : mMaterials)
+			mMaterialList.push_back(e.second.get());
+	}
+
 	auto currMaterialCB = mCurrFrameResource->MaterialCB.get();
-	for (auto& e : mMaterials)
+	mThreadPool.ParallelFor(mMaterialList.size(), gUpdateGrainSize, [&](size_t i)
 	{
 		// Only update the cbuffer data if the constants have changed.  If the cbuffer
 		// data changes, it needs to be updated for each FrameResource.
-		Material* mat = e.second.get();
+		Material* mat = mMaterialList[i];
 		if (mat->NumFramesDirty > 0)
 		{
 			XMMATRIX matTransform = XMLoadFloat4x4(&mat->MatTransform);
@@ -675,7 +1113,42 @@ void DX12App::UpdateMaterialCBs(const GameTimer& gt)
 			// Next FrameResource need to be updated too.
 			mat->NumFramesDirty--;
 		}
+	});
+}
+
+void DX12App::UpdateLightClusters()
+{
+	// Lights past the buffer are left out of the binning, so no index points past it.
+	size_t lightCount = std::min<size_t>(mClusterLights.size(), gMaxClusterLights);
+	mLightClusters.Build(mCamera.GetView(), mClusterLightBounds.data(), lightCount, mThreadPool);
+
+	auto lights = mCurrFrameResource->ClusterLights.get();
+	for (size_t i = 0; i < lightCount; i++)
+		lights->CopyData((int)i, mClusterLights[i]);
+
+	auto clusters = mCurrFrameResource->ClusterRanges.get();
+	auto indices = mCurrFrameResource->ClusterLightIndices.get();
+	const std::vector<LightCluster>& binned = mLightClusters.Clusters();
+	for (size_t c = 0; c < binned.size(); c++)
+	{
+		LightCluster cluster = binned[c];
+		if (cluster.Offset + cluster.Count > gMaxClusterLightIndices)
+			cluster.Count = cluster.Offset < gMaxClusterLightIndices ? gMaxClusterLightIndices - cluster.Offset : 0;
+		clusters->CopyData((int)c, cluster);
+	}
+	const std::vector<uint32_t>& binnedIndices = mLightClusters.Indices();
+	size_t indexCount = std::min<size_t>(binnedIndices.size(), gMaxClusterLightIndices);
+	for (size_t i = 0; i < indexCount; i++)
+		indices->CopyData((int)i, binnedIndices[i]);
+
+	const LightClusters::Stats& stats = mLightClusters.GetStats();
+	if (stats.Binned != mLightClusterStats.Binned || stats.Indices != mLightClusterStats.Indices || stats.MaxPerCluster != mLightClusterStats.MaxPerCluster)
+	{
+		std::string line = "Light clusters: " + std::to_string(stats.Binned) + " of " + std::to_string(lightCount) + " lights in view, " +
+			std::to_string(stats.Indices) + " indices, up to " + std::to_string(stats.MaxPerCluster) + " in a cluster\n";
+		OutputDebugStringA(line.c_str());
 	}
+	mLightClusterStats = stats;
 }
 
 void DX12App::UpdatePostProcessCB(const GameTimer& gt)
@@ -724,14 +1197,85 @@ void DX12App::UpdateMainPassCB(const GameTimer& gt)
 	currPassCB->CopyData(0, mMainPassCB);
 }
 
-void DX12App::LoadTexture(std::string name, std::wstring filename, TextureType type)
+void DX12App::LoadTexture(std::string name, std::wstring filename, TextureType type, size_t maxSize)
 {
+	if (TextureTranscoder::IsTranscodable(filename))
+	{
+		std::wstring source = filename;
+		filename = mTextureTranscoder.Transcode({ source }, TranscodeOptions(), mThreadPool)[0];
+		if (filename.empty())
+			throw DxException(E_FAIL, L"TextureTranscoder::Transcode", source, __LINE__);
+	}
+
 	auto tex = std::make_unique<Texture>();
+	tex->Name = name;
 	tex->Filename = filename;
 	tex->Type = type;
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), tex->Filename.c_str(),
-		tex->Resource, tex->UploadHeap));
+
+	// Descriptors and residency are planned from the header alone.
+	ThrowIfFailed(DirectX::GetDDSTextureInfoFromFile(filename.c_str(), tex->Info));
+	tex->TopMip = (UINT)DirectX::GetDDSSkippedMips(tex->Info, maxSize);
+
+	// Byte-identical files share the resource of the texture that loaded them first.
+	bool isNew = true;
+	tex->CacheEntry = mTextureCache.AcquireFile(filename, maxSize, isNew);
+
+	if (isNew)
+	{
+		ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
+			mCommandList.Get(), tex->Filename.c_str(),
+			tex->Resource, tex->UploadHeap, maxSize));
+
+		if (tex->CacheEntry >= 0)
+		{
+			auto desc = tex->Resource->GetDesc();
+			mTextureCache.SetByteSize(tex->CacheEntry, md3dDevice->GetResourceAllocationInfo(0, 1, &desc).SizeInBytes);
+			mTextureCacheResources[tex->CacheEntry] = tex->Resource;
+		}
+	}
+	else
+	{
+		tex->Resource = mTextureCacheResources[tex->CacheEntry];
+	}
+
+	auto old = mTextures.find(name);
+	if (old != mTextures.end() && mTextureCache.Release(old->second->CacheEntry))
+		mTextureCacheResources.erase(old->second->CacheEntry);
+
+	mTextures[name] = std::move(tex);
+}
+
+void DX12App::LoadTextureFromMemory(std::string name, const std::vector<uint8_t>& dds)
+{
+	auto tex = std::make_unique<Texture>();
+	tex->Name = name;
+	tex->Type = TextureType::TEXTURE2D;
+
+	ThrowIfFailed(DirectX::GetDDSTextureInfoFromMemory(dds.data(), dds.size(), tex->Info));
+
+	// Shares resources with LoadTexture, a file and its bytes fingerprint the same.
+	bool isNew = true;
+	tex->CacheEntry = mTextureCache.AcquireMemory(dds.data(), dds.size(), 0, isNew);
+
+	if (isNew)
+	{
+		ThrowIfFailed(DirectX::CreateDDSTextureFromMemory12(md3dDevice.Get(),
+			mCommandList.Get(), dds.data(), dds.size(),
+			tex->Resource, tex->UploadHeap));
+
+		auto desc = tex->Resource->GetDesc();
+		mTextureCache.SetByteSize(tex->CacheEntry, md3dDevice->GetResourceAllocationInfo(0, 1, &desc).SizeInBytes);
+		mTextureCacheResources[tex->CacheEntry] = tex->Resource;
+	}
+	else
+	{
+		tex->Resource = mTextureCacheResources[tex->CacheEntry];
+	}
+
+	auto old = mTextures.find(name);
+	if (old != mTextures.end() && mTextureCache.Release(old->second->CacheEntry))
+		mTextureCacheResources.erase(old->second->CacheEntry);
+
 	mTextures[name] = std::move(tex);
 }
 
@@ -753,29 +1297,15 @@ void DX12App::LoadTextures()
 	LoadTexture("trex_diffuse", L"../Textures/trex_diffuse.dds");
 	LoadTexture("trex_nmap", L"../Textures/trex_nmap.dds");
 
+	// Vegetation billboards, a slice per VegetationKind
+	LoadTexture("treeArray", L"../Textures/treearray.dds", TextureType::TEXTURE2DARRAY);
+
 	// Last textures for sky
 	LoadTexture("skyBrdf", L"../Textures/skyBrdf.dds");
 	LoadTexture("skyDiffuseCube", L"../Textures/skyDiffuseCube.dds", TextureType::CUBEMAP);
 	LoadTexture("skyIrradianceCube", L"../Textures/skyIrradianceCube.dds", TextureType::CUBEMAP);
 }
 
-void DX12App::LoadTerrainTextures()
-{
-	for (int layer = 0; layer < layers; layer++)
-		for (int x = 0; x < (1 << layer); x++)
-			for (int y = 0; y < (1 << layer); y++)
-			{
-				LoadTexture("tile_diffuse_level" + std::to_string(layer) + "_" + std::to_string(x) + "_" + std::to_string(y),
-					L"../Textures/Terrain/L" + std::to_wstring(layer) + L"/diffuse/tile_diffuse_level" + std::to_wstring(layer) + L"_" + std::to_wstring(x) + L"_" + std::to_wstring(y) + L".dds");
-				
-				LoadTexture("tile_height_level" + std::to_string(layer) + "_" + std::to_string(x) + "_" + std::to_string(y),
-					L"../Textures/Terrain/L" + std::to_wstring(layer) + L"/height/tile_height_level" + std::to_wstring(layer) + L"_" + std::to_wstring(x) + L"_" + std::to_wstring(y) + L".dds");
-				
-				LoadTexture("tile_normal_level" + std::to_string(layer) + "_" + std::to_string(x) + "_" + std::to_string(y),
-					L"../Textures/Terrain/L" + std::to_wstring(layer) + L"/normal/tile_normal_level" + std::to_wstring(layer) + L"_" + std::to_wstring(x) + L"_" + std::to_wstring(y) + L".dds");
-			}
-}
-
 void DX12App::BuildRootSignature()
 {
 	CD3DX12_DESCRIPTOR_RANGE texTables[10];
@@ -786,19 +1316,28 @@ void DX12App::BuildRootSignature()
 			i); // register ti
 	}
 
+	// Terrain tile textures, 3 per slot, see Terrain.hlsl.
+	CD3DX12_DESCRIPTOR_RANGE terrainTable;
+	terrainTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 3 * gTerrainTileSlots, 0, 1);
+
 	// Root parameter can be a table, root descriptor or root constants.
-	CD3DX12_ROOT_PARAMETER slotRootParameter[20];
+	CD3DX12_ROOT_PARAMETER slotRootParameter[25];
 
 	// Perfomance TIP: Order from most frequent to least frequent.
 	for (int i = 0; i < 10; i++) {
 		slotRootParameter[i].InitAsDescriptorTable(1, &texTables[i], D3D12_SHADER_VISIBILITY_ALL); // 0-9   = textures
 		slotRootParameter[i + 10].InitAsConstantBufferView(i);									   // 10-19 = CBs
 	}
+	slotRootParameter[20].InitAsDescriptorTable(1, &terrainTable, D3D12_SHADER_VISIBILITY_ALL);    // terrain slots
+	slotRootParameter[21].InitAsShaderResourceView(0, 2);                                          // terrain instances
+	slotRootParameter[22].InitAsConstants(4, 0, 1);                                                // terrain batch
+	slotRootParameter[23].InitAsShaderResourceView(1, 2);                                          // light clusters
+	slotRootParameter[24].InitAsShaderResourceView(2, 2);                                          // cluster light indices
 
 	auto staticSamplers = GetStaticSamplers();
 
 	// A root signature is an array of root parameters.
-	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(20, slotRootParameter,
+	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(25, slotRootParameter,
 		(UINT)staticSamplers.size(), staticSamplers.data(),
 		D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
 
@@ -845,22 +1384,39 @@ void DX12App::BuildDescriptorHeaps()
 	srvDesc.Texture2D.MostDetailedMip = 0;
 	srvDesc.Texture2D.ResourceMinLODClamp = 0.0f;
 
+	// Textures sharing a cache entry (and view type) share one descriptor.
+	std::unordered_map<INT64, UINT> sharedSrvs;
+	auto srvKey = [](const Texture* t) { return (INT64)t->CacheEntry * 3 + t->Type; };
+
 	int i = 0;
 	mTextures["black"]->SrvHeapIndex = i++;
-	auto& tex = mTextures["black"]->Resource;
-	srvDesc.Format = tex->GetDesc().Format;
-	srvDesc.Texture2D.MipLevels = tex->GetDesc().MipLevels;
-	md3dDevice->CreateShaderResourceView(tex.Get(), &srvDesc, hDescriptor);
+	auto black = mTextures["black"].get();
+	srvDesc.Format = black->Info.Format;
+	srvDesc.Texture2D.MipLevels = black->Info.MipCount - black->TopMip;
+	md3dDevice->CreateShaderResourceView(black->Resource.Get(), &srvDesc, hDescriptor);
 	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	if (mTextures["black"]->CacheEntry >= 0)
+		sharedSrvs[srvKey(mTextures["black"].get())] = mTextures["black"]->SrvHeapIndex;
 
 	// texture descriptors except default "black"
 	for (auto &Tex : mTextures)
 	{
 		if (Tex.first == "black") continue;
 
+		if (Tex.second->CacheEntry >= 0)
+		{
+			auto shared = sharedSrvs.find(srvKey(Tex.second.get()));
+			if (shared != sharedSrvs.end())
+			{
+				Tex.second->SrvHeapIndex = shared->second;
+				continue;
+			}
+			sharedSrvs[srvKey(Tex.second.get())] = i;
+		}
+
 		Tex.second->SrvHeapIndex = i++;
-		auto& tex = Tex.second->Resource;
-		srvDesc.Format = tex->GetDesc().Format;
+		auto tex = Tex.second.get();
+		srvDesc.Format = tex->Info.Format;
 
 		switch (Tex.second->Type)
 		{
@@ -868,22 +1424,49 @@ void DX12App::BuildDescriptorHeaps()
 			srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
 			srvDesc.Texture2D.MostDetailedMip = 0;
 			srvDesc.Texture2D.ResourceMinLODClamp = 0.0f;
-			srvDesc.Texture2D.MipLevels = tex->GetDesc().MipLevels;
+			srvDesc.Texture2D.MipLevels = tex->Info.MipCount - tex->TopMip;
 			break;
 			
 		case TextureType::CUBEMAP:
 			srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURECUBE;
 			srvDesc.TextureCube.MostDetailedMip = 0;
 			srvDesc.TextureCube.ResourceMinLODClamp = 0.0f;
-			srvDesc.TextureCube.MipLevels = tex->GetDesc().MipLevels;
+			srvDesc.TextureCube.MipLevels = tex->Info.MipCount - tex->TopMip;
+			break;
+
+		case TextureType::TEXTURE2DARRAY:
+			srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2DARRAY;
+			srvDesc.Texture2DArray.MostDetailedMip = 0;
+			srvDesc.Texture2DArray.ResourceMinLODClamp = 0.0f;
+			srvDesc.Texture2DArray.MipLevels = tex->Info.MipCount - tex->TopMip;
+			srvDesc.Texture2DArray.FirstArraySlice = 0;
+			srvDesc.Texture2DArray.ArraySize = tex->Info.ArraySize;
+			srvDesc.Texture2DArray.PlaneSlice = 0;
 			break;
 		}
 
-		md3dDevice->CreateShaderResourceView(tex.Get(), &srvDesc, hDescriptor);
+		md3dDevice->CreateShaderResourceView(tex->Resource.Get(), &srvDesc, hDescriptor);
+		hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	}
+
+	// Terrain tile slots, black until a node takes them.
+	mTerrainSrvBase = i;
+	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	srvDesc.Format = black->Info.Format;
+	srvDesc.Texture2D.MostDetailedMip = 0;
+	srvDesc.Texture2D.ResourceMinLODClamp = 0.0f;
+	srvDesc.Texture2D.MipLevels = black->Info.MipCount - black->TopMip;
+	for (int slot = 0; slot < 3 * gTerrainTileSlots; slot++, i++)
+	{
+		md3dDevice->CreateShaderResourceView(black->Resource.Get(), &srvDesc, hDescriptor);
 		hDescriptor.Offset(1, mCbvSrvDescriptorSize);
 	}
 
-	mGBuffer->Channel0SRVHeapIndex = (UINT)mTextures.size();
+	// Second descriptors of the textures, written when residency reloads them.
+	mResidencySrvBase = i;
+	i += mTerrainSrvBase;
+
+	mGBuffer->Channel0SRVHeapIndex = i;
 	mShadowMapHeapIndex = mGBuffer->Channel0SRVHeapIndex + mGBuffer->NumBuffers + 1;
 
 	// copy gbuffer resources into the srv heap
@@ -903,11 +1486,9 @@ void DX12App::BuildShadersAndInputLayout()
 	};
 
 	mShaders["deferredVS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "VS", "vs_5_0");
-	mShaders["displaceVS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "displaceVS", "vs_5_0");
 	mShaders["tessVS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "tessVS", "vs_5_0");
 	mShaders["tessHS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "HS", "hs_5_0");
 	mShaders["tessDS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "DS", "ds_5_0");
-	mShaders["curtainsGS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "curtainsGS", "gs_5_0");
 	mShaders["deferredPS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "DeferredPS", "ps_5_0");
 	mShaders["originalNormalPS"] = d3dUtil::CompileShader(L"Shaders\\DeferredGeometry.hlsl", nullptr, "OriginalNormalPS", "ps_5_0");
 	
@@ -923,7 +1504,13 @@ void DX12App::BuildShadersAndInputLayout()
 	mShaders["deferredLightsPS"] = d3dUtil::CompileShader(L"Shaders\\DeferredLights.hlsl", nullptr, "PS", "ps_5_1");
 	mShaders["deferredLightsGeometryVS"] = d3dUtil::CompileShader(L"Shaders\\DeferredLights.hlsl", nullptr, "LightsGeometryVS", "vs_5_1");
 	mShaders["deferredAmbientPS"] = d3dUtil::CompileShader(L"Shaders\\DeferredLights.hlsl", nullptr, "AmbientPS", "ps_5_1");
+	mShaders["deferredClusteredPS"] = d3dUtil::CompileShader(L"Shaders\\DeferredLights.hlsl", nullptr, "ClusteredPS", "ps_5_1");
 	
+	mShaders["terrainVS"] = d3dUtil::CompileShader(L"Shaders\\Terrain.hlsl", nullptr, "VS", "vs_5_1");
+	mShaders["terrainPS"] = d3dUtil::CompileShader(L"Shaders\\Terrain.hlsl", nullptr, "PS", "ps_5_1");
+	mShaders["vegetationVS"] = d3dUtil::CompileShader(L"Shaders\\Vegetation.hlsl", nullptr, "VS", "vs_5_1");
+	mShaders["vegetationPS"] = d3dUtil::CompileShader(L"Shaders\\Vegetation.hlsl", nullptr, "PS", "ps_5_1");
+
 	mShaders["postVS"] = d3dUtil::CompileShader(L"Shaders\\PostProcessing.hlsl", nullptr, "VS", "vs_5_0");
 	mShaders["postPS"] = d3dUtil::CompileShader(L"Shaders\\PostProcessing.hlsl", nullptr, "PS", "ps_5_0");
 
@@ -942,7 +1529,7 @@ void DX12App::BuildShapeGeometry()
 	std::vector<GeometryGenerator::MeshData> allMeshData;
 
 	// if you want to generate new model -- generate it here
-	allMeshData.push_back( geoGen.CreateGrid(1.0f, 1.0f, 128, 128, 1.0f) );           // grid
+	allMeshData.push_back( geoGen.CreateGrid(1.0f, 1.0f, TerrainHeightData::GridVertices, TerrainHeightData::GridVertices, 1.0f) );           // grid
 	allMeshData.push_back( geoGen.CreateBox(10.0f, 10.0f, 10.0f, 3) );                // box
 	allMeshData.push_back( geoGen.LoadModel("..\\Models\\trex.obj"));             // trex
 	allMeshData.push_back( geoGen.LoadModel("..\\Models\\Baryonyx.obj"));         // baryonyx
@@ -1055,6 +1642,16 @@ void DX12App::BuildShapeGeometry()
 		geo->DrawArgs[allMeshData.at(i).name] = allSubmeshes.at(i);
 	}
 
+	for (auto& mesh : allMeshData)
+	{
+		for (const char* model : gOccluderModels)
+		{
+			if (mesh.name == model && !mesh.Vertices.empty())
+				mOccluderMeshes[mesh.name] = SimplifyOccluder(&mesh.Vertices[0].Position, sizeof(GeometryGenerator::Vertex), mesh.Vertices.size(),
+					mesh.Indices32.data(), mesh.Indices32.size(), gOccluderCells);
+		}
+	}
+
 	mGeometries[geo->Name] = std::move(geo);
 }
 
@@ -1128,6 +1725,11 @@ void DX12App::BuildPSOs()
 	smapPsoDesc.RasterizerState.SlopeScaledDepthBias = 1.0f;
 	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&smapPsoDesc, IID_PPV_ARGS(&mPSOs["shadow_opaque"])));
 
+	// Cascades draw the casters between the light and their near plane as well, see
+	// CullShadowCasters; clamping their depth flattens them onto the near plane.
+	smapPsoDesc.RasterizerState.DepthClipEnable = FALSE;
+	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&smapPsoDesc, IID_PPV_ARGS(&mPSOs["shadow_directional"])));
+
 	//
 	// PSO for sky.
 	//
@@ -1179,21 +1781,32 @@ void DX12App::BuildPSOs()
 
 	deferredGeometryPsoDesc.VS =
 	{
-		reinterpret_cast<BYTE*>(mShaders["displaceVS"]->GetBufferPointer()),
-		mShaders["displaceVS"]->GetBufferSize()
-	};
-	deferredGeometryPsoDesc.GS =
-	{
-	  reinterpret_cast<BYTE*>(mShaders["curtainsGS"]->GetBufferPointer()),
-	  mShaders["curtainsGS"]->GetBufferSize()
+		reinterpret_cast<BYTE*>(mShaders["terrainVS"]->GetBufferPointer()),
+		mShaders["terrainVS"]->GetBufferSize()
 	};
 	deferredGeometryPsoDesc.PS =
 	{
-	 reinterpret_cast<BYTE*>(mShaders["originalNormalPS"]->GetBufferPointer()),
-	 mShaders["originalNormalPS"]->GetBufferSize()
+	 reinterpret_cast<BYTE*>(mShaders["terrainPS"]->GetBufferPointer()),
+	 mShaders["terrainPS"]->GetBufferSize()
 	};
 	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&deferredGeometryPsoDesc, IID_PPV_ARGS(&mPSOs["terrainGeometry"])));
 
+	// Billboards come from SV_VertexID and face the eye, so no input layout and no culling.
+	D3D12_GRAPHICS_PIPELINE_STATE_DESC vegetationPsoDesc = deferredGeometryPsoDesc;
+	vegetationPsoDesc.InputLayout = { nullptr, 0 };
+	vegetationPsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+	vegetationPsoDesc.VS =
+	{
+		reinterpret_cast<BYTE*>(mShaders["vegetationVS"]->GetBufferPointer()),
+		mShaders["vegetationVS"]->GetBufferSize()
+	};
+	vegetationPsoDesc.PS =
+	{
+		reinterpret_cast<BYTE*>(mShaders["vegetationPS"]->GetBufferPointer()),
+		mShaders["vegetationPS"]->GetBufferSize()
+	};
+	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&vegetationPsoDesc, IID_PPV_ARGS(&mPSOs["vegetationGeometry"])));
+
 	deferredGeometryPsoDesc.VS =
 	{
 		reinterpret_cast<BYTE*>(mShaders["tessVS"]->GetBufferPointer()),
@@ -1258,6 +1871,16 @@ void DX12App::BuildPSOs()
 	};
 	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&deferredPsoDesc, IID_PPV_ARGS(&mPSOs["deferredAmbient"])));
 
+	//
+	// PSO for the lights without shadow maps, by clusters
+	//
+	deferredPsoDesc.PS =
+	{
+		reinterpret_cast<BYTE*>(mShaders["deferredClusteredPS"]->GetBufferPointer()),
+		mShaders["deferredClusteredPS"]->GetBufferSize()
+	};
+	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&deferredPsoDesc, IID_PPV_ARGS(&mPSOs["deferredClustered"])));
+
 	//
 	// PSO for using geometry for lights
 	//
@@ -1318,7 +1941,8 @@ void DX12App::BuildFrameResources()
 	for (int i = 0; i < gNumFrameResources; ++i)
 	{
 		mFrameResources.push_back(std::make_unique<FrameResource>(md3dDevice.Get(),
-			2, (UINT)mAllRitems.size(), (UINT)mMaterials.size(), (UINT)mAllLights.size()));
+			2, (UINT)mAllRitems.size(), (UINT)mMaterials.size(), (UINT)mAllLights.size(), gTerrainTileSlots, gVegetationMaxInstances,
+			gMaxClusterLights, (UINT)mLightClusters.Clusters().size(), gMaxClusterLightIndices));
 	}
 }
 
@@ -1386,24 +2010,32 @@ void DX12App::BuildMaterials()
 		}
 	}
 
-	// terrain materials
-	for (int layer = 0; layer < layers; layer++)
-		for (int x = 0; x < (1 << layer); x++)
-			for (int y = 0; y < (1 << layer); y++)
-			{
-				auto terrain = std::make_unique<Material>();
-				terrain->Name = "terrain" + std::to_string(layer) + "_" + std::to_string(x) + "_" + std::to_string(y);
-				terrain->MatCBIndex = matCBI++;
-				terrain->DiffuseSrvHeapIndex = mTextures["tile_diffuse_level" + std::to_string(layer) + "_" + std::to_string(x) + "_" + std::to_string(y)]->SrvHeapIndex;
-				terrain->DisplaceSrvHeapIndex = mTextures["tile_height_level" + std::to_string(layer) + "_" + std::to_string(x) + "_" + std::to_string(y)]->SrvHeapIndex;
-				terrain->NormalSrvHeapIndex = mTextures["tile_normal_level" + std::to_string(layer) + "_" + std::to_string(x) + "_" + std::to_string(y)]->SrvHeapIndex;
-				terrain->DiffuseAlbedo = XMFLOAT4(0.5f, 0.5f, 0.5f, 1.0f);
-				terrain->FresnelR0 = XMFLOAT3(0.5f, 0.5f, 0.5f);
-				terrain->Roughness = 1.0f;
-				terrain->Metallic = 0.1f;
-
-				mMaterials[terrain->Name] = std::move(terrain);
-			}
+	// terrain tile slots
+	for (int slot = 0; slot < gTerrainTileSlots; slot++)
+	{
+		auto terrain = std::make_unique<Material>();
+		terrain->Name = "terrainSlot" + std::to_string(slot);
+		terrain->MatCBIndex = matCBI++;
+		terrain->DiffuseSrvHeapIndex = mTerrainSrvBase + 3 * slot;
+		terrain->DisplaceSrvHeapIndex = mTerrainSrvBase + 3 * slot + 1;
+		terrain->NormalSrvHeapIndex = mTerrainSrvBase + 3 * slot + 2;
+		terrain->DiffuseAlbedo = XMFLOAT4(0.5f, 0.5f, 0.5f, 1.0f);
+		terrain->FresnelR0 = XMFLOAT3(0.5f, 0.5f, 0.5f);
+		terrain->Roughness = 1.0f;
+		terrain->Metallic = 0.1f;
+
+		mMaterials[terrain->Name] = std::move(terrain);
+	}
+
+	auto vegetation = std::make_unique<Material>();
+	vegetation->Name = "vegetation";
+	vegetation->MatCBIndex = matCBI++;
+	vegetation->DiffuseSrvHeapIndex = mTextures["treeArray"]->SrvHeapIndex;
+	vegetation->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
+	vegetation->FresnelR0 = XMFLOAT3(0.02f, 0.02f, 0.02f);
+	vegetation->Roughness = 0.9f;
+
+	mMaterials[vegetation->Name] = std::move(vegetation);
 }
 
 RenderItem* DX12App::BuildRenderItem(std::string name, std::string material, XMMATRIX translate, std::vector<std::string>* LODGeoNames, int layer, float scale, float scaleTex)
@@ -1436,12 +2068,13 @@ void DX12App::BuildRenderItems()
 	BuildRenderItem("quad", "bricks0", XMMatrixIdentity(), nullptr, (int)RenderLayer::Debug);
 
 	//BuildRenderItem("box", "bricks0", XMMatrixTranslation(15.f, 0.f, 0.f), nullptr);
-	BuildRenderItem("trex", "trex", XMMatrixTranslation(40.f, -5.f, -60.f), nullptr, 0, 2.f);
+	// The dinosaurs stand on the terrain, see PlaceOnTerrain.
+	mGroundedItems.push_back(BuildRenderItem("trex", "trex", XMMatrixTranslation(40.f, 0.f, -60.f), nullptr, 0, 2.f));
 
 	std::vector<std::string> BaryonyxLODs = {"Baryonyx", "box"};
-	BuildRenderItem("Baryonyx", "gorg", XMMatrixTranslation(0.f, -5.f, 20.f), &BaryonyxLODs);
-	BuildRenderItem("Baryonyx", "gorg", XMMatrixTranslation(-30.f, -5.f, 40.f), &BaryonyxLODs);
-	BuildRenderItem("Baryonyx", "gorg", XMMatrixTranslation(30.f, -5.f, 0.f), &BaryonyxLODs);
+	mGroundedItems.push_back(BuildRenderItem("Baryonyx", "gorg", XMMatrixTranslation(0.f, 0.f, 20.f), &BaryonyxLODs));
+	mGroundedItems.push_back(BuildRenderItem("Baryonyx", "gorg", XMMatrixTranslation(-30.f, 0.f, 40.f), &BaryonyxLODs));
+	mGroundedItems.push_back(BuildRenderItem("Baryonyx", "gorg", XMMatrixTranslation(30.f, 0.f, 0.f), &BaryonyxLODs));
 
 	float spacing = 7.f;
 	for (int i = 0; i < 11; i++)
@@ -1479,6 +2112,21 @@ void DX12App::BuildLightObjects()
 	point1->Strength = { 2.f, 2.f, 2.f };
 	mAllLights.push_back(std::move(point1));
 
+	// Coloured lamps just above the spheres, without shadows.
+	for (int i = 0; i < gLampRows; i++)
+	{
+		for (int j = 0; j < gLampRows; j++)
+		{
+			ClusterLight lamp;
+			lamp.Position = { i * 7.f - 80.f, 3.f, j * 7.f - 80.f };
+			lamp.Strength = { 0.5f + 0.5f * i / gLampRows, 0.5f, 0.5f + 0.5f * j / gLampRows };
+			lamp.FalloffStart = 1.f;
+			lamp.FalloffEnd = 6.f;
+			mClusterLights.push_back(lamp);
+			mClusterLightBounds.push_back(BoundingSphere(lamp.Position, lamp.FalloffEnd));
+		}
+	}
+
 	auto srvCpuStart = mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart();
 	auto srvGpuStart = mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart();
 	auto dsvCpuStart = mDsvHeap->GetCPUDescriptorHandleForHeapStart();
@@ -1598,9 +2246,11 @@ void DX12App::DrawDeferredGeometry()
 	mCommandList->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 	DrawRenderItems(mCommandList.Get(), mVisibleRitems[(int)RenderLayer::Opaque]);
 
-	// terrain w/ tessellation draw
 	mCommandList->SetPipelineState(mPSOs["terrainGeometry"].Get());
-	DrawRenderItems(mCommandList.Get(), mVisibleTerrain);
+	DrawTerrain();
+
+	mCommandList->SetPipelineState(mPSOs["vegetationGeometry"].Get());
+	DrawVegetation();
 	
 	for (int i = 0; i < (int)RenderLayer::Count; i++)
 	{
@@ -1682,6 +2332,22 @@ void DX12App::DrawDeferredLights()
 		}
 	}
 
+	// The lights without shadow maps in one pass, every pixel shaded with the lights
+	// of its cluster.
+	if (!mClusterLights.empty())
+	{
+		const LightClusterSettings& settings = mLightClusters.Settings();
+		UINT tiles[2] = { settings.TilesX | settings.TilesY << 16, settings.Slices };
+		float slices[2] = { mLightClusters.SliceScale(), mLightClusters.SliceBias() };
+		mCommandList->SetPipelineState(mPSOs["deferredClustered"].Get());
+		mCommandList->SetGraphicsRootShaderResourceView(21, mCurrFrameResource->ClusterLights->Resource()->GetGPUVirtualAddress());
+		mCommandList->SetGraphicsRootShaderResourceView(23, mCurrFrameResource->ClusterRanges->Resource()->GetGPUVirtualAddress());
+		mCommandList->SetGraphicsRootShaderResourceView(24, mCurrFrameResource->ClusterLightIndices->Resource()->GetGPUVirtualAddress());
+		mCommandList->SetGraphicsRoot32BitConstants(22, 2, tiles, 0);
+		mCommandList->SetGraphicsRoot32BitConstants(22, 2, slices, 2);
+		mCommandList->DrawInstanced(3, 1, 0, 0);
+	}
+
 	mCommandList->SetPipelineState(mPSOs["deferredAmbient"].Get());
 	mCommandList->DrawInstanced(6, 1, 0, 0); // todo 3?
 }
@@ -1742,11 +2408,12 @@ void DX12App::DrawShadowMaps()
 
 	mCommandList->SetGraphicsRootConstantBufferView(11, passCB->GetGPUVirtualAddress());
 	mCommandList->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-	mCommandList->SetPipelineState(mPSOs["shadow_opaque"].Get());
 
-	for (auto &Light : mAllLights)
+	for (size_t l = 0; l < mAllLights.size(); l++)
 	{
+		auto& Light = mAllLights[l];
 		auto shadowMap = Light->shadowMap;
+		mCommandList->SetPipelineState(mPSOs[Light->LightType == LightType::Directional ? "shadow_directional" : "shadow_opaque"].Get());
 		mCommandList->RSSetViewports(1, &shadowMap->Viewport());
 		mCommandList->RSSetScissorRects(1, &shadowMap->ScissorRect());
 
@@ -1765,7 +2432,23 @@ void DX12App::DrawShadowMaps()
 		D3D12_GPU_VIRTUAL_ADDRESS lightCBAddress = lightCB->GetGPUVirtualAddress() + Light->lightCBIndex * lightCBByteSize;
 		mCommandList->SetGraphicsRootConstantBufferView(13, lightCBAddress);
 
-		DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
+		// Each group once, the geometry shader copying it to the views of its mask.
+		if (mShadowCasterCulling && l < mShadowCasters.size())
+		{
+			for (const ShadowCasters::Group& group : mShadowCasters[l].Groups())
+			{
+				mShadowDrawItems.clear();
+				for (uint32_t item : group.Items)
+					mShadowDrawItems.push_back(mAllRitems[item].get());
+				mCommandList->SetGraphicsRoot32BitConstant(22, group.ViewMask, 0);
+				DrawRenderItems(mCommandList.Get(), mShadowDrawItems);
+			}
+		}
+		else
+		{
+			mCommandList->SetGraphicsRoot32BitConstant(22, (1u << ShadowCasters::MaxViews) - 1, 0);
+			DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
+		}
 
 		// Transition dsv to rtv
 		mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(
@@ -1775,77 +2458,808 @@ void DX12App::DrawShadowMaps()
 	}
 }
 
-Node* DX12App::BuildNode(int layer, float x, float y, int xi, int yi)
+void DX12App::BuildTerrainQuadTree()
 {
+	// nodes.bin describes every node of the tile pyramid; it is built from the height
+	// tiles when missing, or ahead of time with -terrain-nodes.
+	const std::wstring terrainDir = L"../Textures/Terrain";
+	const std::wstring nodesFile = terrainDir + L"/nodes.bin";
+	if (!mTerrainNodes.Open(nodesFile) &&
+		!(BuildTerrainNodeFile(terrainDir, nodesFile, gTerrainMaxLevels) && mTerrainNodes.Open(nodesFile)))
+	{
+		OutputDebugStringA("Terrain: can't read or build nodes.bin, no terrain\n");
+		return;
+	}
 
-	Node* node = new Node();
-	node->layer = layer;
+	// Below the stored levels the terrain goes on with synthesized detail, at the
+	// resolution of the stored tiles (a texel per grid quad).
+	TerrainDetailSettings detailSettings;
+	detailSettings.StoredLevels = mTerrainNodes.Levels();
+	detailSettings.Levels = gTerrainDetailLevels;
+	detailSettings.TileResolution = TerrainHeightData::GridVertices - 1;
+	detailSettings.RootSize = RootSize;
+	detailSettings.HeightScale = TerrainHeightScale;
+	mTerrainDetail.Reset(detailSettings);
+
+	mTerrainTree.Build(std::min(gTerrainMaxLevels, mTerrainDetail.TotalLevels()), RootSize, 0.f, 0.f, TerrainBaseY, TerrainBaseY + TerrainHeightScale);
+	mTerrainLevelErrors = mTerrainDetail.LevelErrors(mTerrainNodes.LevelErrors());
+	for (float& error : mTerrainLevelErrors)
+		error *= TerrainHeightScale;
+
+	for (int slot = 0; slot < gTerrainTileSlots; slot++)
+	{
+		mTerrainItems.push_back(BuildRenderItem("grid", "terrainSlot" + std::to_string(slot), XMMatrixIdentity(), nullptr, (int)RenderLayer::Terrain));
+		mFreeTerrainSlots.push_back(gTerrainTileSlots - 1 - slot);
+	}
+	mTerrainMinHeights.resize(gTerrainTileSlots);
+
+	TerrainPagerSettings settings;
+	settings.MaxNodes = gTerrainTileSlots;
+	settings.BaseY = TerrainBaseY;
+	settings.HeightScale = TerrainHeightScale;
+	settings.DeferCreation = true;
+	mTerrainPager = std::make_unique<TerrainPager>(mTerrainTree, mTerrainNodes, settings, &mTerrainDetail);
+
+	TerrainHeightFieldSettings heightSettings;
+	heightSettings.Levels = mTerrainTree.Depth();
+	heightSettings.RootSize = RootSize;
+	heightSettings.BaseY = TerrainBaseY;
+	heightSettings.HeightScale = TerrainHeightScale;
+	mTerrainHeights.Reset(heightSettings);
+
+	// Only the root exists at startup, read right away; the command list is still open here.
+	mTerrainPager->Reset();
+	for (auto& node : mTerrainPager->Created())
+	{
+		TerrainTileData tile;
+		ReadTerrainTile(node.Node, node.Level, {}, tile);
+		LoadTerrainTile(node.Node, node.Level, tile);
+	}
+}
 
-	float scaleFactor = RootSize / ( 1 << layer );
+void DX12App::UpdateVisibleTerrainTiles()
+{
+	ComputeTerrainLodRanges(mTerrainTree, mTerrainLod, mTerrainLevelErrors, mCamera.GetFovY(), (float)mClientHeight, mTerrainRanges);
+	mTerrainCut.Update(mTerrainTree, mTerrainRanges, mCamera.Bounds, mCamera.GetPosition3f(), gTerrainSelectionBudget);
+	UpdateTerrainPaging();
 
-	std::string debugString = std::to_string(layer) + "_" + std::to_string(xi) + "_" + std::to_string(yi) + "\n";
-	OutputDebugStringA(debugString.c_str());
+	// Slots of the drawn tiles looked up in parallel, then taken in the cut's order.
+	const auto& drawn = mTerrainCut.Drawn();
+	mThreadPool.ParallelRanges(drawn.size(), gUpdateGrainSize, mUpdateRanges, [&](size_t begin, size_t end, UpdateRange& range)
+	{
+		range.Tiles.clear();
+		range.Slots.clear();
+		for (size_t i = begin; i < end; i++)
+		{
+			auto slot = mTerrainNodeSlots.find(drawn[i].Node);
+			if (slot == mTerrainNodeSlots.end())
+				continue;
 
-	node->RItem = BuildRenderItem("grid", "terrain" + std::to_string(layer) + "_" + std::to_string(xi) + "_" + std::to_string(yi),
-		XMMatrixScaling(scaleFactor, 1.0f, scaleFactor) * XMMatrixTranslation(x, -40.f, y),
-		nullptr, (int)RenderLayer::Terrain);
+			range.Tiles.push_back(drawn[i]);
+			range.Slots.push_back((uint32_t)slot->second);
+		}
+	});
 
-	if (layer > layers - 2)
+	mVisibleTerrain.clear();
+	mVisibleTerrainSlots.clear();
+	for (auto& range : mUpdateRanges)
 	{
-		return node;
+		mVisibleTerrain.insert(mVisibleTerrain.end(), range.Tiles.begin(), range.Tiles.end());
+		mVisibleTerrainSlots.insert(mVisibleTerrainSlots.end(), range.Slots.begin(), range.Slots.end());
 	}
+}
 
-	node->hasChildren = true;
+void DX12App::CullBelowTerrainHorizon()
+{
+	if (!mHorizonCulling)
+	{
+		mHorizonCulledTiles = mHorizonCulledItems = 0;
+		return;
+	}
 
+	// Drawn tiles occlude with their cells; tiles and opaque items are the boxes to cull.
+	mTerrainHorizon.Begin(mCamera.GetPosition3f());
+	mCullBoxes.clear();
+	for (uint32_t slot : mVisibleTerrainSlots)
+	{
+		const BoundingBox& bounds = mTerrainItems[slot]->Bounds;
+		if (!mTerrainMinHeights[slot].empty())
+			mTerrainHorizon.AddOccluderGrid(bounds, gTerrainOccluderCells, mTerrainMinHeights[slot].data());
+		mCullBoxes.push_back(bounds);
+	}
+	for (RenderItem* ri : mVisibleRitems[(int)RenderLayer::Opaque])
+		mCullBoxes.push_back(ri->Bounds);
 
-	XMFLOAT2 offsets[4] = { {-1.f, -1.f},
-							{-1.f, 1.f},
-							{1.f, -1.f},
-							{1.f, 1.f} };
+	mTerrainHorizon.Cull(mCullBoxes, mCullHidden);
+	DropHidden("Horizon", mHorizonCulledTiles, mHorizonCulledItems);
+}
 
-	int coords[4][2] =		{{0, 1},
-							{0, 0},
-							{1, 1},
-							{1, 0} };
+void DX12App::CullOccluded()
+{
+	if (!mOcclusionCulling)
+	{
+		mOcclusionCulledTiles = mOcclusionCulledItems = 0;
+		return;
+	}
 
-	for (int i = 0; i < 4; i++)
+	// Tiles the horizon left occlude with their cells and the models with their
+	// simplified meshes; tiles and opaque items are the boxes to cull.
+	mOcclusion.Begin(XMMatrixMultiply(mCamera.GetView(), mCamera.GetProj()));
+	mCullBoxes.clear();
+	for (uint32_t slot : mVisibleTerrainSlots)
+	{
+		const BoundingBox& bounds = mTerrainItems[slot]->Bounds;
+		if (!mTerrainMinHeights[slot].empty())
+			mOcclusion.AddOccluderGrid(bounds, gTerrainOccluderCells, mTerrainMinHeights[slot].data());
+		mCullBoxes.push_back(bounds);
+	}
+	for (RenderItem* ri : mVisibleRitems[(int)RenderLayer::Opaque])
 	{
-		node->children[i] = BuildNode(layer + 1, x + offsets[i].x * scaleFactor * 0.25f, y + offsets[i].y * scaleFactor * 0.25f,
-					xi * 2 + coords[i][0], yi * 2 + coords[i][1]);
+		auto occluder = mOccluderMeshes.find(ri->geoName);
+		if (occluder != mOccluderMeshes.end())
+			mOcclusion.AddOccluder(occluder->second, XMLoadFloat4x4(&ri->World));
+		mCullBoxes.push_back(ri->Bounds);
 	}
 
-	return node;
+	mOcclusion.Rasterize(mThreadPool);
+	mOcclusion.Cull(mCullBoxes, mCullHidden, mThreadPool);
+	DropHidden("Occlusion", mOcclusionCulledTiles, mOcclusionCulledItems);
 }
 
-void DX12App::BuildTerrainQuadTree()
+void DX12App::DropHidden(const char* name, uint32_t& culledTiles, uint32_t& culledItems)
 {
-	root = BuildNode(0, 0.f, 0.f, 0, 0);
+	auto& items = mVisibleRitems[(int)RenderLayer::Opaque];
+	size_t tiles = mVisibleTerrain.size();
+	size_t kept = 0;
+	for (size_t i = 0; i < tiles; i++)
+	{
+		if (mCullHidden[i])
+			continue;
+		mVisibleTerrain[kept] = mVisibleTerrain[i];
+		mVisibleTerrainSlots[kept++] = mVisibleTerrainSlots[i];
+	}
+	uint32_t tilesNow = (uint32_t)(tiles - kept);
+	mVisibleTerrain.resize(kept);
+	mVisibleTerrainSlots.resize(kept);
+
+	kept = 0;
+	for (size_t i = 0; i < items.size(); i++)
+		if (!mCullHidden[tiles + i])
+			items[kept++] = items[i];
+	uint32_t itemsNow = (uint32_t)(items.size() - kept);
+	items.resize(kept);
+
+	if (tilesNow != culledTiles || itemsNow != culledItems)
+	{
+		std::string stats = std::string(name) + ": culled " + std::to_string(tilesNow) + " of " + std::to_string(tiles) + " tiles, " +
+			std::to_string(itemsNow) + " of " + std::to_string(itemsNow + kept) + " objects\n";
+		OutputDebugStringA(stats.c_str());
+	}
+	culledTiles = tilesNow;
+	culledItems = itemsNow;
 }
 
-void DX12App::UpdateVisibleTerrainTiles()
+void DX12App::CullShadowCasters()
 {
-	mVisibleTerrain.clear();
-	
-	ChooseVisibleTerrainTile(root);
+	if (!mShadowCasterCulling)
+		return;
+
+	// Opaque items cast; the sky and the terrain slots don't.
+	if (mCastsShadow.size() != mAllRitems.size())
+	{
+		mCastsShadow.resize(mAllRitems.size());
+		for (size_t i = 0; i < mAllRitems.size(); i++)
+			mCastsShadow[i] = mAllRitems[i]->layer == (int)RenderLayer::Opaque;
+	}
+
+	// A light per job. Cascades are boxes around the camera and reach back to the
+	// light, so what stands between them and the light still shadows them; cube faces
+	// and spot lights start at the light anyway.
+	mShadowCasters.resize(mAllLights.size());
+	mThreadPool.ParallelFor(mAllLights.size(), 1, [&](size_t l)
+	{
+		const LightObject& light = *mAllLights[l];
+		ShadowCasterView views[ShadowCasters::MaxViews];
+		for (uint32_t v = 0; v < light.ShadowViewCount; v++)
+			views[v] = MakeShadowCasterView(XMLoadFloat4x4(&light.ShadowViewProj[v]), light.LightType == LightType::Directional);
+		mShadowCasters[l].Cull(mRitemBounds, views, light.ShadowViewCount, mCastsShadow);
+	});
+
+	std::vector<size_t> counts;
+	for (const ShadowCasters& casters : mShadowCasters)
+		for (uint32_t v = 0; v < casters.ViewCount(); v++)
+			counts.push_back(casters.View(v).size());
+	if (counts != mShadowCasterCounts)
+	{
+		std::string stats = "Shadow casters of " + std::to_string(mRitemLayer[(int)RenderLayer::Opaque].size()) + " objects:";
+		for (size_t l = 0; l < mShadowCasters.size(); l++)
+		{
+			stats += (l == 0 ? " light " : ", light ") + std::to_string(l) + " [";
+			for (uint32_t v = 0; v < mShadowCasters[l].ViewCount(); v++)
+				stats += (v == 0 ? "" : " ") + std::to_string(mShadowCasters[l].View(v).size());
+			stats += "] in " + std::to_string(mShadowCasters[l].Groups().size()) + " groups";
+		}
+		stats += "\n";
+		OutputDebugStringA(stats.c_str());
+		mShadowCasterCounts.swap(counts);
+	}
 }
 
-void DX12App::ChooseVisibleTerrainTile(Node* node)
+void DX12App::PlaceOnTerrain()
 {
-	if (!mCamera.Bounds.Intersects(node->RItem->Bounds))
+	// Heights only change when tiles are paged in or out.
+	if (mTerrainHeights.Version() == mGroundedVersion)
 		return;
 
-	float distToCam;
-	XMStoreFloat(&distToCam, XMVector3Length(XMVectorSubtract(mCamera.GetPosition(), XMLoadFloat3(&node->RItem->Bounds.Center))));
+	std::vector<XMFLOAT2> points;
+	for (RenderItem* ri : mGroundedItems)
+		points.push_back(XMFLOAT2(ri->World._41, ri->World._43));
+	std::vector<float> heights(points.size());
+	if (!mTerrainHeights.QueryHeights(points.data(), points.size(), heights.data()))
+		return;
+	mGroundedVersion = mTerrainHeights.Version();
 
-	if (distToCam > thresholds[node->layer] || !node->hasChildren)
-		mVisibleTerrain.push_back(node->RItem);
+	for (size_t i = 0; i < mGroundedItems.size(); i++)
+	{
+		RenderItem* ri = mGroundedItems[i];
+		if (ri->World._42 == heights[i])
+			continue;
+		ri->World._42 = heights[i];
+		ri->Geo->DrawArgs[ri->geoName].Bounds.Transform(ri->Bounds, XMLoadFloat4x4(&ri->World));
+		ri->NumFramesDirty = gNumFrameResources;
+	}
+}
 
-	else
+void DX12App::PickTerrain(int x, int y)
+{
+	XMFLOAT4X4 proj = mCamera.GetProj4x4f();
+	float vx = (2.0f * x / mClientWidth - 1.0f) / proj(0, 0);
+	float vy = (-2.0f * y / mClientHeight + 1.0f) / proj(1, 1);
+
+	TerrainRay ray;
+	ray.Origin = mCamera.GetPosition3f();
+	XMStoreFloat3(&ray.Direction, XMVector3Normalize(vx * mCamera.GetRight() + vy * mCamera.GetUp() + mCamera.GetLook()));
+	TerrainRayHit hit;
+	if (!mTerrainHeights.Raycast(&ray, 1, &hit))
+		return;
+
+	std::string report = "Terrain pick: missed\n";
+	if (hit.Hit)
+		report = "Terrain pick: (" + std::to_string(hit.Position.x) + ", " + std::to_string(hit.Position.y) + ", " +
+			std::to_string(hit.Position.z) + ") on a level " + std::to_string(hit.Level) + " tile, " + std::to_string(hit.T) + " away\n";
+	OutputDebugStringA(report.c_str());
+}
+
+void DX12App::UpdateTerrainInstances()
+{
+	BuildTerrainInstances(mTerrainTree, mTerrainRanges, mVisibleTerrain, mVisibleTerrainSlots, mTerrainInstances, mTerrainBatches);
+
+	auto instances = mCurrFrameResource->TerrainInstances.get();
+	for (size_t i = 0; i < mTerrainInstances.size(); i++)
+		instances->CopyData((int)i, mTerrainInstances[i]);
+}
+
+void DX12App::DrawTerrain()
+{
+	if (mTerrainBatches.empty())
+		return;
+
+	// All tiles share the grid mesh and the slot material; only the instance buffer
+	// and the slot textures it points into differ.
+	RenderItem* grid = mTerrainItems[0];
+	UINT matCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(MaterialConstants));
+	D3D12_GPU_VIRTUAL_ADDRESS matCBAddress = mCurrFrameResource->MaterialCB->Resource()->GetGPUVirtualAddress() + grid->Mat->MatCBIndex * matCBByteSize;
+
+	mCommandList->SetGraphicsRootDescriptorTable(20, CD3DX12_GPU_DESCRIPTOR_HANDLE(
+		mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart(), mTerrainSrvBase, mCbvSrvDescriptorSize));
+	mCommandList->SetGraphicsRootShaderResourceView(21, mCurrFrameResource->TerrainInstances->Resource()->GetGPUVirtualAddress());
+	mCommandList->SetGraphicsRootConstantBufferView(12, matCBAddress);
+	mCommandList->IASetVertexBuffers(0, 1, &grid->Geo->VertexBufferView());
+	mCommandList->IASetIndexBuffer(&grid->Geo->IndexBufferView());
+
+	float constants[3] = { (float)(TerrainHeightData::GridVertices - 1), TerrainBaseY, TerrainHeightScale };
+	mCommandList->SetGraphicsRoot32BitConstants(22, 3, constants, 1);
+	for (auto& batch : mTerrainBatches)
+	{
+		mCommandList->SetGraphicsRoot32BitConstant(22, batch.FirstInstance, 0);
+		mCommandList->DrawIndexedInstanced(grid->IndexCount, batch.InstanceCount, grid->StartIndexLocation, grid->BaseVertexLocation, 0);
+	}
+
+	uint32_t calls = TerrainCallsPerFrame + TerrainCallsPerBatch * (uint32_t)mTerrainBatches.size();
+	if (calls != mTerrainDrawCalls)
+	{
+		std::string stats = "Terrain: " + std::to_string(mTerrainInstances.size()) + " tiles in " + std::to_string(mTerrainBatches.size()) +
+			" draws, " + std::to_string(calls) + " command list calls (" + std::to_string(TerrainCallsPerItem * mTerrainInstances.size()) + " as render items)\n";
+		OutputDebugStringA(stats.c_str());
+	}
+	mTerrainDrawCalls = calls;
+}
+
+void DX12App::BuildVegetation()
+{
+	// Plants are placed once, on the stored levels loaded just for this; the heights
+	// the pager keeps resident change with the camera.
+	uint32_t levels = std::min<uint32_t>(mTerrainNodes.Levels(), gVegetationGroundLevels);
+	TerrainHeightData data;
+	if (levels == 0 || !data.Load(L"../Textures/Terrain", levels))
 	{
-		for (auto chold : node->children)
+		OutputDebugStringA("Vegetation: can't load the height tiles, no vegetation\n");
+		return;
+	}
+
+	TerrainHeightFieldSettings heightSettings;
+	heightSettings.Levels = levels;
+	heightSettings.RootSize = RootSize;
+	heightSettings.BaseY = TerrainBaseY;
+	heightSettings.HeightScale = TerrainHeightScale;
+	TerrainHeightField ground;
+	ground.Reset(heightSettings);
+	for (uint32_t level = 0; level < levels; level++)
+		for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+		{
+			uint32_t x, y;
+			TerrainQuadTree::TileCoords(n, level, x, y);
+			const uint16_t* tile = data.Tile(level, x, y);
+			ground.Insert(n, level, std::vector<uint16_t>(tile, tile + data.TileResolution() * data.TileResolution()), data.TileResolution());
+		}
+
+	// One kind per slice of treeArray: broadleaf trees down low, a mix on the
+	// hillsides, conifers up to the ridges.
+	VegetationScatterSettings settings;
+	settings.RootSize = RootSize;
+	VegetationKind low, mid, high;
+	low.Density = 0.12f;
+	low.MaxHeight = 40.0f;
+	low.MaxSlope = 0.5f;
+	mid.Density = 0.1f;
+	mid.MinHeight = 0.0f;
+	mid.MaxHeight = 120.0f;
+	mid.MaxSlope = 0.8f;
+	high.Density = 0.1f;
+	high.MinHeight = 60.0f;
+	high.MaxSlope = 1.2f;
+	high.MinSize = 10.0f;
+	high.MaxSize = 18.0f;
+	settings.Kinds = { low, mid, high };
+	mVegetation.Scatter(ground, settings, mThreadPool);
+	mVegetationCull.MaxInstances = gVegetationMaxInstances;
+
+	std::string stats = "Vegetation: " + std::to_string(mVegetation.Instances().size()) + " plants in " +
+		std::to_string(mVegetation.CellCount()) + " cells\n";
+	OutputDebugStringA(stats.c_str());
+}
+
+void DX12App::UpdateVegetationInstances()
+{
+	mVegetation.Cull(mCamera.Bounds, mCamera.GetPosition3f(), mVegetationCull, mVegetationInstances, mVegetationBatches);
+
+	auto instances = mCurrFrameResource->VegetationInstances.get();
+	for (size_t i = 0; i < mVegetationInstances.size(); i++)
+		instances->CopyData((int)i, mVegetationInstances[i]);
+}
+
+void DX12App::DrawVegetation()
+{
+	if (mVegetationBatches.empty())
+		return;
+
+	// Quads are made up in the vertex shader from the instance buffer, no vertex
+	// or index buffers are needed.
+	Material* mat = mMaterials["vegetation"].get();
+	UINT matCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(MaterialConstants));
+	D3D12_GPU_VIRTUAL_ADDRESS matCBAddress = mCurrFrameResource->MaterialCB->Resource()->GetGPUVirtualAddress() + mat->MatCBIndex * matCBByteSize;
+
+	mCommandList->SetGraphicsRootDescriptorTable(0, CD3DX12_GPU_DESCRIPTOR_HANDLE(
+		mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart(), mat->DiffuseSrvHeapIndex, mCbvSrvDescriptorSize));
+	mCommandList->SetGraphicsRootShaderResourceView(21, mCurrFrameResource->VegetationInstances->Resource()->GetGPUVirtualAddress());
+	mCommandList->SetGraphicsRootConstantBufferView(12, matCBAddress);
+	mCommandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+	for (auto& batch : mVegetationBatches)
+	{
+		mCommandList->SetGraphicsRoot32BitConstant(22, batch.FirstInstance, 0);
+		mCommandList->DrawInstanced(4, batch.InstanceCount, 0, 0);
+	}
+	mCommandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+	if (mVegetationInstances.size() != mVegetationDrawn)
+	{
+		std::string stats = "Vegetation: " + std::to_string(mVegetationInstances.size()) + " plants in " +
+			std::to_string(mVegetationBatches.size()) + " draws\n";
+		OutputDebugStringA(stats.c_str());
+	}
+	mVegetationDrawn = (uint32_t)mVegetationInstances.size();
+}
+
+void DX12App::UpdateTerrainPaging()
+{
+	if (!mTerrainPager)
+		return;
+
+	mTerrainPager->Update(mTerrainCut.Drawn(), mTerrainCut.Wanted());
+	auto& destroyed = mTerrainPager->Destroyed();
+	for (auto& node : destroyed)
+		ReleaseTerrainTile(node.Node, node.Level);
+
+	for (auto& parent : mTerrainPager->Requested())
+	{
+		// A group dropped and requested again keeps the load it still has.
+		bool loading = false;
+		for (auto& load : mTerrainLoads)
+			loading |= load->Parent == parent.Node;
+		if (loading)
+			continue;
+
+		// Parents are resident before their children are requested, so their heights
+		// are in mTerrainHeights.
+		auto load = std::make_shared<TerrainGroupLoad>();
+		load->Parent = parent.Node;
+		load->Level = parent.Level;
+		uint32_t resolution = 0;
+		if (mTerrainDetail.IsSynthesized(parent.Level + 1) &&
+			(!mTerrainHeights.CopyTile(parent.Node, load->ParentHeights, resolution) || resolution != mTerrainDetail.Settings().TileResolution))
+			load->ParentHeights.clear();
+
+		mTerrainLoads.push_back(load);
+		mLoadThreads.Submit([this, load]()
+		{
+			uint32_t child = TerrainQuadTree::FirstChild(load->Parent, load->Level);
+			for (uint32_t i = 0; i < 4; i++)
+				ReadTerrainTile(child + i, load->Level + 1, load->ParentHeights, load->Tiles[i]);
+			load->Done = true;
+		});
+	}
+
+	// Loaded groups enter the tree in request order while there are free slots,
+	// which no frame in flight draws.
+	size_t finished = 0, created = 0;
+	for (auto& load : mTerrainLoads)
+	{
+		if (!load->Done || mFreeTerrainSlots.size() < 4)
+			break;
+
+		finished++;
+		if (!mTerrainPager->Complete(load->Parent, load->Level))
+			continue;
+
+		uint32_t child = TerrainQuadTree::FirstChild(load->Parent, load->Level);
+		for (uint32_t i = 0; i < 4; i++)
+			LoadTerrainTile(child + i, load->Level + 1, load->Tiles[i]);
+		created += 4;
+	}
+	mTerrainLoads.erase(mTerrainLoads.begin(), mTerrainLoads.begin() + finished);
+
+	if (created == 0 && destroyed.empty())
+		return;
+
+	std::string stats = "Terrain: " + std::to_string(created) + " nodes created, " +
+		std::to_string(destroyed.size()) + " destroyed, " + std::to_string(mTerrainTree.NodeCount()) + " resident, " +
+		std::to_string(mTerrainLoads.size()) + " groups loading\n";
+	OutputDebugStringA(stats.c_str());
+}
+
+namespace
+{
+	// Texture kinds of a terrain tile in slot order.
+	const char* gTerrainTileKinds[] = { "diffuse", "height", "normal" };
+
+	std::string TerrainTileName(const char* kind, uint32_t level, uint32_t x, uint32_t y)
+	{
+		return std::string("tile_") + kind + "_level" + std::to_string(level) + "_" + std::to_string(x) + "_" + std::to_string(y);
+	}
+
+	std::wstring TerrainTilePath(const char* kind, uint32_t level, uint32_t x, uint32_t y)
+	{
+		return L"../Textures/Terrain/L" + std::to_wstring(level) + L"/" + AnsiToWString(kind) + L"/" +
+			AnsiToWString(TerrainTileName(kind, level, x, y)) + L".dds";
+	}
+
+	bool ReadFileBytes(const std::wstring& filename, std::vector<uint8_t>& bytes)
+	{
+		std::ifstream fin(filename, std::ios::binary | std::ios::ate);
+		if (!fin)
+			return false;
+
+		bytes.resize((size_t)fin.tellg());
+		fin.seekg(0, std::ios_base::beg);
+		return (bool)fin.read((char*)bytes.data(), bytes.size());
+	}
+}
+
+void DX12App::ReadTerrainTile(uint32_t node, uint32_t level, const std::vector<uint16_t>& parentHeights, TerrainTileData& tile) const
+{
+	uint32_t x, y;
+	TerrainQuadTree::TileCoords(node, level, x, y);
+	const uint32_t resolution = mTerrainDetail.Settings().TileResolution;
+
+	if (!mTerrainDetail.IsSynthesized(level))
+	{
+		// A missing texture fails in LoadTerrainTile, missing heights only leave the
+		// tile out of the horizon and game logic.
+		for (int k = 0; k < 3; k++)
+			ReadFileBytes(TerrainTilePath(gTerrainTileKinds[k], level, x, y), tile.Dds[k]);
+		tile.Resolution = resolution;
+		if (!TerrainHeightData::LoadTile(TerrainTilePath("height", level, x, y), tile.Heights, tile.Resolution))
+			tile.Heights.clear();
+		return;
+	}
+
+	if (parentHeights.empty())
+		return;
+
+	// Stored diffuse tiles give the synthesized ones their colour.
+	const uint32_t stored = mTerrainDetail.Settings().StoredLevels;
+	uint32_t shift = level + 1 - stored;
+	std::vector<uint32_t> albedo;
+	uint32_t albedoResolution = 0;
+	bool hasAlbedo = TerrainDetail::LoadColorTile(TerrainTilePath("diffuse", stored - 1, x >> shift, y >> shift),
+		albedo, albedoResolution) && albedoResolution == resolution;
+
+	TerrainDetailTile detail;
+	mTerrainDetail.Synthesize(node, level, parentHeights.data(), hasAlbedo ? albedo.data() : nullptr, detail);
+	tile.Dds[0] = EncodeTerrainTile(std::move(detail.Diffuse), resolution);
+	tile.Dds[1] = EncodeTerrainTile(detail.Heights, resolution);
+	tile.Dds[2] = EncodeTerrainTile(std::move(detail.Normals), resolution);
+	tile.Heights = std::move(detail.Heights);
+	tile.Resolution = resolution;
+}
+
+void DX12App::LoadTerrainTile(uint32_t node, uint32_t level, TerrainTileData& tile)
+{
+	// The pager never has more nodes than there are slots.
+	if (mFreeTerrainSlots.empty())
+		return;
+
+	// Synthesized nodes whose parent had no heights stay without a tile.
+	if (mTerrainDetail.IsSynthesized(level) && tile.Heights.empty())
+		return;
+
+	int slot = mFreeTerrainSlots.back();
+	mFreeTerrainSlots.pop_back();
+	mTerrainNodeSlots[node] = slot;
+
+	uint32_t x, y;
+	TerrainQuadTree::TileCoords(node, level, x, y);
+
+	for (int k = 0; k < 3; k++)
+	{
+		std::string name = TerrainTileName(gTerrainTileKinds[k], level, x, y);
+		LoadTextureFromMemory(name, tile.Dds[k]);
+
+		Texture* tex = mTextures[name].get();
+		tex->SrvHeapIndex = mTerrainSrvBase + 3 * slot + k;
+
+		D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+		srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+		srvDesc.Format = tex->Info.Format;
+		srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+		srvDesc.Texture2D.MostDetailedMip = 0;
+		srvDesc.Texture2D.ResourceMinLODClamp = 0.0f;
+		srvDesc.Texture2D.MipLevels = tex->Info.MipCount - tex->TopMip;
+		md3dDevice->CreateShaderResourceView(tex->Resource.Get(), &srvDesc,
+			CD3DX12_CPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), tex->SrvHeapIndex, mCbvSrvDescriptorSize));
+	}
+
+	// The horizon needs the ground of the tile on the CPU as well, coarsely, and game
+	// logic at full resolution.
+	if (!tile.Heights.empty())
+	{
+		mTerrainMinHeights[slot] = TerrainHeightData::ComputeMinHeights(tile.Heights.data(), tile.Resolution, gTerrainOccluderCells);
+		for (float& h : mTerrainMinHeights[slot])
+			h = TerrainBaseY + h * TerrainHeightScale;
+		mTerrainHeights.Insert(node, level, std::move(tile.Heights), tile.Resolution);
+	}
+
+	float scaleFactor = mTerrainTree.TileSize(level);
+	XMFLOAT3 center = mTerrainTree.Center(node);
+	XMMATRIX world = XMMatrixScaling(scaleFactor, 1.0f, scaleFactor) * XMMatrixTranslation(center.x, TerrainBaseY, center.z);
+
+	RenderItem* ri = mTerrainItems[slot];
+	XMStoreFloat4x4(&ri->World, world);
+	ri->Bounds = mTerrainTree.Bounds(node);
+	ri->NumFramesDirty = gNumFrameResources;
+}
+
+void DX12App::ReleaseTerrainTile(uint32_t node, uint32_t level)
+{
+	auto slot = mTerrainNodeSlots.find(node);
+	if (slot == mTerrainNodeSlots.end())
+		return;
+
+	uint32_t x, y;
+	TerrainQuadTree::TileCoords(node, level, x, y);
+
+	// Frames in flight may still draw the tile, its resources and slot are released
+	// after the current frame's fence.
+	for (const char* kind : gTerrainTileKinds)
+	{
+		auto tex = mTextures.find(TerrainTileName(kind, level, x, y));
+		if (tex == mTextures.end())
+			continue;
+
+		mCurrFrameResource->RetiredResources.push_back(tex->second->Resource);
+		mCurrFrameResource->RetiredResources.push_back(tex->second->UploadHeap);
+		if (mTextureCache.Release(tex->second->CacheEntry))
+			mTextureCacheResources.erase(tex->second->CacheEntry);
+		mTextures.erase(tex);
+	}
+
+	mTerrainMinHeights[slot->second].clear();
+	mTerrainHeights.Remove(node);
+	mCurrFrameResource->RetiredTerrainSlots.push_back(slot->second);
+	mTerrainNodeSlots.erase(slot);
+}
+
+void DX12App::BuildTextureResidency()
+{
+	for (auto& t : mTextures)
+	{
+		Texture* tex = t.second.get();
+
+		// Height and displacement maps shape geometry, they always stay complete.
+		if (tex->Type != TextureType::TEXTURE2D || t.first == "black" ||
+			t.first.find("height") != std::string::npos || t.first.find("disp") != std::string::npos)
+			continue;
+
+		if (mResidencyIds.count(tex->SrvHeapIndex))
+			continue;
+
+		// Sizes of the whole chain in the file, so textures loaded with a
+		// maxSize can be promoted later.
+		const DirectX::DDSTextureInfo& info = tex->Info;
+		UINT topSize = std::max(info.Width, info.Height);
+		std::vector<uint64_t> mipBytes(info.MipCount);
+		UINT tailMips = 0;
+		for (UINT mip = 0; mip < info.MipCount; mip++)
+		{
+			mipBytes[mip] = info.MipBytes[mip] * info.ArraySize;
+
+			// mips up to 32x32 are kept resident
+			if (topSize >> mip <= 32)
+				tailMips++;
+		}
+
+		int id = mTextureResidency.Register(info.Width, mipBytes, tailMips, tex->TopMip);
+		mResidencyIds[tex->SrvHeapIndex] = id;
+		mResidencyIds[mResidencySrvBase + tex->SrvHeapIndex] = id;
+		mResidencyHeapIndices.push_back(tex->SrvHeapIndex);
+		mResidencyTopSizes.push_back(topSize);
+	}
+
+	mResidencySwapFences.resize(mResidencyHeapIndices.size(), 0);
+	mResidencyLoads.resize(mResidencyHeapIndices.size());
+}
+
+void DX12App::RequestTextureResidency(const RenderItem* ri)
+{
+	if (ri->Mat == nullptr)
+		return;
+
+	// Projected diameter of the bounds in pixels.
+	float radius = XMVectorGetX(XMVector3Length(XMLoadFloat3(&ri->Bounds.Extents)));
+	float dist = XMVectorGetX(XMVector3Length(XMVectorSubtract(mCamera.GetPosition(), XMLoadFloat3(&ri->Bounds.Center))));
+	float pixels = radius * mClientHeight / (std::max(dist - radius, mCamera.GetNearZ()) * tanf(0.5f * mCamera.GetFovY()));
+
+	int indices[] = { ri->Mat->DiffuseSrvHeapIndex, ri->Mat->NormalSrvHeapIndex };
+	for (int index : indices)
+	{
+		auto id = mResidencyIds.find((UINT)index);
+		if (id != mResidencyIds.end())
+			mTextureResidency.Request(id->second, ri->TexTransform._11, pixels);
+	}
+}
+
+void DX12App::UpdateTextureResidency()
+{
+	auto& changes = mTextureResidency.Update();
+	if (changes.empty())
+		return;
+
+	for (auto& change : changes)
+	{
+		UINT heapIndex = mResidencyHeapIndices[change.Id];
+		auto load = std::make_shared<ResidencyLoad>();
+		load->MaxSize = change.NewTopMip ? std::max<size_t>(mResidencyTopSizes[change.Id] >> change.NewTopMip, 1) : 0;
+		for (auto& t : mTextures)
+		{
+			if (t.second->SrvHeapIndex == heapIndex && t.second->Type == TextureType::TEXTURE2D)
+			{
+				load->Filename = t.second->Filename;
+				break;
+			}
+		}
+
+		mResidencyLoads[change.Id] = load;
+		mLoadThreads.Submit([load]()
+		{
+			load->Result = DirectX::LoadDDSTextureDataFromFile(load->Filename.c_str(), load->MaxSize, load->Data, load->DataSize);
+			load->Done = true;
+		});
+	}
+
+	std::string stats = "TextureResidency: " + std::to_string(changes.size()) + " changes, " +
+		std::to_string(mTextureResidency.ResidentBytes() >> 20) + " / " +
+		std::to_string(mTextureResidency.Budget() >> 20) + " MB, " +
+		std::to_string(mTextureResidency.LastPressureTrims()) + " mips trimmed by budget\n";
+	OutputDebugStringA(stats.c_str());
+}
+
+void DX12App::UploadTextureResidency()
+{
+	for (size_t id = 0; id < mResidencyLoads.size(); id++)
+	{
+		auto& load = mResidencyLoads[id];
+		if (!load || !load->Done || mFence->GetCompletedValue() < mResidencySwapFences[id])
+			continue;
+
+		UINT oldIndex = mResidencyHeapIndices[id];
+		HRESULT hr = load->Result;
+		ComPtr<ID3D12Resource> resource, uploadHeap;
+		if (SUCCEEDED(hr))
+			hr = DirectX::CreateDDSTextureFromMemory12(md3dDevice.Get(),
+				mCommandList.Get(), load->Data.get(), load->DataSize, resource, uploadHeap);
+		if (FAILED(hr))
+		{
+			// Keep drawing with what is resident and let the policy know, it asks
+			// for the mips again on a later update if they are still wanted.
+			OutputDebugStringW((L"TextureResidency: can't load " + load->Filename + L", keeping the resident mips\n").c_str());
+			for (auto& t : mTextures)
+			{
+				Texture* tex = t.second.get();
+				if (tex->SrvHeapIndex == oldIndex && tex->Type == TextureType::TEXTURE2D)
+				{
+					mTextureResidency.SetTopMip((int)id, tex->TopMip);
+					break;
+				}
+			}
+			load.reset();
+			continue;
+		}
+		mCurrFrameResource->RetiredResources.push_back(uploadHeap);
+
+		UINT newIndex = oldIndex >= mResidencySrvBase ? oldIndex - mResidencySrvBase : oldIndex + mResidencySrvBase;
+		for (auto& t : mTextures)
+		{
+			Texture* tex = t.second.get();
+			if (tex->SrvHeapIndex != oldIndex || tex->Type != TextureType::TEXTURE2D)
+				continue;
+
+			// Frames in flight may still sample the old resource.
+			mCurrFrameResource->RetiredResources.push_back(tex->Resource);
+			tex->Resource = resource;
+			tex->TopMip = (UINT)DirectX::GetDDSSkippedMips(tex->Info, load->MaxSize);
+			tex->SrvHeapIndex = newIndex;
+			if (tex->CacheEntry >= 0)
+				mTextureCacheResources[tex->CacheEntry] = resource;
+			mTextureResidency.SetTopMip((int)id, tex->TopMip);
+		}
+
+		D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+		srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+		srvDesc.Format = resource->GetDesc().Format;
+		srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+		srvDesc.Texture2D.MostDetailedMip = 0;
+		srvDesc.Texture2D.ResourceMinLODClamp = 0.0f;
+		srvDesc.Texture2D.MipLevels = resource->GetDesc().MipLevels;
+
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hDescriptor(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart());
+		hDescriptor.Offset(newIndex, mCbvSrvDescriptorSize);
+		md3dDevice->CreateShaderResourceView(resource.Get(), &srvDesc, hDescriptor);
+
+		// Draws recorded from now on use the new descriptor; the old one is free once
+		// the frames submitted so far are done.
+		for (auto& m : mMaterials)
 		{
-			ChooseVisibleTerrainTile(chold);
+			Material* mat = m.second.get();
+			if (mat->DiffuseSrvHeapIndex == (int)oldIndex)
+				mat->DiffuseSrvHeapIndex = newIndex;
+			if (mat->NormalSrvHeapIndex == (int)oldIndex)
+				mat->NormalSrvHeapIndex = newIndex;
+			if (mat->DisplaceSrvHeapIndex == (int)oldIndex)
+				mat->DisplaceSrvHeapIndex = newIndex;
 		}
+		mResidencyHeapIndices[id] = newIndex;
+		mResidencySwapFences[id] = mCurrentFence;
+		load.reset();
 	}
 }
 
@@ -1,6 +1,7 @@
 #include "FrameResource.h"
 
-FrameResource::FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount, UINT lightCount)
+FrameResource::FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount, UINT lightCount, UINT terrainInstanceCount, UINT vegetationInstanceCount,
+    UINT clusterLightCount, UINT clusterCount, UINT clusterIndexCount)
 {
     ThrowIfFailed(device->CreateCommandAllocator(
         D3D12_COMMAND_LIST_TYPE_DIRECT,
@@ -12,6 +13,11 @@ FrameResource::FrameResource(ID3D12Device* device, UINT passCount, UINT objectCo
     ObjectCB = std::make_unique<UploadBuffer<ObjectConstants>>(device, objectCount, true);
     PostProcessCB = std::make_unique<UploadBuffer<PostProcessSettings>>(device, 1, true);
     LightCB = std::make_unique<UploadBuffer<LightConstants>>(device, lightCount, true);
+    TerrainInstances = std::make_unique<UploadBuffer<TerrainInstance>>(device, terrainInstanceCount, false);
+    VegetationInstances = std::make_unique<UploadBuffer<VegetationInstance>>(device, vegetationInstanceCount, false);
+    ClusterLights = std::make_unique<UploadBuffer<ClusterLight>>(device, clusterLightCount, false);
+    ClusterRanges = std::make_unique<UploadBuffer<LightCluster>>(device, clusterCount, false);
+    ClusterLightIndices = std::make_unique<UploadBuffer<uint32_t>>(device, clusterIndexCount, false);
 }
 
 FrameResource::~FrameResource()
@@ -3,6 +3,9 @@
 #include "../Common/d3dUtil.h"
 #include "../Common/MathHelper.h"
 #include "../Common/UploadBuffer.h"
+#include "LightClusters.h"
+#include "TerrainInstances.h"
+#include "VegetationScatter.h"
 
 struct PostProcessSettings {
     float FocusDistance;
@@ -59,7 +62,8 @@ struct FrameResource
 {
 public:
     
-    FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount, UINT lightCount);
+    FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount, UINT lightCount, UINT terrainInstanceCount, UINT vegetationInstanceCount,
+        UINT clusterLightCount, UINT clusterCount, UINT clusterIndexCount);
     FrameResource(const FrameResource& rhs) = delete;
     FrameResource& operator=(const FrameResource& rhs) = delete;
     ~FrameResource();
@@ -76,7 +80,21 @@ public:
     std::unique_ptr<UploadBuffer<ObjectConstants>> ObjectCB = nullptr;
     std::unique_ptr<UploadBuffer<PostProcessSettings>> PostProcessCB = nullptr;
     std::unique_ptr<UploadBuffer<LightConstants>> LightCB = nullptr;
+    // Visible terrain tiles, read by Terrain.hlsl as a structured buffer.
+    std::unique_ptr<UploadBuffer<TerrainInstance>> TerrainInstances = nullptr;
+    // Visible plants, read by Vegetation.hlsl.
+    std::unique_ptr<UploadBuffer<VegetationInstance>> VegetationInstances = nullptr;
+    // Lights without shadow maps, their clusters and the clusters' light lists, read
+    // by ClusteredPS in DeferredLights.hlsl.
+    std::unique_ptr<UploadBuffer<ClusterLight>> ClusterLights = nullptr;
+    std::unique_ptr<UploadBuffer<LightCluster>> ClusterRanges = nullptr;
+    std::unique_ptr<UploadBuffer<uint32_t>> ClusterLightIndices = nullptr;
 
+    // Resources the frame's commands still use after the app let go of them, such as
+    // upload heaps and replaced textures. Released once the frame's fence has passed.
+    std::vector<Microsoft::WRL::ComPtr<ID3D12Resource>> RetiredResources;
+    // Terrain tile slots released while recording the frame, free again after its fence.
+    std::vector<int> RetiredTerrainSlots;
 
     // Fence value to mark commands up to this fence point.  This lets us
     // check if these frame resources are still in use by the GPU.
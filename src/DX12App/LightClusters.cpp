@@ -0,0 +1,224 @@
+#include "LightClusters.h"
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <emmintrin.h>
+
+using namespace DirectX;
+
+namespace
+{
+	// Lights transformed to view space per job.
+	const size_t gTransformGrainSize = 256;
+
+	const uint32_t gOutside = UINT32_MAX;
+	const float gSliceWidening[2] = { 0.999f, 1.001f };
+
+	uint32_t FirstBit(uint32_t mask)
+	{
+		uint32_t bit = 0;
+		while (!(mask & (1u << bit)))
+			bit++;
+		return bit;
+	}
+
+	// Planes of tiles 0 to tiles - 1 whose boundaries are x = a_k z (or y = a_k z),
+	// a_k running from first at k = 0 to last at k = tiles. Tile i lies between
+	// boundaries i and i + 1, its planes facing into it.
+	void SetTilePlanes(std::vector<float> (&planes)[2][2], uint32_t tiles, float first, float last)
+	{
+		size_t padded = (tiles + 3) & ~3u;
+		for (int side = 0; side < 2; side++)
+		{
+			planes[side][0].assign(padded, 0.0f);
+			planes[side][1].assign(padded, 0.0f);
+		}
+		for (uint32_t i = 0; i < tiles; i++)
+		{
+			float low = first + (last - first) * i / tiles;
+			float high = first + (last - first) * (i + 1) / tiles;
+			float lowScale = 1.0f / std::sqrt(1.0f + low * low);
+			float highScale = 1.0f / std::sqrt(1.0f + high * high);
+			// Rows run from the top, where a falls as i grows, so their planes flip.
+			float sign = last > first ? 1.0f : -1.0f;
+			planes[0][0][i] = sign * lowScale;
+			planes[0][1][i] = -sign * low * lowScale;
+			planes[1][0][i] = -sign * highScale;
+			planes[1][1][i] = sign * high * highScale;
+		}
+	}
+}
+
+void LightClusters::Reset(const LightClusterSettings& settings, float fovY, float aspect)
+{
+	mSettings = settings;
+	mSettings.TilesX = std::min(std::max(mSettings.TilesX, 1u), 32u);
+	mSettings.TilesY = std::min(std::max(mSettings.TilesY, 1u), 32u);
+	mSettings.Slices = std::max(mSettings.Slices, 1u);
+
+	float logRatio = std::log(mSettings.Far / mSettings.Near);
+	mSliceScale = mSettings.Slices / logRatio;
+	mSliceBias = -std::log(mSettings.Near) * mSliceScale;
+	mSliceDepths.resize(mSettings.Slices + 1);
+	for (uint32_t s = 0; s <= mSettings.Slices; s++)
+		mSliceDepths[s] = mSettings.Near * std::exp(logRatio * s / mSettings.Slices);
+	mSliceDepths[0] = 0.0f;
+	mSliceDepths[mSettings.Slices] = FLT_MAX;
+
+	float tanY = std::tan(0.5f * fovY);
+	float tanX = tanY * aspect;
+	SetTilePlanes(mColumnPlanes, mSettings.TilesX, -tanX, tanX);
+	SetTilePlanes(mRowPlanes, mSettings.TilesY, tanY, -tanY);
+
+	mClusters.assign((size_t)mSettings.TilesX * mSettings.TilesY * mSettings.Slices, LightCluster{ 0, 0 });
+	mIndices.clear();
+}
+
+uint32_t LightClusters::Slice(float viewZ) const
+{
+	if (viewZ <= mSettings.Near)
+		return 0;
+	float slice = std::floor(std::log(viewZ) * mSliceScale + mSliceBias);
+	return slice >= (float)(mSettings.Slices - 1) ? mSettings.Slices - 1 : (uint32_t)std::max(slice, 0.0f);
+}
+
+uint32_t LightClusters::TileMask(const std::vector<float> (&planes)[2][2], uint32_t tiles, float a, float z, float radius)
+{
+	const __m128 va = _mm_set1_ps(a);
+	const __m128 vz = _mm_set1_ps(z);
+	const __m128 minusRadius = _mm_set1_ps(-radius);
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < tiles; i += 4)
+	{
+		__m128 low = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&planes[0][0][i]), va), _mm_mul_ps(_mm_loadu_ps(&planes[0][1][i]), vz));
+		__m128 high = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&planes[1][0][i]), va), _mm_mul_ps(_mm_loadu_ps(&planes[1][1][i]), vz));
+		__m128 inside = _mm_and_ps(_mm_cmpge_ps(low, minusRadius), _mm_cmpge_ps(high, minusRadius));
+		mask |= (uint32_t)_mm_movemask_ps(inside) << i;
+	}
+	// Padding tiles have zero planes and pass.
+	return tiles == 32 ? mask : mask & ((1u << tiles) - 1);
+}
+
+void LightClusters::Build(FXMMATRIX view, const BoundingSphere* lights, size_t count, ThreadPool& pool)
+{
+	mX.resize(count);
+	mY.resize(count);
+	mZ.resize(count);
+	mRadius.resize(count);
+	mFirstSlice.resize(count);
+	mLastSlice.resize(count);
+
+	// Lights to view space, with the slices they reach and whether the columns and rows
+	// see them at all.
+	XMMATRIX toView = view;
+	pool.ParallelFor(count, gTransformGrainSize, [&](size_t i)
+	{
+		XMFLOAT3 center;
+		XMStoreFloat3(&center, XMVector3TransformCoord(XMLoadFloat3(&lights[i].Center), toView));
+		float radius = lights[i].Radius;
+		mX[i] = center.x;
+		mY[i] = center.y;
+		mZ[i] = center.z;
+		mRadius[i] = radius;
+
+		if (center.z + radius <= 0.0f || center.z - radius > mSettings.Far ||
+			TileMask(mColumnPlanes, mSettings.TilesX, center.x, center.z, radius) == 0 ||
+			TileMask(mRowPlanes, mSettings.TilesY, center.y, center.z, radius) == 0)
+		{
+			mFirstSlice[i] = gOutside;
+			return;
+		}
+		mFirstSlice[i] = Slice(center.z - radius);
+		mLastSlice[i] = Slice(center.z + radius);
+	});
+
+	mInView.clear();
+	for (size_t i = 0; i < count; i++)
+		if (mFirstSlice[i] != gOutside)
+			mInView.push_back((uint32_t)i);
+
+	pool.ParallelRanges(mSettings.Slices, 1, mRanges, [&](size_t begin, size_t end, SliceRange& range)
+	{
+		BinSlices((uint32_t)begin, (uint32_t)end, range);
+	});
+
+	// Ranges hold consecutive slices, so their lists follow each other.
+	std::vector<uint32_t> bases(mRanges.size());
+	uint32_t offset = 0;
+	uint32_t cluster = 0;
+	mStats = Stats();
+	for (size_t r = 0; r < mRanges.size(); r++)
+	{
+		bases[r] = offset;
+		for (uint32_t c : mRanges[r].Counts)
+		{
+			mClusters[cluster++] = LightCluster{ offset, c };
+			offset += c;
+			mStats.MaxPerCluster = std::max(mStats.MaxPerCluster, c);
+		}
+	}
+	mIndices.resize(offset);
+	pool.ParallelFor(mRanges.size(), [&](size_t r)
+	{
+		std::copy(mRanges[r].Indices.begin(), mRanges[r].Indices.end(), mIndices.begin() + bases[r]);
+	});
+
+	mStats.Binned = (uint32_t)mInView.size();
+	mStats.Indices = offset;
+}
+
+void LightClusters::BinSlices(uint32_t begin, uint32_t end, SliceRange& range) const
+{
+	const uint32_t tilesX = mSettings.TilesX;
+	const uint32_t perSlice = tilesX * mSettings.TilesY;
+	range.Counts.assign((end - begin) * perSlice, 0);
+	range.Pairs.clear();
+
+	for (uint32_t light : mInView)
+	{
+		uint32_t first = std::max(mFirstSlice[light], begin);
+		uint32_t last = std::min(mLastSlice[light], end - 1);
+		float x = mX[light], y = mY[light], z = mZ[light], radius = mRadius[light];
+		for (uint32_t s = first; s <= last; s++)
+		{
+			// The sphere's part inside the slice lies in the sphere around the point of
+			// the slice nearest to the center, whose radius shrinks by the distance. The
+			// slice is widened a little for the rounding of the resolve pass's log.
+			float sliceZ = std::min(std::max(z, mSliceDepths[s] * gSliceWidening[0]), mSliceDepths[s + 1] * gSliceWidening[1]);
+			float shrunk = radius * radius - (sliceZ - z) * (sliceZ - z);
+			if (shrunk < 0.0f)
+				continue;
+			shrunk = std::sqrt(shrunk);
+
+			uint32_t columns = TileMask(mColumnPlanes, tilesX, x, sliceZ, shrunk);
+			uint32_t rows = columns ? TileMask(mRowPlanes, mSettings.TilesY, y, sliceZ, shrunk) : 0;
+			for (; rows; rows &= rows - 1)
+			{
+				uint32_t row = FirstBit(rows);
+				uint32_t base = (s - begin) * perSlice + row * tilesX;
+				for (uint32_t bits = columns; bits; bits &= bits - 1)
+				{
+					uint32_t local = base + FirstBit(bits);
+					range.Counts[local]++;
+					range.Pairs.push_back(local);
+					range.Pairs.push_back(light);
+				}
+			}
+		}
+	}
+
+	// Counting sort by cluster; lights were visited in order, so each cluster's stay so.
+	std::vector<uint32_t> next(range.Counts.size());
+	uint32_t offset = 0;
+	for (size_t c = 0; c < range.Counts.size(); c++)
+	{
+		next[c] = offset;
+		offset += range.Counts[c];
+	}
+	range.Indices.resize(offset);
+	for (size_t p = 0; p < range.Pairs.size(); p += 2)
+		range.Indices[next[range.Pairs[p]]++] = range.Pairs[p + 1];
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <DirectXCollision.h>
+#include <DirectXMath.h>
+
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// A light without a shadow map, laid out like Light in LightingUtil.hlsl.
+struct ClusterLight
+{
+	DirectX::XMFLOAT3 Strength = { 1.0f, 1.0f, 1.0f };
+	float FalloffStart = 1.0f;
+	DirectX::XMFLOAT3 Direction = { 0.0f, -1.0f, 0.0f };
+	float FalloffEnd = 10.0f;
+	DirectX::XMFLOAT3 Position = { 0.0f, 0.0f, 0.0f };
+	float SpotPower = 64.0f;
+};
+
+struct LightClusterSettings
+{
+	// Screen tiles, at most 32 each way, and depth slices of the view.
+	uint32_t TilesX = 16;
+	uint32_t TilesY = 9;
+	uint32_t Slices = 24;
+	// View depth the slices cover, cut exponentially: slice s starts at
+	// Near * (Far / Near)^(s / Slices). Nearer pixels are in slice 0.
+	float Near = 1.0f;
+	float Far = 1000.0f;
+};
+
+// A cluster's lights, Count indices from Offset on in LightClusters::Indices. Laid
+// out like the cluster ranges in DeferredLights.hlsl.
+struct LightCluster
+{
+	uint32_t Offset;
+	uint32_t Count;
+};
+
+// Clustered light assignment: the view frustum is cut into TilesX x TilesY screen
+// tiles and Slices depth slices, and every light's bounding sphere is binned into the
+// clusters it touches, so a full screen pass looks up a pixel's cluster and shades
+// with its lights only.
+//
+// A light is tested against the tile columns and rows of each slice it reaches, four
+// tile planes at a time with SSE, with the part of its sphere inside the slice
+// bounded by a smaller sphere. Columns and rows are tested apart, so a sphere near
+// the corner of a cluster may be binned into it without touching it, never the other
+// way. Slices are binned in parallel, each job writing its own clusters, and the
+// lists of a cluster keep the lights in order whatever the number of threads.
+class LightClusters
+{
+public:
+	struct Stats
+	{
+		// Lights whose sphere reaches into the clusters' volume, and the indices written.
+		uint32_t Binned = 0;
+		uint32_t Indices = 0;
+		uint32_t MaxPerCluster = 0;
+	};
+
+	// Sets up the clusters of a view with the given vertical field of view and aspect
+	// ratio.
+	void Reset(const LightClusterSettings& settings, float fovY, float aspect);
+	const LightClusterSettings& Settings() const { return mSettings; }
+
+	// Bins lights by their world space bounding spheres.
+	void Build(DirectX::FXMMATRIX view, const DirectX::BoundingSphere* lights, size_t count, ThreadPool& pool);
+
+	// Clusters slice by slice, each slice's rows from the top of the screen.
+	const std::vector<LightCluster>& Clusters() const { return mClusters; }
+	const std::vector<uint32_t>& Indices() const { return mIndices; }
+	uint32_t ClusterIndex(uint32_t x, uint32_t y, uint32_t slice) const { return (slice * mSettings.TilesY + y) * mSettings.TilesX + x; }
+	// Slice of a view depth, as the resolve pass computes it.
+	uint32_t Slice(float viewZ) const;
+	// Slice = floor(log(viewZ) * SliceScale + SliceBias), clamped to the slices.
+	float SliceScale() const { return mSliceScale; }
+	float SliceBias() const { return mSliceBias; }
+	const Stats& GetStats() const { return mStats; }
+
+private:
+	// What binning a range of slices wrote: the light count of each of its clusters
+	// and their lights, cluster by cluster.
+	struct SliceRange
+	{
+		std::vector<uint32_t> Counts;
+		std::vector<uint32_t> Indices;
+		// Scratch of (cluster, light) pairs before they are sorted by cluster.
+		std::vector<uint32_t> Pairs;
+	};
+
+	void BinSlices(uint32_t begin, uint32_t end, SliceRange& range) const;
+	// Bit i set for the tiles i whose two planes the sphere isn't entirely outside of.
+	static uint32_t TileMask(const std::vector<float> (&planes)[2][2], uint32_t tiles, float a, float z, float radius);
+
+	LightClusterSettings mSettings;
+	float mSliceScale = 0.0f;
+	float mSliceBias = 0.0f;
+	// View depths where the slices start and the end of the last; slice 0 reaches to
+	// the eye and the last has no end.
+	std::vector<float> mSliceDepths;
+	// Tile planes through the eye, inside when N.p >= 0 with N = (Nx, 0, Nz) for
+	// columns and (0, Ny, Nz) for rows. [0][] bounds tile i on its low side and [1][]
+	// on its high side, a row's low side being its top; [][0] is Nx or Ny and [][1]
+	// Nz. Padded to a multiple of four.
+	std::vector<float> mColumnPlanes[2][2];
+	std::vector<float> mRowPlanes[2][2];
+
+	// Lights in view space, the slices they reach and those in the clusters at all.
+	std::vector<float> mX, mY, mZ, mRadius;
+	std::vector<uint32_t> mFirstSlice, mLastSlice;
+	std::vector<uint32_t> mInView;
+
+	std::vector<SliceRange> mRanges;
+	std::vector<LightCluster> mClusters;
+	std::vector<uint32_t> mIndices;
+	Stats mStats;
+};
@@ -0,0 +1,49 @@
+#include "LodSelector.h"
+
+#include <cfloat>
+#include <cmath>
+
+using namespace DirectX;
+
+float LodProjectionScale(float fovY, float viewportHeight)
+{
+	return viewportHeight / (2.0f * std::tan(0.5f * fovY));
+}
+
+float LodProjectedRadius(const BoundingSphere& sphere, const XMFLOAT3& eye, float projectionScale)
+{
+	float dx = sphere.Center.x - eye.x, dy = sphere.Center.y - eye.y, dz = sphere.Center.z - eye.z;
+	float tangentSq = dx * dx + dy * dy + dz * dz - sphere.Radius * sphere.Radius;
+	if (tangentSq <= 0.0f)
+		return FLT_MAX;
+	// Tangent of the half angle the outline spans, times the pixels per unit of it.
+	return projectionScale * sphere.Radius / std::sqrt(tangentSq);
+}
+
+uint32_t SelectLod(const LodSettings& settings, float pixels, uint32_t levelCount, uint32_t current)
+{
+	if (levelCount <= 1)
+		return 0;
+	if (current >= levelCount)
+		current = levelCount - 1;
+
+	// The bias scales the radius instead of every threshold.
+	float scaled = pixels * std::pow(settings.LevelRatio, settings.Bias);
+	float finer = 1.0f + settings.Hysteresis;
+	float coarser = 1.0f - settings.Hysteresis;
+
+	// Threshold of level L is FinestPixels * LevelRatio^L; level L is left for L + 1
+	// below it and entered from L + 1 above it.
+	float threshold = settings.FinestPixels * std::pow(settings.LevelRatio, (float)current);
+	while (current + 1 < levelCount && scaled < threshold * coarser)
+	{
+		current++;
+		threshold *= settings.LevelRatio;
+	}
+	while (current > 0 && scaled >= threshold / settings.LevelRatio * finer)
+	{
+		current--;
+		threshold /= settings.LevelRatio;
+	}
+	return current;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <DirectXCollision.h>
+
+#include <cstdint>
+
+// Level of detail of render items by the size of their bounding sphere on screen.
+// Level 0 is the finest; an item drops to level L + 1 when its projected radius falls
+// below the threshold of level L. The threshold of level 0 is FinestPixels and every
+// next one LevelRatio times the one before, so a level lasts for the same factor of
+// distance whatever the number of levels.
+struct LodSettings
+{
+	float FinestPixels = 64.0f;
+	float LevelRatio = 0.5f;
+	// An item only leaves its level once the radius is this fraction past the
+	// threshold, so items sitting on a threshold don't switch every frame.
+	float Hysteresis = 0.15f;
+	// Moves every item this many levels coarser, or finer when negative, to scale the
+	// cost of the frame; fractions move the thresholds part of the way.
+	float Bias = 0.0f;
+};
+
+// Pixels per world unit at distance 1 for a viewport viewportHeight pixels tall.
+float LodProjectionScale(float fovY, float viewportHeight);
+
+// Radius in pixels of the sphere's outline seen from the eye, FLT_MAX when the eye is
+// inside it.
+float LodProjectedRadius(const DirectX::BoundingSphere& sphere, const DirectX::XMFLOAT3& eye, float projectionScale);
+
+// Level, of levelCount, for an item whose sphere projects to pixels and that was at
+// level current the frame before. Any current level is fine for the first frame;
+// the result may then lag by the hysteresis band.
+uint32_t SelectLod(const LodSettings& settings, float pixels, uint32_t levelCount, uint32_t current);
@@ -0,0 +1,418 @@
+#include "OcclusionBuffer.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <emmintrin.h>
+#include <unordered_map>
+
+using namespace DirectX;
+
+namespace
+{
+	// Sides of the clip volume a vertex is outside of; a triangle with a side all its
+	// vertices share can't be seen.
+	uint32_t OutCode(const XMFLOAT4& v)
+	{
+		return (v.x < -v.w) | (v.x > v.w) << 1 | (v.y < -v.w) << 2 | (v.y > v.w) << 3 | (v.z < 0.0f) << 4 | (v.z > v.w) << 5;
+	}
+
+	XMFLOAT4 Lerp(const XMFLOAT4& a, const XMFLOAT4& b, float t)
+	{
+		return XMFLOAT4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t);
+	}
+}
+
+OccluderMesh SimplifyOccluder(const XMFLOAT3* positions, size_t stride, size_t vertexCount,
+	const uint32_t* indices, size_t indexCount, uint32_t cells)
+{
+	auto position = [&](size_t i) -> const XMFLOAT3&
+	{
+		return *(const XMFLOAT3*)((const uint8_t*)positions + i * stride);
+	};
+
+	OccluderMesh mesh;
+	if (vertexCount == 0)
+		return mesh;
+
+	XMFLOAT3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (size_t i = 0; i < vertexCount; i++)
+	{
+		const XMFLOAT3& p = position(i);
+		lo = XMFLOAT3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+		hi = XMFLOAT3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+	}
+	auto cell = [&](float v, float l, float h)
+	{
+		return std::min((uint32_t)((v - l) / std::max(h - l, FLT_MIN) * cells), cells - 1);
+	};
+
+	// Cell of every vertex, and the sum of the positions in every cell.
+	std::unordered_map<uint32_t, uint32_t> cellVertex;
+	std::vector<uint32_t> remap(vertexCount);
+	std::vector<uint32_t> counts;
+	for (size_t i = 0; i < vertexCount; i++)
+	{
+		const XMFLOAT3& p = position(i);
+		uint32_t key = (cell(p.x, lo.x, hi.x) * cells + cell(p.y, lo.y, hi.y)) * cells + cell(p.z, lo.z, hi.z);
+		auto found = cellVertex.emplace(key, (uint32_t)mesh.Vertices.size());
+		if (found.second)
+		{
+			mesh.Vertices.push_back(XMFLOAT3(0.0f, 0.0f, 0.0f));
+			counts.push_back(0);
+		}
+		uint32_t v = found.first->second;
+		mesh.Vertices[v].x += p.x;
+		mesh.Vertices[v].y += p.y;
+		mesh.Vertices[v].z += p.z;
+		counts[v]++;
+		remap[i] = v;
+	}
+	for (size_t v = 0; v < mesh.Vertices.size(); v++)
+	{
+		float scale = 1.0f / counts[v];
+		mesh.Vertices[v] = XMFLOAT3(mesh.Vertices[v].x * scale, mesh.Vertices[v].y * scale, mesh.Vertices[v].z * scale);
+	}
+
+	// Triangles that still have three corners, once each whichever way they face;
+	// the rasterizer draws both sides.
+	std::vector<std::array<uint32_t, 3>> triangles;
+	for (size_t i = 0; i + 2 < indexCount; i += 3)
+	{
+		std::array<uint32_t, 3> t = { { remap[indices[i]], remap[indices[i + 1]], remap[indices[i + 2]] } };
+		std::sort(t.begin(), t.end());
+		if (t[0] != t[1] && t[1] != t[2])
+			triangles.push_back(t);
+	}
+	std::sort(triangles.begin(), triangles.end());
+	triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+
+	mesh.Indices.reserve(triangles.size() * 3);
+	for (auto& t : triangles)
+		mesh.Indices.insert(mesh.Indices.end(), t.begin(), t.end());
+	return mesh;
+}
+
+OcclusionBuffer::OcclusionBuffer(uint32_t width, uint32_t height)
+{
+	mBinsX = std::max<uint32_t>((width + BinWidth - 1) / BinWidth, 1);
+	mBinsY = std::max<uint32_t>((height + BinHeight - 1) / BinHeight, 1);
+	mWidth = mBinsX * BinWidth;
+	mHeight = mBinsY * BinHeight;
+	mBins.resize(mBinsX * mBinsY);
+
+	uint32_t w = mWidth, h = mHeight;
+	for (;;)
+	{
+		mLevelWidths.push_back(w);
+		mLevelHeights.push_back(h);
+		mLevels.push_back(std::vector<float>(w * h, 1.0f));
+		if (w == 1 && h == 1)
+			break;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+}
+
+void OcclusionBuffer::Begin(FXMMATRIX viewProj)
+{
+	XMStoreFloat4x4(&mViewProj, viewProj);
+	mTriangles.clear();
+	for (auto& bin : mBins)
+		bin.clear();
+	std::fill(mLevels[0].begin(), mLevels[0].end(), 1.0f);
+	mStats = Stats();
+}
+
+void OcclusionBuffer::AddOccluder(const OccluderMesh& mesh, FXMMATRIX world)
+{
+	XMMATRIX toClip = XMMatrixMultiply(world, XMLoadFloat4x4(&mViewProj));
+	mClip.resize(mesh.Vertices.size());
+	for (size_t i = 0; i < mesh.Vertices.size(); i++)
+		XMStoreFloat4(&mClip[i], XMVector3Transform(XMLoadFloat3(&mesh.Vertices[i]), toClip));
+
+	for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+	{
+		XMFLOAT4 clip[3] = { mClip[mesh.Indices[i]], mClip[mesh.Indices[i + 1]], mClip[mesh.Indices[i + 2]] };
+		AddTriangle(clip);
+	}
+	mStats.Occluders++;
+}
+
+void OcclusionBuffer::AddOccluderGrid(const BoundingBox& tile, uint32_t cells, const float* minHeights)
+{
+	XMMATRIX viewProj = XMLoadFloat4x4(&mViewProj);
+	float sizeX = 2.0f * tile.Extents.x / cells;
+	float sizeZ = 2.0f * tile.Extents.z / cells;
+	float x0 = tile.Center.x - tile.Extents.x;
+	float z0 = tile.Center.z + tile.Extents.z;
+	uint32_t corners = cells + 1;
+	mClip.resize(corners * corners);
+	for (uint32_t gy = 0; gy < corners; gy++)
+	{
+		for (uint32_t gx = 0; gx < corners; gx++)
+		{
+			float y = FLT_MAX;
+			for (uint32_t cy = gy > 0 ? gy - 1 : 0; cy <= std::min(gy, cells - 1); cy++)
+				for (uint32_t cx = gx > 0 ? gx - 1 : 0; cx <= std::min(gx, cells - 1); cx++)
+					y = std::min(y, minHeights[cy * cells + cx]);
+			XMVECTOR p = XMVectorSet(x0 + gx * sizeX, y, z0 - gy * sizeZ, 1.0f);
+			XMStoreFloat4(&mClip[gy * corners + gx], XMVector4Transform(p, viewProj));
+		}
+	}
+
+	for (uint32_t cy = 0; cy < cells; cy++)
+	{
+		for (uint32_t cx = 0; cx < cells; cx++)
+		{
+			const XMFLOAT4* row0 = &mClip[cy * corners + cx];
+			const XMFLOAT4* row1 = row0 + corners;
+			XMFLOAT4 first[3] = { row0[0], row0[1], row1[0] };
+			XMFLOAT4 second[3] = { row0[1], row1[1], row1[0] };
+			AddTriangle(first);
+			AddTriangle(second);
+		}
+	}
+	mStats.Occluders++;
+}
+
+void OcclusionBuffer::AddTriangle(const XMFLOAT4* clip)
+{
+	uint32_t codes[3] = { OutCode(clip[0]), OutCode(clip[1]), OutCode(clip[2]) };
+	if (codes[0] & codes[1] & codes[2])
+		return;
+	if (!((codes[0] | codes[1] | codes[2]) & 16))
+	{
+		AddScreenTriangle(clip[0], clip[1], clip[2]);
+		return;
+	}
+
+	// Cut at the near plane, z = 0, which leaves a triangle or a quad.
+	XMFLOAT4 polygon[4];
+	int count = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		const XMFLOAT4& a = clip[i];
+		const XMFLOAT4& b = clip[(i + 1) % 3];
+		if (a.z >= 0.0f)
+			polygon[count++] = a;
+		if ((a.z >= 0.0f) != (b.z >= 0.0f))
+			polygon[count++] = Lerp(a, b, a.z / (a.z - b.z));
+	}
+	for (int i = 2; i < count; i++)
+		AddScreenTriangle(polygon[0], polygon[i - 1], polygon[i]);
+}
+
+void OcclusionBuffer::AddScreenTriangle(const XMFLOAT4& a, const XMFLOAT4& b, const XMFLOAT4& c)
+{
+	mStats.Triangles++;
+
+	Triangle t;
+	const XMFLOAT4* v[3] = { &a, &b, &c };
+	for (int i = 0; i < 3; i++)
+	{
+		float invW = 1.0f / v[i]->w;
+		t.X[i] = (0.5f + 0.5f * v[i]->x * invW) * mWidth;
+		t.Y[i] = (0.5f - 0.5f * v[i]->y * invW) * mHeight;
+		t.Z[i] = v[i]->z * invW;
+	}
+
+	float area = (t.X[1] - t.X[0]) * (t.Y[2] - t.Y[0]) - (t.X[2] - t.X[0]) * (t.Y[1] - t.Y[0]);
+	if (area == 0.0f)
+		return;
+	if (area < 0.0f)
+	{
+		std::swap(t.X[1], t.X[2]);
+		std::swap(t.Y[1], t.Y[2]);
+		std::swap(t.Z[1], t.Z[2]);
+	}
+
+	// Pixels whose centers the bounds hold.
+	float minX = std::min(std::min(t.X[0], t.X[1]), t.X[2]);
+	float maxX = std::max(std::max(t.X[0], t.X[1]), t.X[2]);
+	float minY = std::min(std::min(t.Y[0], t.Y[1]), t.Y[2]);
+	float maxY = std::max(std::max(t.Y[0], t.Y[1]), t.Y[2]);
+	int x0 = std::max((int)std::ceil(minX - 0.5f), 0);
+	int x1 = std::min((int)std::floor(maxX - 0.5f), (int)mWidth - 1);
+	int y0 = std::max((int)std::ceil(minY - 0.5f), 0);
+	int y1 = std::min((int)std::floor(maxY - 0.5f), (int)mHeight - 1);
+	if (x0 > x1 || y0 > y1)
+		return;
+
+	uint32_t index = (uint32_t)mTriangles.size();
+	mTriangles.push_back(t);
+	for (int by = y0 / (int)BinHeight; by <= y1 / (int)BinHeight; by++)
+		for (int bx = x0 / (int)BinWidth; bx <= x1 / (int)BinWidth; bx++)
+			mBins[by * mBinsX + bx].push_back(index);
+	mStats.Binned++;
+}
+
+void OcclusionBuffer::Rasterize(ThreadPool& pool)
+{
+	pool.ParallelFor(mBins.size(), [&](size_t bin)
+	{
+		RasterizeBin((uint32_t)bin);
+	});
+
+	// Level 1 was done with the bins.
+	for (size_t level = 2; level < mLevels.size(); level++)
+	{
+		const std::vector<float>& src = mLevels[level - 1];
+		uint32_t srcWidth = mLevelWidths[level - 1], srcHeight = mLevelHeights[level - 1];
+		std::vector<float>& dst = mLevels[level];
+		for (uint32_t y = 0; y < mLevelHeights[level]; y++)
+		{
+			uint32_t sy0 = 2 * y, sy1 = std::min(2 * y + 1, srcHeight - 1);
+			for (uint32_t x = 0; x < mLevelWidths[level]; x++)
+			{
+				uint32_t sx0 = 2 * x, sx1 = std::min(2 * x + 1, srcWidth - 1);
+				dst[y * mLevelWidths[level] + x] = std::max(std::max(src[sy0 * srcWidth + sx0], src[sy0 * srcWidth + sx1]),
+					std::max(src[sy1 * srcWidth + sx0], src[sy1 * srcWidth + sx1]));
+			}
+		}
+	}
+}
+
+void OcclusionBuffer::RasterizeBin(uint32_t bin)
+{
+	int binX0 = (int)(bin % mBinsX * BinWidth);
+	int binY0 = (int)(bin / mBinsX * BinHeight);
+	float* depth = mLevels[0].data();
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+
+	for (uint32_t index : mBins[bin])
+	{
+		const Triangle& t = mTriangles[index];
+
+		// Edge i faces vertex i: E(p) = A x + B y + C, positive inside, and equal to
+		// twice the area of the triangle p makes with the edge.
+		float a[3], b[3], c[3];
+		for (int i = 0; i < 3; i++)
+		{
+			int j = (i + 1) % 3, k = (i + 2) % 3;
+			a[i] = t.Y[j] - t.Y[k];
+			b[i] = t.X[k] - t.X[j];
+			c[i] = -(a[i] * t.X[j] + b[i] * t.Y[j]);
+		}
+		float invArea = 1.0f / (c[0] + c[1] + c[2]);
+		float za = (a[0] * t.Z[0] + a[1] * t.Z[1] + a[2] * t.Z[2]) * invArea;
+		float zb = (b[0] * t.Z[0] + b[1] * t.Z[1] + b[2] * t.Z[2]) * invArea;
+		float zc = (c[0] * t.Z[0] + c[1] * t.Z[1] + c[2] * t.Z[2]) * invArea;
+
+		float minX = std::min(std::min(t.X[0], t.X[1]), t.X[2]);
+		float maxX = std::max(std::max(t.X[0], t.X[1]), t.X[2]);
+		float minY = std::min(std::min(t.Y[0], t.Y[1]), t.Y[2]);
+		float maxY = std::max(std::max(t.Y[0], t.Y[1]), t.Y[2]);
+		// Groups of four pixels start on a multiple of four.
+		int x0 = std::max((int)std::ceil(minX - 0.5f), binX0) & ~3;
+		int x1 = std::min((int)std::floor(maxX - 0.5f), binX0 + (int)BinWidth - 1);
+		int y0 = std::max((int)std::ceil(minY - 0.5f), binY0);
+		int y1 = std::min((int)std::floor(maxY - 0.5f), binY0 + (int)BinHeight - 1);
+
+		__m128 ea0 = _mm_set1_ps(a[0]), ea1 = _mm_set1_ps(a[1]), ea2 = _mm_set1_ps(a[2]);
+		__m128 step0 = _mm_set1_ps(4.0f * a[0]), step1 = _mm_set1_ps(4.0f * a[1]), step2 = _mm_set1_ps(4.0f * a[2]);
+		__m128 zStep = _mm_set1_ps(4.0f * za);
+		__m128 xs = _mm_add_ps(_mm_set1_ps((float)x0), lanes);
+		for (int y = y0; y <= y1; y++)
+		{
+			float yc = y + 0.5f;
+			__m128 e0 = _mm_add_ps(_mm_mul_ps(ea0, xs), _mm_set1_ps(b[0] * yc + c[0]));
+			__m128 e1 = _mm_add_ps(_mm_mul_ps(ea1, xs), _mm_set1_ps(b[1] * yc + c[1]));
+			__m128 e2 = _mm_add_ps(_mm_mul_ps(ea2, xs), _mm_set1_ps(b[2] * yc + c[2]));
+			__m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(za), xs), _mm_set1_ps(zb * yc + zc));
+			float* row = depth + y * mWidth;
+			for (int x = x0; x <= x1; x += 4)
+			{
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+				if (_mm_movemask_ps(inside))
+				{
+					__m128 old = _mm_loadu_ps(row + x);
+					__m128 nearer = _mm_min_ps(old, z);
+					_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+				}
+				e0 = _mm_add_ps(e0, step0);
+				e1 = _mm_add_ps(e1, step1);
+				e2 = _mm_add_ps(e2, step2);
+				z = _mm_add_ps(z, zStep);
+			}
+		}
+	}
+
+	// The bin's part of level 1.
+	uint32_t halfWidth = mLevelWidths[1];
+	float* half = mLevels[1].data();
+	for (int y = binY0; y < binY0 + (int)BinHeight; y += 2)
+	{
+		const float* row0 = depth + y * mWidth;
+		const float* row1 = row0 + mWidth;
+		for (int x = binX0; x < binX0 + (int)BinWidth; x += 8)
+		{
+			// Maxima of columns, then of the neighbouring pairs, kept in the even lanes.
+			__m128 m0 = _mm_max_ps(_mm_loadu_ps(row0 + x), _mm_loadu_ps(row1 + x));
+			__m128 m1 = _mm_max_ps(_mm_loadu_ps(row0 + x + 4), _mm_loadu_ps(row1 + x + 4));
+			__m128 even = _mm_shuffle_ps(m0, m1, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 odd = _mm_shuffle_ps(m0, m1, _MM_SHUFFLE(3, 1, 3, 1));
+			_mm_storeu_ps(half + (y / 2) * halfWidth + x / 2, _mm_max_ps(even, odd));
+		}
+	}
+}
+
+bool OcclusionBuffer::IsHidden(const BoundingBox& box) const
+{
+	XMFLOAT3 corners[BoundingBox::CORNER_COUNT];
+	box.GetCorners(corners);
+	XMMATRIX viewProj = XMLoadFloat4x4(&mViewProj);
+
+	float minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX, minZ = FLT_MAX;
+	for (auto& corner : corners)
+	{
+		XMFLOAT4 clip;
+		XMStoreFloat4(&clip, XMVector3Transform(XMLoadFloat3(&corner), viewProj));
+		if (clip.z < 0.0f)
+			return false;
+		float invW = 1.0f / clip.w;
+		float x = (0.5f + 0.5f * clip.x * invW) * mWidth;
+		float y = (0.5f - 0.5f * clip.y * invW) * mHeight;
+		minX = std::min(minX, x);
+		maxX = std::max(maxX, x);
+		minY = std::min(minY, y);
+		maxY = std::max(maxY, y);
+		minZ = std::min(minZ, clip.z * invW);
+	}
+
+	// Every pixel the box touches and their neighbours, on the level where that is at
+	// most 4 x 4 texels.
+	if (maxX < 0.0f || minX >= mWidth || maxY < 0.0f || minY >= mHeight)
+		return true;
+	int x0 = std::max((int)std::floor(minX) - 1, 0);
+	int x1 = std::min((int)std::floor(maxX) + 1, (int)mWidth - 1);
+	int y0 = std::max((int)std::floor(minY) - 1, 0);
+	int y1 = std::min((int)std::floor(maxY) + 1, (int)mHeight - 1);
+	size_t level = 0;
+	while (level + 1 < mLevels.size() && ((x1 >> level) - (x0 >> level) >= 4 || (y1 >> level) - (y0 >> level) >= 4))
+		level++;
+
+	const std::vector<float>& depth = mLevels[level];
+	uint32_t width = mLevelWidths[level];
+	for (int y = y0 >> level; y <= (y1 >> level); y++)
+		for (int x = x0 >> level; x <= (x1 >> level); x++)
+			if (depth[y * width + x] >= minZ)
+				return false;
+	return true;
+}
+
+void OcclusionBuffer::Cull(const std::vector<BoundingBox>& boxes, std::vector<uint8_t>& hidden, ThreadPool& pool)
+{
+	hidden.assign(boxes.size(), 0);
+	pool.ParallelFor(boxes.size(), 64, [&](size_t i)
+	{
+		hidden[i] = IsHidden(boxes[i]);
+	});
+
+	mStats.Tested += (uint32_t)boxes.size();
+	for (uint8_t h : hidden)
+		mStats.Culled += h;
+}
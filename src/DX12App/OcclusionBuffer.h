@@ -0,0 +1,113 @@
+#pragma once
+
+#include <DirectXCollision.h>
+#include <DirectXMath.h>
+
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// Triangles of an occluder in its local space, far coarser than what is drawn.
+struct OccluderMesh
+{
+	std::vector<DirectX::XMFLOAT3> Vertices;
+	std::vector<uint32_t> Indices;
+};
+
+// Simplifies a mesh for occlusion by vertex clustering: its bounds are cut into
+// cells x cells x cells, the vertices of a cell merge into their average and triangles
+// that lose a corner are dropped. Positions are read every stride bytes. The surface
+// moves by up to a cell, so cells should be small next to the parts meant to occlude.
+OccluderMesh SimplifyOccluder(const DirectX::XMFLOAT3* positions, size_t stride, size_t vertexCount,
+	const uint32_t* indices, size_t indexCount, uint32_t cells);
+
+// Software occlusion culling. Occluders are rasterized on the CPU into a small depth
+// buffer, four pixels at a time with SSE and one screen bin per job, and a max depth
+// pyramid is built over it. A box is hidden when its nearest depth is behind the
+// furthest depth of the occluders everywhere it covers on screen.
+//
+// Depth is z / w of the view projection, smaller is nearer. Occluders are sampled at
+// pixel centers, so a box is tested against the pixels around it as well: a pixel
+// an occluder covers only in part then has an uncovered neighbour, and no box seen
+// through the uncovered part is hidden.
+class OcclusionBuffer
+{
+public:
+	struct Stats
+	{
+		uint32_t Occluders = 0;
+		// Triangles left after clipping, and those binned into a screen bin.
+		uint32_t Triangles = 0;
+		uint32_t Binned = 0;
+		uint32_t Tested = 0;
+		uint32_t Culled = 0;
+	};
+
+	// Pixels of a bin, the part of the screen one job rasterizes.
+	static const uint32_t BinWidth = 32;
+	static const uint32_t BinHeight = 32;
+
+	// Width and height are rounded up to whole bins.
+	explicit OcclusionBuffer(uint32_t width = 256, uint32_t height = 128);
+
+	uint32_t Width() const { return mWidth; }
+	uint32_t Height() const { return mHeight; }
+
+	// Starts a frame: drops the occluders, clears the depth and resets the stats.
+	void Begin(DirectX::FXMMATRIX viewProj);
+
+	void AddOccluder(const OccluderMesh& mesh, DirectX::FXMMATRIX world);
+
+	// A tile's ground as a cells x cells grid over its footprint, with the lowest height
+	// of every cell in texel order (rows from the tile's +z edge), like
+	// TerrainHorizon::AddOccluderGrid. Grid corners take the lowest of their cells, so
+	// the occluder stays below the ground; the eye has to be above it.
+	void AddOccluderGrid(const DirectX::BoundingBox& tile, uint32_t cells, const float* minHeights);
+
+	// Rasterizes the occluders and builds the depth pyramid.
+	void Rasterize(ThreadPool& pool);
+
+	// Whether the occluders hide the box. Boxes reaching in front of the near plane
+	// are never hidden.
+	bool IsHidden(const DirectX::BoundingBox& box) const;
+
+	// Sets hidden[i] for the boxes the occluders hide.
+	void Cull(const std::vector<DirectX::BoundingBox>& boxes, std::vector<uint8_t>& hidden, ThreadPool& pool);
+
+	// Depth after Rasterize, row by row from the top of the screen.
+	const std::vector<float>& Depth() const { return mLevels[0]; }
+	const Stats& GetStats() const { return mStats; }
+
+private:
+	// Screen space in pixels, wound so that all three edge functions are positive
+	// inside.
+	struct Triangle
+	{
+		float X[3], Y[3], Z[3];
+	};
+
+	// Clips a triangle in clip space against the near plane and bins what is left.
+	void AddTriangle(const DirectX::XMFLOAT4* clip);
+	void AddScreenTriangle(const DirectX::XMFLOAT4& a, const DirectX::XMFLOAT4& b, const DirectX::XMFLOAT4& c);
+	void RasterizeBin(uint32_t bin);
+
+	uint32_t mWidth;
+	uint32_t mHeight;
+	uint32_t mBinsX;
+	uint32_t mBinsY;
+	DirectX::XMFLOAT4X4 mViewProj;
+
+	std::vector<Triangle> mTriangles;
+	// Indices into mTriangles of the triangles that overlap each bin.
+	std::vector<std::vector<uint32_t>> mBins;
+	// Scratch for the clip space vertices of an occluder.
+	std::vector<DirectX::XMFLOAT4> mClip;
+
+	// Level 0 is the depth buffer, every next level the max of 2 x 2 texels.
+	std::vector<std::vector<float>> mLevels;
+	std::vector<uint32_t> mLevelWidths;
+	std::vector<uint32_t> mLevelHeights;
+
+	Stats mStats;
+};
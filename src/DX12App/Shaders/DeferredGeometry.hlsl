@@ -37,24 +37,6 @@ struct GBufferData
     float4 MaterialFresnelRoughness : SV_TARGET4;
 };
 
-bool isVertexOnEdge(float2 TexC1, float2 TexC2)
-{
-    float scale = 1e-3;
-    
-    if (abs(TexC1.x) < scale && abs(TexC2.x) < scale)
-        return true;
-    if (abs(TexC1.y) < scale && abs(TexC2.y) < scale)
-        return true;
-    
-    
-    if (abs(1.f - TexC1.x) < scale && abs(1.f - TexC2.x) < scale)
-        return true;
-    if (abs(1.f - TexC1.y) < scale && abs(1.f - TexC2.y) < scale)
-        return true;
-    
-    return false;
-}
-
 VertexIn tessVS(VertexIn vin)
 {
     vin.TexC = mul(float4(vin.TexC, 0.f, 1.f), gTexTransform).xy;
@@ -74,26 +56,6 @@ VertexOut VS(VertexIn vin)
     return vo;
 }
 
-VertexOut displaceVS(VertexIn vin)
-{
-    VertexOut vo;
-    
-    vo.Tangent = vin.Tangent;
-    vo.PosW = mul(float4(vin.PosL, 1.0f), gWorld);
-    vo.NormalL = vin.NormalL;
-    vo.TexC = mul(float4(vin.TexC, 0.f, 1.f), gTexTransform).xy;
-    
-    // Displacement mapping
-    uint width, height;
-    float disp = gDisplacementMap.SampleLevel(gsamAnisotropicClamp, vo.TexC, 0).r;
-    vo.PosW.y += disp * 250.0f;
-    
-    vo.PosH = mul(vo.PosW, gViewProj);
-    
-    return vo;
-}
-
-
 PatchTess ConstantHS(InputPatch<VertexIn, 3> patch, uint patchID : SV_PrimitiveID)
 {
     PatchTess pt;
@@ -173,49 +135,6 @@ VertexOut DS(PatchTess patchTess,
     return dout;
 }
 
-[maxvertexcount(21)]
-void curtainsGS(triangle VertexOut p[3], inout TriangleStream<VertexOut> stream)
-{
-    stream.Append(p[0]);
-    stream.Append(p[1]);
-    stream.Append(p[2]);
-    
-    float downOffset = 10.f;
-    int sides[3][2] = { { 0, 1 }, { 1, 2 }, { 2, 0 } };
-    
-    VertexOut p1, p2;
-    
-    // check if triangle's side is on the edge
-    
-    for (int i = 0; i < 3; i++)
-    {
-        p1 = p[sides[i][0]];
-        p2 = p[sides[i][1]];
-        
-        if (isVertexOnEdge(p1.TexC, p2.TexC))
-        {
-            // if yes -- generate from it two triangles down
-            VertexOut p3 = p1;
-            p3.PosW.y -= downOffset;
-            p3.PosH = mul(p3.PosW, gViewProj);
-            
-            VertexOut p4 = p2;
-            p4.PosW.y -= downOffset;
-            p4.PosH = mul(p4.PosW, gViewProj);
-            
-            stream.Append(p1);
-            stream.Append(p2);
-            stream.Append(p4);
-            
-            stream.Append(p1);
-            stream.Append(p3);
-            stream.Append(p4);
-        }
-
-    }
-    
-}
-
 GBufferData OriginalNormalPS(VertexOut pin)
 {
     GBufferData pout;
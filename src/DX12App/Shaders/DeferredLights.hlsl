@@ -48,6 +48,21 @@ cbuffer LightConstants : register(b1)
     float4x4 LShadowTransform[6];
 };
 
+// Lights without shadow maps, binned on the CPU into clusters of the view: screen
+// tiles by depth slices, see LightClusters.h. A cluster is an (offset, count) range
+// of gClusterLightIndices.
+StructuredBuffer<Light> gClusterLights : register(t0, space2);
+StructuredBuffer<uint2> gLightClusters : register(t1, space2);
+StructuredBuffer<uint> gClusterLightIndices : register(t2, space2);
+
+cbuffer cbLightClusters : register(b0, space1)
+{
+    uint gClusterTiles; // tiles across | tiles down << 16
+    uint gClusterSlices;
+    float gSliceScale;
+    float gSliceBias;
+};
+
 float DistributionGGX(float3 N, float3 H, float roughness)
 {
     float a = roughness * roughness;
@@ -318,4 +333,41 @@ float4 AmbientPS(VertexOut vo) : SV_Target
     float3 ambient = (kD * diffuse + specular) * ao * 0.2f.xxx;
     
     return float4(ambient, diffuseAlbedo.a);
+}
+
+// Every light without a shadow map that reaches the pixel's cluster, in one pass.
+float4 ClusteredPS(VertexOut vo) : SV_Target
+{
+    float2 uv = vo.PosH.xy / gRenderTargetSize;
+    uint2 pixelC = vo.PosH.xy;
+    float4 diffuseAlbedo = gDiffuse.Load(int3(pixelC, 0));
+    float4 zw = gZW.Load(int3(pixelC, 0));
+    float4 normalChannel = gNormal.Load(int3(pixelC, 0));
+    float4 matAlbedo = gMaterialAlbedo.Load(int3(pixelC, 0));
+    float4 matFrR = gMaterialFresnelRoughness.Load(int3(pixelC, 0));
+    float3 normal = normalChannel.rgb;
+    
+    if (length(normal) < 0.01f)
+        discard;
+    
+    float3 posW = RestoreWorldPosition(uv, zw.a);
+    float3 toEyeW = normalize(gEyePosW - posW);
+    Material mat = { diffuseAlbedo * matAlbedo, matFrR.rgb, 1.0f - matFrR.a };
+    
+    // The cluster of the pixel's screen tile and view depth, as LightClusters finds it.
+    uint tilesX = gClusterTiles & 0xffff;
+    uint tilesY = gClusterTiles >> 16;
+    uint2 tile = min(uint2(uv * float2(tilesX, tilesY)), uint2(tilesX - 1, tilesY - 1));
+    float viewZ = mul(float4(posW, 1.0f), gView).z;
+    uint slice = (uint)clamp(floor(log(max(viewZ, 1e-4f)) * gSliceScale + gSliceBias), 0.0f, gClusterSlices - 1.0f);
+    uint2 cluster = gLightClusters[(slice * tilesY + tile.y) * tilesX + tile.x];
+    
+    float3 litColor = 0.0f;
+    for (uint i = 0; i < cluster.y; i++)
+    {
+        Light light = gClusterLights[gClusterLightIndices[cluster.x + i]];
+        litColor += ComputePointLight(light, mat, posW, normal, toEyeW);
+    }
+    
+    return float4(litColor, 1.0f);
 }
\ No newline at end of file
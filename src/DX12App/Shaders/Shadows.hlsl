@@ -15,6 +15,12 @@ cbuffer LightConstants : register(b3)
     float4x4 LShadowTransform[6];
 };
 
+// Views the drawn items cast into, bit i for LViewProj[i]; see ShadowCasters.h.
+cbuffer cbShadowCasters : register(b0, space1)
+{
+    uint gCasterViews;
+};
+
 struct VertexIn
 {
 	float3 PosL    : POSITION;
@@ -58,6 +64,8 @@ void GS(triangle VertexOut p[3], in uint id : SV_GSInstanceID, inout TriangleStr
             if (id > 0) return;
             break;
     }
+    if ((gCasterViews & (1u << id)) == 0)
+        return;
     
     for (int i = 0; i < 3; i++)
     {
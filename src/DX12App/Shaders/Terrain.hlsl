@@ -0,0 +1,103 @@
+#include "Common.hlsl"
+
+// Diffuse, height and normal map of tile slot s at 3 * s + 0, 1 and 2.
+Texture2D gTerrainMaps[] : register(t0, space1);
+
+// See TerrainInstance in TerrainInstances.h.
+struct TerrainInstance
+{
+    float2 Center;
+    float Size;
+    uint Slot;
+    uint Level;
+    float MorphStart;
+    float MorphScale;
+    float Pad;
+};
+
+StructuredBuffer<TerrainInstance> gTerrainInstances : register(t0, space2);
+
+// Set per batch; SV_InstanceID doesn't include the draw's start instance.
+cbuffer cbTerrainBatch : register(b0, space1)
+{
+    uint gFirstInstance;
+    float gGridQuads;
+    float gTerrainBaseY;
+    float gTerrainHeightScale;
+};
+
+struct VertexIn
+{
+    float3 Tangent : TANGENT;
+    float3 PosL : POSITION;
+    float3 NormalL : NORMAL;
+    float2 TexC : TEXCOORD;
+};
+
+struct VertexOut
+{
+    float4 PosH : SV_POSITION;
+    float2 TexC : TEXCOORD;
+    nointerpolation uint Slot : SLOT;
+};
+
+struct GBufferData
+{
+    float4 diffuse : SV_TARGET0;
+    float4 zwzanashih_RGBA32F : SV_TARGET1;
+    float4 normal : SV_TARGET2;
+    float4 materialAlbedo : SV_TARGET3;
+    float4 MaterialFresnelRoughness : SV_TARGET4;
+};
+
+float TerrainHeight(uint slot, float2 uv, float mip)
+{
+    return gTerrainMaps[NonUniformResourceIndex(3 * slot + 1)].SampleLevel(gsamAnisotropicClamp, uv, mip).r;
+}
+
+VertexOut VS(VertexIn vin, uint instanceID : SV_InstanceID)
+{
+    TerrainInstance tile = gTerrainInstances[gFirstInstance + instanceID];
+
+    VertexOut vo;
+    vo.Slot = tile.Slot;
+    vo.TexC = vin.TexC;
+
+    // CDLOD morph: vertices that are not on the parent's grid (odd grid indices)
+    // slide onto their even neighbour as the distance approaches the end of the
+    // tile's range, and the height blends to the next mip, which has the parent's
+    // texel spacing. Fully morphed tiles match the coarser tile next to them.
+    float3 posW = float3(tile.Center.x + vin.PosL.x * tile.Size, gTerrainBaseY, tile.Center.y + vin.PosL.z * tile.Size);
+    posW.y += TerrainHeight(tile.Slot, vo.TexC, 0) * gTerrainHeightScale;
+    float morph = saturate((distance(gEyePosW, posW) - tile.MorphStart) * tile.MorphScale);
+
+    float2 grid = round(vin.TexC * gGridQuads);
+    float2 shift = frac(grid * 0.5f) * 2.0f * morph / gGridQuads;
+    vo.TexC -= shift;
+
+    // The grid's u grows with x and v with -z.
+    posW.x -= shift.x * tile.Size;
+    posW.z += shift.y * tile.Size;
+
+    float disp = lerp(TerrainHeight(tile.Slot, vo.TexC, 0), TerrainHeight(tile.Slot, vo.TexC, 1), morph);
+    posW.y = gTerrainBaseY + disp * gTerrainHeightScale;
+
+    vo.PosH = mul(float4(posW, 1.0f), gViewProj);
+    return vo;
+}
+
+GBufferData PS(VertexOut pin)
+{
+    GBufferData pout;
+
+    float3 normalMap = gTerrainMaps[NonUniformResourceIndex(3 * pin.Slot + 2)].Sample(gsamAnisotropicWrap, pin.TexC).rgb;
+    float4 diffuseAlbedo = gTerrainMaps[NonUniformResourceIndex(3 * pin.Slot)].Sample(gsamAnisotropicWrap, pin.TexC);
+
+    pout.diffuse = diffuseAlbedo;
+    pout.zwzanashih_RGBA32F = float4(0.f, 0.f, 0.f, pin.PosH.z);
+    pout.normal = float4(normalMap, Metallic);
+    pout.materialAlbedo = gDiffuseAlbedo;
+    pout.MaterialFresnelRoughness = float4(gFresnelR0, gRoughness);
+
+    return pout;
+}
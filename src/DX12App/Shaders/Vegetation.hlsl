@@ -0,0 +1,81 @@
+#include "Common.hlsl"
+
+// Billboard of kind k in slice k.
+Texture2DArray gTreeMaps : register(t0);
+
+// See VegetationInstance in VegetationScatter.h.
+struct VegetationInstance
+{
+    float3 Position;
+    float Size;
+    uint Kind;
+    float Variation;
+    float2 Pad;
+};
+
+StructuredBuffer<VegetationInstance> gVegetationInstances : register(t0, space2);
+
+// Set per batch; SV_InstanceID doesn't include the draw's start instance.
+cbuffer cbVegetationBatch : register(b0, space1)
+{
+    uint gFirstInstance;
+};
+
+struct VertexOut
+{
+    float4 PosH : SV_POSITION;
+    float3 NormalW : NORMAL;
+    float2 TexC : TEXCOORD;
+    nointerpolation uint Kind : KIND;
+    nointerpolation float Tint : TINT;
+};
+
+struct GBufferData
+{
+    float4 diffuse : SV_TARGET0;
+    float4 zwzanashih_RGBA32F : SV_TARGET1;
+    float4 normal : SV_TARGET2;
+    float4 materialAlbedo : SV_TARGET3;
+    float4 MaterialFresnelRoughness : SV_TARGET4;
+};
+
+// A quad drawn as a 4 vertex strip, standing on the instance's position and turned
+// about the vertical axis to face the eye.
+VertexOut VS(uint vertexID : SV_VertexID, uint instanceID : SV_InstanceID)
+{
+    VegetationInstance plant = gVegetationInstances[gFirstInstance + instanceID];
+    float2 corner = float2((vertexID & 1) - 0.5f, vertexID >> 1);
+
+    float3 toEye = gEyePosW - plant.Position;
+    toEye.y = 0.0f;
+    toEye = normalize(toEye + float3(1e-4f, 0.0f, 0.0f));
+    float3 right = float3(toEye.z, 0.0f, -toEye.x);
+
+    float3 posW = plant.Position + (right * corner.x + float3(0.0f, corner.y, 0.0f)) * plant.Size;
+
+    VertexOut vo;
+    vo.PosH = mul(float4(posW, 1.0f), gViewProj);
+    // Lit like a rounded crown rather than a flat card.
+    vo.NormalW = normalize(toEye + float3(0.0f, 1.0f, 0.0f) + right * corner.x);
+    // Half the instances are mirrored so neighbours of a kind look different.
+    vo.TexC = float2(plant.Variation < 0.5f ? corner.x + 0.5f : 0.5f - corner.x, 1.0f - corner.y);
+    vo.Kind = plant.Kind;
+    vo.Tint = 0.85f + 0.3f * frac(plant.Variation * 2.0f);
+    return vo;
+}
+
+GBufferData PS(VertexOut pin)
+{
+    GBufferData pout;
+
+    float4 diffuseAlbedo = gTreeMaps.Sample(gsamAnisotropicClamp, float3(pin.TexC, pin.Kind));
+    clip(diffuseAlbedo.a - 0.5f);
+
+    pout.diffuse = float4(diffuseAlbedo.rgb * pin.Tint, 1.0f);
+    pout.zwzanashih_RGBA32F = float4(0.f, 0.f, 0.f, pin.PosH.z);
+    pout.normal = float4(normalize(pin.NormalW), Metallic);
+    pout.materialAlbedo = gDiffuseAlbedo;
+    pout.MaterialFresnelRoughness = float4(gFresnelR0, gRoughness);
+
+    return pout;
+}
@@ -0,0 +1,82 @@
+#include "ShadowCasters.h"
+
+#include "BoundsTree.h"
+
+#include <algorithm>
+
+using namespace DirectX;
+
+ShadowCasterView MakeShadowCasterView(FXMMATRIX viewProj, bool towardLight)
+{
+	// Clip space is x * M for a row vector x; with the columns C0 to C3 of M the
+	// inside is -w <= x <= w, -w <= y <= w and 0 <= z <= w, so the planes are
+	// C3 + C0, C3 - C0, C3 + C1, C3 - C1, C3 - C2 and C2, negated to face outwards.
+	// The near plane C2 comes last to be left out.
+	XMMATRIX columns = XMMatrixTranspose(viewProj);
+	XMVECTOR planes[6] =
+	{
+		XMVectorAdd(columns.r[3], columns.r[0]),
+		XMVectorSubtract(columns.r[3], columns.r[0]),
+		XMVectorAdd(columns.r[3], columns.r[1]),
+		XMVectorSubtract(columns.r[3], columns.r[1]),
+		XMVectorSubtract(columns.r[3], columns.r[2]),
+		columns.r[2],
+	};
+
+	ShadowCasterView view;
+	view.PlaneCount = towardLight ? 5 : 6;
+	for (uint32_t p = 0; p < view.PlaneCount; p++)
+		XMStoreFloat4(&view.Planes[p], XMVectorNegate(planes[p]));
+	return view;
+}
+
+void ShadowCasters::Cull(const BoundsTree& tree, const ShadowCasterView* views, uint32_t viewCount, const std::vector<uint8_t>& casts)
+{
+	mViewCount = std::min(viewCount, MaxViews);
+	mMasks.resize(casts.size(), 0);
+	mMarked.clear();
+
+	for (uint32_t v = 0; v < mViewCount; v++)
+	{
+		std::vector<uint32_t>& items = mViews[v];
+		tree.Query(views[v].Planes, views[v].PlaneCount, items);
+
+		size_t kept = 0;
+		for (uint32_t item : items)
+		{
+			if (item >= casts.size() || !casts[item])
+				continue;
+			if (mMasks[item] == 0)
+				mMarked.push_back(item);
+			mMasks[item] |= (uint8_t)(1u << v);
+			items[kept++] = item;
+		}
+		items.resize(kept);
+		std::sort(items.begin(), items.end());
+	}
+	for (uint32_t v = mViewCount; v < MaxViews; v++)
+		mViews[v].clear();
+
+	// One group per mask that occurs, the masks' items in order.
+	std::sort(mMarked.begin(), mMarked.end());
+	std::vector<int> groupOfMask(1u << MaxViews, -1);
+	for (Group& group : mGroups)
+		group.Items.clear();
+	size_t groupCount = 0;
+	for (uint32_t item : mMarked)
+	{
+		uint32_t mask = mMasks[item];
+		mMasks[item] = 0;
+		if (groupOfMask[mask] < 0)
+		{
+			groupOfMask[mask] = (int)groupCount++;
+			if (mGroups.size() < groupCount)
+				mGroups.emplace_back();
+			mGroups[groupCount - 1].ViewMask = mask;
+		}
+		mGroups[groupOfMask[mask]].Items.push_back(item);
+	}
+	mGroups.resize(groupCount);
+	std::sort(mGroups.begin(), mGroups.end(), [](const Group& a, const Group& b) { return a.ViewMask < b.ViewMask; });
+	mCasterCount = mMarked.size();
+}
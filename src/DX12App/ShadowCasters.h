@@ -0,0 +1,60 @@
+#pragma once
+
+#include <DirectXMath.h>
+
+#include <cstdint>
+#include <vector>
+
+class BoundsTree;
+
+// What a shadow map view (a cascade, a cube face or a spot light's map) can see, as
+// world space planes; p is outside a plane when N.p + D > 0.
+struct ShadowCasterView
+{
+	DirectX::XMFLOAT4 Planes[6];
+	uint32_t PlaneCount = 0;
+};
+
+// Planes of a view projection matrix. With towardLight the near plane is left out, so
+// the volume reaches back to the light: casters in front of a cascade still throw
+// their shadow into it. Only for orthographic projections, a perspective frustum
+// without its near plane opens up again behind its apex.
+ShadowCasterView MakeShadowCasterView(DirectX::FXMMATRIX viewProj, bool towardLight);
+
+// Shadow casters of one light, per view. The views of a light are drawn by one
+// geometry shader that copies every triangle to each of them; an item is drawn once
+// with the mask of the views it is in, and the shader skips the others. Items come
+// grouped by mask so that the mask is set once per group.
+class ShadowCasters
+{
+public:
+	static const uint32_t MaxViews = 6;
+
+	struct Group
+	{
+		// Bit v for view v.
+		uint32_t ViewMask = 0;
+		std::vector<uint32_t> Items;
+	};
+
+	// Finds the casters of every view among the tree's items; only items with
+	// casts[item] set count.
+	void Cull(const BoundsTree& tree, const ShadowCasterView* views, uint32_t viewCount, const std::vector<uint8_t>& casts);
+
+	uint32_t ViewCount() const { return mViewCount; }
+	// Casters of a view, in item order.
+	const std::vector<uint32_t>& View(uint32_t view) const { return mViews[view]; }
+	// Groups in mask order, each in item order.
+	const std::vector<Group>& Groups() const { return mGroups; }
+	// Items in at least one view.
+	size_t CasterCount() const { return mCasterCount; }
+
+private:
+	uint32_t mViewCount = 0;
+	std::vector<uint32_t> mViews[MaxViews];
+	std::vector<Group> mGroups;
+	size_t mCasterCount = 0;
+	// Views of every item, and the items set there.
+	std::vector<uint8_t> mMasks;
+	std::vector<uint32_t> mMarked;
+};
@@ -0,0 +1,237 @@
+#include "TerrainCut.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace DirectX;
+
+namespace
+{
+	// Coarsest first, then nearest: a heap top is the most urgent split.
+	bool LaterSplit(uint32_t levelA, float distanceA, uint32_t levelB, float distanceB)
+	{
+		return levelA != levelB ? levelA > levelB : distanceA > distanceB;
+	}
+
+	bool IsBelow(uint32_t node, uint32_t level, uint32_t ancestor, uint32_t ancestorLevel)
+	{
+		while (level > ancestorLevel)
+		{
+			node = TerrainQuadTree::Parent(node, level);
+			level--;
+		}
+		return node == ancestor;
+	}
+}
+
+void TerrainCut::Clear()
+{
+	for (auto& e : mEntries)
+		if (e.Drawn)
+			mRemoved.push_back({ e.Node, e.Level });
+	mEntries.clear();
+	mIndex.clear();
+	mDrawn.clear();
+}
+
+bool TerrainCut::Refines(const BoundingBox& bounds, uint32_t level) const
+{
+	XMVECTOR outside = XMVectorMax(XMVectorSubtract(XMVectorAbs(XMVectorSubtract(XMLoadFloat3(&mEye), XMLoadFloat3(&bounds.Center))),
+		XMLoadFloat3(&bounds.Extents)), XMVectorZero());
+	return RefineTerrainNode(*mRanges, level, XMVectorGetX(XMVector3Length(outside)));
+}
+
+bool TerrainCut::WantsSplit(uint32_t node, uint32_t level) const
+{
+	BoundingBox bounds = mTree->Bounds(node);
+	return mFrustum->Intersects(bounds) && Refines(bounds, level) && mTree->HasChildren(node, level);
+}
+
+void TerrainCut::Add(uint32_t node, uint32_t level)
+{
+	Entry entry = { node, level, false, false, mTree->Bounds(node) };
+	entry.Visible = mFrustum->Intersects(entry.Bounds);
+	mIndex[node] = (uint32_t)mEntries.size();
+	mEntries.push_back(entry);
+	mStats.Evaluated++;
+
+	if (!entry.Visible || !Refines(entry.Bounds, level))
+		return;
+
+	if (mTree->HasChildren(node, level))
+	{
+		mSplits.push_back({ node, level, mTree->DistanceToBounds(node, level, mEye) });
+		std::push_heap(mSplits.begin(), mSplits.end(), [](const Split& a, const Split& b)
+		{
+			return LaterSplit(a.Level, a.Distance, b.Level, b.Distance);
+		});
+	}
+	else
+		mWanted.push_back({ node, level });
+}
+
+void TerrainCut::Remove(uint32_t node)
+{
+	auto it = mIndex.find(node);
+	uint32_t index = it->second;
+	mIndex.erase(it);
+
+	if (mEntries[index].Drawn)
+		mRemoved.push_back({ mEntries[index].Node, mEntries[index].Level });
+
+	if (index + 1 != mEntries.size())
+	{
+		mEntries[index] = mEntries.back();
+		mIndex[mEntries[index].Node] = index;
+	}
+	mEntries.pop_back();
+}
+
+void TerrainCut::QueueMerge(uint32_t node, uint32_t level)
+{
+	if (level == 0)
+		return;
+
+	uint32_t parent = TerrainQuadTree::Parent(node, level);
+	uint32_t first = TerrainQuadTree::FirstChild(parent, level - 1);
+	for (uint32_t i = 0; i < 4; i++)
+		if (!InCut(first + i))
+			return;
+
+	if (!WantsSplit(parent, level - 1))
+		mMerges.push_back({ parent, level - 1 });
+}
+
+void TerrainCut::Collapse(uint32_t ancestor, uint32_t level)
+{
+	for (size_t i = mEntries.size(); i-- > 0;)
+	{
+		if (IsBelow(mEntries[i].Node, mEntries[i].Level, ancestor, level))
+			Remove(mEntries[i].Node);
+	}
+	Add(ancestor, level);
+}
+
+void TerrainCut::Update(const TerrainQuadTree& tree, const TerrainLodRanges& ranges, const BoundingFrustum& frustum,
+	const XMFLOAT3& eye, uint32_t maxOperations)
+{
+	mAdded.clear();
+	mRemoved.clear();
+	mStats = Stats();
+
+	bool sameView = std::memcmp(&frustum, &mLastFrustum, sizeof(frustum)) == 0 && eye.x == mEye.x && eye.y == mEye.y && eye.z == mEye.z;
+	if (mSettled && sameView && ranges.Range == mLastRanges && tree.Version() == mLastVersion)
+		return;
+
+	mTree = &tree;
+	mRanges = &ranges;
+	mFrustum = &frustum;
+	mEye = eye;
+	mLastFrustum = frustum;
+	mLastRanges = ranges.Range;
+	mLastVersion = tree.Version();
+	mWanted.clear();
+	mSplits.clear();
+	mMerges.clear();
+
+	if (!tree.HasNode(0, 0))
+	{
+		Clear();
+		return;
+	}
+	if (mEntries.empty())
+		Add(0, 0);
+
+	// Nodes the tree no longer has fall back to their closest remaining ancestor,
+	// whatever the limit.
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		uint32_t node = mEntries[i].Node, level = mEntries[i].Level;
+		if (tree.HasNode(node, level))
+			continue;
+		while (!tree.HasNode(node, level))
+		{
+			node = TerrainQuadTree::Parent(node, level);
+			level--;
+		}
+		Collapse(node, level);
+		i = (size_t)-1;
+	}
+	mSplits.clear();
+	mWanted.clear();
+
+	// Re-test the whole cut against the view. A node that refines has a parent that
+	// refines as well, so only groups whose first node doesn't can merge.
+	size_t count = mEntries.size();
+	for (size_t i = 0; i < count; i++)
+	{
+		Entry& e = mEntries[i];
+		e.Visible = frustum.Intersects(e.Bounds);
+		mStats.Evaluated++;
+		if (e.Visible && Refines(e.Bounds, e.Level))
+		{
+			if (tree.HasChildren(e.Node, e.Level))
+				mSplits.push_back({ e.Node, e.Level, tree.DistanceToBounds(e.Node, e.Level, eye) });
+			else
+				mWanted.push_back({ e.Node, e.Level });
+		}
+		else if (e.Level > 0 && ((e.Node - TerrainQuadTree::LevelOffset(e.Level)) & 3) == 0)
+			QueueMerge(e.Node, e.Level);
+	}
+	auto later = [](const Split& a, const Split& b) { return LaterSplit(a.Level, a.Distance, b.Level, b.Distance); };
+	std::make_heap(mSplits.begin(), mSplits.end(), later);
+
+	uint32_t operations = 0;
+	while (!mSplits.empty())
+	{
+		if (operations == maxOperations)
+		{
+			mStats.Deferred += (uint32_t)mSplits.size();
+			break;
+		}
+		std::pop_heap(mSplits.begin(), mSplits.end(), later);
+		Split split = mSplits.back();
+		mSplits.pop_back();
+
+		// Children that want splitting as well join the heap.
+		Remove(split.Node);
+		uint32_t child = TerrainQuadTree::FirstChild(split.Node, split.Level);
+		for (uint32_t i = 0; i < 4; i++)
+			Add(child + i, split.Level + 1);
+		mStats.Splits++;
+		operations++;
+	}
+
+	// A node that wants splitting has a parent that does too, so no group queued
+	// here was touched by the splits. Merged parents may complete a group above.
+	for (size_t m = 0; m < mMerges.size(); m++)
+	{
+		if (operations == maxOperations)
+		{
+			mStats.Deferred += (uint32_t)(mMerges.size() - m);
+			break;
+		}
+		TerrainQuadTree::Selected parent = mMerges[m];
+		uint32_t child = TerrainQuadTree::FirstChild(parent.Node, parent.Level);
+		for (uint32_t i = 0; i < 4; i++)
+			Remove(child + i);
+		Add(parent.Node, parent.Level);
+		QueueMerge(parent.Node, parent.Level);
+		mStats.Merges++;
+		operations++;
+	}
+
+	mSettled = mStats.Deferred == 0;
+
+	mDrawn.clear();
+	for (auto& e : mEntries)
+	{
+		if (e.Visible && !e.Drawn)
+			mAdded.push_back({ e.Node, e.Level });
+		else if (!e.Visible && e.Drawn)
+			mRemoved.push_back({ e.Node, e.Level });
+		e.Drawn = e.Visible;
+		if (e.Visible)
+			mDrawn.push_back({ e.Node, e.Level });
+	}
+}
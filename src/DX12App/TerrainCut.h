@@ -0,0 +1,104 @@
+#pragma once
+
+#include "TerrainLod.h"
+
+#include <unordered_map>
+
+// Terrain selection that carries over from frame to frame. The cut through the
+// quadtree of the last update, nodes that together cover the terrain once whether
+// they are in view or not, is kept, and only changed where a node's LOD or
+// visibility changed: a node is split where SelectTerrainTiles would refine it, and
+// four siblings merge where it would stop at their parent. Each update does at most
+// maxOperations splits and merges, coarsest splits first, and leaves the rest for
+// the next ones. Without a limit the drawn nodes are exactly SelectTerrainTiles'.
+//
+// The drawn nodes are also reported as the difference to the previous update, so
+// whatever follows them only has to look at tiles that appear or disappear.
+class TerrainCut
+{
+public:
+	struct Stats
+	{
+		// Cut nodes tested against the view.
+		uint32_t Evaluated = 0;
+		uint32_t Splits = 0;
+		uint32_t Merges = 0;
+		// Splits and merges left for later by the limit.
+		uint32_t Deferred = 0;
+	};
+
+	// Nodes the tree lost since the last update are replaced by their closest
+	// remaining ancestor first, regardless of maxOperations. An update with the same
+	// view, ranges and tree as the last one that finished its work returns at once.
+	void Update(const TerrainQuadTree& tree, const TerrainLodRanges& ranges, const DirectX::BoundingFrustum& frustum,
+		const DirectX::XMFLOAT3& eye, uint32_t maxOperations = UINT32_MAX);
+
+	// Nodes drawn after the last update, in no particular order.
+	const std::vector<TerrainQuadTree::Selected>& Drawn() const { return mDrawn; }
+	// Changes to Drawn made by the last update.
+	const std::vector<TerrainQuadTree::Selected>& Added() const { return mAdded; }
+	const std::vector<TerrainQuadTree::Selected>& Removed() const { return mRemoved; }
+	// Cut nodes to split whose children don't exist yet, see TerrainQuadTree::Select.
+	const std::vector<TerrainQuadTree::Selected>& Wanted() const { return mWanted; }
+
+	size_t Size() const { return mEntries.size(); }
+	const Stats& GetStats() const { return mStats; }
+
+private:
+	struct Entry
+	{
+		uint32_t Node;
+		uint32_t Level;
+		bool Visible;
+		// Part of Drawn as last reported.
+		bool Drawn;
+		// Kept here so re-testing the cut doesn't go through the tree's pages.
+		DirectX::BoundingBox Bounds;
+	};
+
+	struct Split
+	{
+		uint32_t Node;
+		uint32_t Level;
+		float Distance;
+	};
+
+	// Empties the cut, reporting what was drawn as removed.
+	void Clear();
+	// The refinement test of RefineTerrainNode on known bounds.
+	bool Refines(const DirectX::BoundingBox& bounds, uint32_t level) const;
+	bool WantsSplit(uint32_t node, uint32_t level) const;
+	// Adds a node to the cut, tests it against the view and queues its split.
+	void Add(uint32_t node, uint32_t level);
+	void Remove(uint32_t node);
+	bool InCut(uint32_t node) const { return mIndex.find(node) != mIndex.end(); }
+	// Queues the merge into node's parent when all four siblings are in the cut and
+	// the parent would not be split.
+	void QueueMerge(uint32_t node, uint32_t level);
+	// Replaces whatever the cut holds below ancestor with ancestor itself.
+	void Collapse(uint32_t ancestor, uint32_t level);
+
+	// Set for the duration of Update.
+	const TerrainQuadTree* mTree = nullptr;
+	const TerrainLodRanges* mRanges = nullptr;
+	const DirectX::BoundingFrustum* mFrustum = nullptr;
+	DirectX::XMFLOAT3 mEye = {};
+
+	// The last update's inputs; when none changed and nothing was left for later,
+	// the cut stays as it is without looking at it.
+	DirectX::BoundingFrustum mLastFrustum;
+	std::vector<float> mLastRanges;
+	uint64_t mLastVersion = 0;
+	bool mSettled = false;
+
+	std::vector<Entry> mEntries;
+	std::unordered_map<uint32_t, uint32_t> mIndex;
+	std::vector<Split> mSplits;
+	std::vector<TerrainQuadTree::Selected> mMerges;
+
+	std::vector<TerrainQuadTree::Selected> mDrawn;
+	std::vector<TerrainQuadTree::Selected> mAdded;
+	std::vector<TerrainQuadTree::Selected> mRemoved;
+	std::vector<TerrainQuadTree::Selected> mWanted;
+	Stats mStats;
+};
@@ -0,0 +1,352 @@
+#include "TerrainDetail.h"
+#include "TerrainQuadTree.h"
+#include "../Common/DDSTextureLoader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include <emmintrin.h>
+
+namespace
+{
+	// Texels around a tile that are synthesized as well: one for the central
+	// differences of the normals, one more for the slope at those.
+	const uint32_t Border = 2;
+
+	// One height step, the rounding a level can add on top of its noise.
+	const float HeightStep = 1.0f / 65535.0f;
+
+	uint32_t Hash(int32_t x, int32_t y, uint32_t seed)
+	{
+		uint32_t h = seed ^ (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u;
+		h ^= h >> 16;
+		h *= 0x7feb352du;
+		h ^= h >> 15;
+		h *= 0x846ca68bu;
+		h ^= h >> 16;
+		return h;
+	}
+
+	// Unit gradients the lattice points pick from by hash.
+	struct Gradients
+	{
+		float X[256];
+		float Y[256];
+
+		Gradients()
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				X[i] = std::cos(i * 6.2831853f / 256.0f);
+				Y[i] = std::sin(i * 6.2831853f / 256.0f);
+			}
+		}
+	};
+
+	// A lattice cell spans 2x2 texels, whose centers sit at 1/4 and 3/4 of the cell.
+	// The lanes are those four texels, top row first, so every cell weighs its corner
+	// gradients by the same constants: the fade weight of the corner times the
+	// texel's offset from it, scaled so that the noise stays within [-1, 1].
+	struct NoiseLanes
+	{
+		// Corners (0, 0), (1, 0), (0, 1) and (1, 1) in lattice x and y.
+		__m128 X[4];
+		__m128 Y[4];
+
+		NoiseLanes()
+		{
+			const float fx[4] = { 0.25f, 0.75f, 0.25f, 0.75f };
+			const float fy[4] = { 0.25f, 0.25f, 0.75f, 0.75f };
+			float x[4][4], y[4][4], bound = 0.0f;
+			for (int lane = 0; lane < 4; lane++)
+			{
+				float sum = 0.0f;
+				for (int corner = 0; corner < 4; corner++)
+				{
+					float ox = (float)(corner & 1), oy = (float)(corner >> 1);
+					float w = (ox > 0.0f ? Fade(fx[lane]) : 1.0f - Fade(fx[lane])) * (oy > 0.0f ? Fade(fy[lane]) : 1.0f - Fade(fy[lane]));
+					x[corner][lane] = w * (fx[lane] - ox);
+					y[corner][lane] = w * (fy[lane] - oy);
+					sum += std::sqrt(x[corner][lane] * x[corner][lane] + y[corner][lane] * y[corner][lane]);
+				}
+				bound = std::max<float>(bound, sum);
+			}
+			for (int corner = 0; corner < 4; corner++)
+			{
+				X[corner] = _mm_mul_ps(_mm_loadu_ps(x[corner]), _mm_set1_ps(1.0f / bound));
+				Y[corner] = _mm_mul_ps(_mm_loadu_ps(y[corner]), _mm_set1_ps(1.0f / bound));
+			}
+		}
+
+		static float Fade(float t) { return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f); }
+	};
+
+	const Gradients& GradientTable()
+	{
+		static const Gradients gradients;
+		return gradients;
+	}
+
+	const NoiseLanes& Lanes()
+	{
+		static const NoiseLanes lanes;
+		return lanes;
+	}
+
+	// Bilinear taps of texels first + i, upsampled by 1 / scale from a tile whose
+	// texel offset + (t + 0.5) * scale - 0.5 they land on, clamped like SampleLevel.
+	struct Taps
+	{
+		std::vector<uint32_t> First;
+		std::vector<uint32_t> Second;
+		std::vector<float> Weight;
+
+		void Build(float offset, float scale, int first, uint32_t count, uint32_t resolution)
+		{
+			First.resize(count);
+			Second.resize(count);
+			Weight.resize(count);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				float s = offset + (first + (int)i + 0.5f) * scale - 0.5f;
+				s = std::min<float>(std::max<float>(s, 0.0f), (float)(resolution - 1));
+				First[i] = (uint32_t)s;
+				Second[i] = std::min<uint32_t>(First[i] + 1, resolution - 1);
+				Weight[i] = s - (float)First[i];
+			}
+		}
+	};
+
+	// Red and blue, then green and alpha, of a and b blended with weight t of 256 at
+	// once: each channel times at most 256 still fits its 16 bits.
+	uint32_t LerpColor(uint32_t a, uint32_t b, uint32_t t)
+	{
+		uint32_t rb = ((a & 0x00ff00ffu) * (256 - t) + (b & 0x00ff00ffu) * t) >> 8;
+		uint32_t ga = ((a >> 8 & 0x00ff00ffu) * (256 - t) + (b >> 8 & 0x00ff00ffu) * t) >> 8;
+		return (rb & 0x00ff00ffu) | (ga & 0x00ff00ffu) << 8;
+	}
+}
+
+void TerrainDetail::Reset(const TerrainDetailSettings& settings)
+{
+	mSettings = settings;
+	mAmplitudes.resize(settings.Levels);
+	for (uint32_t k = 0; k < settings.Levels; k++)
+		mAmplitudes[k] = settings.Amplitude * std::pow(settings.Persistence, (float)k) / settings.HeightScale;
+}
+
+float TerrainDetail::TailAmplitude(uint32_t level) const
+{
+	float tail = 0.0f;
+	for (uint32_t k = std::max<uint32_t>(level + 1, mSettings.StoredLevels); k < TotalLevels(); k++)
+		tail += mAmplitudes[k - mSettings.StoredLevels] + HeightStep;
+	return tail;
+}
+
+TerrainNodeRecord TerrainDetail::StoredRecord(const TerrainNodeRecord& record, uint32_t level) const
+{
+	float tail = TailAmplitude(level);
+	TerrainNodeRecord widened;
+	widened.Error = record.Error + tail;
+	widened.MinHeight = std::max<float>(record.MinHeight - tail, 0.0f);
+	widened.MaxHeight = std::min<float>(record.MaxHeight + tail, 1.0f);
+	return widened;
+}
+
+TerrainNodeRecord TerrainDetail::SynthesizedRecord(const TerrainNodeRecord& parent, uint32_t level) const
+{
+	// The parent's range already holds everything below it: its texels bound the
+	// upsampled ones and its tail the noise of this level and the ones under it.
+	TerrainNodeRecord record;
+	record.Error = TailAmplitude(level);
+	record.MinHeight = parent.MinHeight;
+	record.MaxHeight = parent.MaxHeight;
+	return record;
+}
+
+std::vector<float> TerrainDetail::LevelErrors(const std::vector<float>& stored) const
+{
+	std::vector<float> errors(TotalLevels());
+	for (uint32_t level = 0; level < TotalLevels(); level++)
+		errors[level] = (level < stored.size() ? stored[level] : 0.0f) + TailAmplitude(level);
+	return errors;
+}
+
+void TerrainDetail::Synthesize(uint32_t node, uint32_t level, const uint16_t* parent, const uint32_t* albedo, TerrainDetailTile& tile) const
+{
+	const uint32_t r = mSettings.TileResolution;
+	// Grid of the tile and its border, row i and column j at i - Border and j - Border
+	// of the tile. Rows are padded so the SSE passes can run over whole lattice cells
+	// and groups of four without a remainder.
+	const uint32_t rows = r + 2 * Border;
+	const uint32_t stride = r + 2 * Border + 4;
+	const float amplitude = mAmplitudes[level - mSettings.StoredLevels] * 65535.0f;
+
+	uint32_t x, y;
+	TerrainQuadTree::TileCoords(node, level, x, y);
+	tile.Node = node;
+	tile.Level = level;
+	tile.Resolution = r;
+
+	// The parent's quarter, upsampled.
+	Taps columns, rowTaps;
+	columns.Build((float)((x & 1) * r / 2), 0.5f, -(int)Border, stride, r);
+	rowTaps.Build((float)((y & 1) * r / 2), 0.5f, -(int)Border, rows, r);
+
+	// Rows of the parent blended first, then the columns of each blend.
+	const uint32_t firstColumn = columns.First[0];
+	const uint32_t lastColumn = columns.Second[stride - 1];
+	std::vector<float> blend(lastColumn + 1 - firstColumn);
+	std::vector<float> base((size_t)rows * stride);
+	for (uint32_t i = 0; i < rows; i++)
+	{
+		const uint16_t* top = parent + (size_t)rowTaps.First[i] * r;
+		const uint16_t* bottom = parent + (size_t)rowTaps.Second[i] * r;
+		float wy = rowTaps.Weight[i];
+		for (uint32_t c = firstColumn; c <= lastColumn; c++)
+			blend[c - firstColumn] = top[c] + (bottom[c] - (float)top[c]) * wy;
+
+		float* out = &base[(size_t)i * stride];
+		for (uint32_t j = 0; j < stride; j++)
+		{
+			float a = blend[columns.First[j] - firstColumn];
+			out[j] = a + (blend[columns.Second[j] - firstColumn] - a) * columns.Weight[j];
+		}
+	}
+
+	// Gradients of the lattice points around the grid, in world texel coordinates of
+	// this level so neighbouring tiles share them.
+	const uint32_t cellsX = stride / 2, cellsY = rows / 2;
+	const int32_t latticeX = (int32_t)(x * r / 2) - (int32_t)Border / 2;
+	const int32_t latticeY = (int32_t)(y * r / 2) - (int32_t)Border / 2;
+	const uint32_t seed = Hash((int32_t)level, (int32_t)mSettings.Seed, 0x9e3779b9u);
+	const Gradients& gradients = GradientTable();
+	std::vector<float> gx((size_t)(cellsX + 1) * (cellsY + 1)), gy(gx.size());
+	for (uint32_t i = 0; i <= cellsY; i++)
+		for (uint32_t j = 0; j <= cellsX; j++)
+		{
+			uint32_t g = Hash(latticeX + (int32_t)j, latticeY + (int32_t)i, seed) & 255;
+			gx[(size_t)i * (cellsX + 1) + j] = gradients.X[g];
+			gy[(size_t)i * (cellsX + 1) + j] = gradients.Y[g];
+		}
+
+	// A cell's four texels at once.
+	const NoiseLanes& lanes = Lanes();
+	std::vector<float> noise((size_t)rows * stride);
+	for (uint32_t i = 0; i < cellsY; i++)
+		for (uint32_t j = 0; j < cellsX; j++)
+		{
+			size_t corners[4] = { (size_t)i * (cellsX + 1) + j, 0, 0, 0 };
+			corners[1] = corners[0] + 1;
+			corners[2] = corners[0] + cellsX + 1;
+			corners[3] = corners[2] + 1;
+
+			__m128 n = _mm_setzero_ps();
+			for (int k = 0; k < 4; k++)
+			{
+				n = _mm_add_ps(n, _mm_mul_ps(_mm_set1_ps(gx[corners[k]]), lanes.X[k]));
+				n = _mm_add_ps(n, _mm_mul_ps(_mm_set1_ps(gy[corners[k]]), lanes.Y[k]));
+			}
+			float* out = &noise[(size_t)(2 * i) * stride + 2 * j];
+			_mm_storel_pi((__m64*)out, n);
+			_mm_storeh_pi((__m64*)(out + stride), n);
+		}
+
+	// Heights of the tile and a texel around it: the noise scaled by the slope of
+	// the upsampled parent, four texels at a time.
+	const float slopeScale = mSettings.HeightScale / 65535.0f / (2.0f * mSettings.RootSize / (float)(r << level));
+	const __m128 slopeFactor = _mm_set1_ps(slopeScale / mSettings.SteepSlope);
+	const __m128 flat = _mm_set1_ps(mSettings.FlatScale);
+	const __m128 rough = _mm_set1_ps((1.0f - mSettings.FlatScale) * amplitude);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 highest = _mm_set1_ps(65535.0f);
+	const uint32_t columnsOut = (r + 2 + 3) & ~3u;
+	std::vector<int32_t> heights((size_t)rows * stride);
+	for (uint32_t i = 1; i + 1 < rows; i++)
+		for (uint32_t j = 1; j < 1 + columnsOut; j += 4)
+		{
+			size_t at = (size_t)i * stride + j;
+			__m128 h = _mm_loadu_ps(&base[at]);
+			__m128 sx = _mm_sub_ps(_mm_loadu_ps(&base[at + 1]), _mm_loadu_ps(&base[at - 1]));
+			__m128 sy = _mm_sub_ps(_mm_loadu_ps(&base[at + stride]), _mm_loadu_ps(&base[at - stride]));
+			__m128 steep = _mm_min_ps(_mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy))), slopeFactor), one);
+			__m128 scale = _mm_add_ps(_mm_mul_ps(flat, _mm_set1_ps(amplitude)), _mm_mul_ps(steep, rough));
+			h = _mm_add_ps(h, _mm_mul_ps(_mm_loadu_ps(&noise[at]), scale));
+			h = _mm_min_ps(_mm_max_ps(h, _mm_setzero_ps()), highest);
+			_mm_storeu_si128((__m128i*)&heights[at], _mm_cvtps_epi32(h));
+		}
+
+	// Tangent space normals like the stored normal tiles, u along x and v down the
+	// rows, four at a time.
+	tile.Heights.resize((size_t)r * r);
+	tile.Normals.resize((size_t)r * r);
+	const __m128 gradient = _mm_set1_ps(-slopeScale);
+	const __m128 half = _mm_set1_ps(127.5f);
+	const __m128 center = _mm_set1_ps(128.0f);
+	for (uint32_t i = 0; i < r; i++)
+	{
+		const int32_t* row = &heights[(size_t)(i + Border) * stride + Border];
+		for (uint32_t j = 0; j < r; j++)
+			tile.Heights[(size_t)i * r + j] = (uint16_t)row[j];
+
+		for (uint32_t j = 0; j < r; j += 4)
+		{
+			const int32_t* at = row + j;
+			__m128 du = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)(at + 1)), _mm_loadu_si128((const __m128i*)(at - 1)))), gradient);
+			__m128 dv = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)(at + stride)), _mm_loadu_si128((const __m128i*)(at - stride)))), gradient);
+			__m128 scale = _mm_div_ps(half, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(du, du), _mm_mul_ps(dv, dv)), one)));
+			__m128i nx = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(du, scale), center));
+			__m128i ny = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(dv, scale), center));
+			__m128i nz = _mm_cvttps_epi32(_mm_add_ps(scale, center));
+			__m128i normal = _mm_or_si128(_mm_or_si128(nx, _mm_slli_epi32(ny, 8)), _mm_or_si128(_mm_slli_epi32(nz, 16), _mm_set1_epi32((int)0xff000000u)));
+			_mm_storeu_si128((__m128i*)&tile.Normals[(size_t)i * r + j], normal);
+		}
+	}
+
+	// The diffuse is the stored ancestor's square under the tile, upsampled.
+	if (!albedo)
+	{
+		tile.Diffuse.assign((size_t)r * r, 0xff808080u);
+		return;
+	}
+	tile.Diffuse.resize((size_t)r * r);
+
+	uint32_t depth = level + 1 - mSettings.StoredLevels;
+	uint32_t mask = (1u << depth) - 1;
+	float scale = 1.0f / (float)(1u << depth);
+	columns.Build((float)(x & mask) * r * scale, scale, 0, r, r);
+	rowTaps.Build((float)(y & mask) * r * scale, scale, 0, r, r);
+	std::vector<uint32_t> columnWeights(r);
+	for (uint32_t j = 0; j < r; j++)
+		columnWeights[j] = (uint32_t)(columns.Weight[j] * 256.0f + 0.5f);
+	const uint32_t firstTexel = columns.First[0];
+	std::vector<uint32_t> colors(columns.Second[r - 1] + 1 - firstTexel);
+	for (uint32_t i = 0; i < r; i++)
+	{
+		const uint32_t* top = albedo + (size_t)rowTaps.First[i] * r;
+		const uint32_t* bottom = albedo + (size_t)rowTaps.Second[i] * r;
+		uint32_t wy = (uint32_t)(rowTaps.Weight[i] * 256.0f + 0.5f);
+		for (uint32_t c = 0; c < colors.size(); c++)
+			colors[c] = LerpColor(top[firstTexel + c], bottom[firstTexel + c], wy);
+
+		uint32_t* out = &tile.Diffuse[(size_t)i * r];
+		for (uint32_t j = 0; j < r; j++)
+			out[j] = LerpColor(colors[columns.First[j] - firstTexel], colors[columns.Second[j] - firstTexel], columnWeights[j]);
+	}
+}
+
+bool TerrainDetail::LoadColorTile(const std::wstring& path, std::vector<uint32_t>& texels, uint32_t& resolution)
+{
+	DirectX::DDSTextureInfo info;
+	if (FAILED(DirectX::GetDDSTextureInfoFromFile(path.c_str(), info)) ||
+		info.Format != DXGI_FORMAT_R8G8B8A8_UNORM || info.Width != info.Height)
+		return false;
+
+	resolution = info.Width;
+	texels.resize(resolution * resolution);
+
+	std::ifstream file(path, std::ios::binary);
+	file.seekg(info.HeaderSize);
+	return (bool)file.read((char*)texels.data(), texels.size() * sizeof(uint32_t));
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "TerrainNodeFile.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct TerrainDetailSettings
+{
+	// Levels of the stored pyramid; synthesized levels follow below the finest of them.
+	uint32_t StoredLevels = 1;
+	uint32_t Levels = 2;
+	// Same tile layout as the stored pyramid.
+	uint32_t TileResolution = 128;
+	float RootSize = 1024.0f;
+	float HeightScale = 250.0f;
+
+	uint32_t Seed = 1;
+	// World height the noise of the first synthesized level reaches on steep ground;
+	// every further level adds noise of half the wavelength and Persistence times the
+	// amplitude.
+	float Amplitude = 0.4f;
+	float Persistence = 0.5f;
+	// Share of the amplitude on flat ground. It grows with the slope of the parent,
+	// rise over run, up to the full amplitude at SteepSlope.
+	float FlatScale = 0.25f;
+	float SteepSlope = 1.0f;
+};
+
+// A synthesized tile, resolution x resolution texels in texture order like the
+// stored tiles: 16 bit heights, tangent space normals and diffuse colors.
+struct TerrainDetailTile
+{
+	uint32_t Node = 0;
+	uint32_t Level = 0;
+	uint32_t Resolution = 0;
+	std::vector<uint16_t> Heights;
+	std::vector<uint32_t> Normals;
+	std::vector<uint32_t> Diffuse;
+};
+
+// Quadtree levels below the finest stored level, made up on demand. A child tile is
+// its parent's quarter upsampled bilinearly plus one octave of gradient noise with
+// two texels per lattice cell, seeded by the level, so the levels stacked up are
+// fractal noise. The noise is scaled by the parent's slope: flat ground stays
+// smooth and slopes get rough. Lattice points are in world texel coordinates,
+// the noise runs on across tile edges.
+//
+// Everything is a function of the parent tile, the node and the settings, so tiles
+// can be synthesized on any thread, in any order, and come out the same each time.
+// Nodes need no file records either: the noise is bounded, which bounds the
+// error and height range of every level.
+class TerrainDetail
+{
+public:
+	void Reset(const TerrainDetailSettings& settings);
+	const TerrainDetailSettings& Settings() const { return mSettings; }
+
+	// Stored levels and synthesized ones.
+	uint32_t TotalLevels() const { return mSettings.StoredLevels + mSettings.Levels; }
+	bool IsSynthesized(uint32_t level) const { return level >= mSettings.StoredLevels && level < TotalLevels(); }
+
+	// Most the synthesized levels below level move a height, normalized like the
+	// node file's records.
+	float TailAmplitude(uint32_t level) const;
+
+	// The record of a stored node, its error and height range widened by the detail
+	// below it, and the record of a synthesized node from its parent's.
+	TerrainNodeRecord StoredRecord(const TerrainNodeRecord& record, uint32_t level) const;
+	TerrainNodeRecord SynthesizedRecord(const TerrainNodeRecord& parent, uint32_t level) const;
+
+	// The largest error of every level, for TerrainNodeFile::LevelErrors of the
+	// stored levels.
+	std::vector<float> LevelErrors(const std::vector<float>& stored) const;
+
+	// Synthesizes a node of a synthesized level from its parent's height texels.
+	// albedo holds the diffuse texels of the node's ancestor on the finest stored
+	// level, of the same resolution; the node gets its quarter (or smaller square)
+	// upsampled. Without it the diffuse is gray.
+	void Synthesize(uint32_t node, uint32_t level, const uint16_t* parent, const uint32_t* albedo, TerrainDetailTile& tile) const;
+
+	// Top mip of a 32 bit RGBA tile such as the stored diffuse tiles.
+	static bool LoadColorTile(const std::wstring& path, std::vector<uint32_t>& texels, uint32_t& resolution);
+
+private:
+	TerrainDetailSettings mSettings;
+	// Normalized noise amplitude of each synthesized level.
+	std::vector<float> mAmplitudes;
+};
@@ -0,0 +1,230 @@
+#include "TerrainHeightData.h"
+#include "TerrainQuadTree.h"
+#include "../Common/DDSTextureLoader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+namespace
+{
+	std::wstring TilePath(const std::wstring& terrainDir, uint32_t level, uint32_t x, uint32_t y)
+	{
+		return terrainDir + L"/L" + std::to_wstring(level) + L"/height/tile_height_level" + std::to_wstring(level) +
+			L"_" + std::to_wstring(x) + L"_" + std::to_wstring(y) + L".dds";
+	}
+}
+
+uint32_t TerrainHeightData::CountLevels(const std::wstring& terrainDir, uint32_t maxLevels)
+{
+	uint32_t levels = 0;
+	DirectX::DDSTextureInfo info;
+	while (levels < maxLevels && SUCCEEDED(DirectX::GetDDSTextureInfoFromFile(TilePath(terrainDir, levels, 0, 0).c_str(), info)))
+		levels++;
+	return levels;
+}
+
+bool TerrainHeightData::Load(const std::wstring& terrainDir, uint32_t levels)
+{
+	mTiles.clear();
+	mResolution = 0;
+
+	for (uint32_t level = 0; level < levels; level++)
+	{
+		uint32_t width = 1u << level;
+		std::vector<std::vector<uint16_t>> tiles(width * width);
+		for (uint32_t y = 0; y < width; y++)
+		{
+			for (uint32_t x = 0; x < width; x++)
+			{
+				uint32_t resolution;
+				if (!LoadTile(TilePath(terrainDir, level, x, y), tiles[y * width + x], resolution))
+					return false;
+				if (mResolution == 0)
+					mResolution = resolution;
+				else if (resolution != mResolution)
+					return false;
+			}
+		}
+		mTiles.push_back(std::move(tiles));
+	}
+
+	return levels > 0;
+}
+
+bool TerrainHeightData::LoadTile(const std::wstring& path, std::vector<uint16_t>& texels, uint32_t& resolution)
+{
+	DirectX::DDSTextureInfo info;
+	if (FAILED(DirectX::GetDDSTextureInfoFromFile(path.c_str(), info)) ||
+		info.Format != DXGI_FORMAT_R16_UNORM || info.Width != info.Height)
+		return false;
+
+	resolution = info.Width;
+	texels.resize(resolution * resolution);
+
+	std::ifstream file(path, std::ios::binary);
+	file.seekg(info.HeaderSize);
+	return (bool)file.read((char*)texels.data(), texels.size() * sizeof(uint16_t));
+}
+
+std::vector<float> TerrainHeightData::ComputeMinHeights(const uint16_t* tile, uint32_t resolution, uint32_t cells)
+{
+	// Mip 1 texels average 2x2 texels and are filtered bilinearly, and a morphing
+	// vertex moves by up to one quad.
+	const uint32_t quad = std::max<uint32_t>(resolution / (GridVertices - 1), 1);
+	const uint32_t border = 2 + 2 * quad;
+
+	std::vector<float> heights(cells * cells);
+	for (uint32_t cy = 0; cy < cells; cy++)
+	{
+		uint32_t y0 = cy * resolution / cells, y1 = (cy + 1) * resolution / cells;
+		y0 = y0 > border ? y0 - border : 0;
+		y1 = std::min(y1 + border, resolution);
+		for (uint32_t cx = 0; cx < cells; cx++)
+		{
+			uint32_t x0 = cx * resolution / cells, x1 = (cx + 1) * resolution / cells;
+			x0 = x0 > border ? x0 - border : 0;
+			x1 = std::min(x1 + border, resolution);
+
+			uint16_t lowest = 0xffff;
+			for (uint32_t y = y0; y < y1; y++)
+				lowest = std::min(lowest, *std::min_element(tile + y * resolution + x0, tile + y * resolution + x1));
+			heights[cy * cells + cx] = lowest / 65535.0f;
+		}
+	}
+	return heights;
+}
+
+float TerrainHeightData::SampleTile(uint32_t level, uint32_t x, uint32_t y, float u, float v) const
+{
+	const uint16_t* tile = Tile(level, x, y);
+	int last = (int)mResolution - 1;
+
+	float tx = u * mResolution - 0.5f;
+	float ty = v * mResolution - 0.5f;
+	float fx = std::floor(tx);
+	float fy = std::floor(ty);
+	float ax = tx - fx;
+	float ay = ty - fy;
+
+	int x0 = std::min(std::max((int)fx, 0), last);
+	int y0 = std::min(std::max((int)fy, 0), last);
+	int x1 = std::min(std::max((int)fx + 1, 0), last);
+	int y1 = std::min(std::max((int)fy + 1, 0), last);
+
+	float top = tile[y0 * mResolution + x0] * (1.0f - ax) + tile[y0 * mResolution + x1] * ax;
+	float bottom = tile[y1 * mResolution + x0] * (1.0f - ax) + tile[y1 * mResolution + x1] * ax;
+	return (top * (1.0f - ay) + bottom * ay) / 65535.0f;
+}
+
+std::vector<float> TerrainHeightData::VertexHeights(uint32_t level, uint32_t x, uint32_t y) const
+{
+	const uint32_t n = GridVertices;
+	std::vector<float> heights(n * n);
+	for (uint32_t i = 0; i < n; i++)
+		for (uint32_t j = 0; j < n; j++)
+			heights[i * n + j] = SampleTile(level, x, y, (float)j / (n - 1), (float)i / (n - 1));
+	return heights;
+}
+
+std::vector<float> TerrainHeightData::ComputeGeometricErrors() const
+{
+	std::vector<float> errors(TerrainQuadTree::LevelOffset(Levels()), 0.0f);
+	if (Levels() == 0)
+		return errors;
+
+	const uint32_t n = GridVertices;
+	uint32_t finest = Levels() - 1;
+
+	std::vector<std::vector<float>> finestHeights(1u << (2 * finest));
+	uint32_t finestWidth = 1u << finest;
+	for (uint32_t y = 0; y < finestWidth; y++)
+		for (uint32_t x = 0; x < finestWidth; x++)
+			finestHeights[y * finestWidth + x] = VertexHeights(finest, x, y);
+
+	for (uint32_t level = 0; level < finest; level++)
+	{
+		uint32_t span = 1u << (finest - level);
+		for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+		{
+			uint32_t x, y;
+			TerrainQuadTree::TileCoords(node, level, x, y);
+			std::vector<float> coarse = VertexHeights(level, x, y);
+
+			// The coarse mesh interpolates linearly between its vertices; compare it
+			// with the finest mesh at every finest vertex.
+			float error = 0.0f;
+			for (uint32_t fy = 0; fy < span; fy++)
+			{
+				for (uint32_t fx = 0; fx < span; fx++)
+				{
+					const std::vector<float>& fine = finestHeights[(y * span + fy) * finestWidth + x * span + fx];
+					for (uint32_t i = 0; i < n; i++)
+					{
+						float gv = (fy + (float)i / (n - 1)) / span * (n - 1);
+						uint32_t r0 = std::min((uint32_t)gv, n - 2);
+						float av = gv - r0;
+						for (uint32_t j = 0; j < n; j++)
+						{
+							float gu = (fx + (float)j / (n - 1)) / span * (n - 1);
+							uint32_t c0 = std::min((uint32_t)gu, n - 2);
+							float au = gu - c0;
+
+							const float* row0 = &coarse[r0 * n + c0];
+							const float* row1 = row0 + n;
+							float h = (row0[0] * (1.0f - au) + row0[1] * au) * (1.0f - av) + (row1[0] * (1.0f - au) + row1[1] * au) * av;
+							error = std::max(error, std::fabs(h - fine[i * n + j]));
+						}
+					}
+				}
+			}
+			errors[node] = error;
+		}
+	}
+
+	for (int level = (int)finest - 1; level >= 0; level--)
+	{
+		for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+		{
+			uint32_t child = TerrainQuadTree::FirstChild(node, level);
+			for (uint32_t i = 0; i < 4; i++)
+				errors[node] = std::max(errors[node], errors[child + i]);
+		}
+	}
+
+	return errors;
+}
+
+std::vector<TerrainHeightRange> TerrainHeightData::ComputeHeightRanges() const
+{
+	std::vector<TerrainHeightRange> ranges(TerrainQuadTree::LevelOffset(Levels()));
+	uint32_t texels = mResolution * mResolution;
+
+	for (uint32_t level = 0; level < Levels(); level++)
+	{
+		for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+		{
+			uint32_t x, y;
+			TerrainQuadTree::TileCoords(node, level, x, y);
+			const uint16_t* tile = Tile(level, x, y);
+			auto minMax = std::minmax_element(tile, tile + texels);
+			ranges[node].Min = *minMax.first / 65535.0f;
+			ranges[node].Max = *minMax.second / 65535.0f;
+		}
+	}
+
+	for (int level = (int)Levels() - 2; level >= 0; level--)
+	{
+		for (uint32_t node = TerrainQuadTree::LevelOffset(level); node < TerrainQuadTree::LevelOffset(level + 1); node++)
+		{
+			uint32_t child = TerrainQuadTree::FirstChild(node, level);
+			for (uint32_t i = 0; i < 4; i++)
+			{
+				ranges[node].Min = std::min(ranges[node].Min, ranges[child + i].Min);
+				ranges[node].Max = std::max(ranges[node].Max, ranges[child + i].Max);
+			}
+		}
+	}
+
+	return ranges;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct TerrainHeightRange
+{
+	float Min = 0.0f;
+	float Max = 0.0f;
+};
+
+// CPU copy of the terrain height tiles (tile_height_level{L}_{x}_{y}.dds, 16 bit),
+// top mip only. Heights are normalized to [0, 1] like the shader sees them.
+class TerrainHeightData
+{
+public:
+	// Vertices along a tile edge of the terrain grid mesh. An even number of quads
+	// puts every other vertex on the parent tile's grid, which the morph relies on.
+	static const uint32_t GridVertices = 129;
+
+	// Number of consecutive levels, up to maxLevels, that have a tile under terrainDir.
+	static uint32_t CountLevels(const std::wstring& terrainDir, uint32_t maxLevels);
+
+	// Loads levels [0, levels) from <terrainDir>/L{L}/height/. Returns false if a
+	// tile is missing, isn't 16 bit or the tiles differ in size.
+	bool Load(const std::wstring& terrainDir, uint32_t levels);
+
+	// Top mip of a single 16 bit height tile.
+	static bool LoadTile(const std::wstring& path, std::vector<uint16_t>& texels, uint32_t& resolution);
+
+	// Lowest normalized height in each cell of a cells x cells grid over a tile, in
+	// texel order (rows from the tile's +z edge). Cells take a border of texels
+	// around them, enough for the bilinear samples of mip 1 and the morph's shift of
+	// a vertex, so the drawn surface never dips below its cell.
+	static std::vector<float> ComputeMinHeights(const uint16_t* tile, uint32_t resolution, uint32_t cells);
+
+	uint32_t Levels() const { return (uint32_t)mTiles.size(); }
+	uint32_t TileResolution() const { return mResolution; }
+
+	const uint16_t* Tile(uint32_t level, uint32_t x, uint32_t y) const { return mTiles[level][y * (1u << level) + x].data(); }
+
+	// Bilinear sample at (u, v) in [0, 1] across the tile, clamped at the edges
+	// the way SampleLevel with a clamp sampler reads it.
+	float SampleTile(uint32_t level, uint32_t x, uint32_t y, float u, float v) const;
+
+	// For every node of the complete tree over the loaded levels, in TerrainQuadTree
+	// index order: the largest height difference between the node's grid mesh and
+	// the mesh of the finest level under it. Parents take at least the error of their
+	// children, so a node is never refined less than its descendants.
+	std::vector<float> ComputeGeometricErrors() const;
+
+	// Min/max pyramid: for every node of the complete tree over the loaded levels, in
+	// TerrainQuadTree index order, the lowest and highest texel of the node's tile and
+	// of every tile below it. Whatever the mesh samples from a tile, at any mip, lies
+	// between its texels, so a range holds the drawn surface of the node and of all
+	// its descendants.
+	std::vector<TerrainHeightRange> ComputeHeightRanges() const;
+
+private:
+	// Heights at the grid mesh vertices of a tile.
+	std::vector<float> VertexHeights(uint32_t level, uint32_t x, uint32_t y) const;
+
+	uint32_t mResolution = 0;
+	// Per level, tiles in row order.
+	std::vector<std::vector<std::vector<uint16_t>>> mTiles;
+};
@@ -0,0 +1,630 @@
+#include "TerrainHeightField.h"
+#include "TerrainQuadTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+#include <mutex>
+
+using namespace DirectX;
+
+namespace
+{
+	// SSE2 has no floor.
+	__m128 Floor(__m128 v)
+	{
+		__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+		return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.0f)));
+	}
+
+	__m128 Clamp(__m128 v, __m128 lo, __m128 hi)
+	{
+		return _mm_min_ps(_mm_max_ps(v, lo), hi);
+	}
+
+	// Mip 0 bounds the filtered surface over each texel's square, where the bilinear
+	// samples read the texel and its eight neighbours. Each coarser mip takes the
+	// largest of the four below it.
+	std::vector<std::vector<uint16_t>> BuildMaxMips(const std::vector<uint16_t>& texels, uint32_t resolution)
+	{
+		uint32_t r = resolution;
+		std::vector<uint16_t> rows(texels.size());
+		for (uint32_t y = 0; y < r; y++)
+		{
+			const uint16_t* row = &texels[y * r];
+			for (uint32_t x = 0; x < r; x++)
+				rows[y * r + x] = std::max(row[x], std::max(row[x > 0 ? x - 1 : 0], row[std::min(x + 1, r - 1)]));
+		}
+
+		std::vector<std::vector<uint16_t>> mips(1, std::vector<uint16_t>(texels.size()));
+		for (uint32_t y = 0; y < r; y++)
+		{
+			const uint16_t* above = &rows[(y > 0 ? y - 1 : 0) * r];
+			const uint16_t* below = &rows[std::min(y + 1, r - 1) * r];
+			for (uint32_t x = 0; x < r; x++)
+				mips[0][y * r + x] = std::max(rows[y * r + x], std::max(above[x], below[x]));
+		}
+
+		for (uint32_t size = r / 2; size > 0; size /= 2)
+		{
+			const std::vector<uint16_t>& finer = mips.back();
+			std::vector<uint16_t> mip(size * size);
+			for (uint32_t y = 0; y < size; y++)
+				for (uint32_t x = 0; x < size; x++)
+				{
+					const uint16_t* row0 = &finer[2 * y * 2 * size + 2 * x];
+					const uint16_t* row1 = row0 + 2 * size;
+					mip[y * size + x] = std::max(std::max(row0[0], row0[1]), std::max(row1[0], row1[1]));
+				}
+			mips.push_back(std::move(mip));
+		}
+		return mips;
+	}
+
+	// First t in [t0, t1] where a ray at (ax + bx t, az + bz t) in texel units, at
+	// height ah + bh t in texel values, is at or below the bilinear patch between
+	// texel centers (cx, cz) and (cx + 1, cz + 1), read with clamping.
+	bool HitCell(const uint16_t* texels, int resolution, int cx, int cz, double ax, double bx, double az, double bz,
+		double ah, double bh, double t0, double t1, double& t)
+	{
+		int last = resolution - 1;
+		int x0 = std::min(std::max(cx, 0), last), x1 = std::min(std::max(cx + 1, 0), last);
+		int z0 = std::min(std::max(cz, 0), last), z1 = std::min(std::max(cz + 1, 0), last);
+		double h00 = texels[z0 * resolution + x0], h10 = texels[z0 * resolution + x1];
+		double h01 = texels[z1 * resolution + x0], h11 = texels[z1 * resolution + x1];
+
+		// Along the ray the patch is a quadratic in t; so is the ray's height above it.
+		double e = h00, f = h10 - h00, g = h01 - h00, k = h00 - h10 - h01 + h11;
+		double u0 = ax - cx, v0 = az - cz;
+		double a = -k * bx * bz;
+		double b = bh - (f * bx + g * bz + k * (u0 * bz + v0 * bx));
+		double c = ah - (e + f * u0 + g * v0 + k * u0 * v0);
+
+		if (a * t0 * t0 + b * t0 + c <= 0.0)
+		{
+			t = t0;
+			return true;
+		}
+
+		double roots[2];
+		int count = 0;
+		if (std::fabs(a) < 1e-12)
+		{
+			if (b != 0.0)
+				roots[count++] = -c / b;
+		}
+		else
+		{
+			double discriminant = b * b - 4.0 * a * c;
+			if (discriminant < 0.0)
+				return false;
+			double q = -0.5 * (b + (b < 0.0 ? -1.0 : 1.0) * std::sqrt(discriminant));
+			roots[count++] = q / a;
+			if (q != 0.0)
+				roots[count++] = c / q;
+			if (count == 2 && roots[1] < roots[0])
+				std::swap(roots[0], roots[1]);
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			if (roots[i] >= t0 && roots[i] <= t1)
+			{
+				t = roots[i];
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+struct TerrainHeightField::Packet
+{
+	// World rays, zero direction components nudged off zero so slabs stay finite.
+	alignas(16) float OriginX[4], OriginY[4], OriginZ[4];
+	alignas(16) float DirX[4], DirY[4], DirZ[4];
+	// A lane is traced over [0, End]: its MaxT until it hits, then its nearest hit.
+	// Lanes without a ray end before they start.
+	alignas(16) float End[4];
+	int Lanes;
+	TerrainRayHit Hits[4];
+	TerrainRaycastStats Stats;
+};
+
+// The packet's rays in a tile's texel units: texel (x, z) at x = ax + bx t,
+// z = az + bz t (rows grow towards -z), heights in texel values.
+struct TerrainHeightField::LocalRays
+{
+	alignas(16) float AX[4], BX[4], InvBX[4];
+	alignas(16) float AZ[4], BZ[4], InvBZ[4];
+	alignas(16) float AH[4], BH[4];
+};
+
+const size_t TerrainHeightField::ChunkSize;
+
+void TerrainHeightField::Reset(const TerrainHeightFieldSettings& settings)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mMutex);
+	mSettings = settings;
+	mSettings.Levels = std::max<uint32_t>(settings.Levels, 1);
+	mLeft = settings.CenterX - 0.5f * settings.RootSize;
+	mTop = settings.CenterZ + 0.5f * settings.RootSize;
+	mTiles.clear();
+	mRoot = nullptr;
+	mVersion++;
+}
+
+void TerrainHeightField::Insert(uint32_t node, uint32_t level, std::vector<uint16_t> texels, uint32_t resolution)
+{
+	uint32_t x, y;
+	TerrainQuadTree::TileCoords(node, level, x, y);
+
+	std::vector<std::vector<uint16_t>> maxMips = BuildMaxMips(texels, resolution);
+
+	std::unique_lock<std::shared_timed_mutex> lock(mMutex);
+	Tile tile;
+	float size = mSettings.RootSize / TerrainQuadTree::LevelWidth(level);
+	tile.Texels = std::move(texels);
+	tile.Resolution = resolution;
+	tile.Level = level;
+	tile.Left = mLeft + x * size;
+	tile.Top = mTop - y * size;
+	tile.TexelsPerUnit = resolution / size;
+	tile.MaxMips = std::move(maxMips);
+	tile.SubtreeMax = tile.MaxMips.back()[0];
+
+	auto it = mTiles.find(node);
+	if (it != mTiles.end())
+	{
+		std::copy(it->second.Children, it->second.Children + 4, tile.Children);
+		it->second = std::move(tile);
+	}
+	else
+	{
+		it = mTiles.emplace(node, std::move(tile)).first;
+		uint32_t child = TerrainQuadTree::FirstChild(node, level);
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			auto c = mTiles.find(child + i);
+			it->second.Children[i] = c != mTiles.end() ? &c->second : nullptr;
+		}
+		if (level == 0)
+			mRoot = &it->second;
+		else
+		{
+			auto parent = mTiles.find(TerrainQuadTree::Parent(node, level));
+			if (parent != mTiles.end())
+				parent->second.Children[(x & 1) | ((y & 1) << 1)] = &it->second;
+		}
+	}
+	UpdateSubtreeMax(node, level);
+	mVersion++;
+}
+
+void TerrainHeightField::Remove(uint32_t node)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mMutex);
+	auto it = mTiles.find(node);
+	if (it == mTiles.end())
+		return;
+
+	uint32_t level = it->second.Level;
+	if (level == 0)
+		mRoot = nullptr;
+	else
+	{
+		uint32_t x, y;
+		TerrainQuadTree::TileCoords(node, level, x, y);
+		auto parent = mTiles.find(TerrainQuadTree::Parent(node, level));
+		if (parent != mTiles.end())
+			parent->second.Children[(x & 1) | ((y & 1) << 1)] = nullptr;
+	}
+	mTiles.erase(it);
+	if (level > 0)
+		UpdateSubtreeMax(TerrainQuadTree::Parent(node, level), level - 1);
+	mVersion++;
+}
+
+void TerrainHeightField::UpdateSubtreeMax(uint32_t node, uint32_t level)
+{
+	for (;;)
+	{
+		auto it = mTiles.find(node);
+		if (it == mTiles.end())
+			return;
+
+		Tile& tile = it->second;
+		tile.SubtreeMax = tile.MaxMips.back()[0];
+		for (const Tile* child : tile.Children)
+			if (child)
+				tile.SubtreeMax = std::max(tile.SubtreeMax, child->SubtreeMax);
+
+		if (level == 0)
+			return;
+		node = TerrainQuadTree::Parent(node, level);
+		level--;
+	}
+}
+
+size_t TerrainHeightField::TileCount() const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+	return mTiles.size();
+}
+
+bool TerrainHeightField::CopyTile(uint32_t node, std::vector<uint16_t>& texels, uint32_t& resolution) const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+	auto it = mTiles.find(node);
+	if (it == mTiles.end())
+		return false;
+
+	texels = it->second.Texels;
+	resolution = it->second.Resolution;
+	return true;
+}
+
+const TerrainHeightField::Tile* TerrainHeightField::Find(uint32_t x, uint32_t y) const
+{
+	const Tile* tile = mRoot;
+	for (uint32_t shift = mSettings.Levels - 1; shift-- > 0;)
+	{
+		const Tile* child = tile->Children[((x >> shift) & 1) | (((y >> shift) & 1) << 1)];
+		if (!child)
+			break;
+		tile = child;
+	}
+	return tile;
+}
+
+void TerrainHeightField::Sample(float* xs, float* zs, size_t count, float* heights, uint8_t* levels, float* spacing) const
+{
+	// Pad to whole groups of four with the last point; the arrays hold ChunkSize.
+	size_t padded = (count + 3) & ~(size_t)3;
+	for (size_t i = count; i < padded; i++)
+	{
+		xs[i] = xs[count - 1];
+		zs[i] = zs[count - 1];
+	}
+
+	const __m128 left = _mm_set1_ps(mLeft);
+	const __m128 right = _mm_set1_ps(mLeft + mSettings.RootSize);
+	const __m128 top = _mm_set1_ps(mTop);
+	const __m128 bottom = _mm_set1_ps(mTop - mSettings.RootSize);
+	for (size_t i = 0; i < padded; i += 4)
+	{
+		_mm_storeu_ps(xs + i, Clamp(_mm_loadu_ps(xs + i), left, right));
+		_mm_storeu_ps(zs + i, Clamp(_mm_loadu_ps(zs + i), bottom, top));
+	}
+
+	// Finding the tiles is a walk down from the root per point, skipped while
+	// consecutive points stay in the same finest level tile.
+	uint32_t width = TerrainQuadTree::LevelWidth(mSettings.Levels - 1);
+	float finestPerUnit = width / mSettings.RootSize;
+	const Tile* tiles[ChunkSize];
+	alignas(16) float tileLeft[ChunkSize], tileTop[ChunkSize], tilePerUnit[ChunkSize], tileLast[ChunkSize], tileRes[ChunkSize];
+	uint32_t lastX = UINT32_MAX, lastY = UINT32_MAX;
+	const Tile* tile = nullptr;
+	for (size_t i = 0; i < padded; i++)
+	{
+		uint32_t x = std::min((uint32_t)((xs[i] - mLeft) * finestPerUnit), width - 1);
+		uint32_t y = std::min((uint32_t)((mTop - zs[i]) * finestPerUnit), width - 1);
+		if (x != lastX || y != lastY)
+		{
+			tile = Find(x, y);
+			lastX = x;
+			lastY = y;
+		}
+		tiles[i] = tile;
+		tileLeft[i] = tile->Left;
+		tileTop[i] = tile->Top;
+		tilePerUnit[i] = tile->TexelsPerUnit;
+		tileLast[i] = (float)(tile->Resolution - 1);
+		tileRes[i] = (float)tile->Resolution;
+	}
+
+	// Bilinear filtering as SampleLevel does it with a clamp sampler, texel centers
+	// at half texels.
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 scale = _mm_set1_ps(mSettings.HeightScale / 65535.0f);
+	const __m128 base = _mm_set1_ps(mSettings.BaseY);
+	for (size_t i = 0; i < padded; i += 4)
+	{
+		__m128 perUnit = _mm_load_ps(tilePerUnit + i);
+		__m128 tx = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(xs + i), _mm_load_ps(tileLeft + i)), perUnit), half);
+		__m128 ty = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(tileTop + i), _mm_loadu_ps(zs + i)), perUnit), half);
+		__m128 fx = Floor(tx);
+		__m128 fy = Floor(ty);
+		__m128 ax = _mm_sub_ps(tx, fx);
+		__m128 ay = _mm_sub_ps(ty, fy);
+
+		__m128 last = _mm_load_ps(tileLast + i);
+		__m128 res = _mm_load_ps(tileRes + i);
+		__m128 x0 = Clamp(fx, zero, last);
+		__m128 x1 = Clamp(_mm_add_ps(fx, one), zero, last);
+		__m128 row0 = _mm_mul_ps(Clamp(fy, zero, last), res);
+		__m128 row1 = _mm_mul_ps(Clamp(_mm_add_ps(fy, one), zero, last), res);
+
+		alignas(16) int32_t i00[4], i01[4], i10[4], i11[4];
+		_mm_store_si128((__m128i*)i00, _mm_cvttps_epi32(_mm_add_ps(row0, x0)));
+		_mm_store_si128((__m128i*)i01, _mm_cvttps_epi32(_mm_add_ps(row0, x1)));
+		_mm_store_si128((__m128i*)i10, _mm_cvttps_epi32(_mm_add_ps(row1, x0)));
+		_mm_store_si128((__m128i*)i11, _mm_cvttps_epi32(_mm_add_ps(row1, x1)));
+
+		alignas(16) float h00[4], h01[4], h10[4], h11[4];
+		for (int k = 0; k < 4; k++)
+		{
+			const uint16_t* texels = tiles[i + k]->Texels.data();
+			h00[k] = texels[i00[k]];
+			h01[k] = texels[i01[k]];
+			h10[k] = texels[i10[k]];
+			h11[k] = texels[i11[k]];
+		}
+
+		__m128 t0 = _mm_load_ps(h00);
+		__m128 t1 = _mm_load_ps(h10);
+		__m128 upper = _mm_add_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(h01), t0), ax));
+		__m128 lower = _mm_add_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(h11), t1), ax));
+		__m128 h = _mm_add_ps(upper, _mm_mul_ps(_mm_sub_ps(lower, upper), ay));
+		_mm_storeu_ps(heights + i, _mm_add_ps(base, _mm_mul_ps(h, scale)));
+		if (spacing)
+			_mm_storeu_ps(spacing + i, _mm_div_ps(one, perUnit));
+	}
+
+	if (levels)
+		for (size_t i = 0; i < count; i++)
+			levels[i] = (uint8_t)tiles[i]->Level;
+}
+
+bool TerrainHeightField::QueryHeights(const XMFLOAT2* points, size_t count, float* heights, uint8_t* levels) const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+	if (!mRoot)
+		return false;
+
+	float xs[ChunkSize], zs[ChunkSize], chunkHeights[ChunkSize];
+	for (size_t first = 0; first < count; first += ChunkSize)
+	{
+		size_t n = std::min(count - first, ChunkSize);
+		for (size_t i = 0; i < n; i++)
+		{
+			xs[i] = points[first + i].x;
+			zs[i] = points[first + i].y;
+		}
+		Sample(xs, zs, n, chunkHeights, levels ? levels + first : nullptr, nullptr);
+		std::copy(chunkHeights, chunkHeights + n, heights + first);
+	}
+	return true;
+}
+
+bool TerrainHeightField::QueryNormals(const XMFLOAT2* points, size_t count, XMFLOAT3* normals, float* slopes) const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+	if (!mRoot)
+		return false;
+
+	// Every point takes four samples, one texel of its own tile to each side: +x, -x,
+	// +z and -z in consecutive quarters of the chunk.
+	const size_t quarter = ChunkSize / 4;
+	float xs[ChunkSize], zs[ChunkSize], h[ChunkSize];
+	alignas(16) float spacing[ChunkSize], nx[quarter], ny[quarter], nz[quarter], slope[quarter];
+	for (size_t first = 0; first < count; first += quarter)
+	{
+		size_t n = std::min(count - first, quarter);
+		for (size_t i = 0; i < n; i++)
+		{
+			xs[i] = points[first + i].x;
+			zs[i] = points[first + i].y;
+		}
+		Sample(xs, zs, n, h, nullptr, spacing);
+
+		for (size_t i = 0; i < n; i++)
+		{
+			float x = xs[i], z = zs[i], d = spacing[i];
+			xs[i] = x + d;
+			zs[i] = z;
+			xs[quarter + i] = x - d;
+			zs[quarter + i] = z;
+			xs[2 * quarter + i] = x;
+			zs[2 * quarter + i] = z + d;
+			xs[3 * quarter + i] = x;
+			zs[3 * quarter + i] = z - d;
+		}
+		// Quarters past n repeat their last point so the chunk is sampled in one go.
+		for (size_t q = 0; q < 4; q++)
+		{
+			for (size_t i = n; i < quarter; i++)
+			{
+				xs[q * quarter + i] = xs[q * quarter + n - 1];
+				zs[q * quarter + i] = zs[q * quarter + n - 1];
+			}
+		}
+		for (size_t i = n; i < quarter; i++)
+			spacing[i] = spacing[n - 1];
+		Sample(xs, zs, ChunkSize, h, nullptr, nullptr);
+
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 one = _mm_set1_ps(1.0f);
+		for (size_t i = 0; i < n; i += 4)
+		{
+			__m128 inv = _mm_div_ps(half, _mm_load_ps(spacing + i));
+			__m128 gx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(h + i), _mm_loadu_ps(h + quarter + i)), inv);
+			__m128 gz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(h + 2 * quarter + i), _mm_loadu_ps(h + 3 * quarter + i)), inv);
+			__m128 g2 = _mm_add_ps(_mm_mul_ps(gx, gx), _mm_mul_ps(gz, gz));
+			__m128 invLength = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(g2, one)));
+			_mm_store_ps(nx + i, _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(gx, invLength)));
+			_mm_store_ps(ny + i, invLength);
+			_mm_store_ps(nz + i, _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(gz, invLength)));
+			_mm_store_ps(slope + i, _mm_sqrt_ps(g2));
+		}
+
+		for (size_t i = 0; i < n; i++)
+		{
+			if (normals)
+				normals[first + i] = XMFLOAT3(nx[i], ny[i], nz[i]);
+			if (slopes)
+				slopes[first + i] = slope[i];
+		}
+	}
+	return true;
+}
+
+void TerrainHeightField::TraceNode(const Tile& tile, const LocalRays& rays, Packet& packet, uint32_t mip, uint32_t i, uint32_t j) const
+{
+	uint32_t top = (uint32_t)tile.MaxMips.size() - 1;
+
+	// Where the rays cross the node's square, texel centers at whole numbers.
+	float size = (float)(1u << mip);
+	__m128 left = _mm_set1_ps(i * size - 0.5f), right = _mm_set1_ps((i + 1) * size - 0.5f);
+	__m128 upper = _mm_set1_ps(j * size - 0.5f), lower = _mm_set1_ps((j + 1) * size - 0.5f);
+	__m128 ax = _mm_load_ps(rays.AX), invBx = _mm_load_ps(rays.InvBX);
+	__m128 az = _mm_load_ps(rays.AZ), invBz = _mm_load_ps(rays.InvBZ);
+	__m128 tx0 = _mm_mul_ps(_mm_sub_ps(left, ax), invBx), tx1 = _mm_mul_ps(_mm_sub_ps(right, ax), invBx);
+	__m128 tz0 = _mm_mul_ps(_mm_sub_ps(upper, az), invBz), tz1 = _mm_mul_ps(_mm_sub_ps(lower, az), invBz);
+	__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(tz0, tz1)), _mm_setzero_ps());
+	__m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(tz0, tz1)), _mm_load_ps(packet.End));
+	int lanes = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & packet.Lanes;
+	if (lanes == 0)
+		return;
+
+	// Quarters a child tile covers are traced there, with the child's own bounds.
+	if (mip + 1 == top)
+	{
+		const Tile* child = tile.Children[i | (j << 1)];
+		if (child)
+		{
+			TraceTile(*child, packet);
+			return;
+		}
+	}
+
+	// Skip the node for rays that stay above its highest texel while crossing it.
+	float highest = mip == top ? tile.SubtreeMax : tile.MaxMips[mip][j * (tile.Resolution >> mip) + i];
+	__m128 ah = _mm_load_ps(rays.AH), bh = _mm_load_ps(rays.BH);
+	__m128 lowest = _mm_min_ps(_mm_add_ps(ah, _mm_mul_ps(bh, t0)), _mm_add_ps(ah, _mm_mul_ps(bh, t1)));
+	lanes &= _mm_movemask_ps(_mm_cmple_ps(lowest, _mm_set1_ps(highest)));
+	if (lanes == 0)
+		return;
+	packet.Stats.Nodes++;
+
+	if (mip > 0)
+	{
+		// Children front to back for the first ray; the others are cut off by End
+		// once they hit, whatever order they would have taken.
+		int first = 0;
+		while (!(lanes & (1 << first)))
+			first++;
+		uint32_t flipX = rays.BX[first] < 0.0f ? 1 : 0, flipZ = rays.BZ[first] < 0.0f ? 1 : 0;
+		static const uint32_t order[4][2] = { { 0, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 } };
+		for (auto& o : order)
+			TraceNode(tile, rays, packet, mip - 1, 2 * i + (o[0] ^ flipX), 2 * j + (o[1] ^ flipZ));
+		return;
+	}
+
+	// A texel's square holds a quarter of four patches, split at the texel center.
+	alignas(16) float enter[4], exit[4];
+	_mm_store_ps(enter, t0);
+	_mm_store_ps(exit, t1);
+	for (int lane = 0; lane < 4; lane++)
+	{
+		if (!(lanes & (1 << lane)))
+			continue;
+
+		double ax = rays.AX[lane], bx = rays.BX[lane], az = rays.AZ[lane], bz = rays.BZ[lane];
+		double cuts[4] = { enter[lane], (i - ax) / bx, (j - az) / bz, exit[lane] };
+		if (cuts[2] < cuts[1])
+			std::swap(cuts[1], cuts[2]);
+		for (int k = 0; k < 3; k++)
+		{
+			double from = std::max(cuts[k], cuts[0]), to = std::min(cuts[k + 1], cuts[3]);
+			if (from > to)
+				continue;
+
+			double mid = 0.5 * (from + to);
+			int cx = ax + bx * mid < i ? (int)i - 1 : (int)i;
+			int cz = az + bz * mid < j ? (int)j - 1 : (int)j;
+			packet.Stats.Cells++;
+			double t;
+			if (HitCell(tile.Texels.data(), (int)tile.Resolution, cx, cz, ax, bx, az, bz, rays.AH[lane], rays.BH[lane], from, to, t))
+			{
+				if (t <= packet.End[lane])
+				{
+					packet.End[lane] = (float)t;
+					packet.Hits[lane].Hit = true;
+					packet.Hits[lane].Level = (uint8_t)tile.Level;
+				}
+				break;
+			}
+		}
+	}
+}
+
+void TerrainHeightField::TraceTile(const Tile& tile, Packet& packet) const
+{
+	LocalRays rays;
+	float heightPerUnit = 65535.0f / mSettings.HeightScale;
+	for (int lane = 0; lane < 4; lane++)
+	{
+		rays.AX[lane] = (packet.OriginX[lane] - tile.Left) * tile.TexelsPerUnit - 0.5f;
+		rays.BX[lane] = packet.DirX[lane] * tile.TexelsPerUnit;
+		rays.InvBX[lane] = 1.0f / rays.BX[lane];
+		rays.AZ[lane] = (tile.Top - packet.OriginZ[lane]) * tile.TexelsPerUnit - 0.5f;
+		rays.BZ[lane] = -packet.DirZ[lane] * tile.TexelsPerUnit;
+		rays.InvBZ[lane] = 1.0f / rays.BZ[lane];
+		rays.AH[lane] = (packet.OriginY[lane] - mSettings.BaseY) * heightPerUnit;
+		rays.BH[lane] = packet.DirY[lane] * heightPerUnit;
+	}
+	TraceNode(tile, rays, packet, (uint32_t)tile.MaxMips.size() - 1, 0, 0);
+}
+
+bool TerrainHeightField::Raycast(const TerrainRay* rays, size_t count, TerrainRayHit* hits, TerrainRaycastStats* stats) const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mMutex);
+	if (!mRoot)
+		return false;
+
+	TerrainRaycastStats total;
+	for (size_t first = 0; first < count; first += 4)
+	{
+		size_t n = std::min<size_t>(count - first, 4);
+		Packet packet;
+		packet.Lanes = (1 << n) - 1;
+		for (size_t lane = 0; lane < 4; lane++)
+		{
+			const TerrainRay& ray = rays[first + std::min(lane, n - 1)];
+			auto nudge = [](float d) { return d != 0.0f ? d : 1e-20f; };
+			packet.OriginX[lane] = ray.Origin.x;
+			packet.OriginY[lane] = ray.Origin.y;
+			packet.OriginZ[lane] = ray.Origin.z;
+			packet.DirX[lane] = nudge(ray.Direction.x);
+			packet.DirY[lane] = ray.Direction.y;
+			packet.DirZ[lane] = nudge(ray.Direction.z);
+			packet.End[lane] = lane < n ? ray.MaxT : -1.0f;
+		}
+
+		TraceTile(*mRoot, packet);
+		total.Packets++;
+		total.Nodes += packet.Stats.Nodes;
+		total.Cells += packet.Stats.Cells;
+
+		for (size_t lane = 0; lane < n; lane++)
+		{
+			TerrainRayHit& hit = hits[first + lane];
+			const TerrainRay& ray = rays[first + lane];
+			hit = packet.Hits[lane];
+			hit.T = hit.Hit ? packet.End[lane] : 0.0f;
+			hit.Position = hit.Hit ? XMFLOAT3(ray.Origin.x + ray.Direction.x * hit.T, ray.Origin.y + ray.Direction.y * hit.T,
+				ray.Origin.z + ray.Direction.z * hit.T) : XMFLOAT3(0.0f, 0.0f, 0.0f);
+		}
+	}
+
+	if (stats)
+	{
+		stats->Packets += total.Packets;
+		stats->Nodes += total.Nodes;
+		stats->Cells += total.Cells;
+	}
+	return true;
+}
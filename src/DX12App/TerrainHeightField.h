@@ -0,0 +1,144 @@
+#pragma once
+
+#include <DirectXMath.h>
+
+#include <atomic>
+#include <cfloat>
+#include <cstdint>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+struct TerrainHeightFieldSettings
+{
+	// Same layout as the TerrainQuadTree the tiles belong to.
+	uint32_t Levels = 1;
+	float RootSize = 1024.0f;
+	float CenterX = 0.0f;
+	float CenterZ = 0.0f;
+	// World height of a texel: BaseY + texel / 65535 * HeightScale.
+	float BaseY = 0.0f;
+	float HeightScale = 1.0f;
+};
+
+// A ray hits at Origin + T * Direction with T in [0, MaxT]. Direction needn't be unit
+// length: from a to b with MaxT = 1 is a line of sight test.
+struct TerrainRay
+{
+	DirectX::XMFLOAT3 Origin = {};
+	DirectX::XMFLOAT3 Direction = { 0.0f, -1.0f, 0.0f };
+	float MaxT = FLT_MAX;
+};
+
+struct TerrainRayHit
+{
+	bool Hit = false;
+	float T = 0.0f;
+	DirectX::XMFLOAT3 Position = {};
+	// Level of the tile that was hit.
+	uint8_t Level = 0;
+};
+
+struct TerrainRaycastStats
+{
+	uint64_t Packets = 0;
+	// Max mip nodes entered by at least one ray of a packet.
+	uint64_t Nodes = 0;
+	// Bilinear patches solved for a ray.
+	uint64_t Cells = 0;
+};
+
+// Terrain heights on the CPU for game logic, from the 16 bit height tiles the
+// renderer has resident. A query point is answered by the finest tile that holds
+// it, with the bilinear filtering of the tile's texels that the vertex shader reads
+// at mip 0; points off the terrain take its edge. Queries come in batches and are
+// worked through four at a time with SSE.
+//
+// Any number of threads may query at once. Insert and Remove wait for running
+// batches, and a batch sees the tiles as they were when it started.
+class TerrainHeightField
+{
+public:
+	void Reset(const TerrainHeightFieldSettings& settings);
+
+	// Tile of a TerrainQuadTree node, resolution x resolution texels in texture order
+	// (rows from the tile's +z edge). Replaces what the node had. Points are looked up
+	// from the root down, so like a tree node a tile only counts while its parent is
+	// in as well.
+	void Insert(uint32_t node, uint32_t level, std::vector<uint16_t> texels, uint32_t resolution);
+	void Remove(uint32_t node);
+
+	size_t TileCount() const;
+	// Texels of a node's tile as they were inserted. False if the node has none.
+	bool CopyTile(uint32_t node, std::vector<uint16_t>& texels, uint32_t& resolution) const;
+	// Changes whenever a tile is inserted or removed, so callers know when heights
+	// they placed things at may have moved.
+	uint64_t Version() const { return mVersion; }
+
+	// World heights at count points (x, z). levels, if given, receives the level of the
+	// tile that answered. False, with nothing written, if the root tile is missing.
+	bool QueryHeights(const DirectX::XMFLOAT2* points, size_t count, float* heights, uint8_t* levels = nullptr) const;
+
+	// Unit normals from central differences one texel apart, and the slope, rise
+	// over horizontal distance, of the steepest direction. Either may be null.
+	bool QueryNormals(const DirectX::XMFLOAT2* points, size_t count, DirectX::XMFLOAT3* normals, float* slopes) const;
+
+	// First points where rays meet the surface QueryHeights answers, the bilinear
+	// filtered texels of the finest tile at each point. Every tile keeps a max mip
+	// pyramid over its texels (tiles have to be a power of two texels across), so a
+	// ray skips any square it passes above; where a tile has a child the ray goes on
+	// in the child. Squares a ray reaches down to are solved exactly, one bilinear
+	// patch at a time.
+	//
+	// Consecutive rays are traced in packets of four with SSE, a node being entered
+	// while any ray of the packet may hit below it, so rays that start close together
+	// and point the same way should be next to each other. Rays that start or enter
+	// below the surface hit at once; rays leaving the terrain's square miss. False,
+	// with nothing written, if the root tile is missing.
+	bool Raycast(const TerrainRay* rays, size_t count, TerrainRayHit* hits, TerrainRaycastStats* stats = nullptr) const;
+
+private:
+	struct Tile
+	{
+		std::vector<uint16_t> Texels;
+		uint32_t Resolution;
+		uint32_t Level;
+		// World position of the -x/+z corner and texels per world unit.
+		float Left;
+		float Top;
+		float TexelsPerUnit;
+		// Resident children in Morton order, null where missing.
+		Tile* Children[4];
+		// Largest texel around each texel's square, then of 2x2 squares and so on up
+		// to the whole tile, and the largest of the tile and the resident tiles below.
+		std::vector<std::vector<uint16_t>> MaxMips;
+		uint16_t SubtreeMax;
+	};
+
+	// Four rays on their way through the tiles; defined in the .cpp.
+	struct Packet;
+	struct LocalRays;
+
+	// Points per chunk of a batch; a chunk's coordinates live on the stack.
+	static const size_t ChunkSize = 64;
+
+	// Finest tile holding the finest level tile (x, y); the root has to be in.
+	const Tile* Find(uint32_t x, uint32_t y) const;
+	// Heights at up to ChunkSize points with the lock held. Points are moved onto the
+	// terrain first. spacing, if given, receives the texel size of the answering tile.
+	void Sample(float* xs, float* zs, size_t count, float* heights, uint8_t* levels, float* spacing) const;
+	// Recomputes SubtreeMax from node up to the root.
+	void UpdateSubtreeMax(uint32_t node, uint32_t level);
+	// Traces the packet through a tile, or through node (i, j) of its max mip.
+	void TraceTile(const Tile& tile, Packet& packet) const;
+	void TraceNode(const Tile& tile, const LocalRays& rays, Packet& packet, uint32_t mip, uint32_t i, uint32_t j) const;
+
+	TerrainHeightFieldSettings mSettings;
+	float mLeft = 0.0f;
+	float mTop = 0.0f;
+
+	mutable std::shared_timed_mutex mMutex;
+	std::unordered_map<uint32_t, Tile> mTiles;
+	Tile* mRoot = nullptr;
+	std::atomic<uint64_t> mVersion{ 0 };
+};
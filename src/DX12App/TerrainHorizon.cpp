@@ -0,0 +1,222 @@
+#include "TerrainHorizon.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace DirectX;
+
+void TerrainHorizon::Begin(const XMFLOAT3& eye, uint32_t columns)
+{
+	mEye = eye;
+	mHorizon.assign(std::max<uint32_t>(columns, 1), -FLT_MAX);
+	if (mEdgeDirections.size() != 2 * mHorizon.size())
+	{
+		mEdgeDirections.resize(2 * mHorizon.size());
+		for (uint32_t c = 0; c < mHorizon.size(); c++)
+		{
+			float a = (float)c / mHorizon.size() * XM_2PI - XM_PI;
+			mEdgeDirections[2 * c] = std::cos(a);
+			mEdgeDirections[2 * c + 1] = std::sin(a);
+		}
+	}
+	mOccluders.clear();
+	mStats = Stats();
+}
+
+uint32_t TerrainHorizon::Wrap(int column) const
+{
+	int n = (int)mHorizon.size();
+	return (uint32_t)(((column % n) + n) % n);
+}
+
+bool TerrainHorizon::MakeFootprint(const BoundingBox& box, Footprint& footprint) const
+{
+	footprint.MinX = box.Center.x - box.Extents.x;
+	footprint.MaxX = box.Center.x + box.Extents.x;
+	footprint.MinZ = box.Center.z - box.Extents.z;
+	footprint.MaxZ = box.Center.z + box.Extents.z;
+	footprint.MinY = box.Center.y - box.Extents.y;
+	footprint.MaxY = box.Center.y + box.Extents.y;
+
+	float dx0 = footprint.MinX - mEye.x, dx1 = footprint.MaxX - mEye.x;
+	float dz0 = footprint.MinZ - mEye.z, dz1 = footprint.MaxZ - mEye.z;
+	if (dx0 <= 0.0f && dx1 >= 0.0f && dz0 <= 0.0f && dz1 >= 0.0f)
+		return false;
+
+	float nearX = std::max<float>(std::max<float>(dx0, -dx1), 0.0f);
+	float nearZ = std::max<float>(std::max<float>(dz0, -dz1), 0.0f);
+	float farX = std::max<float>(std::fabs(dx0), std::fabs(dx1));
+	float farZ = std::max<float>(std::fabs(dz0), std::fabs(dz1));
+	footprint.MinDist = std::sqrt(nearX * nearX + nearZ * nearZ);
+	footprint.MaxDist = std::sqrt(farX * farX + farZ * farZ);
+
+	// The eye is outside, so the footprint spans less than half a turn around the
+	// azimuth of its center.
+	float center = std::atan2(0.5f * (dz0 + dz1), 0.5f * (dx0 + dx1));
+	float lo = FLT_MAX, hi = -FLT_MAX;
+	const float xs[2] = { dx0, dx1 };
+	const float zs[2] = { dz0, dz1 };
+	for (float x : xs)
+	{
+		for (float z : zs)
+		{
+			float a = std::atan2(z, x) - center;
+			if (a > XM_PI)
+				a -= XM_2PI;
+			else if (a < -XM_PI)
+				a += XM_2PI;
+			lo = std::min(lo, a);
+			hi = std::max(hi, a);
+		}
+	}
+
+	float columnsPerRadian = mHorizon.size() / XM_2PI;
+	footprint.Column0 = (center + lo + XM_PI) * columnsPerRadian;
+	footprint.Column1 = (center + hi + XM_PI) * columnsPerRadian;
+	return true;
+}
+
+bool TerrainHorizon::Cross(const Footprint& footprint, int c, float& enter, float& leave) const
+{
+	const float* dir = &mEdgeDirections[2 * Wrap(c)];
+	float lo[2] = { footprint.MinX - mEye.x, footprint.MinZ - mEye.z };
+	float hi[2] = { footprint.MaxX - mEye.x, footprint.MaxZ - mEye.z };
+
+	enter = 0.0f;
+	leave = FLT_MAX;
+	for (int i = 0; i < 2; i++)
+	{
+		if (std::fabs(dir[i]) < 1e-8f)
+		{
+			if (lo[i] > 0.0f || hi[i] < 0.0f)
+				return false;
+			continue;
+		}
+		float t0 = lo[i] / dir[i];
+		float t1 = hi[i] / dir[i];
+		if (t0 > t1)
+			std::swap(t0, t1);
+		enter = std::max(enter, t0);
+		leave = std::min(leave, t1);
+	}
+	return enter <= leave;
+}
+
+void TerrainHorizon::AddOccluder(const BoundingBox& box)
+{
+	Footprint footprint;
+	if (!MakeFootprint(box, footprint))
+		return;
+
+	mOccluders.push_back(footprint);
+	mStats.Occluders++;
+}
+
+void TerrainHorizon::AddOccluderGrid(const BoundingBox& tile, uint32_t cells, const float* minHeights)
+{
+	float sizeX = 2.0f * tile.Extents.x / cells;
+	float sizeZ = 2.0f * tile.Extents.z / cells;
+	float x0 = tile.Center.x - tile.Extents.x;
+	float z0 = tile.Center.z + tile.Extents.z;
+	for (uint32_t cy = 0; cy < cells; cy++)
+	{
+		for (uint32_t cx = 0; cx < cells; cx++)
+		{
+			XMFLOAT3 center(x0 + (cx + 0.5f) * sizeX, minHeights[cy * cells + cx], z0 - (cy + 0.5f) * sizeZ);
+			AddOccluder(BoundingBox(center, XMFLOAT3(0.5f * sizeX, 0.0f, 0.5f * sizeZ)));
+		}
+	}
+}
+
+void TerrainHorizon::Raise(const Footprint& occluder)
+{
+	// A ray below the bottom of the occluder where it crosses the footprint has gone
+	// into the ground. Going down, the far edge of the crossing is the last chance to
+	// hit it, going up the near edge. Only columns the footprint covers completely
+	// count, and each takes the lower slope of its two edges. Inside the column the
+	// crossing distance differs from the edges by at most a factor of the cosine of
+	// the column width, which is taken off as well.
+	float rise = occluder.MinY - mEye.y;
+	float widthCos = std::cos(XM_2PI / mHorizon.size());
+	int first = (int)std::ceil(occluder.Column0);
+	int last = (int)std::floor(occluder.Column1);
+	for (int c = first; c < last; c++)
+	{
+		float slope = FLT_MAX;
+		for (int edge = 0; edge < 2; edge++)
+		{
+			float enter, leave;
+			if (!Cross(occluder, c + edge, enter, leave))
+			{
+				slope = -FLT_MAX;
+				break;
+			}
+			float dist = rise < 0.0f ? leave * widthCos : enter / widthCos;
+			slope = std::min(slope, dist > 0.0f ? rise / dist : -FLT_MAX);
+		}
+
+		float& horizon = mHorizon[Wrap(c)];
+		horizon = std::max(horizon, slope);
+	}
+}
+
+bool TerrainHorizon::IsBelow(const Footprint& box) const
+{
+	// The steepest slope to any point of the box.
+	float rise = box.MaxY - mEye.y;
+	float dist = rise > 0.0f ? box.MinDist : box.MaxDist;
+	if (dist <= 0.0f)
+		return false;
+	float slope = rise / dist;
+
+	int first = (int)std::floor(box.Column0);
+	int last = (int)std::floor(box.Column1);
+	if (last - first >= (int)mHorizon.size())
+		return false;
+	for (int c = first; c <= last; c++)
+	{
+		if (!(slope < mHorizon[Wrap(c)]))
+			return false;
+	}
+	return true;
+}
+
+void TerrainHorizon::Cull(const std::vector<BoundingBox>& boxes, std::vector<uint8_t>& hidden)
+{
+	hidden.assign(boxes.size(), 0);
+	std::fill(mHorizon.begin(), mHorizon.end(), -FLT_MAX);
+	if (mHorizon.empty())
+		return;
+
+	std::sort(mOccluders.begin(), mOccluders.end(),
+		[](const Footprint& a, const Footprint& b) { return a.MaxDist < b.MaxDist; });
+
+	mBoxes.resize(boxes.size());
+	mOrder.clear();
+	for (uint32_t i = 0; i < (uint32_t)boxes.size(); i++)
+	{
+		if (MakeFootprint(boxes[i], mBoxes[i]))
+			mOrder.push_back(i);
+	}
+	std::sort(mOrder.begin(), mOrder.end(),
+		[this](uint32_t a, uint32_t b) { return mBoxes[a].MinDist < mBoxes[b].MinDist; });
+
+	size_t raised = 0;
+	uint32_t culled = 0;
+	for (uint32_t i : mOrder)
+	{
+		const Footprint& box = mBoxes[i];
+		while (raised < mOccluders.size() && mOccluders[raised].MaxDist <= box.MinDist)
+			Raise(mOccluders[raised++]);
+
+		if (raised > 0 && IsBelow(box))
+		{
+			hidden[i] = 1;
+			culled++;
+		}
+	}
+
+	mStats.Tested += (uint32_t)boxes.size();
+	mStats.Culled += culled;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <DirectXCollision.h>
+
+#include <cstdint>
+#include <vector>
+
+// Horizon culling for low views over the terrain. Around the eye the azimuth is cut
+// into columns, and every column keeps the steepest slope (rise over horizontal
+// distance) below which the ground added as occluders hides everything behind it.
+// A box is hidden when, in every column it spans, its highest point stays under the
+// horizon of occluders that are all nearer than the box. The ground has to be solid
+// below each occluder box, which holds for terrain tiles bounded by their height
+// range as long as the eye is above the terrain.
+class TerrainHorizon
+{
+public:
+	struct Stats
+	{
+		uint32_t Occluders = 0;
+		uint32_t Tested = 0;
+		uint32_t Culled = 0;
+	};
+
+	// Starts a frame: drops the occluders and resets the horizon and the stats.
+	void Begin(const DirectX::XMFLOAT3& eye, uint32_t columns = 1024);
+
+	// The ground below the bottom of box, over its footprint, is solid. Occluders
+	// whose footprint holds the eye are ignored.
+	void AddOccluder(const DirectX::BoundingBox& box);
+
+	// A tile's ground as a cells x cells grid of occluders over its footprint, with the
+	// lowest height of every cell in texel order (rows from the tile's +z edge).
+	void AddOccluderGrid(const DirectX::BoundingBox& tile, uint32_t cells, const float* minHeights);
+
+	// Sets hidden[i] for the boxes below the horizon. Boxes are taken nearest first
+	// and an occluder only raises the horizon for boxes beyond its whole footprint,
+	// so terrain tiles can be passed as occluders and as boxes at the same time.
+	void Cull(const std::vector<DirectX::BoundingBox>& boxes, std::vector<uint8_t>& hidden);
+
+	const Stats& GetStats() const { return mStats; }
+
+private:
+	// The box's footprint as seen from above the eye: horizontal distances and the
+	// azimuth span in columns, which may run past [0, columns) and wraps around.
+	struct Footprint
+	{
+		float MinX, MaxX, MinZ, MaxZ;
+		float MinY, MaxY;
+		float MinDist, MaxDist;
+		float Column0, Column1;
+	};
+
+	bool MakeFootprint(const DirectX::BoundingBox& box, Footprint& footprint) const;
+	void Raise(const Footprint& occluder);
+	bool IsBelow(const Footprint& box) const;
+	// Horizontal distances at which the ray from the eye along the azimuth of column
+	// edge c enters and leaves the footprint; false if it misses.
+	bool Cross(const Footprint& footprint, int c, float& enter, float& leave) const;
+	uint32_t Wrap(int column) const;
+
+	DirectX::XMFLOAT3 mEye = {};
+	std::vector<float> mHorizon;
+	// Direction of every column edge, x and z.
+	std::vector<float> mEdgeDirections;
+	std::vector<Footprint> mOccluders;
+	std::vector<Footprint> mBoxes;
+	std::vector<uint32_t> mOrder;
+	Stats mStats;
+};
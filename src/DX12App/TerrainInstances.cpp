@@ -0,0 +1,42 @@
+#include "TerrainInstances.h"
+
+using namespace DirectX;
+
+void BuildTerrainInstances(const TerrainQuadTree& tree, const TerrainLodRanges& ranges,
+	const std::vector<TerrainQuadTree::Selected>& tiles, const std::vector<uint32_t>& slots,
+	std::vector<TerrainInstance>& instances, std::vector<TerrainDrawBatch>& batches)
+{
+	instances.resize(tiles.size());
+	batches.clear();
+
+	// Counting sort by level.
+	std::vector<uint32_t> offsets(tree.Depth(), 0);
+	for (auto& tile : tiles)
+		offsets[tile.Level]++;
+
+	uint32_t first = 0;
+	for (uint32_t level = 0; level < tree.Depth(); level++)
+	{
+		uint32_t count = offsets[level];
+		if (count > 0)
+			batches.push_back({ level, first, count });
+		offsets[level] = first;
+		first += count;
+	}
+
+	for (size_t i = 0; i < tiles.size(); i++)
+	{
+		const TerrainQuadTree::Selected& tile = tiles[i];
+		XMFLOAT3 center = tree.Center(tile.Node);
+
+		TerrainInstance& instance = instances[offsets[tile.Level]++];
+		instance.CenterX = center.x;
+		instance.CenterZ = center.z;
+		instance.Size = tree.TileSize(tile.Level);
+		instance.Slot = slots[i];
+		instance.Level = tile.Level;
+		instance.MorphStart = ranges.MorphStart[tile.Level];
+		instance.MorphScale = ranges.MorphScale[tile.Level];
+		instance.Pad = 0.0f;
+	}
+}
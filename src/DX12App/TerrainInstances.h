@@ -0,0 +1,43 @@
+#pragma once
+
+#include "TerrainLod.h"
+
+// Per-instance data of a terrain tile, laid out like TerrainInstance in Terrain.hlsl.
+// The grid mesh is a unit square that the instance scales and moves.
+struct TerrainInstance
+{
+	float CenterX;
+	float CenterZ;
+	float Size;
+	// Tile slot; its diffuse, height and normal maps are at 3 * Slot + 0, 1, 2 of the
+	// slot descriptor table.
+	uint32_t Slot;
+	uint32_t Level;
+	// Morph range of the level, see TerrainLodRanges.
+	float MorphStart;
+	float MorphScale;
+	float Pad;
+};
+
+// One instanced draw: InstanceCount tiles of one level from FirstInstance on.
+struct TerrainDrawBatch
+{
+	uint32_t Level;
+	uint32_t FirstInstance;
+	uint32_t InstanceCount;
+};
+
+// Command list calls to draw the terrain. Drawing every tile as a render item took
+// TerrainCallsPerItem per tile (three tables, two buffers, two CBVs and the draw);
+// instanced drawing sets the slot table, the instance buffer, the material, two
+// buffers and the shared constants once per frame, then the first instance and a
+// draw per batch.
+const uint32_t TerrainCallsPerItem = 8;
+const uint32_t TerrainCallsPerFrame = 6;
+const uint32_t TerrainCallsPerBatch = 2;
+
+// Instances of the visible tiles, slots[i] being the slot of tiles[i], sorted into
+// one batch per level from the coarsest on. Tiles of a level keep their order.
+void BuildTerrainInstances(const TerrainQuadTree& tree, const TerrainLodRanges& ranges,
+	const std::vector<TerrainQuadTree::Selected>& tiles, const std::vector<uint32_t>& slots,
+	std::vector<TerrainInstance>& instances, std::vector<TerrainDrawBatch>& batches);
@@ -0,0 +1,120 @@
+#include "TerrainLod.h"
+#include "LodSelector.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <unordered_set>
+
+using namespace DirectX;
+
+void ComputeTerrainLodRanges(const TerrainQuadTree& tree, const TerrainLodSettings& settings,
+	const std::vector<float>& levelErrors, float fovY, float viewportHeight, TerrainLodRanges& ranges)
+{
+	uint32_t depth = tree.Depth();
+	ranges.Range.assign(depth, 0.0f);
+	ranges.MorphStart.assign(depth, FLT_MAX);
+	ranges.MorphScale.assign(depth, 0.0f);
+	if (depth == 0)
+		return;
+
+	ranges.Range[0] = FLT_MAX;
+	float scale = LodProjectionScale(fovY, viewportHeight);
+	for (uint32_t level = 1; level < depth; level++)
+	{
+		uint32_t parent = level - 1;
+		if (level > 1 && ranges.Range[parent] <= 0.0f)
+			break;
+
+		if (settings.Mode == TerrainLodMode::DistanceThresholds)
+			ranges.Range[level] = parent < settings.DistanceThresholds.size() ? settings.DistanceThresholds[parent] : 0.0f;
+		else
+			ranges.Range[level] = parent < levelErrors.size() ? levelErrors[parent] * scale / settings.PixelError : 0.0f;
+	}
+
+	float heightExtent = tree.MaxY() - tree.MinY();
+	for (uint32_t level = depth - 1; level >= 1; level--)
+	{
+		if (ranges.Range[level] <= 0.0f)
+			continue;
+
+		float size = tree.TileSize(level);
+		float diagonal = std::sqrt(2.0f * size * size + heightExtent * heightExtent);
+		float finer = level + 1 < depth ? ranges.Range[level + 1] : 0.0f;
+		ranges.Range[level] = std::max(ranges.Range[level], finer + diagonal);
+
+		float start = finer + (ranges.Range[level] - finer) * settings.MorphStartRatio;
+		if (start < ranges.Range[level])
+		{
+			ranges.MorphStart[level] = start;
+			ranges.MorphScale[level] = 1.0f / (ranges.Range[level] - start);
+		}
+	}
+}
+
+float TerrainMorphFactor(const TerrainLodRanges& ranges, uint32_t level, float distance)
+{
+	float k = (distance - ranges.MorphStart[level]) * ranges.MorphScale[level];
+	return std::min(std::max(k, 0.0f), 1.0f);
+}
+
+bool RefineTerrainNode(const TerrainLodRanges& ranges, uint32_t level, float distance)
+{
+	return level + 1 < ranges.Range.size() && distance < ranges.Range[level + 1];
+}
+
+void SelectTerrainTiles(const TerrainQuadTree& tree, const TerrainLodRanges& ranges,
+	const BoundingFrustum& frustum, const XMFLOAT3& eye,
+	std::vector<TerrainQuadTree::Selected>& selected, std::vector<TerrainQuadTree::Selected>* wanted)
+{
+	tree.Select(frustum, XMLoadFloat3(&eye), [&](uint32_t, uint32_t level, float distance)
+	{
+		return RefineTerrainNode(ranges, level, distance);
+	}, selected, wanted);
+}
+
+TerrainSeamStats CheckTerrainSeams(const TerrainQuadTree& tree, const TerrainLodRanges& ranges,
+	const XMFLOAT3& eye, const std::vector<TerrainQuadTree::Selected>& selected)
+{
+	std::unordered_set<uint32_t> drawn;
+	for (auto& s : selected)
+		drawn.insert(s.Node);
+
+	// Finer neighbours check the edge from their side, so only look at the same
+	// level and up.
+	const int dirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	TerrainSeamStats stats;
+	for (auto& s : selected)
+	{
+		uint32_t x, y;
+		TerrainQuadTree::TileCoords(s.Node, s.Level, x, y);
+		int width = (int)TerrainQuadTree::LevelWidth(s.Level);
+
+		for (auto& d : dirs)
+		{
+			int nx = (int)x + d[0];
+			int ny = (int)y + d[1];
+			if (nx < 0 || ny < 0 || nx >= width || ny >= width)
+				continue;
+
+			for (int level = (int)s.Level; level >= 0; level--)
+			{
+				uint32_t shift = s.Level - level;
+				uint32_t neighbour = TerrainQuadTree::NodeIndex(level, nx >> shift, ny >> shift);
+				if (!drawn.count(neighbour))
+					continue;
+
+				uint32_t delta = s.Level - level;
+				if (delta > 0)
+				{
+					stats.CoarserEdges++;
+					stats.MaxLevelDelta = std::max(stats.MaxLevelDelta, delta);
+					if (delta > 1 || tree.DistanceToBounds(neighbour, level, eye) < ranges.Range[s.Level])
+						stats.UnmorphedEdges++;
+				}
+				break;
+			}
+		}
+	}
+	return stats;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "TerrainQuadTree.h"
+
+enum class TerrainLodMode
+{
+	// Level L + 1 is used within DistanceThresholds[L] of the eye.
+	DistanceThresholds,
+	// Level L + 1 is used where the largest geometric error of level L projects to
+	// more than PixelError pixels.
+	ScreenSpaceError,
+};
+
+struct TerrainLodSettings
+{
+	TerrainLodMode Mode = TerrainLodMode::ScreenSpaceError;
+	float PixelError = 2.0f;
+	std::vector<float> DistanceThresholds = { 1500.f, 1000.f, 500.f, 200.f, 100.f };
+	// Where in its range a level starts morphing to the parent grid: 0 at the end
+	// of the next finer range, 1 at the end of its own (no morph).
+	float MorphStartRatio = 0.7f;
+};
+
+// CDLOD ranges, per level. A node is refined when its bounds come closer to the eye
+// than the range of its children's level, and the vertices of a node morph to its
+// parent's grid as their distance goes from MorphStart to the end of the node's own
+// range: factor = saturate((distance - MorphStart) * MorphScale), as in Terrain.hlsl.
+struct TerrainLodRanges
+{
+	// Range[0] is unbounded, 0 marks levels that are never used.
+	std::vector<float> Range;
+	std::vector<float> MorphStart;
+	std::vector<float> MorphScale;
+};
+
+// levelErrors holds the largest geometric error of every level, in world units; fovY,
+// viewportHeight and levelErrors are only used by the screen space error mode.
+// Ranges are widened where needed so that every range exceeds the next finer one by
+// a node diagonal: tiles sharing an edge then differ by at most one level and the
+// finer one has fully morphed along it.
+void ComputeTerrainLodRanges(const TerrainQuadTree& tree, const TerrainLodSettings& settings,
+	const std::vector<float>& levelErrors, float fovY, float viewportHeight, TerrainLodRanges& ranges);
+
+// Morph factor of a level-L vertex at the given distance from the eye.
+float TerrainMorphFactor(const TerrainLodRanges& ranges, uint32_t level, float distance);
+
+// True when a visible level-L node whose bounds are distance from the eye comes within
+// the range of its children's level, the refinement test of SelectTerrainTiles.
+bool RefineTerrainNode(const TerrainLodRanges& ranges, uint32_t level, float distance);
+
+// Selects the terrain tiles to draw for a view. wanted gets the nodes that should be
+// refined but have no children yet, see TerrainQuadTree::Select.
+void SelectTerrainTiles(const TerrainQuadTree& tree, const TerrainLodRanges& ranges,
+	const DirectX::BoundingFrustum& frustum, const DirectX::XMFLOAT3& eye,
+	std::vector<TerrainQuadTree::Selected>& selected, std::vector<TerrainQuadTree::Selected>* wanted = nullptr);
+
+struct TerrainSeamStats
+{
+	// Tile edges shared with a coarser tile.
+	uint32_t CoarserEdges = 0;
+	// Of those, edges where the finer tile may not have finished morphing, which
+	// leaves a crack; only nodes still waiting for their children cause them.
+	uint32_t UnmorphedEdges = 0;
+	uint32_t MaxLevelDelta = 0;
+};
+
+// Checks a selection for the conditions the morph relies on.
+TerrainSeamStats CheckTerrainSeams(const TerrainQuadTree& tree, const TerrainLodRanges& ranges,
+	const DirectX::XMFLOAT3& eye, const std::vector<TerrainQuadTree::Selected>& selected);
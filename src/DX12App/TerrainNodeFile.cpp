@@ -0,0 +1,140 @@
+#include "TerrainNodeFile.h"
+#include "TerrainHeightData.h"
+#include "TerrainQuadTree.h"
+
+#include "../Common/d3dUtil.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+bool TerrainNodeFile::Write(const std::wstring& filename, uint32_t levels, const std::vector<TerrainNodeRecord>& records)
+{
+	if (records.size() != TerrainQuadTree::LevelOffset(levels))
+		return false;
+
+	std::ofstream fout(filename, std::ios::binary);
+	if (!fout)
+		return false;
+
+	Header header;
+	std::memcpy(header.Magic, "TQND", 4);
+	header.Version = Version;
+	header.Levels = levels;
+	header.RecordSize = sizeof(TerrainNodeRecord);
+	fout.write((const char*)&header, sizeof(header));
+
+	std::vector<float> levelErrors(levels, 0.0f);
+	for (uint32_t level = 0; level < levels; level++)
+		for (uint32_t n = TerrainQuadTree::LevelOffset(level); n < TerrainQuadTree::LevelOffset(level + 1); n++)
+			levelErrors[level] = std::max<float>(levelErrors[level], records[n].Error);
+	fout.write((const char*)levelErrors.data(), levels * sizeof(float));
+	fout.write((const char*)records.data(), records.size() * sizeof(TerrainNodeRecord));
+
+	return (bool)fout;
+}
+
+bool TerrainNodeFile::Open(const std::wstring& filename)
+{
+	mFile.close();
+	mFile.clear();
+	mLevels = 0;
+	mLevelErrors.clear();
+	mBytesRead = 0;
+
+	mFile.open(filename, std::ios::binary);
+	if (!mFile)
+		return false;
+
+	Header header;
+	if (!mFile.read((char*)&header, sizeof(header)) || std::memcmp(header.Magic, "TQND", 4) != 0 ||
+		header.Version != Version || header.RecordSize != sizeof(TerrainNodeRecord) || header.Levels == 0 || header.Levels > MaxLevels)
+		return false;
+
+	std::vector<float> levelErrors(header.Levels);
+	if (!mFile.read((char*)levelErrors.data(), header.Levels * sizeof(float)))
+		return false;
+
+	mFile.seekg(0, std::ios::end);
+	if ((uint64_t)mFile.tellg() < RecordOffset(header.Levels, TerrainQuadTree::LevelOffset(header.Levels)))
+		return false;
+
+	mLevels = header.Levels;
+	mLevelErrors = levelErrors;
+	return true;
+}
+
+void TerrainNodeFile::Close()
+{
+	mFile.close();
+	mLevels = 0;
+	mLevelErrors.clear();
+}
+
+uint64_t TerrainNodeFile::RecordOffset(uint32_t levels, uint32_t node)
+{
+	return sizeof(Header) + levels * sizeof(float) + (uint64_t)node * sizeof(TerrainNodeRecord);
+}
+
+bool TerrainNodeFile::Read(uint32_t node, uint32_t count, TerrainNodeRecord* records)
+{
+	if (!IsOpen() || node + count > TerrainQuadTree::LevelOffset(mLevels))
+		return false;
+
+	mFile.clear();
+	mFile.seekg(RecordOffset(mLevels, node));
+	if (!mFile.read((char*)records, count * sizeof(TerrainNodeRecord)))
+		return false;
+
+	mBytesRead += count * sizeof(TerrainNodeRecord);
+	return true;
+}
+
+bool BuildTerrainNodeFile(const std::wstring& terrainDir, const std::wstring& filename, uint32_t maxLevels)
+{
+	uint32_t levels = TerrainHeightData::CountLevels(terrainDir, maxLevels);
+	TerrainHeightData heights;
+	if (levels == 0 || !heights.Load(terrainDir, levels))
+		return false;
+
+	std::vector<float> errors = heights.ComputeGeometricErrors();
+	std::vector<TerrainHeightRange> heightRanges = heights.ComputeHeightRanges();
+	std::vector<TerrainNodeRecord> records(errors.size());
+	for (size_t i = 0; i < errors.size(); i++)
+	{
+		records[i].Error = errors[i];
+		records[i].MinHeight = heightRanges[i].Min;
+		records[i].MaxHeight = heightRanges[i].Max;
+	}
+
+	return TerrainNodeFile::Write(filename, levels, records);
+}
+
+bool RunTerrainNodeTool(const std::string& commandLine)
+{
+	std::istringstream args(commandLine);
+	std::string arg, dir;
+	bool requested = false;
+	while (args >> arg)
+	{
+		if (arg == "-terrain-nodes")
+		{
+			requested = true;
+			args >> dir;
+		}
+	}
+
+	if (!requested)
+		return false;
+
+	if (dir.empty())
+		dir = "../Textures/Terrain";
+
+	std::string out = dir + "/nodes.bin";
+	bool built = BuildTerrainNodeFile(AnsiToWString(dir), AnsiToWString(out), TerrainNodeFile::MaxLevels);
+
+	std::string report = "TerrainNodeFile: " + (built ? "written to " + out : "failed to build " + out) + "\n";
+	OutputDebugStringA(report.c_str());
+
+	return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// What the quadtree needs to know about a node before its tile is loaded.
+struct TerrainNodeRecord
+{
+	// Geometric error in normalized height units, see TerrainQuadTree::GeometricError.
+	float Error = 0.0f;
+	// Normalized height range of the node and its descendants, see
+	// TerrainHeightData::ComputeHeightRanges.
+	float MinHeight = 0.0f;
+	float MaxHeight = 1.0f;
+};
+
+// Records of every node of a terrain pyramid in TerrainQuadTree index order, read
+// from disk a few at a time as nodes are created. Siblings are consecutive, so a
+// group of four children is a single small read. The largest error of every level
+// is kept in front of the records and loaded on Open.
+class TerrainNodeFile
+{
+public:
+	static const uint32_t Version = 3;
+	static const uint32_t MaxLevels = 15;
+
+	static bool Write(const std::wstring& filename, uint32_t levels, const std::vector<TerrainNodeRecord>& records);
+
+	bool Open(const std::wstring& filename);
+	void Close();
+	bool IsOpen() const { return mLevels != 0; }
+	uint32_t Levels() const { return mLevels; }
+	const std::vector<float>& LevelErrors() const { return mLevelErrors; }
+
+	// Reads count records starting at node.
+	bool Read(uint32_t node, uint32_t count, TerrainNodeRecord* records);
+
+	uint64_t BytesRead() const { return mBytesRead; }
+
+private:
+	struct Header
+	{
+		char Magic[4];
+		uint32_t Version;
+		uint32_t Levels;
+		uint32_t RecordSize;
+	};
+
+	static uint64_t RecordOffset(uint32_t levels, uint32_t node);
+
+	std::ifstream mFile;
+	uint32_t mLevels = 0;
+	std::vector<float> mLevelErrors;
+	uint64_t mBytesRead = 0;
+};
+
+// Computes the records from the height tiles below terrainDir (every level found,
+// up to maxLevels) and writes them to filename.
+bool BuildTerrainNodeFile(const std::wstring& terrainDir, const std::wstring& filename, uint32_t maxLevels);
+
+// "-terrain-nodes [<terrain dir>]" on the command line builds <terrain dir>/nodes.bin
+// (default ../Textures/Terrain). Returns false when the command line doesn't ask for it.
+bool RunTerrainNodeTool(const std::string& commandLine);
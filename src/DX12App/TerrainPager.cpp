@@ -0,0 +1,198 @@
+#include "TerrainPager.h"
+
+#include <algorithm>
+
+TerrainPager::TerrainPager(TerrainQuadTree& tree, TerrainNodeFile& nodes, const TerrainPagerSettings& settings,
+	const TerrainDetail* detail)
+	: mTree(tree), mNodes(nodes), mSettings(settings), mDetail(detail)
+{
+}
+
+bool TerrainPager::Reset()
+{
+	mCreated.clear();
+	mDestroyed.clear();
+	mRequested.clear();
+	mPending.clear();
+
+	for (auto& s : mStates)
+	{
+		mTree.DestroyNode(s.first, s.second.Level);
+		mDestroyed.push_back({ s.first, s.second.Level });
+	}
+	mStates.clear();
+
+	TerrainNodeRecord root;
+	if (mTree.Depth() == 0 || !mNodes.Read(0, 1, &root))
+		return false;
+
+	CreateNode(0, 0, mDetail ? mDetail->StoredRecord(root, 0) : root);
+	return true;
+}
+
+void TerrainPager::CreateNode(uint32_t node, uint32_t level, const TerrainNodeRecord& record)
+{
+	mTree.CreateNode(node, level, record.Error * mSettings.HeightScale);
+	mTree.SetHeightRange(node, mSettings.BaseY + record.MinHeight * mSettings.HeightScale,
+		mSettings.BaseY + record.MaxHeight * mSettings.HeightScale);
+	mStates[node] = { level, mUpdate, record };
+	mCreated.push_back({ node, level });
+}
+
+void TerrainPager::FindLeafGroups(std::vector<Group>& groups) const
+{
+	groups.clear();
+	for (auto& s : mStates)
+	{
+		uint32_t level = s.second.Level;
+		if (level == 0 || ((s.first - TerrainQuadTree::LevelOffset(level)) & 3) != 0)
+			continue;
+
+		// Only groups whose members have no children of their own.
+		Group group = { TerrainQuadTree::Parent(s.first, level), level - 1, 0 };
+		bool leaves = true;
+		for (uint32_t i = 0; i < 4 && leaves; i++)
+		{
+			auto it = mStates.find(s.first + i);
+			leaves = !mTree.HasChildren(s.first + i, level);
+			group.LastUsed = std::max(group.LastUsed, it->second.LastUsed);
+		}
+		if (leaves)
+			groups.push_back(group);
+	}
+}
+
+void TerrainPager::DestroyGroup(const Group& group)
+{
+	uint32_t child = TerrainQuadTree::FirstChild(group.Parent, group.Level);
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		mTree.DestroyNode(child + i, group.Level + 1);
+		mStates.erase(child + i);
+		mPending.erase(child + i);
+		mDestroyed.push_back({ child + i, group.Level + 1 });
+	}
+}
+
+bool TerrainPager::Complete(uint32_t parent, uint32_t level)
+{
+	auto pending = mPending.find(parent);
+	if (pending == mPending.end() || pending->second.Level != level)
+		return false;
+
+	uint32_t child = TerrainQuadTree::FirstChild(parent, level);
+	for (uint32_t i = 0; i < 4; i++)
+		CreateNode(child + i, level + 1, pending->second.Records[i]);
+	mPending.erase(pending);
+	return true;
+}
+
+bool TerrainPager::EvictOldest()
+{
+	FindLeafGroups(mGroups);
+
+	const Group* oldest = nullptr;
+	for (auto& g : mGroups)
+	{
+		if (g.LastUsed < mUpdate && (!oldest || g.LastUsed < oldest->LastUsed ||
+			(g.LastUsed == oldest->LastUsed && g.Parent < oldest->Parent)))
+			oldest = &g;
+	}
+
+	if (!oldest)
+		return false;
+
+	DestroyGroup(*oldest);
+	return true;
+}
+
+void TerrainPager::Update(const std::vector<TerrainQuadTree::Selected>& selected, const std::vector<TerrainQuadTree::Selected>& wanted)
+{
+	mUpdate++;
+	mCreated.clear();
+	mDestroyed.clear();
+	mRequested.clear();
+
+	for (auto& s : selected)
+	{
+		uint32_t node = s.Node;
+		uint32_t level = s.Level;
+		for (;;)
+		{
+			NodeState& state = mStates[node];
+			if (state.LastUsed == mUpdate)
+				break;
+			state.LastUsed = mUpdate;
+			if (level == 0)
+				break;
+			node = TerrainQuadTree::Parent(node, level);
+			level--;
+		}
+	}
+
+	// Stale leaves go first, deepest first so their parents can follow next time.
+	if (mUpdate > mSettings.EvictAfter)
+	{
+		FindLeafGroups(mGroups);
+		std::sort(mGroups.begin(), mGroups.end(), [](const Group& a, const Group& b)
+		{
+			return a.Level != b.Level ? a.Level > b.Level : a.Parent < b.Parent;
+		});
+		for (auto& g : mGroups)
+			if (g.LastUsed + mSettings.EvictAfter < mUpdate)
+				DestroyGroup(g);
+	}
+
+	std::vector<TerrainQuadTree::Selected> order = wanted;
+	std::stable_sort(order.begin(), order.end(), [](const TerrainQuadTree::Selected& a, const TerrainQuadTree::Selected& b)
+	{
+		return a.Level < b.Level;
+	});
+
+	// Requested groups count as created until they are completed or dropped.
+	uint32_t groups = mSettings.DeferCreation ? (uint32_t)mPending.size() : 0;
+	for (auto& w : order)
+	{
+		if (groups >= mSettings.MaxGroupsPerUpdate)
+			break;
+		uint32_t levels = mDetail ? mDetail->TotalLevels() : mNodes.Levels();
+		if (w.Level + 1 >= mTree.Depth() || w.Level + 1 >= levels ||
+			!mTree.HasNode(w.Node, w.Level) || mTree.HasChildren(w.Node, w.Level) || mPending.count(w.Node))
+			continue;
+
+		while (mTree.NodeCount() + 4 * mPending.size() + 4 > mSettings.MaxNodes && EvictOldest())
+		{
+		}
+		if (mTree.NodeCount() + 4 * mPending.size() + 4 > mSettings.MaxNodes)
+			break;
+
+		uint32_t child = TerrainQuadTree::FirstChild(w.Node, w.Level);
+		TerrainNodeRecord records[4];
+		if (w.Level + 1 >= mNodes.Levels())
+		{
+			TerrainNodeRecord record = mDetail->SynthesizedRecord(mStates[w.Node].Record, w.Level + 1);
+			std::fill(records, records + 4, record);
+		}
+		else if (!mNodes.Read(child, 4, records))
+			continue;
+		else if (mDetail)
+		{
+			for (auto& record : records)
+				record = mDetail->StoredRecord(record, w.Level + 1);
+		}
+
+		if (mSettings.DeferCreation)
+		{
+			PendingGroup& pending = mPending[w.Node];
+			pending.Level = w.Level;
+			std::copy(records, records + 4, pending.Records);
+			mRequested.push_back(w);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < 4; i++)
+				CreateNode(child + i, w.Level + 1, records[i]);
+		}
+		groups++;
+	}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "TerrainQuadTree.h"
+#include "TerrainNodeFile.h"
+#include "TerrainDetail.h"
+
+#include <unordered_map>
+
+struct TerrainPagerSettings
+{
+	// Most nodes that exist at once, e.g. the number of GPU tile slots.
+	uint32_t MaxNodes = 1024;
+	// Groups of four children created per Update, bounds the loading work per frame.
+	// With DeferCreation it bounds the groups waiting for Complete instead.
+	uint32_t MaxGroupsPerUpdate = 4;
+	// Update only requests groups and the caller creates them with Complete once it
+	// has loaded their tiles, so loading can take several frames.
+	bool DeferCreation = false;
+	// Updates a group of leaves has to go unused before it is destroyed.
+	uint32_t EvictAfter = 120;
+	// Maps the normalized heights and errors of the node file to world units:
+	// BaseY + height * HeightScale, error * HeightScale.
+	float BaseY = 0.0f;
+	float HeightScale = 1.0f;
+};
+
+// Grows and shrinks a TerrainQuadTree with the view. Children are created four at a
+// time, reading their records from the node file, when selection wants to refine
+// their parent; groups of leaves that go unused are destroyed again. Until children
+// exist their parent stays selected, so the caller can load tile data as nodes
+// appear and the tree always covers the terrain. With DeferCreation the caller
+// loads the data of a requested group first and then completes it.
+//
+// With a TerrainDetail the tree goes on below the node file's levels: stored records
+// are widened by the detail below them and the synthesized levels take theirs from
+// the detail, and the caller synthesizes their tiles.
+class TerrainPager
+{
+public:
+	TerrainPager(TerrainQuadTree& tree, TerrainNodeFile& nodes, const TerrainPagerSettings& settings = TerrainPagerSettings(),
+		const TerrainDetail* detail = nullptr);
+
+	// Drops every node and creates the root. False if its record can't be read.
+	bool Reset();
+
+	// Marks the selected nodes (and their ancestors) as used, destroys stale groups
+	// and creates the children of wanted nodes, coarsest first, within the limits.
+	void Update(const std::vector<TerrainQuadTree::Selected>& selected, const std::vector<TerrainQuadTree::Selected>& wanted);
+
+	// Creates the children of a parent requested by Update. False if the request
+	// was dropped since, because the parent was destroyed.
+	bool Complete(uint32_t parent, uint32_t level);
+
+	// Nodes created and destroyed since the last Reset or Update, with the ones of
+	// Complete.
+	const std::vector<TerrainQuadTree::Selected>& Created() const { return mCreated; }
+	const std::vector<TerrainQuadTree::Selected>& Destroyed() const { return mDestroyed; }
+	// Parents whose children the last Update requested, with DeferCreation.
+	const std::vector<TerrainQuadTree::Selected>& Requested() const { return mRequested; }
+	// Groups requested and not completed or dropped yet.
+	size_t PendingCount() const { return mPending.size(); }
+
+	const TerrainPagerSettings& Settings() const { return mSettings; }
+
+private:
+	struct NodeState
+	{
+		uint32_t Level;
+		uint64_t LastUsed;
+		// As created, for the children of synthesized levels.
+		TerrainNodeRecord Record;
+	};
+
+	// Parent of a group of four leaves, with the last update any of them was used.
+	struct Group
+	{
+		uint32_t Parent;
+		uint32_t Level;
+		uint64_t LastUsed;
+	};
+
+	// Records of a requested group, keyed by its parent.
+	struct PendingGroup
+	{
+		uint32_t Level;
+		TerrainNodeRecord Records[4];
+	};
+
+	void CreateNode(uint32_t node, uint32_t level, const TerrainNodeRecord& record);
+	void FindLeafGroups(std::vector<Group>& groups) const;
+	void DestroyGroup(const Group& group);
+	// Destroys the least recently used group not used by the current update.
+	bool EvictOldest();
+
+	TerrainQuadTree& mTree;
+	TerrainNodeFile& mNodes;
+	TerrainPagerSettings mSettings;
+	const TerrainDetail* mDetail;
+
+	std::unordered_map<uint32_t, NodeState> mStates;
+	uint64_t mUpdate = 0;
+
+	std::vector<TerrainQuadTree::Selected> mCreated;
+	std::vector<TerrainQuadTree::Selected> mDestroyed;
+	std::vector<TerrainQuadTree::Selected> mRequested;
+	std::unordered_map<uint32_t, PendingGroup> mPending;
+	std::vector<Group> mGroups;
+};
@@ -0,0 +1,893 @@
+#include "TerrainPyramidBuilder.h"
+#include "TerrainHeightData.h"
+#include "TerrainNodeFile.h"
+#include "TerrainQuadTree.h"
+#include "ThreadPool.h"
+
+#include "../Common/d3dUtil.h"
+
+#include <wincodec.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cwctype>
+#include <fstream>
+#include <sstream>
+
+using Microsoft::WRL::ComPtr;
+
+namespace
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double MsSince(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	// Rows kept above and below a band: one for the central differences of the
+	// normals, two for the texels of the next coarser level that the bilinear
+	// samples of its mesh read just outside a child's quarter.
+	const uint32_t Halo = 2;
+
+	const wchar_t* const TileKinds[] = { L"height", L"normal", L"diffuse" };
+
+	class RawHeightSource : public TerrainHeightSource
+	{
+	public:
+		bool Open(const std::wstring& filename, uint32_t width, uint32_t height)
+		{
+			mFile.open(filename, std::ios::binary);
+			if (!mFile)
+				return false;
+
+			mFile.seekg(0, std::ios::end);
+			uint64_t texels = (uint64_t)mFile.tellg() / 2;
+			if (width == 0 || height == 0)
+			{
+				width = (uint32_t)std::sqrt((double)texels);
+				while ((uint64_t)width * width > texels)
+					width--;
+				while ((uint64_t)(width + 1) * (width + 1) <= texels)
+					width++;
+				height = width;
+			}
+			if (width == 0 || height == 0 || (uint64_t)width * height > texels)
+				return false;
+
+			mWidth = width;
+			mHeight = height;
+			return true;
+		}
+
+		uint32_t Width() const override { return mWidth; }
+		uint32_t Height() const override { return mHeight; }
+
+		bool ReadRows(uint32_t first, uint32_t count, uint16_t* texels) override
+		{
+			mFile.clear();
+			mFile.seekg((uint64_t)first * mWidth * 2);
+			return (bool)mFile.read((char*)texels, (std::streamsize)count * mWidth * 2);
+		}
+
+	private:
+		std::ifstream mFile;
+		uint32_t mWidth = 0;
+		uint32_t mHeight = 0;
+	};
+
+	// Source rows covering the rows a band of the finest level resamples from. Rows
+	// are read as they are first needed and dropped once no later band needs them.
+	template<typename Source, typename Texel>
+	class SourceWindow
+	{
+	public:
+		explicit SourceWindow(Source& source) : mSource(source) {}
+
+		bool Cover(uint32_t firstRow, uint32_t lastRow)
+		{
+			uint32_t width = mSource.Width();
+			if (firstRow > mFirst)
+			{
+				uint32_t drop = std::min<uint32_t>(firstRow - mFirst, mCount);
+				mTexels.erase(mTexels.begin(), mTexels.begin() + (size_t)drop * width);
+				mFirst += drop;
+				mCount -= drop;
+				if (mCount == 0)
+					mFirst = firstRow;
+			}
+			if (lastRow < mFirst + mCount)
+				return true;
+
+			uint32_t start = mFirst + mCount;
+			uint32_t count = lastRow + 1 - start;
+			mTexels.resize((size_t)(mCount + count) * width);
+			if (!mSource.ReadRows(start, count, &mTexels[(size_t)mCount * width]))
+				return false;
+			mCount += count;
+			return true;
+		}
+
+		const Texel* Row(uint32_t row) const { return &mTexels[(size_t)(row - mFirst) * mSource.Width()]; }
+		size_t Bytes() const { return mTexels.capacity() * sizeof(Texel); }
+
+	private:
+		Source& mSource;
+		std::vector<Texel> mTexels;
+		uint32_t mFirst = 0;
+		uint32_t mCount = 0;
+	};
+
+	// Bilinear taps of a resample from sourceSize texels to size texels, texel centers aligned.
+	struct ResampleTaps
+	{
+		std::vector<uint32_t> First;
+		std::vector<uint32_t> Second;
+		std::vector<float> Weight;
+
+		void Build(uint32_t sourceSize, uint32_t size)
+		{
+			First.resize(size);
+			Second.resize(size);
+			Weight.resize(size);
+			float scale = (float)sourceSize / size;
+			for (uint32_t i = 0; i < size; i++)
+			{
+				float s = std::max<float>((i + 0.5f) * scale - 0.5f, 0.0f);
+				First[i] = std::min<uint32_t>((uint32_t)s, sourceSize - 1);
+				Second[i] = std::min<uint32_t>(First[i] + 1, sourceSize - 1);
+				Weight[i] = s - (float)(uint32_t)s;
+			}
+		}
+	};
+
+	uint32_t Channel(uint32_t texel, uint32_t c) { return (texel >> (8 * c)) & 0xff; }
+
+	uint32_t LerpColor(uint32_t a, uint32_t b, float t)
+	{
+		uint32_t color = 0;
+		for (uint32_t c = 0; c < 4; c++)
+			color |= (uint32_t)(Channel(a, c) + (Channel(b, c) - (float)Channel(a, c)) * t + 0.5f) << (8 * c);
+		return color;
+	}
+
+	uint32_t AverageColor(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+	{
+		uint32_t color = 0;
+		for (uint32_t k = 0; k < 4; k++)
+			color |= ((Channel(a, k) + Channel(b, k) + Channel(c, k) + Channel(d, k) + 2) >> 2) << (8 * k);
+		return color;
+	}
+
+	uint16_t AverageHeight(uint16_t a, uint16_t b, uint16_t c, uint16_t d)
+	{
+		return (uint16_t)(((uint32_t)a + b + c + d + 2) >> 2);
+	}
+
+	// Box filtered mip chain of a square tile, top mip included.
+	template<typename Texel, typename Average>
+	std::vector<std::vector<Texel>> MipChain(std::vector<Texel> top, uint32_t resolution, Average average)
+	{
+		std::vector<std::vector<Texel>> chain;
+		chain.push_back(std::move(top));
+		for (uint32_t size = resolution / 2; size > 0; size /= 2)
+		{
+			const std::vector<Texel>& above = chain.back();
+			std::vector<Texel> mip((size_t)size * size);
+			for (uint32_t y = 0; y < size; y++)
+				for (uint32_t x = 0; x < size; x++)
+				{
+					const Texel* row0 = &above[(size_t)(2 * y) * (2 * size) + 2 * x];
+					const Texel* row1 = row0 + 2 * size;
+					mip[(size_t)y * size + x] = average(row0[0], row0[1], row1[0], row1[1]);
+				}
+			chain.push_back(std::move(mip));
+		}
+		return chain;
+	}
+
+	// Legacy DDS headers like the shipped tiles: 16 bit luminance for heights and
+	// 32 bit RGBA for the rest, uncompressed with every mip.
+	template<typename Texel>
+	std::vector<uint8_t> EncodeTile(uint32_t resolution, const std::vector<std::vector<Texel>>& chain)
+	{
+		const uint32_t DDSD_CAPS = 0x1, DDSD_HEIGHT = 0x2, DDSD_WIDTH = 0x4, DDSD_PITCH = 0x8,
+			DDSD_PIXELFORMAT = 0x1000, DDSD_MIPMAPCOUNT = 0x20000;
+		const uint32_t DDPF_ALPHAPIXELS = 0x1, DDPF_RGB = 0x40, DDPF_LUMINANCE = 0x20000;
+		const uint32_t DDSCAPS_COMPLEX = 0x8, DDSCAPS_TEXTURE = 0x1000, DDSCAPS_MIPMAP = 0x400000;
+		bool luminance = sizeof(Texel) == 2;
+
+		uint32_t header[32] = {};
+		header[0] = 0x20534444; // "DDS "
+		header[1] = 124;
+		header[2] = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT;
+		header[3] = resolution;
+		header[4] = resolution;
+		header[5] = resolution * (uint32_t)sizeof(Texel);
+		header[6] = 1;
+		header[7] = (uint32_t)chain.size();
+		// DDS_PIXELFORMAT
+		header[19] = 32;
+		header[20] = luminance ? DDPF_LUMINANCE : DDPF_RGB | DDPF_ALPHAPIXELS;
+		header[22] = 8 * (uint32_t)sizeof(Texel);
+		header[23] = luminance ? 0xffff : 0x000000ff;
+		header[24] = luminance ? 0 : 0x0000ff00;
+		header[25] = luminance ? 0 : 0x00ff0000;
+		header[26] = luminance ? 0 : 0xff000000;
+		header[27] = DDSCAPS_TEXTURE | (chain.size() > 1 ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0);
+
+		size_t bytes = sizeof(header);
+		for (auto& mip : chain)
+			bytes += mip.size() * sizeof(Texel);
+
+		std::vector<uint8_t> dds(bytes);
+		uint8_t* out = dds.data();
+		memcpy(out, header, sizeof(header));
+		out += sizeof(header);
+		for (auto& mip : chain)
+		{
+			memcpy(out, mip.data(), mip.size() * sizeof(Texel));
+			out += mip.size() * sizeof(Texel);
+		}
+		return dds;
+	}
+
+	uint64_t WriteTile(const std::wstring& filename, const std::vector<uint8_t>& dds)
+	{
+		std::ofstream fout(filename, std::ios::binary);
+		if (!fout)
+			return 0;
+		fout.write((const char*)dds.data(), dds.size());
+		return fout ? dds.size() : 0;
+	}
+
+	class PyramidBuilder
+	{
+	public:
+		PyramidBuilder(const std::wstring& outDir, const TerrainPyramidSettings& settings, uint32_t levels, bool albedo,
+			ThreadPool& pool, TerrainPyramidStats& stats)
+			: mOutDir(outDir), mSettings(settings), mResolution(settings.TileResolution), mAlbedo(albedo), mPool(pool), mStats(stats)
+		{
+			mLevels.resize(levels);
+			for (uint32_t level = 0; level < levels; level++)
+			{
+				mLevels[level].Level = level;
+				mLevels[level].Tiles = 1u << level;
+				mLevels[level].Width = mResolution << level;
+			}
+
+			mRecords.resize(TerrainQuadTree::LevelOffset(levels));
+			for (auto& record : mRecords)
+			{
+				record.MinHeight = 1.0f;
+				record.MaxHeight = 0.0f;
+			}
+		}
+
+		const std::vector<TerrainNodeRecord>& Records() const { return mRecords; }
+		bool Failed() const { return mFailed; }
+
+		// Rows of the finest level, in order.
+		void PushFinest(const uint16_t* heights, const uint32_t* albedo, uint32_t count)
+		{
+			Push((uint32_t)mLevels.size() - 1, heights, albedo, count);
+		}
+
+		// Adds the tile and write times and the bytes written to the stats.
+		void FinishStats()
+		{
+			mStats.TileMs = mTileUs / 1000.0;
+			mStats.WriteMs = mWriteUs / 1000.0;
+			mStats.BytesWritten = mBytesWritten;
+		}
+
+		size_t BandBytes() const
+		{
+			size_t bytes = 0;
+			for (auto& band : mLevels)
+				bytes += band.Heights.capacity() * sizeof(uint16_t) + band.Albedo.capacity() * sizeof(uint32_t);
+			return bytes;
+		}
+
+	private:
+		// Rows [First, First + Rows) of a level, every texel across.
+		struct Band
+		{
+			uint32_t Level = 0;
+			uint32_t Tiles = 0;
+			uint32_t Width = 0;
+			uint32_t First = 0;
+			uint32_t Rows = 0;
+			std::vector<uint16_t> Heights;
+			std::vector<uint32_t> Albedo;
+			// Rows of the next coarser level made so far, and the next tile row to cut.
+			uint32_t Downsampled = 0;
+			uint32_t NextTileRow = 0;
+
+			const uint16_t* HeightRow(uint32_t row) const { return &Heights[(size_t)(row - First) * Width]; }
+			const uint32_t* AlbedoRow(uint32_t row) const { return &Albedo[(size_t)(row - First) * Width]; }
+			uint32_t End() const { return First + Rows; }
+		};
+
+		// The error, min and max a tile adds to its parent.
+		struct TileResult
+		{
+			float Error = 0.0f;
+			float Min = 1.0f;
+			float Max = 0.0f;
+		};
+
+		// Appends rows to a level a few at a time, so a level never holds more than
+		// its band, the halo and a row waiting for its pair.
+		void Push(uint32_t level, const uint16_t* heights, const uint32_t* albedo, uint32_t count)
+		{
+			Band& band = mLevels[level];
+			while (count > 0 && !mFailed)
+			{
+				uint32_t wanted = std::min<uint32_t>((band.NextTileRow + 1) * mResolution + Halo, band.Width);
+				uint32_t take = band.End() < wanted ? std::min<uint32_t>(wanted - band.End(), count) : count;
+
+				band.Heights.insert(band.Heights.end(), heights, heights + (size_t)take * band.Width);
+				if (mAlbedo)
+					band.Albedo.insert(band.Albedo.end(), albedo, albedo + (size_t)take * band.Width);
+				band.Rows += take;
+				heights += (size_t)take * band.Width;
+				if (mAlbedo)
+					albedo += (size_t)take * band.Width;
+				count -= take;
+
+				Process(band);
+			}
+		}
+
+		void Process(Band& band)
+		{
+			// Pairs of rows average into the next coarser level; they are handed on
+			// after this level's tiles so a parent is always cut after its children.
+			std::vector<uint16_t> parentHeights;
+			std::vector<uint32_t> parentAlbedo;
+			uint32_t parentRows = 0;
+			if (band.Level > 0 && 2 * band.Downsampled + 1 < band.End())
+			{
+				uint32_t first = band.Downsampled;
+				parentRows = (band.End() - 2 * first) / 2;
+				uint32_t parentWidth = band.Width / 2;
+				parentHeights.resize((size_t)parentRows * parentWidth);
+				if (mAlbedo)
+					parentAlbedo.resize(parentHeights.size());
+
+				mPool.ParallelFor(parentRows, [&](size_t r)
+				{
+					uint32_t row = 2 * (first + (uint32_t)r);
+					const uint16_t* h0 = band.HeightRow(row);
+					const uint16_t* h1 = h0 + band.Width;
+					uint16_t* out = &parentHeights[r * parentWidth];
+					for (uint32_t x = 0; x < parentWidth; x++)
+						out[x] = AverageHeight(h0[2 * x], h0[2 * x + 1], h1[2 * x], h1[2 * x + 1]);
+
+					if (mAlbedo)
+					{
+						const uint32_t* a0 = band.AlbedoRow(row);
+						const uint32_t* a1 = a0 + band.Width;
+						uint32_t* outAlbedo = &parentAlbedo[r * parentWidth];
+						for (uint32_t x = 0; x < parentWidth; x++)
+							outAlbedo[x] = AverageColor(a0[2 * x], a0[2 * x + 1], a1[2 * x], a1[2 * x + 1]);
+					}
+				});
+				band.Downsampled += parentRows;
+			}
+
+			while (band.NextTileRow < band.Tiles &&
+				band.End() >= std::min<uint32_t>((band.NextTileRow + 1) * mResolution + Halo, band.Width))
+			{
+				CutTileRow(band, band.NextTileRow);
+				band.NextTileRow++;
+			}
+
+			// Drop the rows neither the next tile row nor the next pair needs.
+			uint32_t keep = band.NextTileRow * mResolution;
+			keep = keep > Halo ? keep - Halo : 0;
+			if (band.Level > 0)
+				keep = std::min<uint32_t>(keep, 2 * band.Downsampled);
+			if (keep > band.First)
+			{
+				uint32_t drop = std::min<uint32_t>(keep - band.First, band.Rows);
+				band.Heights.erase(band.Heights.begin(), band.Heights.begin() + (size_t)drop * band.Width);
+				if (mAlbedo)
+					band.Albedo.erase(band.Albedo.begin(), band.Albedo.begin() + (size_t)drop * band.Width);
+				band.First += drop;
+				band.Rows -= drop;
+			}
+
+			if (parentRows > 0)
+				Push(band.Level - 1, parentHeights.data(), mAlbedo ? parentAlbedo.data() : nullptr, parentRows);
+		}
+
+		// Height at a texel of the level, clamped to the level's edges.
+		uint16_t HeightAt(const Band& band, int row, int column) const
+		{
+			int last = (int)band.Width - 1;
+			row = std::min<int>(std::max<int>(row, 0), last);
+			column = std::min<int>(std::max<int>(column, 0), last);
+			return band.HeightRow((uint32_t)row)[column];
+		}
+
+		// Bilinear sample at (u, v) of a tile's texels, clamped at the tile's edges
+		// like TerrainHeightData::SampleTile.
+		template<typename Fetch>
+		float SampleTile(Fetch fetch, float u, float v) const
+		{
+			int last = (int)mResolution - 1;
+			float tx = u * mResolution - 0.5f;
+			float ty = v * mResolution - 0.5f;
+			float fx = std::floor(tx);
+			float fy = std::floor(ty);
+			float ax = tx - fx;
+			float ay = ty - fy;
+
+			int x0 = std::min<int>(std::max<int>((int)fx, 0), last);
+			int y0 = std::min<int>(std::max<int>((int)fy, 0), last);
+			int x1 = std::min<int>(std::max<int>((int)fx + 1, 0), last);
+			int y1 = std::min<int>(std::max<int>((int)fy + 1, 0), last);
+
+			float top = fetch(y0, x0) * (1.0f - ax) + fetch(y0, x1) * ax;
+			float bottom = fetch(y1, x0) * (1.0f - ax) + fetch(y1, x1) * ax;
+			return (top * (1.0f - ay) + bottom * ay) / 65535.0f;
+		}
+
+		// Largest difference between the grid mesh of tile (x, y) and the mesh of its
+		// parent over the same ground. The parent's texels are averaged from this
+		// level's rows the same way the coarser level is.
+		float ParentMeshError(const Band& band, uint32_t x, uint32_t y) const
+		{
+			const uint32_t n = TerrainHeightData::GridVertices;
+			const uint32_t half = (n - 1) / 2;
+			uint32_t qx = x & 1, qy = y & 1;
+			int left = (int)(x * mResolution), top = (int)(y * mResolution);
+			int parentLeft = (int)((x & ~1u) * mResolution), parentTop = (int)((y & ~1u) * mResolution);
+
+			auto child = [&](int row, int column) -> float { return band.HeightRow(top + row)[left + column]; };
+			auto parent = [&](int row, int column) -> float
+			{
+				const uint16_t* h0 = band.HeightRow(parentTop + 2 * row) + parentLeft + 2 * column;
+				const uint16_t* h1 = h0 + band.Width;
+				return AverageHeight(h0[0], h0[1], h1[0], h1[1]);
+			};
+
+			std::vector<float> parentVertices((half + 1) * (half + 1));
+			for (uint32_t i = 0; i <= half; i++)
+				for (uint32_t j = 0; j <= half; j++)
+					parentVertices[i * (half + 1) + j] = SampleTile(parent, (float)(qx * half + j) / (n - 1), (float)(qy * half + i) / (n - 1));
+
+			float error = 0.0f;
+			for (uint32_t i = 0; i < n; i++)
+			{
+				float gv = i * 0.5f;
+				uint32_t r0 = std::min<uint32_t>((uint32_t)gv, half - 1);
+				float av = gv - r0;
+				float v = (float)i / (n - 1);
+				for (uint32_t j = 0; j < n; j++)
+				{
+					float gu = j * 0.5f;
+					uint32_t c0 = std::min<uint32_t>((uint32_t)gu, half - 1);
+					float au = gu - c0;
+
+					const float* row0 = &parentVertices[r0 * (half + 1) + c0];
+					const float* row1 = row0 + half + 1;
+					float h = (row0[0] * (1.0f - au) + row0[1] * au) * (1.0f - av) + (row1[0] * (1.0f - au) + row1[1] * au) * av;
+					error = std::max<float>(error, std::fabs(h - SampleTile(child, (float)j / (n - 1), v)));
+				}
+			}
+			return error;
+		}
+
+		std::wstring TilePath(uint32_t kind, uint32_t level, uint32_t x, uint32_t y) const
+		{
+			return mOutDir + L"/L" + std::to_wstring(level) + L"/" + TileKinds[kind] + L"/tile_" + TileKinds[kind] +
+				L"_level" + std::to_wstring(level) + L"_" + std::to_wstring(x) + L"_" + std::to_wstring(y) + L".dds";
+		}
+
+		TileResult CutTile(const Band& band, uint32_t x, uint32_t y)
+		{
+			auto start = Clock::now();
+			const uint32_t r = mResolution;
+			int left = (int)(x * r), top = (int)(y * r);
+			// World height units over world units between neighbouring texels.
+			float slopeScale = mSettings.HeightScale / 65535.0f / (2.0f * mSettings.RootSize / band.Width);
+
+			TileResult result;
+			std::vector<uint16_t> heights((size_t)r * r);
+			std::vector<uint32_t> normals((size_t)r * r), diffuse((size_t)r * r);
+			uint16_t lowest = 0xffff, highest = 0;
+			for (uint32_t i = 0; i < r; i++)
+			{
+				int row = top + (int)i;
+				for (uint32_t j = 0; j < r; j++)
+				{
+					int column = left + (int)j;
+					uint16_t h = HeightAt(band, row, column);
+					heights[i * r + j] = h;
+					lowest = std::min<uint16_t>(lowest, h);
+					highest = std::max<uint16_t>(highest, h);
+
+					// Tangent space normal, u along x and v down the rows like the
+					// shipped normal tiles.
+					float du = (HeightAt(band, row, column + 1) - HeightAt(band, row, column - 1)) * slopeScale;
+					float dv = (HeightAt(band, row + 1, column) - HeightAt(band, row - 1, column)) * slopeScale;
+					float length = std::sqrt(du * du + dv * dv + 1.0f);
+					normals[i * r + j] = (uint32_t)((-du / length * 0.5f + 0.5f) * 255.0f + 0.5f) |
+						(uint32_t)((-dv / length * 0.5f + 0.5f) * 255.0f + 0.5f) << 8 |
+						(uint32_t)((1.0f / length * 0.5f + 0.5f) * 255.0f + 0.5f) << 16 | 0xff000000u;
+
+					if (mAlbedo)
+						diffuse[i * r + j] = band.AlbedoRow((uint32_t)row)[column];
+					else
+						diffuse[i * r + j] = Shade(h / 65535.0f, 1.0f - 1.0f / length);
+				}
+			}
+			result.Min = lowest / 65535.0f;
+			result.Max = highest / 65535.0f;
+			if (band.Level > 0)
+				result.Error = ParentMeshError(band, x, y);
+			double tileMs = MsSince(start);
+
+			start = Clock::now();
+			uint32_t level = band.Level;
+			uint64_t bytes = WriteTile(TilePath(0, level, x, y), EncodeTerrainTile(std::move(heights), r));
+			uint64_t normalBytes = WriteTile(TilePath(1, level, x, y), EncodeTerrainTile(std::move(normals), r));
+			uint64_t diffuseBytes = WriteTile(TilePath(2, level, x, y), EncodeTerrainTile(std::move(diffuse), r));
+			if (bytes == 0 || normalBytes == 0 || diffuseBytes == 0)
+				mFailed = true;
+
+			mBytesWritten += bytes + normalBytes + diffuseBytes;
+			mTileUs += (long long)(tileMs * 1000.0);
+			mWriteUs += (long long)(MsSince(start) * 1000.0);
+			return result;
+		}
+
+		// Grass on flat ground, rock on steep slopes and snow on the tops, for sources
+		// without an albedo image. steepness is 0 for flat ground.
+		static uint32_t Shade(float height, float steepness)
+		{
+			const uint32_t grass = 0xff2a5c47, dirt = 0xff3a5a6e, rock = 0xff6b7378, snow = 0xffeeeae6;
+			uint32_t color = LerpColor(grass, dirt, std::min<float>(height * 2.0f, 1.0f));
+			color = LerpColor(color, rock, std::min<float>(std::max<float>((steepness - 0.1f) * 5.0f, 0.0f), 1.0f));
+			return LerpColor(color, snow, std::min<float>(std::max<float>((height - 0.75f) * 8.0f, 0.0f), 1.0f) * (1.0f - steepness));
+		}
+
+		void CutTileRow(const Band& band, uint32_t y)
+		{
+			std::vector<TileResult> results(band.Tiles);
+			mPool.ParallelFor(band.Tiles, [&](size_t x)
+			{
+				results[x] = CutTile(band, (uint32_t)x, y);
+			});
+			mStats.Tiles += band.Tiles;
+
+			// Children were cut before, so a tile's own record is complete here.
+			for (uint32_t x = 0; x < band.Tiles; x++)
+			{
+				uint32_t node = TerrainQuadTree::NodeIndex(band.Level, x, y);
+				TerrainNodeRecord& record = mRecords[node];
+				record.MinHeight = std::min<float>(record.MinHeight, results[x].Min);
+				record.MaxHeight = std::max<float>(record.MaxHeight, results[x].Max);
+				if (band.Level == 0)
+					continue;
+
+				TerrainNodeRecord& parent = mRecords[TerrainQuadTree::Parent(node, band.Level)];
+				parent.Error = std::max<float>(parent.Error, record.Error + results[x].Error);
+				parent.MinHeight = std::min<float>(parent.MinHeight, record.MinHeight);
+				parent.MaxHeight = std::max<float>(parent.MaxHeight, record.MaxHeight);
+			}
+		}
+
+		std::wstring mOutDir;
+		TerrainPyramidSettings mSettings;
+		uint32_t mResolution;
+		bool mAlbedo;
+		ThreadPool& mPool;
+		TerrainPyramidStats& mStats;
+		std::vector<Band> mLevels;
+		std::vector<TerrainNodeRecord> mRecords;
+		std::atomic<bool> mFailed{ false };
+		std::atomic<uint64_t> mBytesWritten{ 0 };
+		std::atomic<long long> mTileUs{ 0 };
+		std::atomic<long long> mWriteUs{ 0 };
+	};
+}
+
+std::vector<uint8_t> EncodeTerrainTile(std::vector<uint16_t> heights, uint32_t resolution)
+{
+	return EncodeTile(resolution, MipChain(std::move(heights), resolution, AverageHeight));
+}
+
+std::vector<uint8_t> EncodeTerrainTile(std::vector<uint32_t> colors, uint32_t resolution)
+{
+	return EncodeTile(resolution, MipChain(std::move(colors), resolution, AverageColor));
+}
+
+bool BuildTerrainPyramid(TerrainHeightSource& heights, TerrainAlbedoSource* albedo, const std::wstring& outDir,
+	const TerrainPyramidSettings& settings, ThreadPool& pool, TerrainPyramidStats* stats)
+{
+	auto wallStart = Clock::now();
+	TerrainPyramidStats result;
+
+	const uint32_t r = settings.TileResolution;
+	if (r < 2 || (r & (r - 1)) != 0 || heights.Width() < r || heights.Height() < r ||
+		(albedo && (albedo->Width() == 0 || albedo->Height() == 0)))
+		return false;
+
+	uint32_t levels = settings.Levels;
+	if (levels == 0)
+	{
+		uint32_t size = std::min<uint32_t>(heights.Width(), heights.Height());
+		while (levels < TerrainNodeFile::MaxLevels && ((uint64_t)r << levels) <= size)
+			levels++;
+	}
+	levels = std::min<uint32_t>(levels, TerrainNodeFile::MaxLevels);
+	const uint32_t finest = levels - 1;
+	const uint32_t width = r << finest;
+	result.Levels = levels;
+	result.SourceTexels = (uint64_t)heights.Width() * heights.Height();
+
+	CreateDirectoryW(outDir.c_str(), nullptr);
+	for (uint32_t level = 0; level < levels; level++)
+	{
+		std::wstring levelDir = outDir + L"/L" + std::to_wstring(level);
+		CreateDirectoryW(levelDir.c_str(), nullptr);
+		for (auto kind : TileKinds)
+			CreateDirectoryW((levelDir + L"/" + kind).c_str(), nullptr);
+	}
+
+	PyramidBuilder builder(outDir, settings, levels, albedo != nullptr, pool, result);
+
+	// The finest level is made a tile row at a time from the source rows under it.
+	ResampleTaps columns, rows, albedoColumns, albedoRows;
+	columns.Build(heights.Width(), width);
+	rows.Build(heights.Height(), width);
+	SourceWindow<TerrainHeightSource, uint16_t> heightWindow(heights);
+	std::unique_ptr<SourceWindow<TerrainAlbedoSource, uint32_t>> albedoWindow;
+	if (albedo)
+	{
+		albedoColumns.Build(albedo->Width(), width);
+		albedoRows.Build(albedo->Height(), width);
+		albedoWindow.reset(new SourceWindow<TerrainAlbedoSource, uint32_t>(*albedo));
+	}
+
+	std::vector<uint16_t> bandHeights((size_t)r * width);
+	std::vector<uint32_t> bandAlbedo(albedo ? bandHeights.size() : 0);
+	double readMs = 0.0, resampleMs = 0.0;
+	for (uint32_t tileRow = 0; tileRow < (1u << finest); tileRow++)
+	{
+		uint32_t first = tileRow * r, last = first + r - 1;
+
+		auto start = Clock::now();
+		if (!heightWindow.Cover(rows.First[first], rows.Second[last]) ||
+			(albedo && !albedoWindow->Cover(albedoRows.First[first], albedoRows.Second[last])))
+			return false;
+		readMs += MsSince(start);
+
+		start = Clock::now();
+		pool.ParallelFor(r, 8, [&](size_t i)
+		{
+			uint32_t row = first + (uint32_t)i;
+			const uint16_t* s0 = heightWindow.Row(rows.First[row]);
+			const uint16_t* s1 = heightWindow.Row(rows.Second[row]);
+			float wy = rows.Weight[row];
+			uint16_t* out = &bandHeights[i * width];
+			for (uint32_t x = 0; x < width; x++)
+			{
+				uint32_t c0 = columns.First[x], c1 = columns.Second[x];
+				float wx = columns.Weight[x];
+				float top = s0[c0] + (s0[c1] - (float)s0[c0]) * wx;
+				float bottom = s1[c0] + (s1[c1] - (float)s1[c0]) * wx;
+				out[x] = (uint16_t)(top + (bottom - top) * wy + 0.5f);
+			}
+
+			if (albedo)
+			{
+				const uint32_t* a0 = albedoWindow->Row(albedoRows.First[row]);
+				const uint32_t* a1 = albedoWindow->Row(albedoRows.Second[row]);
+				float ay = albedoRows.Weight[row];
+				uint32_t* outAlbedo = &bandAlbedo[i * width];
+				for (uint32_t x = 0; x < width; x++)
+				{
+					uint32_t c0 = albedoColumns.First[x], c1 = albedoColumns.Second[x];
+					float ax = albedoColumns.Weight[x];
+					outAlbedo[x] = LerpColor(LerpColor(a0[c0], a0[c1], ax), LerpColor(a1[c0], a1[c1], ax), ay);
+				}
+			}
+		});
+		resampleMs += MsSince(start);
+
+		builder.PushFinest(bandHeights.data(), albedo ? bandAlbedo.data() : nullptr, r);
+		if (builder.Failed())
+			return false;
+
+		size_t bytes = builder.BandBytes() + heightWindow.Bytes() + (albedoWindow ? albedoWindow->Bytes() : 0) +
+			bandHeights.capacity() * sizeof(uint16_t) + bandAlbedo.capacity() * sizeof(uint32_t);
+		result.PeakBandBytes = std::max<size_t>(result.PeakBandBytes, bytes);
+	}
+
+	bool written = TerrainNodeFile::Write(outDir + L"/nodes.bin", levels, builder.Records());
+
+	result.ReadMs = readMs;
+	result.ResampleMs = resampleMs;
+	builder.FinishStats();
+	result.WallMs = MsSince(wallStart);
+	if (stats)
+		*stats = result;
+	return written;
+}
+
+namespace
+{
+	// Rows of an image decoded by WIC, converted to format.
+	class WicRows
+	{
+	public:
+		bool Open(const std::wstring& filename, REFWICPixelFormatGUID format)
+		{
+			ComPtr<IWICImagingFactory> factory;
+			if (FAILED(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory))))
+				return false;
+
+			ComPtr<IWICBitmapDecoder> decoder;
+			if (FAILED(factory->CreateDecoderFromFilename(filename.c_str(), nullptr, GENERIC_READ,
+				WICDecodeMetadataCacheOnDemand, &decoder)))
+				return false;
+
+			ComPtr<IWICBitmapFrameDecode> frame;
+			if (FAILED(decoder->GetFrame(0, &frame)))
+				return false;
+
+			ComPtr<IWICFormatConverter> converter;
+			if (FAILED(factory->CreateFormatConverter(&converter)) ||
+				FAILED(converter->Initialize(frame.Get(), format, WICBitmapDitherTypeNone, nullptr, 0.0, WICBitmapPaletteTypeCustom)))
+				return false;
+
+			UINT width = 0, height = 0;
+			if (FAILED(converter->GetSize(&width, &height)))
+				return false;
+
+			mSource = converter;
+			mWidth = width;
+			mHeight = height;
+			return true;
+		}
+
+		bool Read(uint32_t first, uint32_t count, uint32_t bytesPerTexel, void* texels)
+		{
+			WICRect rect = { 0, (INT)first, (INT)mWidth, (INT)count };
+			UINT stride = mWidth * bytesPerTexel;
+			return SUCCEEDED(mSource->CopyPixels(&rect, stride, stride * count, (BYTE*)texels));
+		}
+
+		uint32_t mWidth = 0;
+		uint32_t mHeight = 0;
+
+	private:
+		ComPtr<IWICBitmapSource> mSource;
+	};
+
+	class WicHeightSource : public TerrainHeightSource
+	{
+	public:
+		bool Open(const std::wstring& filename) { return mRows.Open(filename, GUID_WICPixelFormat16bppGray); }
+		uint32_t Width() const override { return mRows.mWidth; }
+		uint32_t Height() const override { return mRows.mHeight; }
+		bool ReadRows(uint32_t first, uint32_t count, uint16_t* texels) override { return mRows.Read(first, count, 2, texels); }
+
+	private:
+		WicRows mRows;
+	};
+
+	class WicAlbedoSource : public TerrainAlbedoSource
+	{
+	public:
+		bool Open(const std::wstring& filename) { return mRows.Open(filename, GUID_WICPixelFormat32bppRGBA); }
+		uint32_t Width() const override { return mRows.mWidth; }
+		uint32_t Height() const override { return mRows.mHeight; }
+		bool ReadRows(uint32_t first, uint32_t count, uint32_t* texels) override { return mRows.Read(first, count, 4, texels); }
+
+	private:
+		WicRows mRows;
+	};
+
+	bool IsRawHeightmap(const std::wstring& filename)
+	{
+		size_t dot = filename.find_last_of(L'.');
+		if (dot == std::wstring::npos)
+			return false;
+		std::wstring ext = filename.substr(dot);
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+		return ext == L".raw" || ext == L".r16";
+	}
+}
+
+std::unique_ptr<TerrainHeightSource> OpenTerrainHeightSource(const std::wstring& filename, uint32_t width, uint32_t height)
+{
+	if (IsRawHeightmap(filename))
+	{
+		std::unique_ptr<RawHeightSource> raw(new RawHeightSource());
+		if (!raw->Open(filename, width, height))
+			return nullptr;
+		return std::move(raw);
+	}
+
+	std::unique_ptr<WicHeightSource> image(new WicHeightSource());
+	if (!image->Open(filename))
+		return nullptr;
+	return std::move(image);
+}
+
+std::unique_ptr<TerrainAlbedoSource> OpenTerrainAlbedoSource(const std::wstring& filename)
+{
+	std::unique_ptr<WicAlbedoSource> image(new WicAlbedoSource());
+	if (!image->Open(filename))
+		return nullptr;
+	return std::move(image);
+}
+
+bool RunTerrainPyramidTool(const std::string& commandLine)
+{
+	std::istringstream args(commandLine);
+	std::string arg, source, albedoName, dir = "../Textures/Terrain";
+	TerrainPyramidSettings settings;
+	uint32_t width = 0, height = 0;
+	bool requested = false;
+	while (args >> arg)
+	{
+		if (arg == "-terrain-build")
+		{
+			requested = true;
+			args >> source;
+		}
+		else if (arg == "-albedo")
+			args >> albedoName;
+		else if (arg == "-out")
+			args >> dir;
+		else if (arg == "-levels")
+			args >> settings.Levels;
+		else if (arg == "-size")
+			args >> width >> height;
+	}
+
+	if (!requested)
+		return false;
+
+	HRESULT hrCo = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+	std::string report;
+	std::unique_ptr<TerrainHeightSource> heights = OpenTerrainHeightSource(AnsiToWString(source), width, height);
+	std::unique_ptr<TerrainAlbedoSource> albedo;
+	if (!albedoName.empty())
+		albedo = OpenTerrainAlbedoSource(AnsiToWString(albedoName));
+
+	if (!heights)
+		report = "TerrainPyramidBuilder: can't read " + source + "\n";
+	else if (!albedoName.empty() && !albedo)
+		report = "TerrainPyramidBuilder: can't read " + albedoName + "\n";
+	else
+	{
+		ThreadPool pool;
+		TerrainPyramidStats stats;
+		if (BuildTerrainPyramid(*heights, albedo.get(), AnsiToWString(dir), settings, pool, &stats))
+		{
+			char line[256];
+			sprintf_s(line, "TerrainPyramidBuilder: %u levels, %u tiles written to %s in %.0f ms, %.1f MB peak band memory\n",
+				stats.Levels, stats.Tiles, dir.c_str(), stats.WallMs, stats.PeakBandBytes / (1024.0 * 1024.0));
+			report = line;
+		}
+		else
+			report = "TerrainPyramidBuilder: failed to build " + dir + "\n";
+	}
+	OutputDebugStringA(report.c_str());
+
+	if (SUCCEEDED(hrCo))
+		CoUninitialize();
+	return true;
+}
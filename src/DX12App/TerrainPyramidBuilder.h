@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// Rows of a 16 bit heightmap, read from the top (the terrain's +z edge) down. The
+// builder asks for every row once, in order.
+class TerrainHeightSource
+{
+public:
+	virtual ~TerrainHeightSource() {}
+	virtual uint32_t Width() const = 0;
+	virtual uint32_t Height() const = 0;
+	// Rows [first, first + count), Width() texels each.
+	virtual bool ReadRows(uint32_t first, uint32_t count, uint16_t* texels) = 0;
+};
+
+// Same for an 8 bit RGBA albedo image, one uint32_t per texel with red in the low byte.
+class TerrainAlbedoSource
+{
+public:
+	virtual ~TerrainAlbedoSource() {}
+	virtual uint32_t Width() const = 0;
+	virtual uint32_t Height() const = 0;
+	virtual bool ReadRows(uint32_t first, uint32_t count, uint32_t* texels) = 0;
+};
+
+// .raw/.r16 files are little endian 16 bit texels without a header; width and height
+// of 0 take a square from the file size. Anything else is decoded with WIC (PNG, TIFF,
+// ...) and converted to 16 bit gray. Null if the file can't be opened.
+std::unique_ptr<TerrainHeightSource> OpenTerrainHeightSource(const std::wstring& filename, uint32_t width = 0, uint32_t height = 0);
+std::unique_ptr<TerrainAlbedoSource> OpenTerrainAlbedoSource(const std::wstring& filename);
+
+struct TerrainPyramidSettings
+{
+	// Texels along a tile edge, on every level.
+	uint32_t TileResolution = 128;
+	// 0 takes as many levels as the source has texels for: the finest level is the
+	// largest TileResolution << (levels - 1) that fits in the source.
+	uint32_t Levels = 0;
+	// World size of the terrain and of the full 16 bit height range, for the slopes of
+	// the normal maps. The defaults are what DX12App draws the terrain with.
+	float RootSize = 1024.0f;
+	float HeightScale = 250.0f;
+};
+
+// Per-stage times are summed over all threads, WallMs is the elapsed time of the call.
+struct TerrainPyramidStats
+{
+	uint32_t Levels = 0;
+	uint32_t Tiles = 0;
+	uint64_t SourceTexels = 0;
+	uint64_t BytesWritten = 0;
+	// Most texel memory held at once: source rows and the band of every level.
+	size_t PeakBandBytes = 0;
+	double ReadMs = 0.0;
+	double ResampleMs = 0.0;
+	double TileMs = 0.0;
+	double WriteMs = 0.0;
+	double WallMs = 0.0;
+};
+
+// Cuts a heightmap (and optionally an albedo image) of any size into the terrain
+// tile pyramid DX12App pages in: <outDir>/L{L}/{height,normal,diffuse}/
+// tile_{kind}_level{L}_{x}_{y}.dds with full mip chains, in the formats of the
+// shipped tiles, and <outDir>/nodes.bin with the per-node error and height range.
+//
+// The source is resampled to the finest level and streamed through in bands of one
+// tile row. Every level keeps a single band, plus two rows on either side for the
+// normals and the error of the level above; each finished band is cut into tiles on
+// the pool, and pairs of its rows are averaged into the rows of the next coarser
+// level. Memory grows with the width of the source, not with its size.
+//
+// Height ranges are the exact min/max pyramid. A node's error is its mesh against
+// its children's plus the largest error of the children, which bounds the error
+// against the finest level that BuildTerrainNodeFile measures from above (and is
+// equal to it one level above the finest).
+//
+// Without an albedo image the diffuse tiles are shaded from height and slope.
+bool BuildTerrainPyramid(TerrainHeightSource& heights, TerrainAlbedoSource* albedo, const std::wstring& outDir,
+	const TerrainPyramidSettings& settings, ThreadPool& pool, TerrainPyramidStats* stats = nullptr);
+
+// A square tile as a DDS file in the format of the shipped tiles, with a box filtered
+// mip chain below the given texels: 16 bit luminance heights, or 32 bit RGBA normals
+// and diffuse colors.
+std::vector<uint8_t> EncodeTerrainTile(std::vector<uint16_t> heights, uint32_t resolution);
+std::vector<uint8_t> EncodeTerrainTile(std::vector<uint32_t> colors, uint32_t resolution);
+
+// "-terrain-build <heightmap> [-albedo <image>] [-out <dir>] [-levels <n>] [-size <w> <h>]"
+// on the command line builds a terrain pyramid (default ../Textures/Terrain). Returns
+// false when the command line doesn't ask for it.
+bool RunTerrainPyramidTool(const std::string& commandLine);
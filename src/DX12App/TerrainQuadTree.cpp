@@ -0,0 +1,261 @@
+#include "TerrainQuadTree.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace DirectX;
+
+namespace
+{
+	// Spreads the low 16 bits of v to the even bits.
+	uint32_t SpreadBits(uint32_t v)
+	{
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+
+	uint32_t CompactBits(uint32_t v)
+	{
+		v &= 0x55555555;
+		v = (v | (v >> 1)) & 0x33333333;
+		v = (v | (v >> 2)) & 0x0f0f0f0f;
+		v = (v | (v >> 4)) & 0x00ff00ff;
+		v = (v | (v >> 8)) & 0x0000ffff;
+		return v;
+	}
+}
+
+uint32_t TerrainQuadTree::MortonEncode(uint32_t x, uint32_t y)
+{
+	return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+void TerrainQuadTree::MortonDecode(uint32_t code, uint32_t& x, uint32_t& y)
+{
+	x = CompactBits(code);
+	y = CompactBits(code >> 1);
+}
+
+uint32_t TerrainQuadTree::LevelOf(uint32_t node)
+{
+	uint32_t level = 0;
+	while (node >= LevelOffset(level + 1))
+		level++;
+	return level;
+}
+
+void TerrainQuadTree::Build(uint32_t depth, float rootSize, float centerX, float centerZ, float minY, float maxY)
+{
+	mDepth = depth;
+	mRootSize = rootSize;
+	mLeft = centerX - 0.5f * rootSize;
+	mTop = centerZ + 0.5f * rootSize;
+	mMinY = minY;
+	mMaxY = maxY;
+
+	mPages.clear();
+	mPages.resize(depth);
+	mExtentXZ.resize(depth);
+	for (uint32_t level = 0; level < depth; level++)
+	{
+		mPages[level].resize(((LevelWidth(level) * LevelWidth(level)) + PageSize - 1) >> PageShift);
+		mExtentXZ[level] = 0.5f * TileSize(level);
+	}
+
+	mNodeCount = 0;
+	mPageCount = 0;
+	mVersion++;
+}
+
+const TerrainQuadTree::Page* TerrainQuadTree::FindPage(uint32_t node, uint32_t level, uint32_t& slot) const
+{
+	uint32_t code = node - LevelOffset(level);
+	slot = code & (PageSize - 1);
+	return mPages[level][code >> PageShift].get();
+}
+
+TerrainQuadTree::Page& TerrainQuadTree::GetPage(uint32_t node, uint32_t& slot)
+{
+	uint32_t level = LevelOf(node);
+	uint32_t code = node - LevelOffset(level);
+	slot = code & (PageSize - 1);
+	return *mPages[level][code >> PageShift];
+}
+
+const TerrainQuadTree::Page& TerrainQuadTree::GetPage(uint32_t node, uint32_t& slot) const
+{
+	return *FindPage(node, LevelOf(node), slot);
+}
+
+void TerrainQuadTree::CreateNode(uint32_t node, uint32_t level, float error)
+{
+	uint32_t code = node - LevelOffset(level);
+	std::unique_ptr<Page>& page = mPages[level][code >> PageShift];
+	if (!page)
+	{
+		page.reset(new Page());
+		mPageCount++;
+	}
+
+	uint32_t slot = code & (PageSize - 1);
+	if (page->Present & (1ull << slot))
+		return;
+
+	uint32_t x, y;
+	MortonDecode(code, x, y);
+	float size = TileSize(level);
+	page->CenterX[slot] = mLeft + (x + 0.5f) * size;
+	page->CenterZ[slot] = mTop - (y + 0.5f) * size;
+	page->CenterY[slot] = 0.5f * (mMinY + mMaxY);
+	page->ExtentY[slot] = 0.5f * (mMaxY - mMinY);
+	page->Error[slot] = error;
+	page->Present |= 1ull << slot;
+	mNodeCount++;
+	mVersion++;
+}
+
+void TerrainQuadTree::DestroyNode(uint32_t node, uint32_t level)
+{
+	uint32_t code = node - LevelOffset(level);
+	std::unique_ptr<Page>& page = mPages[level][code >> PageShift];
+	uint64_t bit = 1ull << (code & (PageSize - 1));
+	if (!page || !(page->Present & bit))
+		return;
+
+	page->Present &= ~bit;
+	mNodeCount--;
+	mVersion++;
+	if (page->Present == 0)
+	{
+		page.reset();
+		mPageCount--;
+	}
+}
+
+bool TerrainQuadTree::HasNode(uint32_t node, uint32_t level) const
+{
+	if (level >= mDepth)
+		return false;
+
+	uint32_t slot;
+	const Page* page = FindPage(node, level, slot);
+	return page && (page->Present & (1ull << slot));
+}
+
+bool TerrainQuadTree::HasChildren(uint32_t node, uint32_t level) const
+{
+	if (level + 1 >= mDepth)
+		return false;
+
+	// Siblings are four aligned slots of one page.
+	uint32_t slot;
+	const Page* page = FindPage(FirstChild(node, level), level + 1, slot);
+	return page && ((page->Present >> slot) & 0xf) == 0xf;
+}
+
+size_t TerrainQuadTree::MemoryBytes() const
+{
+	size_t bytes = mPageCount * sizeof(Page);
+	for (auto& level : mPages)
+		bytes += level.capacity() * sizeof(level[0]);
+	return bytes;
+}
+
+void TerrainQuadTree::SetHeightRange(uint32_t node, float minY, float maxY)
+{
+	uint32_t slot;
+	Page& page = GetPage(node, slot);
+	page.CenterY[slot] = 0.5f * (minY + maxY);
+	page.ExtentY[slot] = 0.5f * (maxY - minY);
+	mVersion++;
+}
+
+BoundingBox TerrainQuadTree::Bounds(uint32_t node) const
+{
+	uint32_t slot;
+	const Page& page = GetPage(node, slot);
+	float extentXZ = mExtentXZ[LevelOf(node)];
+	return BoundingBox(XMFLOAT3(page.CenterX[slot], page.CenterY[slot], page.CenterZ[slot]), XMFLOAT3(extentXZ, page.ExtentY[slot], extentXZ));
+}
+
+XMFLOAT3 TerrainQuadTree::Center(uint32_t node) const
+{
+	uint32_t slot;
+	const Page& page = GetPage(node, slot);
+	return XMFLOAT3(page.CenterX[slot], page.CenterY[slot], page.CenterZ[slot]);
+}
+
+void TerrainQuadTree::SetGeometricError(uint32_t node, float error)
+{
+	uint32_t slot;
+	GetPage(node, slot).Error[slot] = error;
+}
+
+float TerrainQuadTree::GeometricError(uint32_t node) const
+{
+	uint32_t slot;
+	return GetPage(node, slot).Error[slot];
+}
+
+float TerrainQuadTree::DistanceToBounds(uint32_t node, uint32_t level, const XMFLOAT3& eye) const
+{
+	uint32_t slot;
+	const Page& page = *FindPage(node, level, slot);
+	float dx = std::max(std::fabs(eye.x - page.CenterX[slot]) - mExtentXZ[level], 0.0f);
+	float dy = std::max(std::fabs(eye.y - page.CenterY[slot]) - page.ExtentY[slot], 0.0f);
+	float dz = std::max(std::fabs(eye.z - page.CenterZ[slot]) - mExtentXZ[level], 0.0f);
+	return std::sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+void TerrainQuadTree::Select(const BoundingFrustum& frustum, FXMVECTOR eye, const RefineFunc& refine,
+	std::vector<Selected>& selected, std::vector<Selected>* wanted) const
+{
+	if (!HasNode(0, 0))
+		return;
+
+	mStack.clear();
+	mStack.push_back({ 0, 0 });
+
+	while (!mStack.empty())
+	{
+		Selected top = mStack.back();
+		mStack.pop_back();
+
+		uint32_t slot;
+		const Page& page = *FindPage(top.Node, top.Level, slot);
+		float extentXZ = mExtentXZ[top.Level];
+		BoundingBox box(XMFLOAT3(page.CenterX[slot], page.CenterY[slot], page.CenterZ[slot]), XMFLOAT3(extentXZ, page.ExtentY[slot], extentXZ));
+		if (!frustum.Intersects(box))
+			continue;
+
+		bool leaf = top.Level + 1 >= mDepth;
+		if (!leaf)
+		{
+			XMVECTOR outside = XMVectorMax(XMVectorSubtract(XMVectorAbs(XMVectorSubtract(eye, XMLoadFloat3(&box.Center))),
+				XMLoadFloat3(&box.Extents)), XMVectorZero());
+			float distance = XMVectorGetX(XMVector3Length(outside));
+			leaf = !refine(top.Node, top.Level, distance);
+			if (!leaf && !HasChildren(top.Node, top.Level))
+			{
+				if (wanted)
+					wanted->push_back(top);
+				leaf = true;
+			}
+		}
+
+		if (leaf)
+		{
+			selected.push_back(top);
+			continue;
+		}
+
+		// Pushed in reverse so they pop in index order.
+		uint32_t child = FirstChild(top.Node, top.Level);
+		for (int i = 3; i >= 0; i--)
+			mStack.push_back({ child + i, top.Level + 1 });
+	}
+}
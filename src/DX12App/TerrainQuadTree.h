@@ -0,0 +1,131 @@
+#pragma once
+
+#include <DirectXCollision.h>
+#include <DirectXMath.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Quadtree over a square terrain, addressed without pointers. Node indices follow
+// the layout of a complete tree stored level by level (root first) and in Morton
+// order inside a level: the children of a node are the four consecutive indices
+// at 4 * its Morton code on the next level, and whole subtrees stay close together.
+//
+// Only created nodes take memory. Storage is split into pages of PageSize
+// consecutive indices of one level, allocated with their first node and freed with
+// their last, and inside a page the bounds live in separate center/extent arrays
+// that the traversal walks without touching anything else. A deep tree therefore
+// costs what its created nodes cost, plus a pointer per possible page.
+//
+// Tile coordinates follow the terrain texture tiles: x grows with world x,
+// y grows towards -z, (0, 0) is the tile at the -x/+z corner.
+class TerrainQuadTree
+{
+public:
+	struct Selected
+	{
+		uint32_t Node;
+		uint32_t Level;
+	};
+
+	// Called for every visible node that has children, with the distance from the
+	// eye to the node bounds, 0 inside them. Returning true selects the children instead.
+	typedef std::function<bool(uint32_t node, uint32_t level, float distance)> RefineFunc;
+
+	// 8 x 8 tiles of one level.
+	static const uint32_t PageShift = 6;
+	static const uint32_t PageSize = 1u << PageShift;
+
+	// depth is the number of levels, the leaves are on level depth - 1. Nodes are
+	// created with the height range [minY, maxY]. Starts without any node.
+	void Build(uint32_t depth, float rootSize, float centerX, float centerZ, float minY, float maxY);
+
+	uint32_t Depth() const { return mDepth; }
+	float RootSize() const { return mRootSize; }
+	// Height range of the whole terrain, as given to Build.
+	float MinY() const { return mMinY; }
+	float MaxY() const { return mMaxY; }
+
+	static uint32_t LevelOffset(uint32_t level) { return ((1u << (2 * level)) - 1) / 3; }
+	static uint32_t LevelWidth(uint32_t level) { return 1u << level; }
+	static uint32_t MortonEncode(uint32_t x, uint32_t y);
+	static void MortonDecode(uint32_t code, uint32_t& x, uint32_t& y);
+
+	static uint32_t NodeIndex(uint32_t level, uint32_t x, uint32_t y) { return LevelOffset(level) + MortonEncode(x, y); }
+	static uint32_t FirstChild(uint32_t node, uint32_t level) { return LevelOffset(level + 1) + 4 * (node - LevelOffset(level)); }
+	static uint32_t Parent(uint32_t node, uint32_t level) { return LevelOffset(level - 1) + ((node - LevelOffset(level)) >> 2); }
+	static uint32_t LevelOf(uint32_t node);
+	static void TileCoords(uint32_t node, uint32_t level, uint32_t& x, uint32_t& y) { MortonDecode(node - LevelOffset(level), x, y); }
+
+	// Size of a tile edge on the given level.
+	float TileSize(uint32_t level) const { return mRootSize / LevelWidth(level); }
+
+	// error is the node's geometric error, see GeometricError.
+	void CreateNode(uint32_t node, uint32_t level, float error = 0.0f);
+	void DestroyNode(uint32_t node, uint32_t level);
+	bool HasNode(uint32_t node, uint32_t level) const;
+	// True when all four children exist.
+	bool HasChildren(uint32_t node, uint32_t level) const;
+
+	// Created nodes and the memory they and the page tables take.
+	size_t NodeCount() const { return mNodeCount; }
+	size_t PageCount() const { return mPageCount; }
+	size_t MemoryBytes() const;
+	// Changes whenever a node is created or destroyed or its bounds change.
+	uint64_t Version() const { return mVersion; }
+
+	// Accessors of created nodes.
+	void SetHeightRange(uint32_t node, float minY, float maxY);
+	DirectX::BoundingBox Bounds(uint32_t node) const;
+	DirectX::XMFLOAT3 Center(uint32_t node) const;
+
+	// Largest height difference, in world units, between the node's mesh and the
+	// finest data below it.
+	void SetGeometricError(uint32_t node, float error);
+	float GeometricError(uint32_t node) const;
+
+	// Distance from eye to the closest point of the node bounds, 0 inside them.
+	float DistanceToBounds(uint32_t node, uint32_t level, const DirectX::XMFLOAT3& eye) const;
+
+	// Walks the created nodes with an explicit stack and appends the nodes to draw to
+	// selected: nodes outside the frustum are dropped, leaves and nodes refine rejects
+	// are kept. A node refine accepts but whose children don't exist yet is kept too
+	// and also appended to wanted, if given. Children are visited in index order, so
+	// the output is ordered the same way every frame.
+	void Select(const DirectX::BoundingFrustum& frustum, DirectX::FXMVECTOR eye, const RefineFunc& refine,
+		std::vector<Selected>& selected, std::vector<Selected>* wanted = nullptr) const;
+
+private:
+	struct Page
+	{
+		float CenterX[PageSize];
+		float CenterY[PageSize];
+		float CenterZ[PageSize];
+		float ExtentY[PageSize];
+		float Error[PageSize];
+		uint64_t Present = 0;
+	};
+
+	const Page* FindPage(uint32_t node, uint32_t level, uint32_t& slot) const;
+	Page& GetPage(uint32_t node, uint32_t& slot);
+	const Page& GetPage(uint32_t node, uint32_t& slot) const;
+
+	uint32_t mDepth = 0;
+	float mRootSize = 0.0f;
+	float mLeft = 0.0f;
+	float mTop = 0.0f;
+	float mMinY = 0.0f;
+	float mMaxY = 0.0f;
+
+	// Per level, pages by Morton code >> PageShift.
+	std::vector<std::vector<std::unique_ptr<Page>>> mPages;
+	// Horizontal extents only depend on the level.
+	std::vector<float> mExtentXZ;
+	size_t mNodeCount = 0;
+	size_t mPageCount = 0;
+	uint64_t mVersion = 0;
+
+	mutable std::vector<Selected> mStack;
+};
@@ -0,0 +1,292 @@
+#include "TextureCache.h"
+
+#include <algorithm>
+#include <fstream>
+
+uint64_t TextureCache::HashBytes(const uint8_t* data, size_t size, uint64_t seed)
+{
+	// 64-bit FNV-1a
+	uint64_t hash = seed;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+TextureFingerprint TextureCache::FingerprintMemory(const uint8_t* data, size_t size)
+{
+	TextureFingerprint fingerprint;
+	fingerprint.FileSize = size;
+
+	if (size <= FullHashLimit)
+	{
+		fingerprint.Hash = HashBytes(data, size);
+		return fingerprint;
+	}
+
+	uint64_t hash = HashBytes(data, HeaderBytes);
+	uint64_t stride = (size - HeaderBytes - SampleBytes) / (SampleCount - 1);
+	for (uint32_t i = 0; i < SampleCount; i++)
+		hash = HashBytes(data + HeaderBytes + i * stride, SampleBytes, hash);
+
+	fingerprint.Hash = hash;
+	return fingerprint;
+}
+
+bool TextureCache::FingerprintFile(const std::wstring& filename, TextureFingerprint& fingerprint)
+{
+	std::ifstream fin(filename, std::ios::binary);
+	if (!fin)
+		return false;
+
+	fin.seekg(0, std::ios_base::end);
+	uint64_t size = (uint64_t)fin.tellg();
+	fin.seekg(0, std::ios_base::beg);
+
+	std::vector<uint8_t> data;
+	if (size <= FullHashLimit)
+	{
+		data.resize((size_t)size);
+		fin.read((char*)data.data(), size);
+		if (!fin)
+			return false;
+
+		fingerprint = FingerprintMemory(data.data(), data.size());
+		return true;
+	}
+
+	// Large file: read only the bytes FingerprintMemory would look at.
+	data.resize(HeaderBytes + SampleBytes);
+	fin.read((char*)data.data(), HeaderBytes);
+
+	uint64_t hash = HashBytes(data.data(), HeaderBytes);
+	uint64_t stride = (size - HeaderBytes - SampleBytes) / (SampleCount - 1);
+	for (uint32_t i = 0; i < SampleCount; i++)
+	{
+		fin.seekg(HeaderBytes + i * stride, std::ios_base::beg);
+		fin.read((char*)data.data(), SampleBytes);
+		hash = HashBytes(data.data(), SampleBytes, hash);
+	}
+	if (!fin)
+		return false;
+
+	fingerprint.Hash = hash;
+	fingerprint.FileSize = size;
+	return true;
+}
+
+bool TextureCache::FingerprintFileContents(const std::wstring& filename, TextureFingerprint& fingerprint)
+{
+	std::ifstream fin(filename, std::ios::binary);
+	if (!fin)
+		return false;
+
+	// FNV-1a carries over from chunk to chunk, so this is HashBytes of the whole file.
+	std::vector<uint8_t> chunk(1 << 20);
+	uint64_t hash = 14695981039346656037ull;
+	uint64_t size = 0;
+	while (fin)
+	{
+		fin.read((char*)chunk.data(), chunk.size());
+		size_t read = (size_t)fin.gcount();
+		hash = HashBytes(chunk.data(), read, hash);
+		size += read;
+	}
+	if (fin.bad())
+		return false;
+
+	fingerprint = TextureFingerprint();
+	fingerprint.Hash = hash;
+	fingerprint.FileSize = size;
+	return true;
+}
+
+int TextureCache::Acquire(const TextureFingerprint& fingerprint, bool& isNew)
+{
+	int entry = Find(fingerprint, nullptr);
+	isNew = entry < 0;
+	if (isNew)
+		entry = AddEntry(fingerprint);
+	else
+		mEntries[entry].RefCount++;
+	return entry;
+}
+
+int TextureCache::AcquireFile(const std::wstring& filename, uint64_t maxSize, bool& isNew)
+{
+	isNew = true;
+	TextureFingerprint fingerprint;
+	if (!FingerprintFile(filename, fingerprint))
+		return -1;
+	fingerprint.MaxSize = maxSize;
+
+	// The whole file is only read when a sampled fingerprint has a candidate.
+	uint64_t contentHash = 0;
+	bool sampled = fingerprint.FileSize > FullHashLimit && Find(fingerprint, nullptr) >= 0;
+	if (sampled)
+	{
+		TextureFingerprint contents;
+		if (!FingerprintFileContents(filename, contents))
+			return -1;
+		contentHash = contents.Hash;
+	}
+
+	int entry = Find(fingerprint, sampled ? &contentHash : nullptr);
+	isNew = entry < 0;
+	if (!isNew)
+	{
+		mEntries[entry].RefCount++;
+		return entry;
+	}
+
+	entry = AddEntry(fingerprint);
+	mEntries[entry].Filename = filename;
+	mEntries[entry].ContentHash = contentHash;
+	mEntries[entry].HasContentHash = sampled;
+	return entry;
+}
+
+int TextureCache::AcquireMemory(const uint8_t* data, size_t size, uint64_t maxSize, bool& isNew)
+{
+	TextureFingerprint fingerprint = FingerprintMemory(data, size);
+	fingerprint.MaxSize = maxSize;
+
+	// Memory can't be hashed later, so sampled entries get their hash right away.
+	bool sampled = size > FullHashLimit;
+	uint64_t contentHash = sampled ? HashBytes(data, size) : 0;
+
+	int entry = Find(fingerprint, sampled ? &contentHash : nullptr);
+	isNew = entry < 0;
+	if (!isNew)
+	{
+		mEntries[entry].RefCount++;
+		return entry;
+	}
+
+	entry = AddEntry(fingerprint);
+	mEntries[entry].ContentHash = contentHash;
+	mEntries[entry].HasContentHash = sampled;
+	return entry;
+}
+
+int TextureCache::Find(const TextureFingerprint& fingerprint, const uint64_t* contentHash)
+{
+	auto bucket = mLookup.find(fingerprint.Hash);
+	if (bucket == mLookup.end())
+		return -1;
+
+	for (int entry : bucket->second)
+	{
+		Entry& e = mEntries[entry];
+		if (!(e.Fingerprint == fingerprint))
+			continue;
+
+		uint64_t hash;
+		if (!contentHash || (EntryContentHash(e, hash) && hash == *contentHash))
+			return entry;
+	}
+	return -1;
+}
+
+int TextureCache::AddEntry(const TextureFingerprint& fingerprint)
+{
+	int entry;
+	if (!mFreeEntries.empty())
+	{
+		entry = mFreeEntries.back();
+		mFreeEntries.pop_back();
+	}
+	else
+	{
+		entry = (int)mEntries.size();
+		mEntries.emplace_back();
+	}
+
+	mEntries[entry] = Entry();
+	mEntries[entry].Fingerprint = fingerprint;
+	mEntries[entry].RefCount = 1;
+	mLookup[fingerprint.Hash].push_back(entry);
+	return entry;
+}
+
+bool TextureCache::EntryContentHash(Entry& entry, uint64_t& hash)
+{
+	if (!entry.HasContentHash)
+	{
+		TextureFingerprint contents;
+		if (entry.Filename.empty() || !FingerprintFileContents(entry.Filename, contents))
+			return false;
+		entry.ContentHash = contents.Hash;
+		entry.HasContentHash = true;
+	}
+
+	hash = entry.ContentHash;
+	return true;
+}
+
+bool TextureCache::Release(int entry)
+{
+	if (entry < 0 || entry >= (int)mEntries.size() || mEntries[entry].RefCount == 0)
+		return false;
+
+	if (--mEntries[entry].RefCount > 0)
+		return false;
+
+	auto& bucket = mLookup[mEntries[entry].Fingerprint.Hash];
+	bucket.erase(std::remove(bucket.begin(), bucket.end(), entry), bucket.end());
+	if (bucket.empty())
+		mLookup.erase(mEntries[entry].Fingerprint.Hash);
+
+	mFreeEntries.push_back(entry);
+	return true;
+}
+
+void TextureCache::SetByteSize(int entry, uint64_t byteSize)
+{
+	if (entry >= 0 && entry < (int)mEntries.size())
+		mEntries[entry].ByteSize = byteSize;
+}
+
+int TextureCache::RefCount(int entry) const
+{
+	if (entry < 0 || entry >= (int)mEntries.size())
+		return 0;
+	return mEntries[entry].RefCount;
+}
+
+size_t TextureCache::UniqueCount() const
+{
+	size_t count = 0;
+	for (auto& e : mEntries)
+		if (e.RefCount > 0)
+			count++;
+	return count;
+}
+
+size_t TextureCache::RequestCount() const
+{
+	size_t count = 0;
+	for (auto& e : mEntries)
+		count += e.RefCount;
+	return count;
+}
+
+uint64_t TextureCache::BytesLoaded() const
+{
+	uint64_t bytes = 0;
+	for (auto& e : mEntries)
+		if (e.RefCount > 0)
+			bytes += e.ByteSize;
+	return bytes;
+}
+
+uint64_t TextureCache::BytesSaved() const
+{
+	uint64_t bytes = 0;
+	for (auto& e : mEntries)
+		if (e.RefCount > 1)
+			bytes += e.ByteSize * (e.RefCount - 1);
+	return bytes;
+}
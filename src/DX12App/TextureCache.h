@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Identifies texture contents independently of the file name, so byte-identical
+// files can share one GPU resource and one SRV.
+struct TextureFingerprint
+{
+	uint64_t Hash = 0;
+	uint64_t FileSize = 0;
+	// Mip budget the resource is loaded with; the same file at another budget is another resource.
+	uint64_t MaxSize = 0;
+
+	bool operator==(const TextureFingerprint& rhs) const
+	{
+		return Hash == rhs.Hash && FileSize == rhs.FileSize && MaxSize == rhs.MaxSize;
+	}
+};
+
+// Content-addressed bookkeeping for loaded textures. It knows nothing about D3D:
+// the caller keeps the actual resources and uses the entry id to find them.
+class TextureCache
+{
+public:
+	// Files up to this size are hashed completely; bigger ones are fingerprinted
+	// from the header plus evenly spaced samples of the payload.
+	static const uint64_t FullHashLimit = 4ull * 1024 * 1024;
+	static const uint32_t HeaderBytes = 148;
+	static const uint32_t SampleCount = 64;
+	static const uint32_t SampleBytes = 256;
+
+	static uint64_t HashBytes(const uint8_t* data, size_t size, uint64_t seed = 14695981039346656037ull);
+	static TextureFingerprint FingerprintMemory(const uint8_t* data, size_t size);
+	static bool FingerprintFile(const std::wstring& filename, TextureFingerprint& fingerprint);
+	// Hashes every byte of the file whatever its size, for keys that have to tell any
+	// two files apart, such as the names of transcoded files.
+	static bool FingerprintFileContents(const std::wstring& filename, TextureFingerprint& fingerprint);
+
+	// Returns the entry for the fingerprint and adds a reference to it.
+	// isNew is true when this is the first reference, i.e. the caller has to load the data.
+	// The fingerprint is trusted as is.
+	int Acquire(const TextureFingerprint& fingerprint, bool& isNew);
+
+	// Same for the contents of a file or of memory, loaded with maxSize. A sampled
+	// fingerprint only picks a candidate, which is shared when the complete contents
+	// hash the same as well. AcquireFile returns -1 with isNew set when the file can't
+	// be read, and the caller loads it uncached.
+	int AcquireFile(const std::wstring& filename, uint64_t maxSize, bool& isNew);
+	int AcquireMemory(const uint8_t* data, size_t size, uint64_t maxSize, bool& isNew);
+
+	// Drops a reference. Returns true when nobody uses the entry anymore.
+	bool Release(int entry);
+
+	// Size of the loaded resource, used for the saved bytes statistics.
+	void SetByteSize(int entry, uint64_t byteSize);
+
+	int RefCount(int entry) const;
+	size_t UniqueCount() const;
+	size_t RequestCount() const;
+	uint64_t BytesLoaded() const;
+	uint64_t BytesSaved() const;
+
+private:
+	struct Entry
+	{
+		TextureFingerprint Fingerprint;
+		uint64_t ByteSize = 0;
+		int RefCount = 0;
+		// Where the complete contents hash comes from when a sampled match has to be
+		// confirmed; files are hashed on the first such match.
+		std::wstring Filename;
+		uint64_t ContentHash = 0;
+		bool HasContentHash = false;
+	};
+
+	// Entry with the fingerprint, or -1. With a content hash, only an entry whose
+	// complete contents hash the same.
+	int Find(const TextureFingerprint& fingerprint, const uint64_t* contentHash);
+	int AddEntry(const TextureFingerprint& fingerprint);
+	static bool EntryContentHash(Entry& entry, uint64_t& hash);
+
+	std::vector<Entry> mEntries;
+	std::unordered_map<uint64_t, std::vector<int>> mLookup;
+	std::vector<int> mFreeEntries;
+};
@@ -0,0 +1,177 @@
+#include "TextureIndex.h"
+
+#include <cwctype>
+
+namespace
+{
+	std::wstring NormalizePath(std::wstring path)
+	{
+		std::replace(path.begin(), path.end(), L'\\', L'/');
+		std::transform(path.begin(), path.end(), path.begin(), towlower);
+		return path;
+	}
+}
+
+size_t TextureIndex::Build(const std::wstring& dir)
+{
+	mEntries.clear();
+	mLookup.clear();
+
+	std::wstring root = dir;
+	if (!root.empty() && root.back() != L'/' && root.back() != L'\\')
+		root += L'/';
+
+	AddDirectory(root);
+	return mEntries.size();
+}
+
+void TextureIndex::AddDirectory(const std::wstring& dir)
+{
+	WIN32_FIND_DATAW data;
+	HANDLE find = FindFirstFileW((dir + L"*").c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		std::wstring name = data.cFileName;
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (name != L"." && name != L"..")
+				AddDirectory(dir + name + L"/");
+			continue;
+		}
+
+		if (name.size() < 4 || NormalizePath(name.substr(name.size() - 4)) != L".dds")
+			continue;
+
+		TextureIndexEntry entry;
+		entry.Path = dir + name;
+		if (FAILED(DirectX::GetDDSTextureInfoFromFile(entry.Path.c_str(), entry.Info)))
+			continue;
+
+		mLookup[NormalizePath(entry.Path)] = mEntries.size();
+		mEntries.push_back(entry);
+	} while (FindNextFileW(find, &data));
+
+	FindClose(find);
+}
+
+bool TextureIndex::Save(const std::wstring& filename) const
+{
+	std::wofstream fout(filename);
+	if (!fout)
+		return false;
+
+	fout << L"# path\tformat\tdimension\twidth\theight\tdepth\tmips\tarray\tcube\theader\tmip bytes...\n";
+	for (auto& e : mEntries)
+	{
+		const DirectX::DDSTextureInfo& info = e.Info;
+		fout << e.Path << L'\t' << (int)info.Format << L'\t' << (int)info.Dimension << L'\t'
+			<< info.Width << L'\t' << info.Height << L'\t' << info.Depth << L'\t'
+			<< info.MipCount << L'\t' << info.ArraySize << L'\t' << (info.IsCubeMap ? 1 : 0) << L'\t'
+			<< info.HeaderSize;
+		for (uint32_t m = 0; m < info.MipCount; m++)
+			fout << L'\t' << info.MipBytes[m];
+		fout << L'\n';
+	}
+
+	return (bool)fout;
+}
+
+bool TextureIndex::Load(const std::wstring& filename)
+{
+	std::wifstream fin(filename);
+	if (!fin)
+		return false;
+
+	mEntries.clear();
+	mLookup.clear();
+
+	std::wstring line;
+	while (std::getline(fin, line))
+	{
+		if (line.empty() || line[0] == L'#')
+			continue;
+
+		size_t tab = line.find(L'\t');
+		if (tab == std::wstring::npos)
+			return false;
+
+		TextureIndexEntry entry;
+		entry.Path = line.substr(0, tab);
+
+		std::wistringstream fields(line.substr(tab + 1));
+		DirectX::DDSTextureInfo& info = entry.Info;
+		int format = 0, dimension = 0, cube = 0;
+		fields >> format >> dimension >> info.Width >> info.Height >> info.Depth
+			>> info.MipCount >> info.ArraySize >> cube >> info.HeaderSize;
+		if (!fields || info.MipCount > D3D12_REQ_MIP_LEVELS)
+			return false;
+
+		info.Format = (DXGI_FORMAT)format;
+		info.Dimension = (D3D12_RESOURCE_DIMENSION)dimension;
+		info.IsCubeMap = cube != 0;
+		for (uint32_t m = 0; m < info.MipCount; m++)
+		{
+			fields >> info.MipBytes[m];
+			info.SliceBytes += info.MipBytes[m];
+		}
+		if (!fields)
+			return false;
+		info.TotalBytes = info.SliceBytes * info.ArraySize;
+
+		mLookup[NormalizePath(entry.Path)] = mEntries.size();
+		mEntries.push_back(entry);
+	}
+
+	return true;
+}
+
+const TextureIndexEntry* TextureIndex::Find(const std::wstring& path) const
+{
+	auto it = mLookup.find(NormalizePath(path));
+	return it == mLookup.end() ? nullptr : &mEntries[it->second];
+}
+
+uint64_t TextureIndex::TotalBytes() const
+{
+	uint64_t bytes = 0;
+	for (auto& e : mEntries)
+		bytes += e.Info.TotalBytes;
+	return bytes;
+}
+
+bool RunTextureIndexTool(const std::string& commandLine)
+{
+	std::istringstream args(commandLine);
+	std::string arg, dir, out;
+	bool requested = false;
+	while (args >> arg)
+	{
+		if (arg == "-texture-index")
+		{
+			requested = true;
+			args >> dir >> out;
+		}
+	}
+
+	if (!requested)
+		return false;
+
+	if (dir.empty())
+		dir = "../Textures";
+	if (out.empty())
+		out = dir + "/index.txt";
+
+	TextureIndex index;
+	size_t count = index.Build(AnsiToWString(dir));
+	bool saved = index.Save(AnsiToWString(out));
+
+	std::string report = "TextureIndex: " + std::to_string(count) + " textures, " +
+		std::to_string(index.TotalBytes() >> 20) + " MB of pixel data, " +
+		(saved ? "written to " + out : "failed to write " + out) + "\n";
+	OutputDebugStringA(report.c_str());
+
+	return true;
+}
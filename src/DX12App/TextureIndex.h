@@ -0,0 +1,40 @@
+#pragma once
+
+#include "../Common/d3dUtil.h"
+
+struct TextureIndexEntry
+{
+	std::wstring Path;
+	DirectX::DDSTextureInfo Info;
+};
+
+// Header metadata of every DDS file in a directory tree, gathered with the header
+// probe alone. Lets descriptor counts and memory use be planned before any pixel
+// data is read.
+class TextureIndex
+{
+public:
+	// Probes every .dds file below dir. Returns the number of files indexed;
+	// files the probe rejects are skipped.
+	size_t Build(const std::wstring& dir);
+
+	// One line per texture, tab separated, readable by Load.
+	bool Save(const std::wstring& filename) const;
+	bool Load(const std::wstring& filename);
+
+	const TextureIndexEntry* Find(const std::wstring& path) const;
+	const std::vector<TextureIndexEntry>& Entries() const { return mEntries; }
+
+	uint64_t TotalBytes() const;
+
+private:
+	void AddDirectory(const std::wstring& dir);
+
+	std::vector<TextureIndexEntry> mEntries;
+	std::unordered_map<std::wstring, size_t> mLookup;
+};
+
+// "-texture-index <dir> [<index file>]" on the command line builds the index of dir,
+// writes it (default <dir>/index.txt) and reports totals to the debugger output.
+// Returns false when the command line doesn't ask for it.
+bool RunTextureIndexTool(const std::string& commandLine);
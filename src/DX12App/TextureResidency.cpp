@@ -0,0 +1,190 @@
+#include "TextureResidency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+TextureResidency::TextureResidency(uint64_t budgetBytes)
+	: mBudget(budgetBytes)
+{
+}
+
+int TextureResidency::Register(uint32_t width, const std::vector<uint64_t>& mipBytes, uint32_t tailMipCount, uint32_t residentTopMip)
+{
+	Entry e;
+	e.Width = width;
+	e.MipBytes = mipBytes;
+
+	uint32_t mipCount = (uint32_t)mipBytes.size();
+	tailMipCount = std::max<uint32_t>(std::min<uint32_t>(tailMipCount, mipCount), 1);
+	e.TailMip = mipCount - tailMipCount;
+	e.TopMip = std::min<uint32_t>(residentTopMip, e.TailMip);
+	e.WantedMip = e.TailMip;
+
+	mTextures.push_back(e);
+	return (int)mTextures.size() - 1;
+}
+
+uint32_t TextureResidency::DensityMip(float texelsAcross, float pixelsAcross)
+{
+	if (pixelsAcross <= 0.0f)
+		return 31;
+
+	float ratio = texelsAcross / pixelsAcross;
+	if (ratio <= 1.0f)
+		return 0;
+
+	return std::min<uint32_t>((uint32_t)std::floor(std::log2(ratio)), 31);
+}
+
+void TextureResidency::Request(int id, float uvScale, float pixelsAcross)
+{
+	Entry& e = mTextures[id];
+	uint32_t mip = DensityMip(e.Width * std::fabs(uvScale), pixelsAcross);
+
+	if (!e.Requested)
+	{
+		e.Requested = true;
+		e.WantedMip = mip;
+		e.Priority = pixelsAcross;
+	}
+	else
+	{
+		e.WantedMip = std::min(e.WantedMip, mip);
+		e.Priority = std::max(e.Priority, pixelsAcross);
+	}
+}
+
+uint64_t TextureResidency::BytesFrom(int id, uint32_t topMip) const
+{
+	const Entry& e = mTextures[id];
+	uint64_t bytes = 0;
+	for (size_t m = topMip; m < e.MipBytes.size(); m++)
+		bytes += e.MipBytes[m];
+	return bytes;
+}
+
+uint64_t TextureResidency::ResidentBytes() const
+{
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < mTextures.size(); i++)
+		bytes += BytesFrom((int)i, mTextures[i].TopMip);
+	return bytes;
+}
+
+const std::vector<TextureResidency::Change>& TextureResidency::Update()
+{
+	mUpdateIndex++;
+	mChanges.clear();
+	mPressureTrims = 0;
+
+	// Target residency from demand alone: promote right away, demote only after
+	// the texture has wanted less (or not been seen) for DemoteDelay updates.
+	std::vector<uint32_t> target(mTextures.size());
+	uint64_t total = 0;
+	for (size_t i = 0; i < mTextures.size(); i++)
+	{
+		Entry& e = mTextures[i];
+		if (e.Requested)
+		{
+			e.LastSeenUpdate = mUpdateIndex;
+			e.WantedMip = std::min(e.WantedMip, e.TailMip);
+		}
+		else
+		{
+			e.WantedMip = e.TailMip;
+			e.Priority = 0.0f;
+		}
+
+		if (e.WantedMip < e.TopMip)
+		{
+			target[i] = e.WantedMip;
+			e.CoarserUpdates = 0;
+		}
+		else if (e.WantedMip > e.TopMip)
+		{
+			e.CoarserUpdates++;
+			target[i] = e.CoarserUpdates >= DemoteDelay ? e.WantedMip : e.TopMip;
+		}
+		else
+		{
+			target[i] = e.TopMip;
+			e.CoarserUpdates = 0;
+		}
+
+		total += BytesFrom((int)i, target[i]);
+	}
+
+	// Over budget: trim one mip at a time where it loses the least per byte freed.
+	// Mips finer than wanted cost nothing, after that each trim doubles the blur,
+	// weighted by how large the texture is on screen. Ties go to the texture seen
+	// longest ago, then to the lowest id, so the result only depends on the inputs.
+	if (mBudget != 0 && total > mBudget)
+	{
+		struct Candidate
+		{
+			float Cost;
+			uint64_t LastSeen;
+			int Id;
+
+			bool operator<(const Candidate& rhs) const
+			{
+				// reversed, std::priority_queue pops the largest element
+				if (Cost != rhs.Cost) return Cost > rhs.Cost;
+				if (LastSeen != rhs.LastSeen) return LastSeen > rhs.LastSeen;
+				return Id > rhs.Id;
+			}
+		};
+
+		auto trimCost = [&](int id)
+		{
+			const Entry& e = mTextures[id];
+			int blur = (int)target[id] - (int)e.WantedMip;
+			if (blur < 0)
+				return 0.0f;
+			float freedMB = e.MipBytes[target[id]] / (1024.0f * 1024.0f);
+			return e.Priority * std::ldexp(1.0f, blur) / std::max(freedMB, 1e-6f);
+		};
+
+		std::priority_queue<Candidate> queue;
+		for (size_t i = 0; i < mTextures.size(); i++)
+			if (target[i] < mTextures[i].TailMip)
+				queue.push({ trimCost((int)i), mTextures[i].LastSeenUpdate, (int)i });
+
+		while (total > mBudget && !queue.empty())
+		{
+			int id = queue.top().Id;
+			queue.pop();
+
+			if (target[id] >= mTextures[id].WantedMip)
+				mPressureTrims++;
+
+			total -= mTextures[id].MipBytes[target[id]];
+			target[id]++;
+
+			if (target[id] < mTextures[id].TailMip)
+				queue.push({ trimCost(id), mTextures[id].LastSeenUpdate, id });
+		}
+	}
+
+	for (size_t i = 0; i < mTextures.size(); i++)
+	{
+		Entry& e = mTextures[i];
+		if (target[i] != e.TopMip)
+		{
+			mChanges.push_back({ (int)i, e.TopMip, target[i] });
+			e.TopMip = target[i];
+			if (e.TopMip == e.WantedMip)
+				e.CoarserUpdates = 0;
+		}
+		e.Requested = false;
+	}
+
+	return mChanges;
+}
+
+void TextureResidency::SetTopMip(int id, uint32_t topMip)
+{
+	Entry& e = mTextures[id];
+	e.TopMip = std::min(topMip, e.TailMip);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Decides how many mips of every texture should be resident under a memory budget.
+// It only does the bookkeeping: the caller feeds in sizes and on-screen demand and
+// applies the returned changes, so the policy runs the same without a GPU.
+//
+// A texture is described by the byte size of each mip (all array slices together)
+// and a tail of small mips that always stays resident. Its residency is the index of
+// the top resident mip: 0 means the full chain, TailMip() means only the tail.
+class TextureResidency
+{
+public:
+	struct Change
+	{
+		int Id;
+		uint32_t OldTopMip;
+		uint32_t NewTopMip;
+	};
+
+	// Updates a texture has to stay coarser than resident before it is trimmed
+	// without budget pressure. Avoids reloading textures that flicker in and out of view.
+	static const uint32_t DemoteDelay = 4;
+
+	explicit TextureResidency(uint64_t budgetBytes = 0);
+
+	// 0 means unlimited.
+	void SetBudget(uint64_t budgetBytes) { mBudget = budgetBytes; }
+	uint64_t Budget() const { return mBudget; }
+
+	// Returns the id used by the other calls. The texture starts at residentTopMip.
+	int Register(uint32_t width, const std::vector<uint64_t>& mipBytes, uint32_t tailMipCount, uint32_t residentTopMip = 0);
+
+	// Mip that gives about one texel per pixel when texelsAcross texels of the top mip
+	// cover pixelsAcross pixels on screen.
+	static uint32_t DensityMip(float texelsAcross, float pixelsAcross);
+
+	// Records that the texture is visible with uvScale repeats across an object
+	// covering pixelsAcross pixels. Requests accumulate until the next Update.
+	void Request(int id, float uvScale, float pixelsAcross);
+
+	// Runs the policy on the requests since the last call and returns the textures
+	// whose top mip changes, in id order. The new residency is taken as applied.
+	const std::vector<Change>& Update();
+
+	// Sets the mip actually resident when a change returned by Update came out
+	// differently or could not be applied, e.g. because its file failed to load.
+	void SetTopMip(int id, uint32_t topMip);
+
+	uint32_t TopMip(int id) const { return mTextures[id].TopMip; }
+	uint32_t TailMip(int id) const { return mTextures[id].TailMip; }
+	uint32_t MipCount(int id) const { return (uint32_t)mTextures[id].MipBytes.size(); }
+	uint64_t BytesFrom(int id, uint32_t topMip) const;
+	uint64_t ResidentBytes() const;
+	size_t TextureCount() const { return mTextures.size(); }
+
+	// Number of mips trimmed below the requested resolution by the last Update.
+	uint32_t LastPressureTrims() const { return mPressureTrims; }
+
+private:
+	struct Entry
+	{
+		uint32_t Width = 0;
+		std::vector<uint64_t> MipBytes;
+		uint32_t TailMip = 0;
+		uint32_t TopMip = 0;
+
+		// Demand gathered since the last Update.
+		bool Requested = false;
+		uint32_t WantedMip = 0;
+		float Priority = 0.0f;
+
+		uint64_t LastSeenUpdate = 0;
+		uint32_t CoarserUpdates = 0;
+	};
+
+	std::vector<Entry> mTextures;
+	std::vector<Change> mChanges;
+	uint64_t mBudget = 0;
+	uint64_t mUpdateIndex = 0;
+	uint32_t mPressureTrims = 0;
+};
@@ -0,0 +1,562 @@
+#include "TextureTranscoder.h"
+#include "TextureCache.h"
+#include "ThreadPool.h"
+
+#include <windows.h>
+#include <wincodec.h>
+#include <wrl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cwctype>
+#include <fstream>
+
+#pragma comment(lib, "windowscodecs.lib")
+
+using Microsoft::WRL::ComPtr;
+
+namespace
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double MsSince(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	// Images below this many pixels are not split across threads.
+	const size_t ParallelPixelThreshold = 256 * 256;
+
+	std::wstring Lowercase(std::wstring s)
+	{
+		std::transform(s.begin(), s.end(), s.begin(), towlower);
+		return s;
+	}
+
+	std::wstring Extension(const std::wstring& filename)
+	{
+		size_t dot = filename.find_last_of(L'.');
+		if (dot == std::wstring::npos)
+			return L"";
+		return Lowercase(filename.substr(dot));
+	}
+
+	// 32-bit uncompressed BMPs carry alpha in the fourth byte, which WIC reports as
+	// 32bppBGR and drops. The tree billboards rely on it, so read those directly.
+	bool DecodeBmp32(const std::wstring& filename, TranscodeImage& image)
+	{
+		std::ifstream fin(filename, std::ios::binary);
+		if (!fin)
+			return false;
+
+		uint8_t header[54];
+		fin.read((char*)header, sizeof(header));
+		if (!fin || header[0] != 'B' || header[1] != 'M')
+			return false;
+
+		uint32_t dataOffset, infoSize, compression;
+		int32_t width, height;
+		uint16_t bitCount;
+		memcpy(&dataOffset, header + 10, 4);
+		memcpy(&infoSize, header + 14, 4);
+		memcpy(&width, header + 18, 4);
+		memcpy(&height, header + 22, 4);
+		memcpy(&bitCount, header + 28, 2);
+		memcpy(&compression, header + 30, 4);
+
+		if (infoSize != 40 || bitCount != 32 || compression != 0 || width <= 0 || height == 0)
+			return false;
+
+		bool bottomUp = height > 0;
+		uint32_t h = (uint32_t)(bottomUp ? height : -height);
+		uint32_t w = (uint32_t)width;
+
+		std::vector<uint8_t> bgra((size_t)w * h * 4);
+		fin.seekg(dataOffset, std::ios_base::beg);
+		fin.read((char*)bgra.data(), bgra.size());
+		if (!fin)
+			return false;
+
+		bool anyAlpha = false;
+		for (size_t i = 3; i < bgra.size(); i += 4)
+			anyAlpha |= bgra[i] != 0;
+
+		image.Width = w;
+		image.Height = h;
+		image.Pixels.resize(bgra.size());
+		for (uint32_t y = 0; y < h; y++)
+		{
+			const uint8_t* src = bgra.data() + (size_t)(bottomUp ? h - 1 - y : y) * w * 4;
+			uint8_t* dst = image.Pixels.data() + (size_t)y * w * 4;
+			for (uint32_t x = 0; x < w; x++)
+			{
+				dst[x * 4 + 0] = src[x * 4 + 2];
+				dst[x * 4 + 1] = src[x * 4 + 1];
+				dst[x * 4 + 2] = src[x * 4 + 0];
+				// All-zero alpha means the writer didn't store any.
+				dst[x * 4 + 3] = anyAlpha ? src[x * 4 + 3] : 255;
+			}
+		}
+		return true;
+	}
+
+	bool DecodeWIC(const std::wstring& filename, TranscodeImage& image)
+	{
+		ComPtr<IWICImagingFactory> factory;
+		if (FAILED(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory))))
+			return false;
+
+		ComPtr<IWICBitmapDecoder> decoder;
+		if (FAILED(factory->CreateDecoderFromFilename(filename.c_str(), nullptr, GENERIC_READ,
+			WICDecodeMetadataCacheOnDemand, &decoder)))
+			return false;
+
+		ComPtr<IWICBitmapFrameDecode> frame;
+		if (FAILED(decoder->GetFrame(0, &frame)))
+			return false;
+
+		UINT width = 0, height = 0;
+		if (FAILED(frame->GetSize(&width, &height)) || width == 0 || height == 0)
+			return false;
+
+		ComPtr<IWICFormatConverter> converter;
+		if (FAILED(factory->CreateFormatConverter(&converter)))
+			return false;
+
+		if (FAILED(converter->Initialize(frame.Get(), GUID_WICPixelFormat32bppRGBA,
+			WICBitmapDitherTypeNone, nullptr, 0.0, WICBitmapPaletteTypeCustom)))
+			return false;
+
+		image.Width = width;
+		image.Height = height;
+		image.Pixels.resize((size_t)width * height * 4);
+		return SUCCEEDED(converter->CopyPixels(nullptr, width * 4, (UINT)image.Pixels.size(), image.Pixels.data()));
+	}
+
+	uint16_t To565(const int* c)
+	{
+		return (uint16_t)((((c[0] * 31 + 127) / 255) << 11) | (((c[1] * 63 + 127) / 255) << 5) | ((c[2] * 31 + 127) / 255));
+	}
+
+	void From565(uint16_t v, int* c)
+	{
+		int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+		c[0] = (r << 3) | (r >> 2);
+		c[1] = (g << 2) | (g >> 4);
+		c[2] = (b << 3) | (b >> 2);
+	}
+
+	// 4-colour BC1 block from the bounding box of the block colours, with the
+	// box diagonal picked to follow the dominant colour correlation.
+	void EncodeColorBlock(const uint8_t block[16][4], uint8_t* out)
+	{
+		int mn[3] = { 255, 255, 255 }, mx[3] = { 0, 0, 0 };
+		for (int i = 0; i < 16; i++)
+			for (int c = 0; c < 3; c++)
+			{
+				mn[c] = std::min<int>(mn[c], block[i][c]);
+				mx[c] = std::max<int>(mx[c], block[i][c]);
+			}
+
+		int center[3] = { (mn[0] + mx[0]) / 2, (mn[1] + mx[1]) / 2, (mn[2] + mx[2]) / 2 };
+		int covRG = 0, covBG = 0;
+		for (int i = 0; i < 16; i++)
+		{
+			int g = block[i][1] - center[1];
+			covRG += (block[i][0] - center[0]) * g;
+			covBG += (block[i][2] - center[2]) * g;
+		}
+		if (covRG < 0)
+			std::swap(mn[0], mx[0]);
+		if (covBG < 0)
+			std::swap(mn[2], mx[2]);
+
+		// Inset the endpoints a little to reduce the error of the interpolated colours.
+		for (int c = 0; c < 3; c++)
+		{
+			int inset = (mx[c] - mn[c]) / 16;
+			mx[c] -= inset;
+			mn[c] += inset;
+		}
+
+		uint16_t c0 = To565(mx);
+		uint16_t c1 = To565(mn);
+		if (c0 < c1)
+			std::swap(c0, c1);
+
+		uint32_t indices = 0;
+		if (c0 != c1)
+		{
+			int palette[4][3];
+			From565(c0, palette[0]);
+			From565(c1, palette[1]);
+			for (int c = 0; c < 3; c++)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0, bestDist = INT_MAX;
+				for (int p = 0; p < 4; p++)
+				{
+					int dr = block[i][0] - palette[p][0];
+					int dg = block[i][1] - palette[p][1];
+					int db = block[i][2] - palette[p][2];
+					int dist = dr * dr + dg * dg + db * db;
+					if (dist < bestDist)
+					{
+						bestDist = dist;
+						best = p;
+					}
+				}
+				indices |= (uint32_t)best << (2 * i);
+			}
+		}
+
+		memcpy(out + 0, &c0, 2);
+		memcpy(out + 2, &c1, 2);
+		memcpy(out + 4, &indices, 4);
+	}
+
+	// 8-value BC3 alpha block between the block's min and max alpha.
+	void EncodeAlphaBlock(const uint8_t block[16][4], uint8_t* out)
+	{
+		int a0 = 0, a1 = 255;
+		for (int i = 0; i < 16; i++)
+		{
+			a0 = std::max<int>(a0, block[i][3]);
+			a1 = std::min<int>(a1, block[i][3]);
+		}
+
+		uint64_t indices = 0;
+		if (a0 != a1)
+		{
+			int palette[8] = { a0, a1 };
+			for (int p = 1; p < 7; p++)
+				palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0, bestDist = INT_MAX;
+				for (int p = 0; p < 8; p++)
+				{
+					int dist = std::abs(block[i][3] - palette[p]);
+					if (dist < bestDist)
+					{
+						bestDist = dist;
+						best = p;
+					}
+				}
+				indices |= (uint64_t)best << (3 * i);
+			}
+		}
+
+		out[0] = (uint8_t)a0;
+		out[1] = (uint8_t)a1;
+		for (int b = 0; b < 6; b++)
+			out[2 + b] = (uint8_t)(indices >> (8 * b));
+	}
+
+	void WriteU32(std::ofstream& fout, uint32_t v)
+	{
+		fout.write((const char*)&v, 4);
+	}
+}
+
+TextureTranscoder::TextureTranscoder(const std::wstring& cacheDir)
+	: mCacheDir(cacheDir)
+{
+	if (!mCacheDir.empty() && mCacheDir.back() != L'/' && mCacheDir.back() != L'\\')
+		mCacheDir += L'/';
+}
+
+bool TextureTranscoder::IsTranscodable(const std::wstring& filename)
+{
+	std::wstring ext = Extension(filename);
+	return ext == L".png" || ext == L".jpg" || ext == L".jpeg" || ext == L".bmp";
+}
+
+std::wstring TextureTranscoder::CachedPath(const std::wstring& source, const TranscodeOptions& options) const
+{
+	// Large sources are fingerprinted from samples only, which two different files can
+	// share; the transcode reads the whole source anyway, so its key hashes all of it.
+	TextureFingerprint fingerprint;
+	if (!TextureCache::FingerprintFileContents(source, fingerprint))
+		return L"";
+
+	wchar_t name[96];
+	swprintf_s(name, L"%016llx_%llx_%ls%ls.dds", (unsigned long long)fingerprint.Hash, (unsigned long long)fingerprint.FileSize,
+		options.BlockCompress ? L"bc" : L"rgba", options.GenerateMips ? L"" : L"_nomips");
+	return mCacheDir + name;
+}
+
+bool TextureTranscoder::DecodeImage(const std::wstring& filename, TranscodeImage& image)
+{
+	if (Extension(filename) == L".bmp" && DecodeBmp32(filename, image))
+		return true;
+
+	// Every worker thread needs COM; S_FALSE/RPC_E_CHANGED_MODE mean it already has it.
+	HRESULT hrCo = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	bool result = DecodeWIC(filename, image);
+	if (SUCCEEDED(hrCo))
+		CoUninitialize();
+
+	return result;
+}
+
+void TextureTranscoder::BuildMipChain(std::vector<TranscodeImage>& chain, ThreadPool* pool)
+{
+	if (chain.empty())
+		return;
+
+	chain.resize(1);
+	while (chain.back().Width > 1 || chain.back().Height > 1)
+	{
+		const TranscodeImage& src = chain.back();
+		TranscodeImage dst;
+		dst.Width = std::max<uint32_t>(src.Width / 2, 1);
+		dst.Height = std::max<uint32_t>(src.Height / 2, 1);
+		dst.Pixels.resize((size_t)dst.Width * dst.Height * 4);
+
+		// 2x2 box filter; odd sizes clamp the second sample to the last row/column.
+		auto filterRow = [&](size_t y)
+		{
+			uint32_t sy0 = std::min<uint32_t>((uint32_t)y * 2, src.Height - 1);
+			uint32_t sy1 = std::min<uint32_t>((uint32_t)y * 2 + 1, src.Height - 1);
+			const uint8_t* row0 = src.Pixels.data() + (size_t)sy0 * src.Width * 4;
+			const uint8_t* row1 = src.Pixels.data() + (size_t)sy1 * src.Width * 4;
+			uint8_t* out = dst.Pixels.data() + y * dst.Width * 4;
+			for (uint32_t x = 0; x < dst.Width; x++)
+			{
+				uint32_t sx0 = std::min<uint32_t>(x * 2, src.Width - 1) * 4;
+				uint32_t sx1 = std::min<uint32_t>(x * 2 + 1, src.Width - 1) * 4;
+				for (int c = 0; c < 4; c++)
+					out[x * 4 + c] = (uint8_t)((row0[sx0 + c] + row0[sx1 + c] + row1[sx0 + c] + row1[sx1 + c] + 2) / 4);
+			}
+		};
+
+		if (pool && (size_t)dst.Width * dst.Height >= ParallelPixelThreshold)
+			pool->ParallelFor(dst.Height, 16, filterRow);
+		else
+			for (uint32_t y = 0; y < dst.Height; y++)
+				filterRow(y);
+
+		chain.push_back(std::move(dst));
+	}
+}
+
+bool TextureTranscoder::HasAlpha(const TranscodeImage& image)
+{
+	for (size_t i = 3; i < image.Pixels.size(); i += 4)
+		if (image.Pixels[i] != 255)
+			return true;
+	return false;
+}
+
+void TextureTranscoder::CompressBC(const TranscodeImage& image, bool alpha, std::vector<uint8_t>& blocks, ThreadPool* pool)
+{
+	uint32_t blocksX = std::max<uint32_t>((image.Width + 3) / 4, 1);
+	uint32_t blocksY = std::max<uint32_t>((image.Height + 3) / 4, 1);
+	size_t blockBytes = alpha ? 16 : 8;
+	blocks.resize((size_t)blocksX * blocksY * blockBytes);
+
+	auto encodeRow = [&](size_t by)
+	{
+		uint8_t block[16][4];
+		for (uint32_t bx = 0; bx < blocksX; bx++)
+		{
+			// Mips smaller than a block repeat their edge pixels.
+			for (uint32_t py = 0; py < 4; py++)
+				for (uint32_t px = 0; px < 4; px++)
+				{
+					uint32_t x = std::min<uint32_t>(bx * 4 + px, image.Width - 1);
+					uint32_t y = std::min<uint32_t>((uint32_t)by * 4 + py, image.Height - 1);
+					memcpy(block[py * 4 + px], image.Pixels.data() + ((size_t)y * image.Width + x) * 4, 4);
+				}
+
+			uint8_t* out = blocks.data() + (by * blocksX + bx) * blockBytes;
+			if (alpha)
+			{
+				EncodeAlphaBlock(block, out);
+				EncodeColorBlock(block, out + 8);
+			}
+			else
+			{
+				EncodeColorBlock(block, out);
+			}
+		}
+	};
+
+	if (pool && (size_t)image.Width * image.Height >= ParallelPixelThreshold)
+		pool->ParallelFor(blocksY, 4, encodeRow);
+	else
+		for (uint32_t by = 0; by < blocksY; by++)
+			encodeRow(by);
+}
+
+bool TextureTranscoder::WriteDDS(const std::wstring& filename, const std::vector<TranscodeImage>& chain,
+	const std::vector<std::vector<uint8_t>>& blocks, bool alpha)
+{
+	if (chain.empty())
+		return false;
+
+	bool compressed = !blocks.empty();
+	const TranscodeImage& top = chain[0];
+
+	std::ofstream fout(filename, std::ios::binary);
+	if (!fout)
+		return false;
+
+	// DDS_HEADER, see DDSTextureLoader.cpp
+	const uint32_t DDSD_CAPS = 0x1, DDSD_HEIGHT = 0x2, DDSD_WIDTH = 0x4, DDSD_PITCH = 0x8,
+		DDSD_PIXELFORMAT = 0x1000, DDSD_MIPMAPCOUNT = 0x20000, DDSD_LINEARSIZE = 0x80000;
+	const uint32_t DDPF_ALPHAPIXELS = 0x1, DDPF_FOURCC = 0x4, DDPF_RGB = 0x40;
+	const uint32_t DDSCAPS_COMPLEX = 0x8, DDSCAPS_TEXTURE = 0x1000, DDSCAPS_MIPMAP = 0x400000;
+
+	uint32_t flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT;
+	flags |= compressed ? DDSD_LINEARSIZE : DDSD_PITCH;
+	uint32_t pitchOrLinearSize = compressed ? (uint32_t)blocks[0].size() : top.Width * 4;
+
+	WriteU32(fout, 0x20534444); // "DDS "
+	WriteU32(fout, 124);
+	WriteU32(fout, flags);
+	WriteU32(fout, top.Height);
+	WriteU32(fout, top.Width);
+	WriteU32(fout, pitchOrLinearSize);
+	WriteU32(fout, 0); // depth
+	WriteU32(fout, (uint32_t)chain.size());
+	for (int i = 0; i < 11; i++)
+		WriteU32(fout, 0);
+
+	// DDS_PIXELFORMAT
+	WriteU32(fout, 32);
+	if (compressed)
+	{
+		WriteU32(fout, DDPF_FOURCC);
+		fout.write(alpha ? "DXT5" : "DXT1", 4);
+		for (int i = 0; i < 5; i++)
+			WriteU32(fout, 0);
+	}
+	else
+	{
+		WriteU32(fout, DDPF_RGB | DDPF_ALPHAPIXELS);
+		WriteU32(fout, 0);
+		WriteU32(fout, 32);
+		WriteU32(fout, 0x000000ff);
+		WriteU32(fout, 0x0000ff00);
+		WriteU32(fout, 0x00ff0000);
+		WriteU32(fout, 0xff000000);
+	}
+
+	WriteU32(fout, DDSCAPS_TEXTURE | (chain.size() > 1 ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0));
+	for (int i = 0; i < 4; i++)
+		WriteU32(fout, 0);
+
+	for (size_t mip = 0; mip < chain.size(); mip++)
+	{
+		if (compressed)
+			fout.write((const char*)blocks[mip].data(), blocks[mip].size());
+		else
+			fout.write((const char*)chain[mip].Pixels.data(), chain[mip].Pixels.size());
+	}
+
+	return (bool)fout;
+}
+
+std::vector<std::wstring> TextureTranscoder::Transcode(const std::vector<std::wstring>& sources, const TranscodeOptions& options,
+	ThreadPool& pool, TranscodeStats* stats, bool ignoreCache) const
+{
+	auto wallStart = Clock::now();
+	std::vector<std::wstring> results(sources.size());
+
+	if (!mCacheDir.empty())
+		CreateDirectoryW(mCacheDir.c_str(), nullptr);
+
+	// Stage times in microseconds, summed over the worker threads.
+	std::atomic<long long> decodeUs{ 0 }, mipUs{ 0 }, compressUs{ 0 }, writeUs{ 0 };
+	std::atomic<size_t> converted{ 0 }, cacheHits{ 0 }, failed{ 0 };
+
+	pool.ParallelFor(sources.size(), [&](size_t i)
+	{
+		std::wstring target = CachedPath(sources[i], options);
+		if (target.empty())
+		{
+			failed++;
+			return;
+		}
+
+		if (!ignoreCache && GetFileAttributesW(target.c_str()) != INVALID_FILE_ATTRIBUTES)
+		{
+			results[i] = target;
+			cacheHits++;
+			return;
+		}
+
+		auto start = Clock::now();
+		std::vector<TranscodeImage> chain(1);
+		bool decoded = DecodeImage(sources[i], chain[0]);
+		decodeUs += (long long)(MsSince(start) * 1000.0);
+		if (!decoded)
+		{
+			failed++;
+			return;
+		}
+
+		start = Clock::now();
+		if (options.GenerateMips)
+			BuildMipChain(chain, &pool);
+		mipUs += (long long)(MsSince(start) * 1000.0);
+
+		// D3D12 needs block compressed textures to start at a multiple of 4.
+		bool alpha = HasAlpha(chain[0]);
+		std::vector<std::vector<uint8_t>> blocks;
+		start = Clock::now();
+		if (options.BlockCompress && chain[0].Width % 4 == 0 && chain[0].Height % 4 == 0)
+		{
+			blocks.resize(chain.size());
+			for (size_t mip = 0; mip < chain.size(); mip++)
+				CompressBC(chain[mip], alpha, blocks[mip], &pool);
+		}
+		compressUs += (long long)(MsSince(start) * 1000.0);
+
+		// Write to a temporary name first so a half written file is never picked up.
+		start = Clock::now();
+		wchar_t suffix[32];
+		swprintf_s(suffix, L".%u.tmp", GetCurrentThreadId());
+		std::wstring temp = target + suffix;
+		bool written = WriteDDS(temp, chain, blocks, alpha) &&
+			MoveFileExW(temp.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING);
+		writeUs += (long long)(MsSince(start) * 1000.0);
+
+		if (!written)
+		{
+			DeleteFileW(temp.c_str());
+			failed++;
+			return;
+		}
+
+		results[i] = target;
+		converted++;
+	});
+
+	if (stats)
+	{
+		stats->Files = sources.size();
+		stats->Converted = converted;
+		stats->CacheHits = cacheHits;
+		stats->Failed = failed;
+		stats->DecodeMs = decodeUs / 1000.0;
+		stats->MipMs = mipUs / 1000.0;
+		stats->CompressMs = compressUs / 1000.0;
+		stats->WriteMs = writeUs / 1000.0;
+		stats->WallMs = MsSince(wallStart);
+	}
+
+	return results;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// 8-bit RGBA image, rows tightly packed.
+struct TranscodeImage
+{
+	uint32_t Width = 0;
+	uint32_t Height = 0;
+	std::vector<uint8_t> Pixels;
+};
+
+struct TranscodeOptions
+{
+	// BC1 for opaque images, BC3 when any pixel has alpha; otherwise R8G8B8A8.
+	bool BlockCompress = true;
+	bool GenerateMips = true;
+};
+
+// Per-stage times are summed over all threads, WallMs is the elapsed time of the call.
+struct TranscodeStats
+{
+	size_t Files = 0;
+	size_t Converted = 0;
+	size_t CacheHits = 0;
+	size_t Failed = 0;
+	double DecodeMs = 0.0;
+	double MipMs = 0.0;
+	double CompressMs = 0.0;
+	double WriteMs = 0.0;
+	double WallMs = 0.0;
+};
+
+// Converts PNG/JPG/BMP sources into mipmapped DDS files in a cache directory.
+// Cache files are named after the size and full content hash of the source, so renamed or
+// duplicated sources reuse the same DDS and edited sources get a new one.
+class TextureTranscoder
+{
+public:
+	explicit TextureTranscoder(const std::wstring& cacheDir);
+
+	// True for the source formats the transcoder decodes (by file extension).
+	static bool IsTranscodable(const std::wstring& filename);
+
+	// Cache path for the source, or an empty string if the source can't be read.
+	std::wstring CachedPath(const std::wstring& source, const TranscodeOptions& options) const;
+
+	// Makes sure every source has a cached DDS and returns the DDS paths in the same
+	// order (empty string for sources that failed). Files are processed in parallel and
+	// large images also split their mip and compression work across the pool.
+	std::vector<std::wstring> Transcode(const std::vector<std::wstring>& sources, const TranscodeOptions& options,
+		ThreadPool& pool, TranscodeStats* stats = nullptr, bool ignoreCache = false) const;
+
+	// Pipeline stages, public so they can be timed on their own.
+	static bool DecodeImage(const std::wstring& filename, TranscodeImage& image);
+	static void BuildMipChain(std::vector<TranscodeImage>& chain, ThreadPool* pool = nullptr);
+	static void CompressBC(const TranscodeImage& image, bool alpha, std::vector<uint8_t>& blocks, ThreadPool* pool = nullptr);
+	static bool HasAlpha(const TranscodeImage& image);
+	static bool WriteDDS(const std::wstring& filename, const std::vector<TranscodeImage>& chain,
+		const std::vector<std::vector<uint8_t>>& blocks, bool alpha);
+
+private:
+	std::wstring mCacheDir;
+};
@@ -0,0 +1,139 @@
+#include "ThreadPool.h"
+
+#include <memory>
+
+ThreadPool::ThreadPool()
+	: ThreadPool(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0)
+{
+}
+
+ThreadPool::ThreadPool(unsigned workerCount)
+{
+	for (unsigned i = 0; i < workerCount; i++)
+		mWorkers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mWake.notify_all();
+
+	for (auto& worker : mWorkers)
+		worker.join();
+}
+
+void ThreadPool::WorkerLoop()
+{
+	for (;;)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWake.wait(lock, [this] { return mStop || !mTasks.empty(); });
+			if (mStop && mTasks.empty())
+				return;
+
+			task = std::move(mTasks.front());
+			mTasks.pop();
+		}
+		task();
+	}
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	if (mWorkers.empty())
+	{
+		task();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mTasks.push(std::move(task));
+	}
+	mWake.notify_one();
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& func)
+{
+	ParallelFor(count, 1, func);
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t)>& func)
+{
+	if (count == 0)
+		return;
+
+	if (grainSize == 0)
+		grainSize = 1;
+
+	size_t chunkCount = (count + grainSize - 1) / grainSize;
+	if (mWorkers.empty() || chunkCount == 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	// Shared with the queued helpers, which may start only after the caller has
+	// already finished every chunk and returned.
+	struct Job
+	{
+		std::atomic<size_t> Next{ 0 };
+		std::atomic<size_t> Done{ 0 };
+		size_t ChunkCount = 0;
+		size_t Count = 0;
+		size_t GrainSize = 0;
+		const std::function<void(size_t)>* Func = nullptr;
+		std::mutex Mutex;
+		std::condition_variable Finished;
+	};
+
+	auto job = std::make_shared<Job>();
+	job->ChunkCount = chunkCount;
+	job->Count = count;
+	job->GrainSize = grainSize;
+	job->Func = &func;
+
+	auto run = [](Job& j)
+	{
+		for (;;)
+		{
+			size_t chunk = j.Next.fetch_add(1);
+			if (chunk >= j.ChunkCount)
+				return;
+
+			size_t begin = chunk * j.GrainSize;
+			size_t end = begin + j.GrainSize < j.Count ? begin + j.GrainSize : j.Count;
+			for (size_t i = begin; i < end; i++)
+				(*j.Func)(i);
+
+			if (j.Done.fetch_add(1) + 1 == j.ChunkCount)
+			{
+				std::lock_guard<std::mutex> lock(j.Mutex);
+				j.Finished.notify_all();
+			}
+		}
+	};
+
+	size_t helpers = chunkCount - 1 < mWorkers.size() ? chunkCount - 1 : mWorkers.size();
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (size_t i = 0; i < helpers; i++)
+			mTasks.push([job, run] { run(*job); });
+	}
+	if (helpers == 1)
+		mWake.notify_one();
+	else
+		mWake.notify_all();
+
+	run(*job);
+
+	// Only chunks already claimed by running threads can be outstanding here.
+	std::unique_lock<std::mutex> lock(job->Mutex);
+	job->Finished.wait(lock, [&] { return job->Done.load() == job->ChunkCount; });
+}
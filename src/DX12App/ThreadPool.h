@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for CPU side work (texture transcoding, culling, ...).
+class ThreadPool
+{
+public:
+	// One worker per hardware thread, minus the thread that calls ParallelFor.
+	ThreadPool();
+	explicit ThreadPool(unsigned workerCount);
+	ThreadPool(const ThreadPool& rhs) = delete;
+	ThreadPool& operator=(const ThreadPool& rhs) = delete;
+	~ThreadPool();
+
+	// Number of threads that take part in ParallelFor, including the caller.
+	unsigned ThreadCount() const { return (unsigned)mWorkers.size() + 1; }
+
+	// Calls func(i) for every i in [0, count) and returns when all calls are done.
+	// The calling thread works too, so it is safe to nest ParallelFor inside func.
+	void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
+	// Same, but hands out indices in chunks of grainSize to cut down on atomics
+	// for cheap per-item work.
+	void ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t)>& func);
+
+	// Queues task for a worker and returns at once; the caller checks for the task's
+	// result itself. Without workers the task runs on the calling thread. Tasks still
+	// queued when the pool is destroyed run before it returns. ParallelFor helpers
+	// queue behind submitted tasks, so long ones belong on a pool of their own.
+	void Submit(std::function<void()> task);
+
+	// Calls func(begin, end, output) for consecutive ranges of grainSize indices in
+	// [0, count), each with its own element of outputs, which is resized to one per
+	// range. Outputs keep what the last call left in them so their memory is reused;
+	// func clears them. Taking the outputs in order gives the same result whatever the
+	// number of threads.
+	template <typename Output, typename Func>
+	void ParallelRanges(size_t count, size_t grainSize, std::vector<Output>& outputs, const Func& func)
+	{
+		if (grainSize == 0)
+			grainSize = 1;
+		size_t rangeCount = (count + grainSize - 1) / grainSize;
+		outputs.resize(rangeCount);
+		ParallelFor(rangeCount, [&](size_t range)
+		{
+			size_t begin = range * grainSize;
+			func(begin, begin + grainSize < count ? begin + grainSize : count, outputs[range]);
+		});
+	}
+
+private:
+	void WorkerLoop();
+
+	std::vector<std::thread> mWorkers;
+	std::queue<std::function<void()>> mTasks;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	bool mStop = false;
+};
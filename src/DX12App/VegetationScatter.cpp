@@ -0,0 +1,306 @@
+#include "VegetationScatter.h"
+
+#include "TerrainHeightField.h"
+#include "TerrainQuadTree.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+using namespace DirectX;
+
+namespace
+{
+	uint32_t Hash(uint32_t a, uint32_t b, uint32_t c)
+	{
+		uint32_t h = a * 0x9E3779B1u ^ b * 0x85EBCA77u ^ c * 0xC2B2AE3Du;
+		h ^= h >> 15;
+		h *= 0x2C1B3C6Du;
+		h ^= h >> 12;
+		h *= 0x297A2D39u;
+		h ^= h >> 15;
+		return h;
+	}
+
+	float Unit(uint32_t h)
+	{
+		return (h >> 8) * (1.0f / 16777216.0f);
+	}
+
+	float Saturate(float v)
+	{
+		return std::min<float>(std::max<float>(v, 0.0f), 1.0f);
+	}
+
+	// Share of a kind's density the ground gives it.
+	float Fit(const VegetationKind& kind, float height, float slope)
+	{
+		float fit = Saturate((kind.MaxSlope - slope) / std::max<float>(kind.SlopeFade, 1e-6f));
+		if (kind.MinHeight > -FLT_MAX)
+			fit *= Saturate((height - kind.MinHeight) / std::max<float>(kind.HeightFade, 1e-6f));
+		if (kind.MaxHeight < FLT_MAX)
+			fit *= Saturate((kind.MaxHeight - height) / std::max<float>(kind.HeightFade, 1e-6f));
+		return fit;
+	}
+
+	// Random streams of a candidate.
+	const uint32_t StreamJitterX = 0;
+	const uint32_t StreamJitterZ = 1;
+	const uint32_t StreamPick = 2;
+	const uint32_t StreamSize = 3;
+	const uint32_t StreamVariation = 4;
+	const uint32_t StreamShuffle = 5;
+}
+
+bool VegetationScatter::Scatter(const TerrainHeightField& ground, const VegetationScatterSettings& settings, ThreadPool& pool)
+{
+	mSettings = settings;
+	mInstances.clear();
+	mStarts.clear();
+	mBounds.clear();
+	mCounts.clear();
+
+	uint32_t level = settings.CellLevel;
+	uint32_t width = TerrainQuadTree::LevelWidth(level);
+	uint32_t firstCell = TerrainQuadTree::LevelOffset(level);
+	size_t kinds = settings.Kinds.size();
+	mCellCount = width * width;
+
+	float density = 0.0f;
+	for (auto& kind : settings.Kinds)
+		density += std::max<float>(kind.Density, 0.0f);
+
+	// One candidate per 1 / density square units, so the kinds' chances add up to
+	// at most one.
+	float cellSize = settings.RootSize / width;
+	uint32_t perSide = std::max<uint32_t>((uint32_t)std::ceil(cellSize * std::sqrt(density)), 1);
+	float spacing = cellSize / perSide;
+	float area = spacing * spacing;
+	float left = settings.CenterX - 0.5f * settings.RootSize;
+	float top = settings.CenterZ + 0.5f * settings.RootSize;
+
+	// Every cell's instances by kind, then gathered in cell order.
+	std::vector<std::vector<VegetationInstance>> placed(mCellCount);
+	std::atomic<bool> answered(true);
+	if (density > 0.0f)
+	{
+		pool.ParallelFor(mCellCount, [&](size_t c)
+		{
+			uint32_t x, y;
+			TerrainQuadTree::TileCoords(firstCell + (uint32_t)c, level, x, y);
+
+			size_t count = perSide * perSide;
+			std::vector<XMFLOAT2> points(count);
+			std::vector<uint32_t> gx(count), gz(count);
+			for (uint32_t j = 0; j < perSide; j++)
+			{
+				for (uint32_t i = 0; i < perSide; i++)
+				{
+					size_t p = j * perSide + i;
+					gx[p] = x * perSide + i;
+					gz[p] = y * perSide + j;
+					points[p].x = left + (gx[p] + Unit(Hash(gx[p], gz[p], settings.Seed * 8 + StreamJitterX))) * spacing;
+					points[p].y = top - (gz[p] + Unit(Hash(gx[p], gz[p], settings.Seed * 8 + StreamJitterZ))) * spacing;
+				}
+			}
+
+			std::vector<float> heights(count), slopes(count);
+			if (!ground.QueryHeights(points.data(), count, heights.data()) ||
+				!ground.QueryNormals(points.data(), count, nullptr, slopes.data()))
+			{
+				answered = false;
+				return;
+			}
+
+			std::vector<std::vector<VegetationInstance>> byKind(kinds);
+			for (size_t p = 0; p < count; p++)
+			{
+				float pick = Unit(Hash(gx[p], gz[p], settings.Seed * 8 + StreamPick));
+				float chance = 0.0f;
+				for (size_t k = 0; k < kinds; k++)
+				{
+					const VegetationKind& kind = settings.Kinds[k];
+					chance += std::max<float>(kind.Density, 0.0f) * area * Fit(kind, heights[p], slopes[p]);
+					if (pick >= chance)
+						continue;
+
+					VegetationInstance instance = {};
+					instance.Position = XMFLOAT3(points[p].x, heights[p], points[p].y);
+					float size = Unit(Hash(gx[p], gz[p], settings.Seed * 8 + StreamSize));
+					instance.Size = kind.MinSize + (kind.MaxSize - kind.MinSize) * size;
+					instance.Kind = (uint32_t)k;
+					instance.Variation = Unit(Hash(gx[p], gz[p], settings.Seed * 8 + StreamVariation));
+					byKind[k].push_back(instance);
+					break;
+				}
+			}
+
+			auto& cell = placed[c];
+			for (size_t k = 0; k < kinds; k++)
+			{
+				auto& list = byKind[k];
+				for (size_t i = list.size(); i > 1; i--)
+				{
+					uint32_t h = Hash((uint32_t)(firstCell + c), (uint32_t)(k << 20 | i), settings.Seed * 8 + StreamShuffle);
+					std::swap(list[i - 1], list[h % i]);
+				}
+				cell.insert(cell.end(), list.begin(), list.end());
+			}
+		});
+	}
+	if (!answered)
+	{
+		mCellCount = 0;
+		return false;
+	}
+
+	size_t total = 0;
+	for (auto& cell : placed)
+		total += cell.size();
+	mInstances.reserve(total);
+	mStarts.resize(mCellCount * kinds + 1);
+	mBounds.resize(TerrainQuadTree::LevelOffset(level + 1));
+	mCounts.assign(TerrainQuadTree::LevelOffset(level + 1), 0);
+	for (uint32_t c = 0; c < mCellCount; c++)
+	{
+		size_t i = 0;
+		for (size_t k = 0; k < kinds; k++)
+		{
+			mStarts[c * kinds + k] = (uint32_t)mInstances.size();
+			for (; i < placed[c].size() && placed[c][i].Kind == k; i++)
+				mInstances.push_back(placed[c][i]);
+		}
+
+		// A billboard is as wide as it is tall and stands on its position.
+		XMFLOAT3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (auto& instance : placed[c])
+		{
+			const XMFLOAT3& p = instance.Position;
+			float half = 0.5f * instance.Size;
+			lo = XMFLOAT3(std::min<float>(lo.x, p.x - half), std::min<float>(lo.y, p.y), std::min<float>(lo.z, p.z - half));
+			hi = XMFLOAT3(std::max<float>(hi.x, p.x + half), std::max<float>(hi.y, p.y + instance.Size), std::max<float>(hi.z, p.z + half));
+		}
+		uint32_t node = firstCell + c;
+		mCounts[node] = (uint32_t)placed[c].size();
+		if (mCounts[node] > 0)
+			BoundingBox::CreateFromPoints(mBounds[node], XMLoadFloat3(&lo), XMLoadFloat3(&hi));
+		std::vector<VegetationInstance>().swap(placed[c]);
+	}
+	mStarts[mCellCount * kinds] = (uint32_t)mInstances.size();
+
+	for (int l = (int)level - 1; l >= 0; l--)
+	{
+		for (uint32_t n = TerrainQuadTree::LevelOffset(l); n < TerrainQuadTree::LevelOffset(l + 1); n++)
+		{
+			uint32_t child = TerrainQuadTree::FirstChild(n, l);
+			for (uint32_t i = 0; i < 4; i++)
+			{
+				if (mCounts[child + i] == 0)
+					continue;
+				if (mCounts[n] == 0)
+					mBounds[n] = mBounds[child + i];
+				else
+					BoundingBox::CreateMerged(mBounds[n], mBounds[n], mBounds[child + i]);
+				mCounts[n] += mCounts[child + i];
+			}
+		}
+	}
+	return true;
+}
+
+void VegetationScatter::Visit(uint32_t node, uint32_t level, bool inside, const BoundingFrustum& frustum, FXMVECTOR eye,
+	const VegetationCullSettings& settings, std::vector<VisibleCell>& visible, VegetationCullStats& stats) const
+{
+	if (mCounts[node] == 0)
+		return;
+
+	// Distance from the eye to the nearest point of the box.
+	const BoundingBox& box = mBounds[node];
+	XMVECTOR center = XMLoadFloat3(&box.Center);
+	XMVECTOR extents = XMLoadFloat3(&box.Extents);
+	XMVECTOR outside = XMVectorMax(XMVectorSubtract(XMVectorAbs(XMVectorSubtract(eye, center)), extents), XMVectorZero());
+	float distance = XMVectorGetX(XMVector3Length(outside));
+	if (distance > settings.MaxDistance)
+		return;
+
+	if (!inside)
+	{
+		stats.Nodes++;
+		ContainmentType containment = frustum.Contains(box);
+		if (containment == DISJOINT)
+			return;
+		inside = containment == CONTAINS;
+	}
+
+	if (level == mSettings.CellLevel)
+	{
+		float keep = 1.0f;
+		if (distance > settings.ThinStart)
+			keep = (settings.MaxDistance - distance) / std::max<float>(settings.MaxDistance - settings.ThinStart, 1e-6f);
+		visible.push_back({ node - TerrainQuadTree::LevelOffset(level), keep });
+		return;
+	}
+
+	uint32_t child = TerrainQuadTree::FirstChild(node, level);
+	for (uint32_t i = 0; i < 4; i++)
+		Visit(child + i, level + 1, inside, frustum, eye, settings, visible, stats);
+}
+
+void VegetationScatter::Cull(const BoundingFrustum& frustum, const XMFLOAT3& eye, const VegetationCullSettings& settings,
+	std::vector<VegetationInstance>& instances, std::vector<VegetationDrawBatch>& batches, VegetationCullStats* stats) const
+{
+	instances.clear();
+	batches.clear();
+	VegetationCullStats counted;
+	if (mCellCount == 0)
+	{
+		if (stats)
+			*stats = counted;
+		return;
+	}
+
+	std::vector<VisibleCell> visible;
+	Visit(0, 0, false, frustum, XMLoadFloat3(&eye), settings, visible, counted);
+	counted.Cells = (uint32_t)visible.size();
+
+	size_t kinds = mSettings.Kinds.size();
+	auto cellCount = [&](uint32_t c) { return mStarts[(c + 1) * kinds] - mStarts[c * kinds]; };
+
+	// Thin everything alike if the kept instances would overflow the buffer.
+	double wanted = 0.0;
+	for (auto& v : visible)
+		wanted += cellCount(v.Cell) * (double)v.Keep;
+	if (wanted > settings.MaxInstances)
+	{
+		float scale = (float)(settings.MaxInstances / wanted);
+		for (auto& v : visible)
+			v.Keep *= scale;
+	}
+
+	instances.resize((size_t)std::min<double>(wanted, (double)settings.MaxInstances) + 1);
+	uint32_t first = 0;
+	for (size_t k = 0; k < kinds; k++)
+	{
+		uint32_t count = 0;
+		for (auto& v : visible)
+		{
+			uint32_t start = mStarts[v.Cell * kinds + k];
+			uint32_t available = mStarts[v.Cell * kinds + k + 1] - start;
+			uint32_t kept = v.Keep >= 1.0f ? available : (uint32_t)(available * v.Keep);
+			if (kept == 0)
+				continue;
+			memcpy(&instances[first + count], &mInstances[start], kept * sizeof(VegetationInstance));
+			count += kept;
+		}
+		if (count > 0)
+			batches.push_back({ (uint32_t)k, first, count });
+		first += count;
+	}
+	instances.resize(first);
+
+	counted.Instances = first;
+	if (stats)
+		*stats = counted;
+}
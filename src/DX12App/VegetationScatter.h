@@ -0,0 +1,133 @@
+#pragma once
+
+#include <DirectXCollision.h>
+#include <DirectXMath.h>
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+class TerrainHeightField;
+class ThreadPool;
+
+// A kind of plant and the ground it grows on.
+struct VegetationKind
+{
+	// Instances per square world unit where the ground suits the kind fully.
+	float Density = 0.05f;
+	// World heights and slopes, rise over run, the kind grows at. The density fades
+	// out over HeightFade inside both height limits and over SlopeFade below MaxSlope.
+	float MinHeight = -FLT_MAX;
+	float MaxHeight = FLT_MAX;
+	float HeightFade = 10.0f;
+	float MaxSlope = 1.0f;
+	float SlopeFade = 0.2f;
+	// World height of an instance, picked evenly in between.
+	float MinSize = 8.0f;
+	float MaxSize = 14.0f;
+};
+
+struct VegetationScatterSettings
+{
+	// Same square as the TerrainQuadTree of the terrain. The instances are stored in
+	// cells that are the tiles of CellLevel.
+	uint32_t CellLevel = 5;
+	float RootSize = 1024.0f;
+	float CenterX = 0.0f;
+	float CenterZ = 0.0f;
+
+	uint32_t Seed = 1;
+	// Kind i is drawn with slice i of the billboard texture array.
+	std::vector<VegetationKind> Kinds;
+};
+
+// Per-instance data of a plant, laid out like VegetationInstance in Vegetation.hlsl.
+// Position is the foot of the plant on the ground.
+struct VegetationInstance
+{
+	DirectX::XMFLOAT3 Position;
+	float Size;
+	uint32_t Kind;
+	// Evenly in [0, 1), for the shader to tell instances of a kind apart.
+	float Variation;
+	float Pad[2];
+};
+
+// One instanced draw: InstanceCount plants of one kind from FirstInstance on.
+struct VegetationDrawBatch
+{
+	uint32_t Kind;
+	uint32_t FirstInstance;
+	uint32_t InstanceCount;
+};
+
+struct VegetationCullSettings
+{
+	// Cells whose box is farther from the eye than MaxDistance are culled. From
+	// ThinStart on a cell keeps a share of its instances that falls linearly to none
+	// at MaxDistance.
+	float MaxDistance = 800.0f;
+	float ThinStart = 400.0f;
+	// Size of the instance buffer. When more would be visible every visible cell is
+	// thinned alike to fit.
+	uint32_t MaxInstances = UINT32_MAX;
+};
+
+struct VegetationCullStats
+{
+	// Quadtree nodes tested against the frustum and cells that passed.
+	uint32_t Nodes = 0;
+	uint32_t Cells = 0;
+	uint32_t Instances = 0;
+};
+
+// Plants scattered over the terrain by density rules, for drawing thousands of them
+// in a few instanced draws instead of a render item each.
+//
+// Scatter places candidates on a jittered grid as dense as all kinds together and
+// keeps each one with the probability the kinds' densities at its height and slope
+// give it. Candidates are seeded by their world grid position, so the result does
+// not depend on threads or cell order. Instances are stored by cell in Morton order,
+// and inside a cell by kind in a random order, so that any prefix of a cell's kind
+// is an even thinning of it.
+//
+// Cull walks the quadtree levels above the cells, skipping nodes outside the frustum
+// or too far away and testing nothing below nodes fully inside, then copies the kept
+// prefix of every visible cell into one compact run per kind.
+class VegetationScatter
+{
+public:
+	// Scatters over the heights the field answers, the cells in parallel. False,
+	// with nothing scattered, if the field has no root tile.
+	bool Scatter(const TerrainHeightField& ground, const VegetationScatterSettings& settings, ThreadPool& pool);
+
+	const VegetationScatterSettings& Settings() const { return mSettings; }
+	// Every instance, by cell and kind.
+	const std::vector<VegetationInstance>& Instances() const { return mInstances; }
+	uint32_t CellCount() const { return mCellCount; }
+
+	// Visible instances in one batch per kind that has any, kinds in order.
+	void Cull(const DirectX::BoundingFrustum& frustum, const DirectX::XMFLOAT3& eye, const VegetationCullSettings& settings,
+		std::vector<VegetationInstance>& instances, std::vector<VegetationDrawBatch>& batches, VegetationCullStats* stats = nullptr) const;
+
+private:
+	struct VisibleCell
+	{
+		uint32_t Cell;
+		float Keep;
+	};
+
+	void Visit(uint32_t node, uint32_t level, bool inside, const DirectX::BoundingFrustum& frustum, DirectX::FXMVECTOR eye,
+		const VegetationCullSettings& settings, std::vector<VisibleCell>& visible, VegetationCullStats& stats) const;
+
+	VegetationScatterSettings mSettings;
+	uint32_t mCellCount = 0;
+	std::vector<VegetationInstance> mInstances;
+	// Instances of kind k in cell c start at mStarts[c * kinds + k]; one extra entry
+	// ends the last.
+	std::vector<uint32_t> mStarts;
+	// Bounds and instance count of every quadtree node down to the cells, by node
+	// index. Empty nodes are skipped.
+	std::vector<DirectX::BoundingBox> mBounds;
+	std::vector<uint32_t> mCounts;
+};